@@ -1,14 +1,31 @@
 #include "AST.h"
+#include "CheckedArithmetic.h"
+#include "ExpressionValidator.h"
+#include "SpscRing.h"
+#include "SymbolInterner.h"
 
+#include <algorithm>
+#include <atomic>
 #include <cctype>
 #include <charconv>
 #include <cstdint>
+#include <exception>
+#include <functional>
+#include <istream>
+#include <iterator>
+#include <ostream>
 #include <limits>
 #include <memory>
+#include <new>
+#include <optional>
+#include <set>
 #include <stack>
 #include <stdexcept>
 #include <string>
+#include <thread>
+#include <unordered_map>
 #include <utility>
+#include <vector>
 
 // MARK: namespace
 namespace {
@@ -146,59 +163,16 @@ int64_t parse_negative_number(const std::string_view& input_string,
     return -static_cast<int64_t>(magnitude);
 }
 
-/**
- * @brief Checked arithmetic operations that throw an ASTException on overflow
- * or other error conditions (such as division by zero).
- *
- * @param left The left operand of the operation.
- * @param right The right operand of the operation.
- * @return The result of the arithmetic operation if it does not overflow or
- * have other error conditions.
- */
-int64_t checked_add(int64_t left, int64_t right) {
-    int64_t result = 0;
-    if (__builtin_add_overflow(left, right, &result)) {
-        throw ASTException("overflow in addition");
-    }
-    return result;
-}
-
-int64_t checked_sub(int64_t left, int64_t right) {
-    int64_t result = 0;
-    if (__builtin_sub_overflow(left, right, &result)) {
-        throw ASTException("overflow in subtraction");
-    }
-    return result;
-}
-
-int64_t checked_mul(int64_t left, int64_t right) {
-    int64_t result = 0;
-    if (__builtin_mul_overflow(left, right, &result)) {
-        throw ASTException("overflow in multiplication");
-    }
-    return result;
-}
-
-int64_t checked_div(int64_t left, int64_t right) {
-    if (right == 0) {
-        throw ASTException("division by zero");
-    }
-    if (left == std::numeric_limits<int64_t>::min() && right == -1) {
-        throw ASTException("overflow in division");
-    }
-    return left / right;
-}
-
 /**
  * @brief Parses a lower-case ASCII variable name from the input string
  * starting at the given index and advances the index to the first character
  * after the variable.
  * @param input_string The input string to parse from.
  * @param index The index to start parsing from. Advanced past the variable.
- * @return The parsed variable name.
+ * @return The parsed variable name, a view into the input string.
  */
-std::string parse_variable_name(const std::string& input_string,
-                                std::size_t& index) {
+std::string_view parse_variable_name(const std::string& input_string,
+                                     std::size_t& index) {
     const std::size_t start_index = index;
     while (index < input_string.size()) {
         if (const auto curr_char =
@@ -208,9 +182,16 @@ std::string parse_variable_name(const std::string& input_string,
         }
         ++index;
     }
-    return input_string.substr(start_index, index - start_index);
+    return std::string_view(input_string)
+        .substr(start_index, index - start_index);
 }
 
+// The stacks of the shunting-yard algorithm. Backed by vectors, so that
+// their storage can be kept between builds.
+using ValueStack =
+    std::stack<std::unique_ptr<Node>, std::vector<std::unique_ptr<Node>>>;
+using OperatorStack = std::stack<TokenType, std::vector<TokenType>>;
+
 /**
  * @brief Pops the top operator from the operator stack, pops the top two
  * values from the value stack, applies the operator to the values, and pushes
@@ -219,8 +200,8 @@ std::string parse_variable_name(const std::string& input_string,
  * result onto.
  * @param operator_stack The stack of operators to pop the operator from.
  */
-void apply_top_operator(std::stack<std::unique_ptr<Node>>& value_stack,
-                        std::stack<TokenType>& operator_stack) {
+void apply_top_operator(ValueStack& value_stack,
+                        OperatorStack& operator_stack) {
     if (operator_stack.empty()) {
         throw ASTException("missing operator");
     }
@@ -252,9 +233,8 @@ void apply_top_operator(std::stack<std::unique_ptr<Node>>& value_stack,
  * lower precedence.
  * @param op_token_type The type of the operator token we're handling.
  */
-void handle_operator(TokenType op_token_type,
-                     std::stack<std::unique_ptr<Node>>& value_stack,
-                     std::stack<TokenType>& operator_stack) {
+void handle_operator(TokenType op_token_type, ValueStack& value_stack,
+                     OperatorStack& operator_stack) {
     // While: the stack isn't empty,
     // and the top token isn't a '(',
     // and the top operator has a greater precedence than our operator,
@@ -275,10 +255,10 @@ void handle_operator(TokenType op_token_type,
  * token or to -1 * (...).
  * @param input_string The input string being tokenized.
  * @param i The current index in the input string.
- * @param tokens The vector of tokens to add to.
+ * @param tokens The list of tokens to add to.
  */
 void handle_unary_minus(const std::string& input_string, std::size_t& i,
-                        std::vector<Token>& tokens) {
+                        TokenList& tokens) {
     // Look ahead to find the next non-whitespace character after the unary
     // minus, to determine if we have a case like: -(digits...) or -(...) (or
     // another unary minus).
@@ -300,7 +280,7 @@ void handle_unary_minus(const std::string& input_string, std::size_t& i,
     if (std::isdigit(static_cast<unsigned char>(input_string[lookahead]))) {
         i = lookahead;
         const int64_t parsed_number = parse_negative_number(input_string, i);
-        tokens.emplace_back(TokenType::Number, parsed_number, "");
+        tokens.push_number(parsed_number);
         return;
     }
 
@@ -310,8 +290,8 @@ void handle_unary_minus(const std::string& input_string, std::size_t& i,
         input_string[lookahead] != '(' && input_string[lookahead] != '-') {
         throw ASTException("missing operand after unary minus");
     }
-    tokens.emplace_back(TokenType::Number, -1, "");
-    tokens.emplace_back(TokenType::Mult, 0, "");
+    tokens.push_number(-1);
+    tokens.push(TokenType::Mult);
     ++i;
 }
 
@@ -320,29 +300,28 @@ void handle_unary_minus(const std::string& input_string, std::size_t& i,
  * an operand is expected.
  * @param input_string The input string being tokenized.
  * @param i The current index in the input string.
- * @param tokens The vector of tokens to add to.
+ * @param tokens The list of tokens to add to.
  * @return true if an operand was successfully parsed, false otherwise.
  */
 bool is_operand_valid(const std::string& input_string, std::size_t& i,
-                      std::vector<Token>& tokens) {
+                      TokenList& tokens) {
     const auto curr_char = static_cast<unsigned char>(input_string[i]);
 
     // Check if we have a number, variable, or left paren, and handle
     // accordingly.
     if (std::isdigit(curr_char)) {
         const int64_t parsed_number = parse_number(input_string, i);
-        tokens.emplace_back(TokenType::Number, parsed_number, "");
+        tokens.push_number(parsed_number);
         return true;
     }
 
     if (std::islower(curr_char)) {
-        std::string parsed_variable = parse_variable_name(input_string, i);
-        tokens.emplace_back(TokenType::Variable, 0, std::move(parsed_variable));
+        tokens.push_variable(parse_variable_name(input_string, i));
         return true;
     }
 
     if (input_string[i] == '(') {
-        tokens.emplace_back(TokenType::LParen, 0, "");
+        tokens.push(TokenType::LParen);
         ++i;
         return true;
     }
@@ -355,34 +334,34 @@ bool is_operand_valid(const std::string& input_string, std::size_t& i,
  * operand is not expected.
  * @param input_string The input string being tokenized.
  * @param i The current index in the input string.
- * @param tokens The vector of tokens to add to.
+ * @param tokens The list of tokens to add to.
  * @return true if a valid operator or closing paren was found, false otherwise.
  */
 bool handle_operator_or_close_paren(const std::string& input_string,
                                     std::size_t& i,
-                                    std::vector<Token>& tokens) {
+                                    TokenList& tokens) {
     if (input_string[i] == '+') {
-        tokens.emplace_back(TokenType::Plus, 0, "");
+        tokens.push(TokenType::Plus);
         ++i;
         return true;
     }
     if (input_string[i] == '-') {
-        tokens.emplace_back(TokenType::Minus, 0, "");
+        tokens.push(TokenType::Minus);
         ++i;
         return true;
     }
     if (input_string[i] == '*') {
-        tokens.emplace_back(TokenType::Mult, 0, "");
+        tokens.push(TokenType::Mult);
         ++i;
         return true;
     }
     if (input_string[i] == '/') {
-        tokens.emplace_back(TokenType::Div, 0, "");
+        tokens.push(TokenType::Div);
         ++i;
         return true;
     }
     if (input_string[i] == ')') {
-        tokens.emplace_back(TokenType::RParen, 0, "");
+        tokens.push(TokenType::RParen);
         ++i;
         return true;
     }
@@ -409,260 +388,1959 @@ bool handle_operator_or_close_paren(const std::string& input_string,
     throw ASTException("invalid character in expression");
 }
 
-} // namespace
-
-// ---------------------------- Node constructors ----------------------------
-// Constructor for number nodes.
-Node::Node(int64_t v)
-    : type(NodeType::Number), value(v), variable_name(""), left(nullptr),
-      right(nullptr) {}
+// The state the lexer carries from one token to the next.
+struct LexState {
+    std::size_t index = 0;
+    bool is_awaiting_operand = true;
+    bool saw_non_whitespace = false;
+};
+
+// The output of lexing one chunk of the input in the parallel tokenizer.
+struct LexChunk {
+    LexState state;
+    TokenList tokens;
+    std::vector<std::size_t> offsets;
+    std::exception_ptr error;
+    std::size_t max_tokens = 0; // 0 means no limit.
+};
+
+// The errors for going over each of the ASTLimits.
+constexpr const char* input_bytes_error = "input exceeds the byte limit";
+constexpr const char* tokens_error = "expression exceeds the token limit";
+constexpr const char* nodes_error = "expression exceeds the node limit";
+constexpr const char* depth_error = "expression exceeds the depth limit";
+constexpr const char* eval_operations_error =
+    "evaluation exceeds the operation limit";
 
-// Constructor for variable nodes.
-Node::Node(std::string variable)
-    : type(NodeType::Variable), value(0), variable_name(std::move(variable)),
-      left(nullptr), right(nullptr) {}
+/**
+ * @brief Throws if a count has gone over its limit.
+ * @param count The count.
+ * @param limit The limit, or 0 for no limit.
+ * @param message The error to throw.
+ */
+void check_limit(uint64_t count, uint64_t limit, const char* message) {
+    if (limit != 0 && count > limit) {
+        throw ASTException(message);
+    }
+}
 
-// Constructor for operator nodes.
-Node::Node(NodeType t, std::unique_ptr<Node> l, std::unique_ptr<Node> r)
-    : type(t), value(0), variable_name(""), left(std::move(l)),
-      right(std::move(r)) {}
+// Follows the tree builder's shunting-yard on the token types alone, keeping
+// just the depth of each value, so that the node count and depth limits are
+// checked before any node is made. Tokens that the builder would reject are
+// left for it to report.
+class ShapeChecker {
+  public:
+    explicit ShapeChecker(const ASTLimits& limits) : limits_(limits) {}
+
+    void add(TokenType type);
+    void finish();
+
+  private:
+    void push_value(std::size_t depth);
+    void apply_top_operator();
+
+    const ASTLimits& limits_;
+    std::vector<std::size_t> depths_; // Of the values on the value stack.
+    std::vector<TokenType> operators_;
+    // The operators on the stack, not counting '('. Each one ends up in the
+    // right operand of the one below it, so the tree is deeper than this.
+    std::size_t pending_operators_ = 0;
+    std::size_t node_count_ = 0;
+};
 
 /**
- * @brief Recursively evaluates the value of the AST rooted at this node.
- * @return The result of evaluating the AST rooted at this node.
+ * @brief Feeds the next token's type into the checker.
+ * @param type The type of the token.
  */
-int64_t Node::get_value() {
-    if (type == NodeType::Number) {
-        return value;
+void ShapeChecker::add(TokenType type) {
+    if (type == TokenType::Number || type == TokenType::Variable) {
+        push_value(1);
+    } else if (type == TokenType::LParen) {
+        operators_.push_back(type);
+    } else if (type == TokenType::RParen) {
+        while (!operators_.empty() && operators_.back() != TokenType::LParen) {
+            apply_top_operator();
+        }
+        if (!operators_.empty()) {
+            operators_.pop_back();
+        }
+    } else if (is_arithmetic_operator(type)) {
+        while (!operators_.empty() && operators_.back() != TokenType::LParen &&
+               get_precedence(operators_.back()) >= get_precedence(type)) {
+            apply_top_operator();
+        }
+        operators_.push_back(type);
+        ++pending_operators_;
+        check_limit(pending_operators_ + 1, limits_.max_depth, depth_error);
     }
-    if (type == NodeType::Variable) {
-        throw ASTException("cannot evaluate variable without bindings");
+}
+
+/**
+ * @brief Applies the operators left once all tokens have been added.
+ */
+void ShapeChecker::finish() {
+    while (!operators_.empty()) {
+        if (operators_.back() == TokenType::LParen) {
+            operators_.pop_back();
+        } else {
+            apply_top_operator();
+        }
     }
+}
 
-    if (!left || !right) {
-        throw ASTException("malformed AST");
+/**
+ * @brief Counts a new node, and pushes its depth onto the value stack.
+ * @param depth The depth of the subtree rooted at the node.
+ */
+void ShapeChecker::push_value(std::size_t depth) {
+    check_limit(++node_count_, limits_.max_nodes, nodes_error);
+    check_limit(depth, limits_.max_depth, depth_error);
+    depths_.push_back(depth);
+}
+
+/**
+ * @brief Pops the top operator and the depths of its operands, and pushes the
+ * depth of the node it makes.
+ */
+void ShapeChecker::apply_top_operator() {
+    operators_.pop_back();
+    --pending_operators_;
+    if (depths_.size() < 2) {
+        return;
     }
+    const std::size_t right = depths_.back();
+    depths_.pop_back();
+    const std::size_t left = depths_.back();
+    depths_.pop_back();
+    push_value(std::max(left, right) + 1);
+}
 
-    if (type == NodeType::Add) {
-        return checked_add(left->get_value(), right->get_value());
+/**
+ * @brief Checks the node count and depth limits of the tree that the tokens
+ * would build, without building it.
+ * @param tokens The tokens.
+ * @param limits The limits to check.
+ */
+void check_shape_limits(const TokenList& tokens, const ASTLimits& limits) {
+    if (limits.max_nodes == 0 && limits.max_depth == 0) {
+        return;
     }
-    if (type == NodeType::Sub) {
-        return checked_sub(left->get_value(), right->get_value());
+    ShapeChecker checker(limits);
+    for (const TokenType type : tokens.types()) {
+        checker.add(type);
     }
-    if (type == NodeType::Mult) {
-        return checked_mul(left->get_value(), right->get_value());
+    checker.finish();
+}
+
+/**
+ * @brief Counts the operators that evaluating a tree applies, and throws as
+ * soon as there are more than the limit.
+ * @param root The root of the tree.
+ * @param limit The most operators allowed, or 0 for no limit.
+ */
+void check_eval_operations(const Node* root, uint64_t limit) {
+    if (limit == 0) {
+        return;
     }
-    if (type == NodeType::Div) {
-        return checked_div(left->get_value(), right->get_value());
+    uint64_t operation_count = 0;
+    std::vector<const Node*> pending{root};
+    while (!pending.empty()) {
+        const Node* current_node = pending.back();
+        pending.pop_back();
+        if (current_node->left && current_node->right) {
+            check_limit(++operation_count, limit, eval_operations_error);
+            pending.push_back(current_node->left.get());
+            pending.push_back(current_node->right.get());
+        }
     }
-
-    throw ASTException("malformed AST");
 }
 
-// MARK: AST
-// ----------------------------------- AST -----------------------------------
+// The capacity of the ring buffers between the parse_stream() stages.
+constexpr std::size_t stream_chunk_ring_size = 8;
+constexpr std::size_t stream_token_ring_size = 1 << 14;
 
 /**
- * @brief Clears the AST by resetting the root and clearing the tokens_ vector.
+ * @brief Returns whether the lexer expects an operand after the given token.
+ * That's the case after an operator or an opening parenthesis.
+ * @param t The type of the most recently emitted token.
+ * @return true if the next token must be an operand, false otherwise.
  */
-void AST::clear() {
-    root_.reset();
-    tokens_.clear();
+bool is_awaiting_operand_after(TokenType t) {
+    return is_arithmetic_operator(t) || t == TokenType::LParen;
 }
 
 /**
- * @brief Tokenizes the input string into a vector of tokens, which are stored
- * in the tokens_ field.
- * @param input_string The input string to tokenize.
+ * @brief Advances the lexer past any whitespace.
+ * @param input_string The input string being tokenized.
+ * @param state The lexer state, whose index is advanced.
+ * @return true if there's a non-whitespace character left to lex, false if
+ * the end of the input was reached.
  */
-void AST::tokenize(const std::string& input_string) {
-    tokens_.clear(); // Clear the tokens first.
-
-    std::size_t i = 0;
-    bool is_awaiting_operand = true;
-    bool saw_non_whitespace = false;
-
-    // Go through the characters of the string.
-    while (i < input_string.size()) {
-        const auto curr_char = static_cast<unsigned char>(input_string[i]);
-
-        // Ignore whitespace.
-        if (std::isspace(curr_char)) {
-            ++i;
-            continue;
-        }
+bool skip_whitespace(const std::string& input_string, LexState& state) {
+    while (state.index < input_string.size() &&
+           std::isspace(
+               static_cast<unsigned char>(input_string[state.index]))) {
+        ++state.index;
+    }
+    return state.index < input_string.size();
+}
 
-        saw_non_whitespace = true;
+/**
+ * @brief Lexes the token starting at the current (non-whitespace) character.
+ * Usually emits one token, but a unary minus in front of a non-number emits
+ * two (-1 and *).
+ * @param input_string The input string being tokenized.
+ * @param state The lexer state. Advanced past the lexed characters.
+ * @param tokens The list of tokens to add to.
+ */
+void lex_step(const std::string& input_string, LexState& state,
+              TokenList& tokens) {
+    std::size_t& i = state.index;
+    const auto curr_char = static_cast<unsigned char>(input_string[i]);
 
-        // Handle unary minus.
-        if (input_string[i] == '-' && is_awaiting_operand) {
-            handle_unary_minus(input_string, i, tokens_);
-            // Unary minus can emit:
-            // 1) Number(-x)         -> next token must be an operator.
-            // 2) Number(-1), Mult   -> next token must be an operand.
-            is_awaiting_operand = (tokens_.back().type == TokenType::Mult);
-            continue;
-        }
+    state.saw_non_whitespace = true;
 
-        // Handle operands when expected.
-        if (is_awaiting_operand) {
-            if (is_operand_valid(input_string, i, tokens_)) {
-                // If we just consumed "(", we are still awaiting an operand.
-                is_awaiting_operand =
-                    (tokens_.back().type == TokenType::LParen);
-                continue;
-            }
+    // Handle unary minus.
+    if (input_string[i] == '-' && state.is_awaiting_operand) {
+        handle_unary_minus(input_string, i, tokens);
+        // Unary minus can emit:
+        // 1) Number(-x)         -> next token must be an operator.
+        // 2) Number(-1), Mult   -> next token must be an operand.
+        state.is_awaiting_operand = (tokens.types().back() == TokenType::Mult);
+        return;
+    }
 
-            validate_expected_operand(input_string, i);
+    // Handle operands when expected.
+    if (state.is_awaiting_operand) {
+        if (is_operand_valid(input_string, i, tokens)) {
+            // If we just consumed "(", we are still awaiting an operand.
+            state.is_awaiting_operand =
+                (tokens.types().back() == TokenType::LParen);
+            return;
         }
 
-        // Handle operators and closing parenthesis.
-        if (handle_operator_or_close_paren(input_string, i, tokens_)) {
-            is_awaiting_operand = (tokens_.back().type != TokenType::RParen);
-            continue;
-        }
+        validate_expected_operand(input_string, i);
+    }
 
-        // Check for missing operator between operands.
-        if (std::isdigit(curr_char) || std::islower(curr_char) ||
-            input_string[i] == '(') {
-            throw ASTException("missing operator between operands");
-        }
+    // Handle operators and closing parenthesis.
+    if (handle_operator_or_close_paren(input_string, i, tokens)) {
+        state.is_awaiting_operand =
+            (tokens.types().back() != TokenType::RParen);
+        return;
+    }
 
-        throw ASTException("invalid character in expression");
+    // Check for missing operator between operands.
+    if (std::isdigit(curr_char) || std::islower(curr_char) ||
+        input_string[i] == '(') {
+        throw ASTException("missing operator between operands");
     }
 
-    if (!saw_non_whitespace) {
+    throw ASTException("invalid character in expression");
+}
+
+/**
+ * @brief Checks that the lexer stopped in a valid state at the end of input.
+ * @param state The lexer state after the whole input was lexed.
+ */
+void finish_lexing(const LexState& state) {
+    if (!state.saw_non_whitespace) {
         throw ASTException("empty expression");
     }
-    if (is_awaiting_operand) {
+    if (state.is_awaiting_operand) {
         throw ASTException("expression ends with operator");
     }
-
-    tokens_.emplace_back(TokenType::End, 0, ""); // Push the end token.
 }
 
 /**
- * @brief Converts the tokens we've tokenized into an AST, and stores the root
- * in the root_ field.
- *
- * This is done using the "shunting yard algorithm", which uses the
- * operator_stack and value_stack to maintain the current state of the
- * conversion.
+ * @brief Lexes the characters in [begin, end) of the input string, assuming
+ * the lexer expects an operand at begin. Used by the parallel tokenizer, which
+ * only cuts the input right after characters that always leave the lexer
+ * expecting an operand.
+ * @param input_string The input string being tokenized.
+ * @param begin The index to start lexing at.
+ * @param end The index to stop lexing at. Must be at a chunk boundary (or the
+ * end of the input).
+ * @param chunk The chunk to store the tokens, offsets and final state in.
  */
-void AST::add_tokens_to_tree() {
-    root_.reset();
+void lex_chunk(const std::string& input_string, std::size_t begin,
+               std::size_t end, LexChunk& chunk) {
+    try {
+        chunk.state.index = begin;
+        while (chunk.state.index < end &&
+               skip_whitespace(input_string, chunk.state)) {
+            const std::size_t token_start = chunk.state.index;
+            lex_step(input_string, chunk.state, chunk.tokens);
+            chunk.offsets.resize(chunk.tokens.size(), token_start);
+            check_limit(chunk.tokens.size(), chunk.max_tokens, tokens_error);
+        }
+    } catch (...) {
+        chunk.error = std::current_exception();
+    }
+}
 
-    // Initialize our stacks.
-    std::stack<std::unique_ptr<Node>> value_stack; // The stack of values.
-    std::stack<TokenType> operator_stack;
+/**
+ * @brief Returns whether the input can be cut into independently lexable
+ * chunks right after the given character. That's the case for '+', '*', '/'
+ * and '(': the lexer always treats those as a token of their own, and after
+ * lexing one of them successfully, it always expects an operand. So a chunk
+ * starting right after one can be lexed on its own, starting in the "awaiting
+ * operand" state.
+ * @param character The character to check.
+ * @return true if a chunk can end right after the character.
+ */
+bool is_chunk_boundary_char(char character) {
+    return character == '+' || character == '*' || character == '/' ||
+           character == '(';
+}
 
-    // Iterate through all the tokens.
-    for (const Token& current_token : tokens_) {
-        // If we have a number token, push it onto the value stack.
-        if (current_token.type == TokenType::Number) {
-            value_stack.push(std::make_unique<Node>(current_token.value));
-            continue;
+/**
+ * @brief Splits the input string into about chunk_count chunks for parallel
+ * lexing. Every chunk except the last ends right after a character for which
+ * is_chunk_boundary_char() holds.
+ * @param input_string The input string to split.
+ * @param chunk_count The number of chunks to aim for.
+ * @return The start index of each chunk, followed by the input's size.
+ */
+std::vector<std::size_t> split_into_chunks(const std::string& input_string,
+                                           std::size_t chunk_count) {
+    std::vector<std::size_t> bounds{0};
+    const std::size_t target_size = input_string.size() / chunk_count;
+    for (std::size_t chunk = 1; chunk < chunk_count; ++chunk) {
+        std::size_t cut = std::max(chunk * target_size, bounds.back());
+        while (cut < input_string.size() &&
+               !is_chunk_boundary_char(input_string[cut])) {
+            ++cut;
         }
-
-        if (current_token.type == TokenType::Variable) {
-            value_stack.push(
-                std::make_unique<Node>(current_token.variable_name));
-            continue;
+        if (cut >= input_string.size()) {
+            break;
         }
-
-        if (current_token.type == TokenType::LParen) {
-            operator_stack.push(current_token.type);
-            continue;
+        if (cut + 1 > bounds.back()) {
+            bounds.push_back(cut + 1);
         }
+    }
+    bounds.push_back(input_string.size());
+    return bounds;
+}
 
-        if (current_token.type == TokenType::RParen) {
-            // While we don't find a '(', we apply the top operator to the top
-            // 2 values of the value stack.
-            while (!operator_stack.empty() &&
-                   operator_stack.top() != TokenType::LParen) {
-                apply_top_operator(value_stack, operator_stack);
-            }
-            // If we run out of operators before finding a '(', then we have a
-            // mismatched parentheses error.
-            if (operator_stack.empty()) {
-                throw ASTException("mismatched ')'");
+/**
+ * @brief Computes the paren depth before each token with a parallel prefix
+ * sum: each chunk of tokens is summed on its own thread, the chunk totals are
+ * scanned, and then each chunk adds its starting depth on its own thread.
+ * @param tokens The tokens to compute the depths of.
+ * @param chunk_count The number of chunks (and threads) to use.
+ * @param depths Set to the number of unclosed '(' before each token.
+ * @return true if the parentheses are balanced, false if some ')' has no
+ * matching '(' or some '(' is never closed.
+ */
+bool compute_paren_depths(std::span<const TokenType> tokens,
+                          std::size_t chunk_count,
+                          std::vector<int64_t>& depths) {
+    depths.resize(tokens.size());
+    std::vector<int64_t> chunk_totals(chunk_count);
+    std::vector<int64_t> chunk_minimums(chunk_count);
+    auto chunk_begin = [&](std::size_t chunk) {
+        return chunk * tokens.size() / chunk_count;
+    };
+
+    // Pass 1: depths relative to the start of each chunk.
+    auto scan_chunk = [&](std::size_t chunk) {
+        int64_t depth = 0;
+        int64_t minimum = 0;
+        for (std::size_t index = chunk_begin(chunk);
+             index < chunk_begin(chunk + 1); ++index) {
+            depths[index] = depth;
+            if (tokens[index] == TokenType::LParen) {
+                ++depth;
+            } else if (tokens[index] == TokenType::RParen) {
+                --depth;
+                minimum = std::min(minimum, depth);
             }
-            // Finally, pop the '(' from the operator stack and discard it.
-            operator_stack.pop();
-            continue;
         }
+        chunk_totals[chunk] = depth;
+        chunk_minimums[chunk] = minimum;
+    };
+    {
+        std::vector<std::jthread> workers;
+        for (std::size_t chunk = 1; chunk < chunk_count; ++chunk) {
+            workers.emplace_back(scan_chunk, chunk);
+        }
+        scan_chunk(0);
+    }
 
-        // Handle the case if we have an arithmetic operator.
-        if (is_arithmetic_operator(current_token.type)) {
-            handle_operator(current_token.type, value_stack, operator_stack);
-            continue;
+    // Scan the chunk totals to get the depth at the start of each chunk.
+    std::vector<int64_t> chunk_starts(chunk_count);
+    int64_t depth = 0;
+    for (std::size_t chunk = 0; chunk < chunk_count; ++chunk) {
+        if (depth + chunk_minimums[chunk] < 0) {
+            return false;
         }
+        chunk_starts[chunk] = depth;
+        depth += chunk_totals[chunk];
+    }
+    if (depth != 0) {
+        return false;
+    }
 
-        if (current_token.type == TokenType::End) {
-            break;
+    // Pass 2: shift each chunk by its starting depth.
+    auto shift_chunk = [&](std::size_t chunk) {
+        for (std::size_t index = chunk_begin(chunk);
+             index < chunk_begin(chunk + 1); ++index) {
+            depths[index] += chunk_starts[chunk];
+        }
+    };
+    {
+        std::vector<std::jthread> workers;
+        for (std::size_t chunk = 1; chunk < chunk_count; ++chunk) {
+            workers.emplace_back(shift_chunk, chunk);
         }
+        shift_chunk(0);
+    }
+    return true;
+}
 
-        // If we have a token that's not a number, operator, or parentheses,
-        // then we have an unexpected token error.
-        throw ASTException("unexpected token");
+/**
+ * @brief Finds the last safe place to cut a block of streamed input, i.e.
+ * right after the last character for which is_chunk_boundary_char() holds.
+ * @param text The text read so far.
+ * @param searched The length of the prefix of text that is already known to
+ * have no safe cut in it.
+ * @return The index to cut at, or 0 if there's no safe cut yet.
+ */
+std::size_t find_last_safe_cut(const std::string& text, std::size_t searched) {
+    std::size_t cut = text.size();
+    while (cut > searched && !is_chunk_boundary_char(text[cut - 1])) {
+        --cut;
     }
+    return cut == searched ? 0 : cut;
+}
 
-    // While the operator stack isn't empty, apply the top operator to the top
-    // 2 values of the value stack.
-    while (!operator_stack.empty()) {
-        if (operator_stack.top() == TokenType::LParen) {
-            throw ASTException("mismatched '('");
-        }
-        apply_top_operator(value_stack, operator_stack);
+/**
+ * @brief Returns the index of the first token of the group of tokens that
+ * starts at the same source offset as the given token. A unary minus in front
+ * of a non-number emits two tokens with the same offset.
+ * @param offsets The source offsets of the tokens.
+ * @param index The index of the token.
+ * @return The index of the first token with the same offset.
+ */
+std::size_t first_token_at_offset(const std::vector<std::size_t>& offsets,
+                                  std::size_t index) {
+    while (index > 0 && offsets[index - 1] == offsets[index]) {
+        --index;
     }
+    return index;
+}
 
-    // At this point, the operator stack should be empty, and the value stack
-    // should have exactly 1 value (the root of the AST). Otherwise, we have an
-    // error.
-    if (value_stack.size() != 1) {
-        throw ASTException("invalid expression");
+/**
+ * @brief Mixes a value into a running 64-bit hash (FNV-1a style step followed
+ * by a multiply-xorshift finalizer so nearby values spread well).
+ * @param hash The running hash to mix into.
+ * @param value The value to mix in.
+ * @return The updated hash.
+ */
+uint64_t hash_combine(uint64_t hash, uint64_t value) {
+    hash ^= value + 0x9e3779b97f4a7c15ULL + (hash << 6) + (hash >> 2);
+    hash *= 0xff51afd7ed558ccdULL;
+    return hash ^ (hash >> 33);
+}
+
+/**
+ * @brief Recursively hashes the structure of the subtree rooted at the given
+ * node. Two subtrees have the same hash if they have the same shape, the same
+ * operators, the same literals and the same variable names.
+ * @param current_node The root of the subtree to hash.
+ * @return The structural hash of the subtree.
+ */
+uint64_t hash_subtree(const Node* current_node) {
+    uint64_t hash = hash_combine(0, static_cast<uint64_t>(current_node->type));
+    if (current_node->type == NodeType::Number) {
+        return hash_combine(hash, static_cast<uint64_t>(current_node->value));
+    }
+    if (current_node->type == NodeType::Variable) {
+        return hash_combine(
+            hash, std::hash<std::string>{}(current_node->variable_name));
+    }
+    if (!current_node->left || !current_node->right) {
+        throw ASTException("malformed AST");
     }
+    hash = hash_combine(hash, hash_subtree(current_node->left.get()));
+    return hash_combine(hash, hash_subtree(current_node->right.get()));
+}
 
-    // Set the root of the AST to the only value left on the value stack.
-    root_ = std::move(value_stack.top());
-    value_stack.pop();
+/**
+ * @brief Recursively collects the names of all variables referenced in the
+ * subtree rooted at the given node.
+ * @param current_node The root of the subtree to search.
+ * @param names The set to insert the variable names into.
+ */
+void collect_variables(const Node* current_node,
+                       std::set<std::string>& names) {
+    if (current_node->type == NodeType::Variable) {
+        names.insert(current_node->variable_name);
+        return;
+    }
+    if (current_node->left) {
+        collect_variables(current_node->left.get(), names);
+    }
+    if (current_node->right) {
+        collect_variables(current_node->right.get(), names);
+    }
 }
 
 /**
- * @brief Parses the input string into an AST by first tokenizing it and then
- * converting the tokens into a tree. The resulting AST is stored in the root_
- * field.
- * @param input_expression The input string to parse into an AST.
+ * @brief Serialize the subtree rooted at the given node to a stream in
+ * preorder format.
+ *
+ * Format (space-separated tokens):
+ * - Number node  -> <integer>
+ * - Operator node-> <operator_symbol> <left-subtree> <right-subtree>
+ *   where <operator_symbol> is one of +, -, *, /
+ *
+ * Example for 1 + 1:
+ *   + 1 1
+ *
+ * @param current_node Current AST node pointer in recursive context.
+ * - Number node => writes the integer token's value.
+ * - Operator node => writes the operator token and recurses into left/right
+ * @param output_stream Output stream receiving the preorder token stream.
  */
-void AST::parse(const std::string& input_expression) {
-    clear();
-    tokenize(input_expression);
-    add_tokens_to_tree();
+void write_preorder_subtree(const Node* current_node,
+                            std::ostream& output_stream) {
+    // Leaf case: output the integer value.
+    if (current_node->type == NodeType::Number) {
+        output_stream << current_node->value << ' ';
+        return;
+    }
+    if (current_node->type == NodeType::Variable) {
+        output_stream << current_node->variable_name << ' ';
+        return;
+    }
+
+    // Internal node: emit the operator token first (preorder), then recurse
+    // into its child nodes.
+    char operator_symbol;
+    if (current_node->type == NodeType::Add) {
+        operator_symbol = '+';
+    } else if (current_node->type == NodeType::Sub) {
+        operator_symbol = '-';
+    } else if (current_node->type == NodeType::Mult) {
+        operator_symbol = '*';
+    } else if (current_node->type == NodeType::Div) {
+        operator_symbol = '/';
+    } else {
+        // IF it's not one of these, then we have a malformed AST.
+        throw ASTException("malformed AST");
+    }
+    output_stream << operator_symbol << ' ';
+    write_preorder_subtree(current_node->left.get(), output_stream);
+    write_preorder_subtree(current_node->right.get(), output_stream);
 }
 
+// Nodes freed on this thread, kept for the next nodes allocated on it. At
+// most max_free_nodes are kept, so one huge tree doesn't pin its memory for
+// the life of the thread.
+class NodeFreeList {
+  public:
+    static constexpr std::size_t max_free_nodes = 1 << 18;
+
+    NodeFreeList() = default;
+    NodeFreeList(const NodeFreeList&) = delete;
+    NodeFreeList& operator=(const NodeFreeList&) = delete;
+
+    ~NodeFreeList() {
+        while (head_ != nullptr) {
+            FreeNode* next = head_->next;
+            ::operator delete(head_);
+            head_ = next;
+        }
+        // Nodes freed after this (e.g. by static ASTs at exit) go straight
+        // back to the heap.
+        destroyed_ = true;
+    }
+
+    /**
+     * @brief Takes a node's worth of memory off the list.
+     * @return The memory, or nullptr if the list is empty.
+     */
+    void* pop() {
+        FreeNode* node = head_;
+        if (node != nullptr) {
+            head_ = node->next;
+            --size_;
+        }
+        return node;
+    }
+
+    /**
+     * @brief Puts a node's memory on the list.
+     * @param pointer The memory of a destroyed node.
+     * @return false if the list is full or gone, in which case the caller
+     * must free the memory itself.
+     */
+    bool push(void* pointer) {
+        if (destroyed_ || size_ == max_free_nodes) {
+            return false;
+        }
+        head_ = ::new (pointer) FreeNode{head_};
+        ++size_;
+        return true;
+    }
+
+  private:
+    struct FreeNode {
+        FreeNode* next;
+    };
+
+    FreeNode* head_ = nullptr;
+    std::size_t size_ = 0;
+    bool destroyed_ = false;
+};
+
+thread_local NodeFreeList node_free_list;
+
+} // namespace
+
+// ---------------------------- Node constructors ----------------------------
+// Constructor for number nodes.
+Node::Node(int64_t v)
+    : type(NodeType::Number), value(v), variable_name(""), left(nullptr),
+      right(nullptr) {}
+
+// Constructor for variable nodes.
+Node::Node(std::string variable)
+    : type(NodeType::Variable), value(0), variable_name(std::move(variable)),
+      left(nullptr), right(nullptr) {}
+
+// Constructor for operator nodes.
+Node::Node(NodeType t, std::unique_ptr<Node> l, std::unique_ptr<Node> r)
+    : type(t), value(0), variable_name(""), left(std::move(l)),
+      right(std::move(r)) {}
+
 /**
- * @brief Evaluates the AST by calling get_value() on the root node, which
- * recursively evaluates the entire tree and returns the result.
- * @return The result of evaluating the AST.
+ * @brief Allocates a node, reusing the memory of a node freed earlier on this
+ * thread if there is one.
+ * @param size The size of the object being allocated.
+ * @return The memory for the node.
  */
-int64_t AST::evaluate() {
-    if (!root_) {
-        throw ASTException("tree is empty");
+void* Node::operator new(std::size_t size) {
+    if (size == sizeof(Node)) {
+        if (void* pointer = node_free_list.pop()) {
+            return pointer;
+        }
     }
-    return root_->get_value();
+    return ::operator new(size);
 }
 
-// Getter for root_ (because might need to be accessed afterwards).
-Node* AST::root() {
-    return root_.get();
+/**
+ * @brief Frees a node by putting its memory on this thread's free list.
+ * @param pointer The memory of the node.
+ * @param size The size of the object being freed.
+ */
+void Node::operator delete(void* pointer, std::size_t size) noexcept {
+    if (size != sizeof(Node) || !node_free_list.push(pointer)) {
+        ::operator delete(pointer);
+    }
 }
 
-// Const getter for root_.
-const Node* AST::root() const {
-    return root_.get();
+/**
+ * @brief Recursively evaluates the value of the AST rooted at this node, in
+ * the order described in AST.h.
+ * @return The result of evaluating the AST rooted at this node.
+ */
+int64_t Node::get_value() {
+    if (type == NodeType::Number) {
+        return value;
+    }
+    if (type == NodeType::Variable) {
+        throw ASTException("cannot evaluate variable without bindings");
+    }
+
+    if (!left || !right) {
+        throw ASTException("malformed AST");
+    }
+
+    // Right operand first.
+    const int64_t right_value = right->get_value();
+    const int64_t left_value = left->get_value();
+    if (type == NodeType::Add) {
+        return checked_add(left_value, right_value);
+    }
+    if (type == NodeType::Sub) {
+        return checked_sub(left_value, right_value);
+    }
+    if (type == NodeType::Mult) {
+        return checked_mul(left_value, right_value);
+    }
+    if (type == NodeType::Div) {
+        return checked_div(left_value, right_value);
+    }
+
+    throw ASTException("malformed AST");
+}
+
+/**
+ * @brief Recursively evaluates the value of the AST rooted at this node,
+ * looking up variables in the given bindings, in the order described in
+ * AST.h.
+ * @param bindings The values to substitute for variables.
+ * @return The result of evaluating the AST rooted at this node.
+ */
+int64_t Node::get_value(const VariableBindings& bindings) const {
+    if (type == NodeType::Number) {
+        return value;
+    }
+    if (type == NodeType::Variable) {
+        const auto variable_it = bindings.find(variable_name);
+        if (variable_it == bindings.end()) {
+            throw ASTException("missing variable value: " + variable_name);
+        }
+        return variable_it->second;
+    }
+
+    if (!left || !right) {
+        throw ASTException("malformed AST");
+    }
+
+    // Right operand first.
+    const int64_t right_value = right->get_value(bindings);
+    const int64_t left_value = left->get_value(bindings);
+    if (type == NodeType::Add) {
+        return checked_add(left_value, right_value);
+    }
+    if (type == NodeType::Sub) {
+        return checked_sub(left_value, right_value);
+    }
+    if (type == NodeType::Mult) {
+        return checked_mul(left_value, right_value);
+    }
+    if (type == NodeType::Div) {
+        return checked_div(left_value, right_value);
+    }
+
+    throw ASTException("malformed AST");
+}
+
+// MARK: TokenList
+std::size_t TokenList::size() const {
+    return types_.size();
+}
+
+bool TokenList::empty() const {
+    return types_.empty();
+}
+
+TokenType TokenList::type(std::size_t index) const {
+    return types_[index];
+}
+
+// The types of all tokens, e.g. for scans that only need those.
+std::span<const TokenType> TokenList::types() const {
+    return types_;
+}
+
+/**
+ * @brief Returns a token of the list.
+ * @param index The index of the token.
+ * @return The token. Its variable name stays valid until the list (or its
+ * interner) is cleared or destroyed.
+ */
+TokenView TokenList::operator[](std::size_t index) const {
+    const TokenType type = types_[index];
+    if (type == TokenType::Number) {
+        return {type, payloads_[index], {}};
+    }
+    if (type != TokenType::Variable) {
+        return {type, 0, {}};
+    }
+    if (interner_ != nullptr) {
+        const int64_t id = payloads_[index];
+        return {type, id, interner_->name(static_cast<uint32_t>(id))};
+    }
+    const auto offset = static_cast<std::size_t>(payloads_[index]);
+    return {type, 0, std::string_view(names_.data() + offset)};
+}
+
+TokenView TokenList::back() const {
+    return (*this)[size() - 1];
+}
+
+/**
+ * @brief Returns a copy of a token of the list that doesn't depend on it.
+ * @param index The index of the token.
+ * @return The token.
+ */
+Token TokenList::token(std::size_t index) const {
+    const TokenView view = (*this)[index];
+    return {view.type, view.value, std::string(view.variable_name)};
+}
+
+/**
+ * @brief Sets the interner that variables added from now on get their
+ * symbol ids from. Should only be changed while the list is empty.
+ * @param interner The interner, or nullptr to keep the names in the list.
+ */
+void TokenList::set_interner(SymbolInterner* interner) {
+    interner_ = interner;
+}
+
+// Removes all tokens and names, but keeps the interner.
+void TokenList::clear() {
+    types_.clear();
+    payloads_.clear();
+    names_.clear();
+}
+
+void TokenList::reserve(std::size_t count) {
+    types_.reserve(count);
+    payloads_.reserve(count);
+}
+
+// Adds a token that has no payload (an operator, a parenthesis or End).
+void TokenList::push(TokenType type) {
+    types_.push_back(type);
+    payloads_.push_back(0);
+}
+
+/**
+ * @brief Adds a copy of a token.
+ * @param token The token. The value of a variable token is ignored; it gets
+ * its symbol id from this list's interner, if any.
+ */
+void TokenList::push(const Token& token) {
+    if (token.type == TokenType::Number) {
+        push_number(token.value);
+    } else if (token.type == TokenType::Variable) {
+        push_variable(token.variable_name);
+    } else {
+        push(token.type);
+    }
+}
+
+void TokenList::push_number(int64_t value) {
+    types_.push_back(TokenType::Number);
+    payloads_.push_back(value);
+}
+
+/**
+ * @brief Adds a variable token, interning its name if the list has an
+ * interner and copying it into the list's names otherwise.
+ * @param name The name of the variable.
+ */
+void TokenList::push_variable(std::string_view name) {
+    int64_t payload = 0;
+    if (interner_ != nullptr) {
+        payload = interner_->intern(name);
+    } else {
+        payload = static_cast<int64_t>(names_.size());
+        names_.append(name);
+        names_.push_back('\0');
+    }
+    types_.push_back(TokenType::Variable);
+    payloads_.push_back(payload);
+}
+
+/**
+ * @brief Adds copies of all tokens of another list at the end.
+ * @param other The list to copy the tokens of.
+ */
+void TokenList::append(const TokenList& other) {
+    replace(size(), size(), other);
+}
+
+/**
+ * @brief Replaces the tokens in [first, last) with copies of the tokens of
+ * another list.
+ * @param first The index of the first token to replace.
+ * @param last The index after the last token to replace.
+ * @param replacement The list to copy the tokens of.
+ */
+void TokenList::replace(std::size_t first, std::size_t last,
+                        const TokenList& replacement) {
+    const auto first_pos = static_cast<long>(first);
+    const auto last_pos = static_cast<long>(last);
+    types_.erase(types_.begin() + first_pos, types_.begin() + last_pos);
+    types_.insert(types_.begin() + first_pos, replacement.types_.begin(),
+                  replacement.types_.end());
+    payloads_.erase(payloads_.begin() + first_pos,
+                    payloads_.begin() + last_pos);
+    payloads_.insert(payloads_.begin() + first_pos,
+                     replacement.payloads_.begin(),
+                     replacement.payloads_.end());
+
+    // The payloads of numbers carry over as they are, but those of variables
+    // refer to the replacement's interner or names.
+    const bool shares_ids =
+        interner_ != nullptr && interner_ == replacement.interner_;
+    const bool appends_names =
+        interner_ == nullptr && replacement.interner_ == nullptr;
+    if (shares_ids) {
+        return;
+    }
+    const auto names_base = static_cast<int64_t>(names_.size());
+    if (appends_names) {
+        names_.append(replacement.names_);
+    }
+    for (std::size_t index = 0; index < replacement.size(); ++index) {
+        if (replacement.types_[index] != TokenType::Variable) {
+            continue;
+        }
+        int64_t& payload = payloads_[first + index];
+        if (appends_names) {
+            payload += names_base;
+        } else if (interner_ != nullptr) {
+            payload = interner_->intern(replacement[index].variable_name);
+        } else {
+            payload = static_cast<int64_t>(names_.size());
+            names_.append(replacement[index].variable_name);
+            names_.push_back('\0');
+        }
+    }
+}
+
+// MARK: AST
+// ----------------------------------- AST -----------------------------------
+
+/**
+ * @brief Clears the AST by resetting the root and clearing the tokens_ list
+ * (along with the token offsets and paren groups that go with it).
+ */
+void AST::clear() {
+    root_.reset();
+    tokens_.clear();
+    token_offsets_.clear();
+    source_known_ = false;
+    paren_groups_.clear();
+}
+
+/**
+ * @brief Tokenizes the input string into a list of tokens, which are stored
+ * in the tokens_ field. The source offset of each token is stored in the
+ * token_offsets_ field.
+ * @param input_string The input string to tokenize.
+ */
+void AST::tokenize(const std::string& input_string) {
+    tokens_.clear(); // Clear the tokens first.
+    tokens_.set_interner(interner_);
+    token_offsets_.clear();
+    source_known_ = false;
+    check_limit(input_string.size(), limits_.max_input_bytes,
+                input_bytes_error);
+
+    LexState state;
+    // Go through the characters of the string, one token at a time.
+    while (skip_whitespace(input_string, state)) {
+        const std::size_t token_start = state.index;
+        lex_step(input_string, state, tokens_);
+        token_offsets_.resize(tokens_.size(), token_start);
+        check_limit(tokens_.size(), limits_.max_tokens, tokens_error);
+    }
+    finish_lexing(state);
+
+    tokens_.push(TokenType::End); // Push the end token.
+    token_offsets_.push_back(input_string.size());
+    source_.assign(input_string);
+    source_known_ = true;
+}
+
+/**
+ * @brief Tokenizes the input string like tokenize(), but splits the input
+ * into chunks that are lexed on separate threads. The tokens, offsets and
+ * error messages are identical to tokenize().
+ * @param input_string The input string to tokenize.
+ * @param thread_count The number of threads to use. 0 means the tuning's
+ * thread count (see ParseTuning).
+ */
+void AST::tokenize_parallel(const std::string& input_string,
+                            unsigned thread_count) {
+    std::size_t chunk_count =
+        thread_count != 0 ? thread_count : tuning_.thread_count;
+    if (chunk_count == 0) {
+        chunk_count = std::max(1U, std::thread::hardware_concurrency());
+        chunk_count =
+            std::min(chunk_count,
+                     input_string.size() / tuning_.min_parallel_chunk_size);
+    }
+    if (chunk_count <= 1) {
+        tokenize(input_string);
+        return;
+    }
+    check_limit(input_string.size(), limits_.max_input_bytes,
+                input_bytes_error);
+
+    const std::vector<std::size_t> bounds =
+        split_into_chunks(input_string, chunk_count);
+    std::vector<LexChunk> chunks(bounds.size() - 1);
+    for (LexChunk& chunk : chunks) {
+        chunk.tokens.set_interner(interner_);
+        chunk.max_tokens = limits_.max_tokens;
+    }
+    {
+        std::vector<std::jthread> workers;
+        workers.reserve(chunks.size() - 1);
+        for (std::size_t chunk = 1; chunk < chunks.size(); ++chunk) {
+            workers.emplace_back(lex_chunk, std::cref(input_string),
+                                 bounds[chunk], bounds[chunk + 1],
+                                 std::ref(chunks[chunk]));
+        }
+        // Lex the first chunk on this thread while the others are running.
+        lex_chunk(input_string, bounds[0], bounds[1], chunks[0]);
+    } // The jthreads join here.
+
+    // Fix-up pass: every chunk was lexed as if an operand was expected at its
+    // start. That holds as long as all chunks before it lexed without errors,
+    // so the first error in chunk order is also the first error in the input.
+    tokens_.clear();
+    tokens_.set_interner(interner_);
+    token_offsets_.clear();
+    source_known_ = false;
+    std::size_t token_count = 1;
+    for (const LexChunk& chunk : chunks) {
+        if (chunk.error) {
+            std::rethrow_exception(chunk.error);
+        }
+        token_count += chunk.tokens.size();
+    }
+    // Not counting the End token.
+    check_limit(token_count - 1, limits_.max_tokens, tokens_error);
+
+    LexState final_state = chunks.back().state;
+    tokens_.reserve(token_count);
+    token_offsets_.reserve(token_count);
+    for (LexChunk& chunk : chunks) {
+        final_state.saw_non_whitespace |= chunk.state.saw_non_whitespace;
+        tokens_.append(chunk.tokens);
+        token_offsets_.insert(token_offsets_.end(), chunk.offsets.begin(),
+                              chunk.offsets.end());
+    }
+    finish_lexing(final_state);
+
+    tokens_.push(TokenType::End); // Push the end token.
+    token_offsets_.push_back(input_string.size());
+    source_.assign(input_string);
+    source_known_ = true;
+}
+
+/**
+ * @brief Converts the tokens we've tokenized into an AST, and stores the root
+ * in the root_ field.
+ */
+void AST::add_tokens_to_tree() {
+    root_.reset();
+    paren_groups_.clear();
+    check_shape_limits(tokens_, limits_);
+    std::unordered_map<std::size_t, PrebuiltGroup> no_prebuilt;
+    root_ = build_tree(0, tokens_.size(), no_prebuilt, paren_groups_,
+                       builder_stacks_);
+}
+
+// The shared state of one add_tokens_to_tree_parallel() call.
+struct AST::ParallelBuild {
+    std::vector<int64_t> depths; // The paren depth before each token.
+    std::atomic<int> spare_threads;
+};
+
+/**
+ * @brief Converts the tokens into an AST like add_tokens_to_tree(), but
+ * builds large parenthesized groups on separate threads.
+ *
+ * The paren depth of every token is computed with a parallel prefix sum. The
+ * builder then finds the large groups at the top level of the expression
+ * (using the depths to find where each group closes) and builds each of them
+ * concurrently, looking for large groups inside them in the same way. Since a
+ * group's subtree only depends on the tokens inside it, the results are
+ * stitched together by running the usual shunting-yard over the top level with
+ * the groups' subtrees as prebuilt values. The resulting tree (and any error)
+ * is identical to add_tokens_to_tree().
+ * @param thread_count The number of threads to use. 0 means the tuning's
+ * thread count (see ParseTuning).
+ */
+void AST::add_tokens_to_tree_parallel(unsigned thread_count) {
+    root_.reset();
+    paren_groups_.clear();
+
+    std::size_t chunk_count =
+        thread_count != 0 ? thread_count : tuning_.thread_count;
+    if (chunk_count == 0) {
+        chunk_count = std::max(1U, std::thread::hardware_concurrency());
+    }
+    ParallelBuild build;
+    if (chunk_count <= 1 ||
+        tokens_.size() < tuning_.min_parallel_group_tokens ||
+        !compute_paren_depths(tokens_.types(), chunk_count, build.depths)) {
+        // Unbalanced parentheses are left for the sequential builder, so that
+        // it reports the same error it always does.
+        add_tokens_to_tree();
+        return;
+    }
+    check_shape_limits(tokens_, limits_);
+    build.spare_threads = static_cast<int>(chunk_count) - 1;
+
+    try {
+        root_ = build_region(build, 0, tokens_.size(), 0, paren_groups_);
+    } catch (const ASTException&) {
+        // Rebuild sequentially so the error is reported exactly as usual.
+        add_tokens_to_tree();
+    }
+}
+
+/**
+ * @brief Builds the subtree for the tokens in [first, last), handing large
+ * parenthesized groups at the region's top level to other threads while
+ * there are threads to spare.
+ * @param build The shared state of the parallel build.
+ * @param first The index of the first token of the region.
+ * @param last The index after the last token of the region.
+ * @param depth The paren depth of the region's top level.
+ * @param groups Every parenthesized group that gets built is recorded here.
+ * @return The root of the region's subtree.
+ */
+std::unique_ptr<Node> AST::build_region(ParallelBuild& build,
+                                        std::size_t first, std::size_t last,
+                                        int64_t depth,
+                                        std::vector<ParenGroup>& groups) const {
+    // A group of tokens to build on its own, and what came out of it.
+    struct GroupTask {
+        std::size_t open;
+        std::size_t close;
+        std::unique_ptr<Node> node;
+        std::vector<ParenGroup> groups;
+        std::exception_ptr error;
+    };
+
+    std::vector<GroupTask> tasks;
+    if (last - first >= 2 * tuning_.min_parallel_group_tokens &&
+        depth < tuning_.max_parallel_build_depth &&
+        build.spare_threads.load() > 0) {
+        // Find the large groups at this depth. A group opened at depth d is
+        // closed by the first ')' after it with depth d + 1 before it.
+        for (std::size_t index = first; index < last; ++index) {
+            if (tokens_.type(index) != TokenType::LParen ||
+                build.depths[index] != depth) {
+                continue;
+            }
+            const std::size_t open = index;
+            while (tokens_.type(index) != TokenType::RParen ||
+                   build.depths[index] != depth + 1) {
+                ++index;
+            }
+            if (index - open >= tuning_.min_parallel_group_tokens) {
+                tasks.push_back({open, index, nullptr, {}, nullptr});
+            }
+        }
+    }
+
+    auto run_task = [this, &build, depth](GroupTask& task) {
+        try {
+            task.node = build_region(build, task.open + 1, task.close,
+                                     depth + 1, task.groups);
+            task.groups.push_back({task.open, task.close, task.node.get()});
+        } catch (...) {
+            task.error = std::current_exception();
+        }
+    };
+    {
+        std::vector<std::jthread> workers;
+        std::vector<GroupTask*> inline_tasks;
+        for (GroupTask& task : tasks) {
+            // Always keep the last task for this thread, so it isn't idle.
+            if (&task != &tasks.back() &&
+                build.spare_threads.fetch_sub(1) > 0) {
+                workers.emplace_back([&run_task, &build, &task] {
+                    run_task(task);
+                    build.spare_threads.fetch_add(1);
+                });
+            } else {
+                if (&task != &tasks.back()) {
+                    build.spare_threads.fetch_add(1);
+                }
+                inline_tasks.push_back(&task);
+            }
+        }
+        for (GroupTask* task : inline_tasks) {
+            run_task(*task);
+        }
+    } // The jthreads join here.
+
+    std::unordered_map<std::size_t, PrebuiltGroup> prebuilt;
+    for (GroupTask& task : tasks) {
+        if (task.error) {
+            std::rethrow_exception(task.error);
+        }
+        prebuilt.emplace(task.open,
+                         PrebuiltGroup{task.close, std::move(task.node)});
+        groups.insert(groups.end(), task.groups.begin(), task.groups.end());
+    }
+    BuilderStacks stacks;
+    return build_tree(first, last, prebuilt, groups, stacks);
+}
+
+// The state of the "shunting yard algorithm", which uses the operator_stack
+// and value_stack to maintain the current state of the conversion. Tokens are
+// fed in one at a time, so the tree can be built while tokens are still
+// arriving.
+class AST::TreeBuilder {
+  public:
+    TreeBuilder(std::vector<ParenGroup>& groups, BuilderStacks& stacks);
+
+    void push_value(std::unique_ptr<Node> node);
+    void add_token(const TokenView& current_token, std::size_t index);
+    std::unique_ptr<Node> finish();
+
+  private:
+    ValueStack& value_stack_; // The stack of values.
+    OperatorStack& operator_stack_;
+    // The token indices of the '(' tokens on the operator stack.
+    std::stack<std::size_t, std::vector<std::size_t>>& open_paren_indices_;
+    // Every parenthesized group that gets built is recorded here.
+    std::vector<ParenGroup>& groups_;
+};
+
+/**
+ * @brief Constructs a builder that works in the given stacks. Anything left
+ * in them by an earlier build that failed is dropped first.
+ * @param groups Every parenthesized group that gets built is recorded here.
+ * @param stacks The stacks to build in. Their storage is reused.
+ */
+AST::TreeBuilder::TreeBuilder(std::vector<ParenGroup>& groups,
+                              BuilderStacks& stacks)
+    : value_stack_(stacks.values), operator_stack_(stacks.operators),
+      open_paren_indices_(stacks.open_parens), groups_(groups) {
+    while (!value_stack_.empty()) {
+        value_stack_.pop();
+    }
+    while (!operator_stack_.empty()) {
+        operator_stack_.pop();
+    }
+    while (!open_paren_indices_.empty()) {
+        open_paren_indices_.pop();
+    }
+}
+
+/**
+ * @brief Pushes an already built subtree onto the value stack, as if it was a
+ * single operand.
+ * @param node The subtree to push.
+ */
+void AST::TreeBuilder::push_value(std::unique_ptr<Node> node) {
+    value_stack_.push(std::move(node));
+}
+
+/**
+ * @brief Feeds the next token into the builder.
+ * @param current_token The token to add.
+ * @param index The index of the token, used to record parenthesized groups.
+ */
+void AST::TreeBuilder::add_token(const TokenView& current_token,
+                                 std::size_t index) {
+    // If we have a number token, push it onto the value stack.
+    if (current_token.type == TokenType::Number) {
+        value_stack_.push(std::make_unique<Node>(current_token.value));
+        return;
+    }
+
+    if (current_token.type == TokenType::Variable) {
+        value_stack_.push(std::make_unique<Node>(
+            std::string(current_token.variable_name)));
+        return;
+    }
+
+    if (current_token.type == TokenType::LParen) {
+        operator_stack_.push(current_token.type);
+        open_paren_indices_.push(index);
+        return;
+    }
+
+    if (current_token.type == TokenType::RParen) {
+        // While we don't find a '(', we apply the top operator to the top 2
+        // values of the value stack.
+        while (!operator_stack_.empty() &&
+               operator_stack_.top() != TokenType::LParen) {
+            apply_top_operator(value_stack_, operator_stack_);
+        }
+        // If we run out of operators before finding a '(', then we have a
+        // mismatched parentheses error.
+        if (operator_stack_.empty()) {
+            throw ASTException("mismatched ')'");
+        }
+        // Finally, pop the '(' from the operator stack and discard it.
+        operator_stack_.pop();
+        if (value_stack_.empty()) {
+            throw ASTException("missing operand");
+        }
+        groups_.push_back(
+            {open_paren_indices_.top(), index, value_stack_.top().get()});
+        open_paren_indices_.pop();
+        return;
+    }
+
+    // Handle the case if we have an arithmetic operator.
+    if (is_arithmetic_operator(current_token.type)) {
+        handle_operator(current_token.type, value_stack_, operator_stack_);
+        return;
+    }
+
+    if (current_token.type == TokenType::End) {
+        return;
+    }
+
+    // If we have a token that's not a number, operator, or parentheses, then
+    // we have an unexpected token error.
+    throw ASTException("unexpected token");
+}
+
+/**
+ * @brief Applies the remaining operators once all tokens have been added.
+ * @return The root of the built tree.
+ */
+std::unique_ptr<Node> AST::TreeBuilder::finish() {
+    // While the operator stack isn't empty, apply the top operator to the top
+    // 2 values of the value stack.
+    while (!operator_stack_.empty()) {
+        if (operator_stack_.top() == TokenType::LParen) {
+            throw ASTException("mismatched '('");
+        }
+        apply_top_operator(value_stack_, operator_stack_);
+    }
+
+    // At this point, the operator stack should be empty, and the value stack
+    // should have exactly 1 value (the root of the AST). Otherwise, we have an
+    // error.
+    if (value_stack_.size() != 1) {
+        throw ASTException("invalid expression");
+    }
+
+    // Return the only value left on the value stack, the root of the AST.
+    std::unique_ptr<Node> root = std::move(value_stack_.top());
+    value_stack_.pop();
+    return root;
+}
+
+/**
+ * @brief Converts the tokens in [first, last) into a tree and returns its
+ * root.
+ * @param first The index of the first token to convert.
+ * @param last The index after the last token to convert. Conversion also
+ * stops at the end token.
+ * @param prebuilt Subtrees that are already built, keyed by the index of the
+ * '(' token of their group. When the builder reaches such a '(', it pushes the
+ * prebuilt subtree and skips to the token after the matching ')'.
+ * @param groups Every parenthesized group that gets built is recorded here.
+ * @param stacks The stacks to build in. Their storage is reused.
+ * @return The root of the built tree.
+ */
+std::unique_ptr<Node>
+AST::build_tree(std::size_t first, std::size_t last,
+                std::unordered_map<std::size_t, PrebuiltGroup>& prebuilt,
+                std::vector<ParenGroup>& groups, BuilderStacks& stacks) const {
+    TreeBuilder builder(groups, stacks);
+
+    // Iterate through all the tokens.
+    for (std::size_t index = first; index < last; ++index) {
+        const TokenView current_token = tokens_[index];
+        if (current_token.type == TokenType::End) {
+            break;
+        }
+
+        // Reuse the group's subtree if it's already built.
+        if (current_token.type == TokenType::LParen) {
+            if (const auto prebuilt_it = prebuilt.find(index);
+                prebuilt_it != prebuilt.end()) {
+                builder.push_value(std::move(prebuilt_it->second.node));
+                index = prebuilt_it->second.close;
+                continue;
+            }
+        }
+
+        builder.add_token(current_token, index);
+    }
+    return builder.finish();
+}
+
+/**
+ * @brief Parses the input string into an AST by first tokenizing it and then
+ * converting the tokens into a tree (both on several threads if the input is
+ * large). The resulting AST is stored in the root_
+ * field.
+ * @param input_expression The input string to parse into an AST.
+ */
+void AST::parse(const std::string& input_expression) {
+    clear();
+    if (input_expression.size() >= tuning_.parallel_parse_threshold) {
+        tokenize_parallel(input_expression);
+        add_tokens_to_tree_parallel();
+    } else {
+        tokenize(input_expression);
+        add_tokens_to_tree();
+    }
+}
+
+/**
+ * @brief Parses an expression read from a stream, overlapping the stages: a
+ * reader thread reads blocks of the input, a lexer thread lexes them, and this
+ * thread builds the tree from the tokens as they arrive. The stages are
+ * connected by lock-free single-producer/single-consumer rings.
+ *
+ * The reader cuts blocks right after a character for which
+ * is_chunk_boundary_char() holds, so the lexer can lex each block as it
+ * arrives without looking ahead into the next one. The resulting tree (and
+ * any error) is identical to parse() on the whole input.
+ * @param input_stream The stream to read the expression from, until EOF.
+ */
+void AST::parse_stream(std::istream& input_stream) {
+    clear();
+    tokens_.set_interner(interner_);
+
+    // A block of input text and its offset in the whole input.
+    struct TextChunk {
+        std::string text;
+        std::size_t offset;
+    };
+    // A token and its offset in the whole input.
+    struct OffsetToken {
+        Token token;
+        std::size_t offset;
+    };
+    SpscRing<TextChunk> chunk_ring(stream_chunk_ring_size);
+    SpscRing<OffsetToken> token_ring(stream_token_ring_size);
+    std::exception_ptr reader_error;
+    std::exception_ptr lexer_error;
+
+    // Reader stage.
+    std::jthread reader([this, &input_stream, &chunk_ring, &reader_error] {
+        try {
+            std::string pending;
+            std::size_t pending_offset = 0;
+            std::string block(tuning_.stream_block_size, '\0');
+            while (input_stream.read(block.data(),
+                                     static_cast<long>(block.size())) ||
+                   input_stream.gcount() > 0) {
+                check_limit(pending_offset + pending.size() +
+                                static_cast<std::size_t>(input_stream.gcount()),
+                            limits_.max_input_bytes, input_bytes_error);
+                // Everything before the new data has no safe cut in it, so
+                // only the new data needs to be searched.
+                const std::size_t searched = pending.size();
+                pending.append(block, 0,
+                               static_cast<std::size_t>(input_stream.gcount()));
+                // Send everything up to the last safe cut, keep the rest.
+                const std::size_t cut = find_last_safe_cut(pending, searched);
+                if (cut == 0) {
+                    continue;
+                }
+                std::string rest = pending.substr(cut);
+                pending.resize(cut);
+                chunk_ring.push({std::move(pending), pending_offset});
+                pending_offset += cut;
+                pending = std::move(rest);
+            }
+            if (input_stream.bad()) {
+                throw ASTException("error reading expression input");
+            }
+            chunk_ring.push({std::move(pending), pending_offset});
+        } catch (...) {
+            reader_error = std::current_exception();
+        }
+        chunk_ring.close();
+    });
+
+    // Lexer stage. Every chunk starts right after a safe cut, so the lexer
+    // state carries over from one chunk to the next unchanged. Variables are
+    // interned by the builder, as their tokens are added to tokens_.
+    std::jthread lexer([this, &chunk_ring, &token_ring, &lexer_error] {
+        LexState state;
+        std::size_t input_size = 0;
+        std::size_t token_count = 0;
+        TokenList step_tokens;
+        while (std::optional<TextChunk> chunk = chunk_ring.pop()) {
+            if (lexer_error) {
+                continue; // Drain the ring so the reader can finish.
+            }
+            try {
+                state.index = 0;
+                while (skip_whitespace(chunk->text, state)) {
+                    const std::size_t token_start = chunk->offset + state.index;
+                    lex_step(chunk->text, state, step_tokens);
+                    token_count += step_tokens.size();
+                    check_limit(token_count, limits_.max_tokens, tokens_error);
+                    for (std::size_t index = 0; index < step_tokens.size();
+                         ++index) {
+                        token_ring.push({step_tokens.token(index),
+                                         token_start});
+                    }
+                    step_tokens.clear();
+                }
+                input_size = chunk->offset + chunk->text.size();
+            } catch (...) {
+                lexer_error = std::current_exception();
+            }
+        }
+        try {
+            if (!lexer_error) {
+                finish_lexing(state);
+                token_ring.push({{TokenType::End, 0, ""}, input_size});
+            }
+        } catch (...) {
+            lexer_error = std::current_exception();
+        }
+        token_ring.close();
+    });
+
+    // Builder stage. An error here is only reported if lexing succeeds,
+    // since parse() would have reported the lexer's error first.
+    std::exception_ptr builder_error;
+    TreeBuilder builder(paren_groups_, builder_stacks_);
+    std::optional<ShapeChecker> shape_checker;
+    if (limits_.max_nodes != 0 || limits_.max_depth != 0) {
+        shape_checker.emplace(limits_);
+    }
+    while (std::optional<OffsetToken> next = token_ring.pop()) {
+        tokens_.push(next->token);
+        token_offsets_.push_back(next->offset);
+        if (builder_error) {
+            continue;
+        }
+        try {
+            if (shape_checker) {
+                shape_checker->add(next->token.type);
+            }
+            builder.add_token(tokens_.back(), tokens_.size() - 1);
+        } catch (...) {
+            builder_error = std::current_exception();
+        }
+    }
+    reader.join();
+    lexer.join();
+
+    for (const std::exception_ptr& error :
+         {reader_error, lexer_error, builder_error}) {
+        if (error) {
+            root_.reset();
+            std::rethrow_exception(error);
+        }
+    }
+    if (shape_checker) {
+        shape_checker->finish();
+    }
+    root_ = builder.finish();
+}
+
+/**
+ * @brief Checks an expression for the errors that parse() would report,
+ * without making tokens or a tree (see ExpressionValidator). Throws the
+ * ASTException that parse() would throw first, if any.
+ * @param input_expression The expression to check.
+ */
+void AST::validate(std::string_view input_expression) {
+    ExpressionValidator validator;
+    validator.feed(input_expression);
+    validator.finish();
+}
+
+/**
+ * @brief Lexes an expression read from a stream without keeping the input or
+ * the tokens in memory, for inputs too large to parse in memory. The input is
+ * read in blocks that are cut at safe places like in parse_stream(), so only
+ * about one block is held at a time. The tokens and errors are the same as
+ * tokenize() on the whole input.
+ * @param input_stream The stream to read the expression from, until EOF.
+ * @param on_token Called with each token in order, ending with the End token.
+ */
+void AST::lex_stream(std::istream& input_stream,
+                     const std::function<void(const Token&)>& on_token) {
+    LexState state;
+    TokenList step_tokens;
+    auto lex_block = [&state, &step_tokens,
+                      &on_token](const std::string& text) {
+        state.index = 0;
+        while (skip_whitespace(text, state)) {
+            lex_step(text, state, step_tokens);
+            for (std::size_t index = 0; index < step_tokens.size(); ++index) {
+                on_token(step_tokens.token(index));
+            }
+            step_tokens.clear();
+        }
+    };
+
+    std::string pending;
+    std::string block(ParseTuning{}.stream_block_size, '\0');
+    while (input_stream.read(block.data(), static_cast<long>(block.size())) ||
+           input_stream.gcount() > 0) {
+        const std::size_t searched = pending.size();
+        pending.append(block, 0,
+                       static_cast<std::size_t>(input_stream.gcount()));
+        const std::size_t cut = find_last_safe_cut(pending, searched);
+        if (cut == 0) {
+            continue;
+        }
+        std::string rest = pending.substr(cut);
+        pending.resize(cut);
+        lex_block(pending);
+        pending = std::move(rest);
+    }
+    if (input_stream.bad()) {
+        throw ASTException("error reading expression input");
+    }
+    lex_block(pending);
+    finish_lexing(state);
+    on_token({TokenType::End, 0, ""});
+}
+
+/**
+ * @brief Parses the result of applying an edit to the previously parsed
+ * expression, reusing as much of the previous parse as possible.
+ *
+ * Only the tokens around the edit are lexed again: lexing restarts at the
+ * token before the edit, and stops as soon as it reaches an unchanged token
+ * boundary after the edit with the same lexer state. Parenthesized groups
+ * that lie completely outside the re-lexed tokens are moved over from the old
+ * tree instead of being built again. The resulting tree (and any error) is
+ * identical to calling parse() on the edited text.
+ *
+ * This saves lexing the unchanged text and building the reused groups, but
+ * the cost is still linear in the size of the input, not in the size of the
+ * edit: old_input is compared with the text the tokens came from, the token
+ * arrays are spliced, and the builder runs over all tokens, so an expression
+ * without parentheses is built again in full. If old_input isn't the text of
+ * the last parse, nothing is reused and the edited text is parsed from
+ * scratch.
+ * @param old_input The text that this AST was last parsed from.
+ * @param edit The edit to apply to old_input.
+ * @return The edited text.
+ */
+std::string AST::reparse(const std::string& old_input, const TextEdit& edit) {
+    if (edit.offset > old_input.size() ||
+        edit.removed_length > old_input.size() - edit.offset) {
+        throw ASTException("edit out of range");
+    }
+
+    const std::size_t new_size =
+        old_input.size() - edit.removed_length + edit.inserted_text.size();
+    check_limit(new_size, limits_.max_input_bytes, input_bytes_error);
+
+    std::string new_input;
+    new_input.reserve(new_size);
+    new_input.append(old_input, 0, edit.offset);
+    new_input.append(edit.inserted_text);
+    new_input.append(old_input, edit.offset + edit.removed_length);
+
+    // Without a successful previous parse of old_input, there's nothing to
+    // reuse.
+    if (!root_ || tokens_.empty() || token_offsets_.size() != tokens_.size() ||
+        !source_known_ || source_ != old_input) {
+        parse(new_input);
+        return new_input;
+    }
+
+    try {
+        const TokenSplice splice = relex(new_input, edit);
+        // Not counting the End token.
+        check_limit(tokens_.size() - 1, limits_.max_tokens, tokens_error);
+        check_shape_limits(tokens_, limits_);
+        auto prebuilt = take_reusable_groups(splice);
+        root_.reset();
+        root_ = build_tree(0, tokens_.size(), prebuilt, paren_groups_,
+                           builder_stacks_);
+        source_.assign(new_input);
+    } catch (...) {
+        // Leave the AST in the same state as a failed parse().
+        clear();
+        throw;
+    }
+    return new_input;
+}
+
+/**
+ * @brief Lexes the tokens affected by an edit again, and splices them into
+ * tokens_ and token_offsets_ in place of the old ones.
+ * @param input The edited text.
+ * @param edit The edit that was applied to the text tokens_ was lexed from.
+ * @return The range of tokens that was replaced.
+ */
+AST::TokenSplice AST::relex(const std::string& input, const TextEdit& edit) {
+    // Leave the end token out of the search, it's pushed back at the end.
+    const std::size_t old_count = tokens_.size() - 1;
+    const auto offsets_begin = token_offsets_.begin();
+    const auto offsets_end = offsets_begin + static_cast<long>(old_count);
+    const std::size_t old_edit_end = edit.offset + edit.removed_length;
+    const std::size_t new_edit_end = edit.offset + edit.inserted_text.size();
+
+    // Start at the last token that begins before the edit, since the edit
+    // might extend it (e.g. "ab" -> "abc"). A unary minus can emit two tokens
+    // at the same offset, so go back to the first of them.
+    std::size_t first = static_cast<std::size_t>(
+        std::lower_bound(offsets_begin, offsets_end, edit.offset) -
+        offsets_begin);
+    if (first > 0) {
+        first = first_token_at_offset(token_offsets_, first - 1);
+    }
+
+    LexState state;
+    if (first > 0) {
+        state.index = token_offsets_[first];
+        state.is_awaiting_operand =
+            is_awaiting_operand_after(tokens_.type(first - 1));
+        state.saw_non_whitespace = true;
+    }
+
+    TokenList new_tokens;
+    new_tokens.set_interner(interner_);
+    std::vector<std::size_t> new_offsets;
+    std::size_t old_end = old_count;
+    while (skip_whitespace(input, state)) {
+        // Past the edit, stop as soon as we're at the start of an old token in
+        // the same lexer state, since lexing from there gives the same tokens
+        // as before.
+        if (state.index >= new_edit_end) {
+            const std::size_t old_offset =
+                state.index - new_edit_end + old_edit_end;
+            const auto old_it = std::lower_bound(
+                offsets_begin + static_cast<long>(first), offsets_end,
+                old_offset);
+            const auto old_index =
+                static_cast<std::size_t>(old_it - offsets_begin);
+            const bool was_awaiting_operand =
+                old_index == 0 ||
+                is_awaiting_operand_after(tokens_.type(old_index - 1));
+            if (old_it != offsets_end && *old_it == old_offset &&
+                was_awaiting_operand == state.is_awaiting_operand) {
+                old_end = old_index;
+                break;
+            }
+        }
+        const std::size_t token_start = state.index;
+        lex_step(input, state, new_tokens);
+        new_offsets.resize(new_tokens.size(), token_start);
+    }
+    if (old_end == old_count) {
+        finish_lexing(state);
+    }
+
+    // Shift the offsets of the unchanged tokens after the edit (including the
+    // end token) to their new positions.
+    for (std::size_t index = old_end; index < token_offsets_.size(); ++index) {
+        token_offsets_[index] =
+            token_offsets_[index] - old_edit_end + new_edit_end;
+    }
+
+    const auto first_pos = static_cast<long>(first);
+    const auto old_end_pos = static_cast<long>(old_end);
+    tokens_.replace(first, old_end, new_tokens);
+    token_offsets_.erase(token_offsets_.begin() + first_pos,
+                         token_offsets_.begin() + old_end_pos);
+    token_offsets_.insert(token_offsets_.begin() + first_pos,
+                          new_offsets.begin(), new_offsets.end());
+
+    return {first, old_end, first + new_tokens.size()};
+}
+
+/**
+ * @brief Moves the subtrees of the parenthesized groups that weren't touched
+ * by a splice out of the current tree, so the builder can reuse them.
+ *
+ * Only the outermost untouched groups are moved out; groups nested inside
+ * them come along. The records of all untouched groups are kept (with their
+ * token indices shifted), since their nodes stay the same.
+ * @param splice The range of tokens that relex() replaced.
+ * @return The reusable subtrees, keyed by the new index of their '(' token.
+ */
+std::unordered_map<std::size_t, AST::PrebuiltGroup>
+AST::take_reusable_groups(const TokenSplice& splice) {
+    // Maps an old token index outside the splice to its new index.
+    auto to_new_index = [&splice](std::size_t old_index) {
+        if (old_index < splice.first) {
+            return old_index;
+        }
+        return old_index - splice.old_end + splice.new_end;
+    };
+
+    std::vector<ParenGroup> old_groups = std::move(paren_groups_);
+    paren_groups_.clear();
+    std::ranges::sort(old_groups, [](const ParenGroup& a, const ParenGroup& b) {
+        return a.open < b.open;
+    });
+
+    std::unordered_map<std::size_t, PrebuiltGroup> prebuilt;
+    std::unordered_map<const Node*, std::size_t> reused_nodes;
+    prebuilt.reserve(old_groups.size());
+    reused_nodes.reserve(old_groups.size());
+    bool is_covered = false;
+    std::size_t covered_until = 0;
+    for (const ParenGroup& group : old_groups) {
+        if (group.close >= splice.first && group.open < splice.old_end) {
+            continue; // Touched by the splice, so it has to be rebuilt.
+        }
+        const std::size_t open = to_new_index(group.open);
+        const std::size_t close = to_new_index(group.close);
+        paren_groups_.push_back({open, close, group.node});
+        if (is_covered && group.open < covered_until) {
+            continue; // Nested inside a group that's already being reused.
+        }
+        prebuilt.emplace(open, PrebuiltGroup{close, nullptr});
+        reused_nodes.emplace(group.node, open);
+        is_covered = true;
+        covered_until = group.close;
+    }
+
+    // Walk the old tree and take ownership of the reused subtrees. There's no
+    // need to look inside them, so this only visits the nodes that are about
+    // to be thrown away.
+    std::vector<std::unique_ptr<Node>*> pending{&root_};
+    while (!pending.empty()) {
+        std::unique_ptr<Node>* slot = pending.back();
+        pending.pop_back();
+        if (const auto reused_it = reused_nodes.find(slot->get());
+            reused_it != reused_nodes.end()) {
+            prebuilt[reused_it->second].node = std::move(*slot);
+            continue;
+        }
+        if ((*slot)->left) {
+            pending.push_back(&(*slot)->left);
+        }
+        if ((*slot)->right) {
+            pending.push_back(&(*slot)->right);
+        }
+    }
+    return prebuilt;
+}
+
+/**
+ * @brief Evaluates the AST by calling get_value() on the root node, which
+ * recursively evaluates the entire tree and returns the result. A tree with
+ * more operators than the evaluation limit is rejected before any of them is
+ * applied.
+ * @return The result of evaluating the AST.
+ */
+int64_t AST::evaluate() {
+    if (!root_) {
+        throw ASTException("tree is empty");
+    }
+    check_eval_operations(root_.get(), limits_.max_eval_operations);
+    return root_->get_value();
+}
+
+/**
+ * @brief Evaluates the AST with the given variable bindings. It only reads
+ * the tree, the limits and the bindings, so several threads can evaluate the
+ * same AST at once, as long as none of them changes it meanwhile.
+ * @param bindings The values to substitute for variables.
+ * @return The result of evaluating the AST.
+ */
+int64_t AST::evaluate(const VariableBindings& bindings) const {
+    if (!root_) {
+        throw ASTException("tree is empty");
+    }
+    check_eval_operations(root_.get(), limits_.max_eval_operations);
+    return root_->get_value(bindings);
+}
+
+/**
+ * @brief Computes a hash of the tree's structure, so that two ASTs built from
+ * equivalent expressions (e.g. "1+x" and "(1) + x") hash the same.
+ * @return The structural hash of the tree.
+ */
+uint64_t AST::structural_hash() const {
+    if (!root_) {
+        throw ASTException("tree is empty");
+    }
+    return hash_subtree(root_.get());
+}
+
+/**
+ * @brief Collects the names of the variables referenced by the tree.
+ * @return The referenced variable names, sorted and without duplicates.
+ */
+std::vector<std::string> AST::variables() const {
+    std::set<std::string> names;
+    if (root_) {
+        collect_variables(root_.get(), names);
+    }
+    return {names.begin(), names.end()};
+}
+
+/**
+ * @brief Writes the tree in the compact preorder format that eval mode reads
+ * (see write_preorder_subtree).
+ * @param output_stream The stream to write to.
+ */
+void AST::write_preorder(std::ostream& output_stream) const {
+    if (!root_) {
+        throw ASTException("tree is empty");
+    }
+    write_preorder_subtree(root_.get(), output_stream);
+}
+
+// Getter for root_ (because might need to be accessed afterwards).
+Node* AST::root() {
+    return root_.get();
+}
+
+// Const getter for root_.
+const Node* AST::root() const {
+    return root_.get();
+}
+
+/**
+ * @brief Sets the interner that the tokenizer assigns variable ids from. With
+ * an interner, the value of every variable token is its symbol id, so several
+ * ASTs parsed on different threads can share one set of ids.
+ * @param interner The interner to use, or nullptr to leave variable token
+ * values at 0. Must outlive any parsing done with it.
+ */
+void AST::set_interner(SymbolInterner* interner) {
+    interner_ = interner;
+}
+
+/**
+ * @brief Sets the limits that parsing and evaluating are held to from now on
+ * (see ASTLimits). The default is no limits.
+ * @param limits The limits.
+ */
+void AST::set_limits(const ASTLimits& limits) {
+    limits_ = limits;
+}
+
+// Getter for limits_.
+const ASTLimits& AST::limits() const {
+    return limits_;
+}
+
+/**
+ * @brief Sets when parsing uses several threads and how it splits the work
+ * (see ParseTuning). Doesn't change the result of parsing, only its speed.
+ * @param tuning The tuning.
+ */
+void AST::set_tuning(const ParseTuning& tuning) {
+    tuning_ = tuning;
+}
+
+// Getter for tuning_.
+const ParseTuning& AST::tuning() const {
+    return tuning_;
+}
+
+/**
+ * @brief Replaces the tree with one that was built directly (e.g. with the
+ * builder API in ExprBuilder.h) rather than parsed. The tokens are cleared,
+ * since there's no text the tree came from.
+ * @param root The root of the new tree.
+ */
+void AST::set_root(std::unique_ptr<Node> root) {
+    clear();
+    root_ = std::move(root);
+}
+
+/**
+ * @brief Takes the tree out of the AST, e.g. to transform it and put it back
+ * with set_root(). The AST is left empty, since the tokens and groups no
+ * longer describe whatever the tree becomes.
+ * @return The root of the tree.
+ */
+std::unique_ptr<Node> AST::release_root() {
+    std::unique_ptr<Node> root = std::move(root_);
+    clear();
+    return root;
 }
 
 // Const getter for tokens_.
-const std::vector<Token>& AST::tokens() const {
+const TokenList& AST::tokens() const {
     return tokens_;
 }
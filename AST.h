@@ -1,8 +1,15 @@
 #pragma once
+#include <cstddef>
 #include <cstdint>
+#include <functional>
+#include <iosfwd>
 #include <memory>
+#include <span>
+#include <stack>
 #include <stdexcept>
 #include <string>
+#include <string_view>
+#include <unordered_map>
 #include <vector>
 
 // Custom exception for AST
@@ -11,8 +18,16 @@ class ASTException : public std::runtime_error {
     using runtime_error::runtime_error;
 };
 
+// Maps variable names to the values they are bound to during evaluation.
+using VariableBindings = std::unordered_map<std::string, int64_t>;
+
 enum class NodeType { Number, Variable, Add, Sub, Mult, Div };
 
+// Evaluation order: an operator evaluates its right operand, then its left
+// operand, then applies itself. When evaluating could fail in several places,
+// the error reported is the first one met in that order. Node::get_value()
+// defines this order, and every other evaluator (FlatTree, eval mode, ...)
+// follows it, so they all report the same error as AST::evaluate().
 struct Node {
     NodeType type;
     int64_t value; // lets allow large integers cause why not
@@ -21,13 +36,22 @@ struct Node {
     std::unique_ptr<Node> right;
 
     int64_t get_value();
+    int64_t get_value(const VariableBindings& bindings) const;
 
     explicit Node(int64_t v);
     explicit Node(std::string variable);
     Node(NodeType t, std::unique_ptr<Node> l, std::unique_ptr<Node> r);
+
+    // Nodes are recycled through a thread_local free list, so that parsing
+    // again after clear() reuses the old tree's memory instead of going back
+    // to the heap. Only memory freed on the same thread is reused, at most
+    // 2^18 nodes are kept, and a variable name too long for the short-string
+    // buffer still allocates.
+    static void* operator new(std::size_t size);
+    static void operator delete(void* pointer, std::size_t size) noexcept;
 };
 
-enum class TokenType {
+enum class TokenType : uint8_t {
     Number,
     Variable,
     Plus,
@@ -41,23 +65,182 @@ enum class TokenType {
 
 struct Token {
     TokenType type;
-    int64_t value;
+    int64_t value; // The symbol id for variables, if an interner is set.
     std::string variable_name;
 };
 
+// A token of a TokenList. The variable name points into the list, or into
+// its interner, so it's only valid as long as they are.
+struct TokenView {
+    TokenType type;
+    int64_t value; // The symbol id for variables, if an interner is set.
+    std::string_view variable_name;
+};
+
+class SymbolInterner;
+
+// The tokens of an expression, laid out compactly: an array of token types,
+// one byte each, and a parallel array of 8-byte payloads. A number's payload
+// is its value. A variable's payload is its symbol id if the list has an
+// interner, and otherwise the offset of its name in a pool of names. That's
+// 9 bytes per token plus the variable names, instead of a Token's 48.
+class TokenList {
+  public:
+    std::size_t size() const;
+    bool empty() const;
+    TokenType type(std::size_t index) const;
+    std::span<const TokenType> types() const;
+    TokenView operator[](std::size_t index) const;
+    TokenView back() const;
+    Token token(std::size_t index) const;
+
+    void set_interner(SymbolInterner* interner);
+    void clear();
+    void reserve(std::size_t count);
+    void push(TokenType type);
+    void push(const Token& token);
+    void push_number(int64_t value);
+    void push_variable(std::string_view name);
+    void append(const TokenList& other);
+    void replace(std::size_t first, std::size_t last,
+                 const TokenList& replacement);
+
+  private:
+    std::vector<TokenType> types_;
+    std::vector<int64_t> payloads_;
+    // Without an interner, the names of the variables, each followed by a
+    // '\0'. The names of replaced tokens stay here until clear().
+    std::string names_;
+    SymbolInterner* interner_ = nullptr;
+};
+
+// A change to an expression's text: removed_length characters starting at
+// offset are replaced by inserted_text.
+struct TextEdit {
+    std::size_t offset;
+    std::size_t removed_length;
+    std::string inserted_text;
+};
+
+// Limits on the resources that parsing and evaluating one expression may
+// use, for input that can't be trusted. 0 means no limit. Each limit is
+// checked before the memory or work that it bounds is spent, and going over
+// one throws an ASTException that names it.
+struct ASTLimits {
+    std::size_t max_input_bytes = 0;
+    std::size_t max_tokens = 0; // Not counting the End token.
+    std::size_t max_nodes = 0;
+    std::size_t max_depth = 0; // In nodes, so a single number has depth 1.
+    uint64_t max_eval_operations = 0; // Operators applied per evaluation.
+};
+
+// When parsing uses several threads, and how it splits the work. The
+// defaults suit inputs of several megabytes; lower values make small inputs
+// take the parallel and streaming paths, which is what the tests do.
+struct ParseTuning {
+    // parse() lexes and builds on several threads from this input size on.
+    std::size_t parallel_parse_threshold = 4 << 20;
+    // The threads to use. 0 means one per hardware thread, but never so many
+    // that a lexer chunk is smaller than min_parallel_chunk_size.
+    unsigned thread_count = 0;
+    std::size_t min_parallel_chunk_size = 1 << 20;
+    // The parallel builder only hands parenthesized groups of at least this
+    // many tokens to another thread, and stops looking for them below this
+    // paren depth, so that deeply nested input isn't scanned over and over.
+    std::size_t min_parallel_group_tokens = 1 << 16;
+    int64_t max_parallel_build_depth = 64;
+    // parse_stream() reads its input in blocks of this many characters.
+    std::size_t stream_block_size = 1 << 20;
+};
+
 class AST {
   public:
     void clear();
     void tokenize(const std::string& input);
+    void tokenize_parallel(const std::string& input,
+                           unsigned thread_count = 0);
     void add_tokens_to_tree();
+    void add_tokens_to_tree_parallel(unsigned thread_count = 0);
     void parse(const std::string& input);
+    void parse_stream(std::istream& input);
+    static void lex_stream(std::istream& input,
+                           const std::function<void(const Token&)>& on_token);
+    static void validate(std::string_view input);
+    std::string reparse(const std::string& old_input, const TextEdit& edit);
     int64_t evaluate();
+    int64_t evaluate(const VariableBindings& bindings) const;
+
+    uint64_t structural_hash() const;
+    std::vector<std::string> variables() const;
+    void write_preorder(std::ostream& output_stream) const;
 
     Node* root();
     const Node* root() const;
-    const std::vector<Token>& tokens() const;
+    const TokenList& tokens() const;
+    void set_interner(SymbolInterner* interner);
+    void set_limits(const ASTLimits& limits);
+    const ASTLimits& limits() const;
+    void set_tuning(const ParseTuning& tuning);
+    const ParseTuning& tuning() const;
+    void set_root(std::unique_ptr<Node> root);
+    std::unique_ptr<Node> release_root();
 
   private:
+    // A parenthesized group of tokens and the subtree built from it.
+    struct ParenGroup {
+        std::size_t open;  // Index of the '(' token.
+        std::size_t close; // Index of the matching ')' token.
+        const Node* node;
+    };
+
+    // A subtree that the builder can reuse instead of building it again.
+    struct PrebuiltGroup {
+        std::size_t close;
+        std::unique_ptr<Node> node;
+    };
+
+    // The range of tokens replaced by relex(). Tokens [first, old_end) of the
+    // old token vector were replaced by tokens [first, new_end) of the new one.
+    struct TokenSplice {
+        std::size_t first;
+        std::size_t old_end;
+        std::size_t new_end;
+    };
+
+    // The stacks of the shunting-yard builder. They are kept between builds,
+    // so a reused AST doesn't allocate them again.
+    struct BuilderStacks {
+        std::stack<std::unique_ptr<Node>, std::vector<std::unique_ptr<Node>>>
+            values;
+        std::stack<TokenType, std::vector<TokenType>> operators;
+        // The token indices of the '(' tokens on the operator stack.
+        std::stack<std::size_t, std::vector<std::size_t>> open_parens;
+    };
+
+    struct ParallelBuild;
+    class TreeBuilder;
+
+    std::unique_ptr<Node>
+    build_tree(std::size_t first, std::size_t last,
+               std::unordered_map<std::size_t, PrebuiltGroup>& prebuilt,
+               std::vector<ParenGroup>& groups, BuilderStacks& stacks) const;
+    std::unique_ptr<Node> build_region(ParallelBuild& build, std::size_t first,
+                                       std::size_t last, int64_t depth,
+                                       std::vector<ParenGroup>& groups) const;
+    TokenSplice relex(const std::string& input, const TextEdit& edit);
+    std::unordered_map<std::size_t, PrebuiltGroup>
+    take_reusable_groups(const TokenSplice& splice);
+
     std::unique_ptr<Node> root_;
-    std::vector<Token> tokens_;
+    TokenList tokens_;
+    std::vector<std::size_t> token_offsets_; // Source offset of each token.
+    // The text tokens_ came from, if source_known_. Kept between parses so
+    // that copying the text doesn't allocate.
+    std::string source_;
+    bool source_known_ = false;
+    std::vector<ParenGroup> paren_groups_;
+    BuilderStacks builder_stacks_;
+    SymbolInterner* interner_ = nullptr;
+    ASTLimits limits_;
+    ParseTuning tuning_;
 };
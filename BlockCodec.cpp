@@ -0,0 +1,599 @@
+#include "BlockCodec.h"
+#include "AST.h"
+
+#include <algorithm>
+#include <cerrno>
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+#include <fcntl.h>
+#include <future>
+#include <string>
+#include <string_view>
+#include <sys/stat.h>
+#include <thread>
+#include <unistd.h>
+#include <vector>
+
+// MARK: namespace
+namespace {
+
+// The shortest match the format can encode.
+constexpr std::size_t min_match = 4;
+// The shortest match the compressor uses. Every command costs the decoder
+// about as much as copying a dozen bytes, so shorter matches, which are
+// common in preorder text, would halve decompression speed for a gain of
+// about a tenth in size.
+constexpr std::size_t min_useful_match = 6;
+// Matches never start in the last bytes of a block, and always leave some
+// literals at the end, like LZ4. This keeps the decoder's fast copies inside
+// the block.
+constexpr std::size_t match_search_margin = 12;
+constexpr std::size_t end_literals = 5;
+// Matches reach at most this far back, so that the offset fits in 2 bytes.
+constexpr std::size_t max_offset = 65535;
+// The size of the compressor's hash table of recent positions, as a power of
+// two.
+constexpr int hash_bits = 14;
+
+// The size of a block header: the uncompressed and the compressed size.
+constexpr std::size_t block_header_size = 8;
+
+uint32_t load32(const char* bytes) {
+    uint32_t value = 0;
+    std::memcpy(&value, bytes, sizeof(value));
+    return value;
+}
+
+uint32_t hash4(uint32_t sequence) {
+    return (sequence * 2654435761U) >> (32 - hash_bits);
+}
+
+/**
+ * @brief Writes the part of a length that didn't fit in its nibble.
+ * @param output The compressed output.
+ * @param length The length minus 15.
+ */
+void write_extra_length(std::string& output, std::size_t length) {
+    for (; length >= 255; length -= 255) {
+        output += static_cast<char>(255);
+    }
+    output += static_cast<char>(length);
+}
+
+/**
+ * @brief Writes one command: some literals, then a match unless this is the
+ * last command.
+ * @param output The compressed output.
+ * @param literals The literals to copy.
+ * @param offset How far back the match starts. 0 for the last command.
+ * @param match_length The length of the match, at least min_match.
+ */
+void write_command(std::string& output, std::string_view literals,
+                   std::size_t offset, std::size_t match_length) {
+    const std::size_t literal_nibble = std::min<std::size_t>(
+        literals.size(), 15);
+    const std::size_t match_nibble =
+        offset == 0 ? 0 : std::min<std::size_t>(match_length - min_match, 15);
+    output += static_cast<char>((literal_nibble << 4) | match_nibble);
+    if (literal_nibble == 15) {
+        write_extra_length(output, literals.size() - 15);
+    }
+    output += literals;
+    if (offset == 0) {
+        return;
+    }
+    output += static_cast<char>(offset & 0xff);
+    output += static_cast<char>(offset >> 8);
+    if (match_nibble == 15) {
+        write_extra_length(output, match_length - min_match - 15);
+    }
+}
+
+[[noreturn]] void throw_corrupt_block() {
+    throw ASTException("corrupt compressed block");
+}
+
+/**
+ * @brief Rejects the sizes in a block header if no writer produces them:
+ * more text than max_compressed_block_size, or more compressed bytes than
+ * compress_block() writes for that much text (every literal plus one length
+ * byte per 255 of them and a command byte).
+ * @param raw_size The uncompressed size from the header.
+ * @param compressed_size The compressed size from the header.
+ */
+void check_block_header(uint32_t raw_size, uint32_t compressed_size) {
+    if (raw_size > max_compressed_block_size ||
+        compressed_size > raw_size + raw_size / 255 + 16) {
+        throw_corrupt_block();
+    }
+}
+
+/**
+ * @brief Reads the part of a length that didn't fit in its nibble.
+ * @param input The position in the compressed input, moved past the length.
+ * @param end The end of the compressed input.
+ * @return The length to add to 15.
+ */
+std::size_t read_extra_length(const unsigned char*& input,
+                              const unsigned char* end) {
+    std::size_t length = 0;
+    unsigned char byte = 0;
+    do {
+        if (input == end) {
+            throw_corrupt_block();
+        }
+        byte = *input++;
+        length += byte;
+    } while (byte == 255);
+    return length;
+}
+
+void store_le32(char* bytes, uint32_t value) {
+    for (int i = 0; i < 4; ++i) {
+        bytes[i] = static_cast<char>(value >> (8 * i));
+    }
+}
+
+uint32_t load_le32(const unsigned char* bytes) {
+    return static_cast<uint32_t>(bytes[0]) |
+           (static_cast<uint32_t>(bytes[1]) << 8) |
+           (static_cast<uint32_t>(bytes[2]) << 16) |
+           (static_cast<uint32_t>(bytes[3]) << 24);
+}
+
+/**
+ * @brief Reads exactly size bytes at an offset of a file, unless it ends.
+ * @return The number of bytes read.
+ */
+std::size_t read_at(int descriptor, void* destination, std::size_t size,
+                    uint64_t offset) {
+    std::size_t done = 0;
+    while (done < size) {
+        const ssize_t count =
+            pread(descriptor, static_cast<char*>(destination) + done,
+                  size - done, static_cast<off_t>(offset + done));
+        if (count < 0 && errno == EINTR) {
+            continue;
+        }
+        if (count < 0) {
+            throw ASTException("error reading compressed file");
+        }
+        if (count == 0) {
+            break;
+        }
+        done += static_cast<std::size_t>(count);
+    }
+    return done;
+}
+
+} // namespace
+
+// MARK: Functions
+/**
+ * @brief Compresses one block with greedy LZ77 matching over a hash table of
+ * 4-byte sequences. Runs of text without matches are skipped over faster and
+ * faster, so incompressible text costs little time.
+ * @param input The text to compress.
+ * @param output The compressed bytes are appended to this.
+ */
+void compress_block(std::string_view input, std::string& output) {
+    const char* const text = input.data();
+    const std::size_t size = input.size();
+    std::vector<uint32_t> table(std::size_t{1} << hash_bits, 0);
+    std::size_t anchor = 0; // The start of the pending literals.
+
+    if (size > match_search_margin) {
+        const std::size_t search_end = size - match_search_margin;
+        std::size_t position = 1;
+        while (position < search_end) {
+            const uint32_t sequence = load32(text + position);
+            uint32_t& slot = table[hash4(sequence)];
+            const std::size_t candidate = slot;
+            slot = static_cast<uint32_t>(position);
+            if (candidate >= position || position - candidate > max_offset ||
+                load32(text + candidate) != sequence) {
+                position += 1 + ((position - anchor) >> 6);
+                continue;
+            }
+
+            const std::size_t max_length = size - end_literals - position;
+            std::size_t length = min_match;
+            while (length < max_length &&
+                   text[candidate + length] == text[position + length]) {
+                ++length;
+            }
+            if (length < min_useful_match) {
+                position += 1 + ((position - anchor) >> 6);
+                continue;
+            }
+            write_command(output, input.substr(anchor, position - anchor),
+                          position - candidate, length);
+            position += length;
+            anchor = position;
+            // Remember a position inside the match, which helps with the
+            // repetitive text of preorder files.
+            if (position - 2 < search_end) {
+                table[hash4(load32(text + position - 2))] =
+                    static_cast<uint32_t>(position - 2);
+            }
+        }
+    }
+    write_command(output, input.substr(anchor), 0, 0);
+}
+
+/**
+ * @brief Decompresses one block. Every length and offset is checked, so a
+ * corrupt block throws instead of reading or writing out of bounds.
+ * @param input The compressed bytes.
+ * @param output Receives the text.
+ * @param output_size The size of the text, from the block header.
+ */
+void decompress_block(std::string_view input, char* output,
+                      std::size_t output_size) {
+    const auto* in = reinterpret_cast<const unsigned char*>(input.data());
+    const unsigned char* const in_end = in + input.size();
+    char* out = output;
+    char* const out_end = output + output_size;
+
+    for (;;) {
+        if (in == in_end) {
+            throw_corrupt_block();
+        }
+        const unsigned command = *in++;
+
+        std::size_t literal_length = command >> 4;
+        if (literal_length == 15) {
+            literal_length += read_extra_length(in, in_end);
+        }
+        const auto in_left = static_cast<std::size_t>(in_end - in);
+        const auto out_left = static_cast<std::size_t>(out_end - out);
+        if (literal_length > in_left || literal_length > out_left) {
+            throw_corrupt_block();
+        }
+        if (literal_length <= 16 && in_left >= 16 && out_left >= 16) {
+            // Most runs of literals are short; a fixed-size copy is faster
+            // than one of the exact length.
+            std::memcpy(out, in, 16);
+        } else {
+            std::memcpy(out, in, literal_length);
+        }
+        out += literal_length;
+        in += literal_length;
+        if (in == in_end) {
+            break; // The last command has no match.
+        }
+
+        if (in_end - in < 2) {
+            throw_corrupt_block();
+        }
+        const std::size_t offset = in[0] | (std::size_t{in[1]} << 8);
+        in += 2;
+        std::size_t match_length = command & 15;
+        if (match_length == 15) {
+            match_length += read_extra_length(in, in_end);
+        }
+        match_length += min_match;
+        if (offset == 0 || offset > static_cast<std::size_t>(out - output) ||
+            match_length > static_cast<std::size_t>(out_end - out)) {
+            throw_corrupt_block();
+        }
+
+        const char* match = out - offset;
+        const auto room = static_cast<std::size_t>(out_end - out);
+        if (offset >= 16 && room >= match_length + 15) {
+            // Copy 16 bytes at a time. The last copy may write past the match,
+            // but not past the block, and later commands overwrite it.
+            for (std::size_t i = 0; i < match_length; i += 16) {
+                std::memcpy(out + i, match + i, 16);
+            }
+        } else if (offset >= 8 && room >= match_length + 7) {
+            for (std::size_t i = 0; i < match_length; i += 8) {
+                std::memcpy(out + i, match + i, 8);
+            }
+        } else {
+            // Close matches overlap their own output, like a run of the
+            // same byte, so they must be copied a byte at a time.
+            for (std::size_t i = 0; i < match_length; ++i) {
+                out[i] = match[i];
+            }
+        }
+        out += match_length;
+    }
+    if (out != out_end) {
+        throw_corrupt_block();
+    }
+}
+
+/**
+ * @brief Checks whether a file starts with compressed_magic. Only regular
+ * files are checked, so that a pipe isn't read from.
+ * @param path The path of the file.
+ * @return true if the file is compressed.
+ */
+bool is_compressed_file(const char* path) {
+    const int descriptor = open(path, O_RDONLY | O_CLOEXEC);
+    if (descriptor < 0) {
+        return false;
+    }
+    struct stat status{};
+    char magic[compressed_magic.size()];
+    const bool compressed =
+        fstat(descriptor, &status) == 0 && S_ISREG(status.st_mode) &&
+        read_at(descriptor, magic, sizeof(magic), 0) == sizeof(magic) &&
+        std::string_view(magic, sizeof(magic)) == compressed_magic;
+    close(descriptor);
+    return compressed;
+}
+
+/**
+ * @brief Decompresses a whole compressed file that is already in memory.
+ * @param contents The contents of the file, starting with compressed_magic.
+ * @return The text.
+ */
+std::string decompress_file(std::string_view contents) {
+    if (!contents.starts_with(compressed_magic)) {
+        throw ASTException("not a compressed AST file");
+    }
+    std::string text;
+    std::size_t offset = compressed_magic.size();
+    while (offset < contents.size()) {
+        if (contents.size() - offset < block_header_size) {
+            throw ASTException("truncated compressed file");
+        }
+        const auto* header =
+            reinterpret_cast<const unsigned char*>(contents.data() + offset);
+        const uint32_t raw_size = load_le32(header);
+        const uint32_t compressed_size = load_le32(header + 4);
+        check_block_header(raw_size, compressed_size);
+        offset += block_header_size;
+        if (contents.size() - offset < compressed_size) {
+            throw ASTException("truncated compressed file");
+        }
+        const std::size_t start = text.size();
+        text.resize(start + raw_size);
+        decompress_block(contents.substr(offset, compressed_size),
+                         text.data() + start, raw_size);
+        offset += compressed_size;
+    }
+    return text;
+}
+
+// MARK: CompressingStreamBuf
+/**
+ * @brief Constructs a stream buffer that writes compressed blocks to output,
+ * starting with the magic.
+ * @param output The stream to write the compressed file to.
+ * @param block_size How much text to put into each block, at most
+ * max_compressed_block_size.
+ */
+CompressingStreamBuf::CompressingStreamBuf(std::ostream& output,
+                                           std::size_t block_size)
+    : output_(output),
+      block_size_(std::clamp<std::size_t>(block_size, 1,
+                                          max_compressed_block_size)) {
+    output_.write(compressed_magic.data(),
+                  static_cast<std::streamsize>(compressed_magic.size()));
+    pending_.reserve(block_size_ + (block_size_ >> 4));
+}
+
+CompressingStreamBuf::~CompressingStreamBuf() {
+    try {
+        finish();
+    } catch (...) {
+        // Destructors can't report errors; call finish() to see them.
+    }
+}
+
+/**
+ * @brief Compresses and writes the remaining text. Must be called once all
+ * the text has been written, to see any errors.
+ */
+void CompressingStreamBuf::finish() {
+    if (finished_) {
+        return;
+    }
+    finished_ = true;
+    if (!pending_.empty()) {
+        write_block(pending_.size());
+    }
+    output_.flush();
+    if (!output_) {
+        throw ASTException("error writing compressed output");
+    }
+}
+
+CompressingStreamBuf::int_type
+CompressingStreamBuf::overflow(int_type character) {
+    if (traits_type::eq_int_type(character, traits_type::eof())) {
+        return traits_type::not_eof(character);
+    }
+    pending_ += traits_type::to_char_type(character);
+    write_full_blocks();
+    return character;
+}
+
+std::streamsize CompressingStreamBuf::xsputn(const char* text,
+                                             std::streamsize size) {
+    pending_.append(text, static_cast<std::size_t>(size));
+    write_full_blocks();
+    return size;
+}
+
+/**
+ * @brief Writes blocks while there is at least a block's worth of text. Each
+ * block ends after the last whitespace within the block size, or, if there is
+ * none, after the first whitespace beyond it.
+ */
+void CompressingStreamBuf::write_full_blocks() {
+    constexpr std::string_view whitespace = " \t\n\v\f\r";
+    while (pending_.size() >= block_size_) {
+        std::size_t end = pending_.find_last_of(whitespace, block_size_ - 1);
+        if (end == std::string::npos) {
+            end = pending_.find_first_of(whitespace, block_size_);
+            if (end == std::string::npos) {
+                if (pending_.size() > max_compressed_block_size) {
+                    throw ASTException("token too long to compress");
+                }
+                return; // Wait for the end of this very long token.
+            }
+        }
+        write_block(end + 1);
+    }
+}
+
+/**
+ * @brief Compresses the first size characters of the pending text into a
+ * block and writes it.
+ */
+void CompressingStreamBuf::write_block(std::size_t size) {
+    compressed_.assign(block_header_size, '\0');
+    compress_block(std::string_view(pending_).substr(0, size), compressed_);
+    const std::size_t compressed_size = compressed_.size() - block_header_size;
+    if (size > max_compressed_block_size) {
+        throw ASTException("token too long to compress");
+    }
+    store_le32(compressed_.data(), static_cast<uint32_t>(size));
+    store_le32(compressed_.data() + 4, static_cast<uint32_t>(compressed_size));
+    output_.write(compressed_.data(),
+                  static_cast<std::streamsize>(compressed_.size()));
+    pending_.erase(0, size);
+}
+
+// MARK: BlockStreamReader
+/**
+ * @brief Constructs a reader, reading and checking the magic.
+ * @param input The compressed stream.
+ */
+BlockStreamReader::BlockStreamReader(std::istream& input) : input_(input) {
+    char magic[compressed_magic.size()];
+    if (!input_.read(magic, sizeof(magic)) ||
+        std::string_view(magic, sizeof(magic)) != compressed_magic) {
+        throw ASTException("not a compressed AST file");
+    }
+}
+
+/**
+ * @brief Reads and decompresses the next block.
+ * @param text Receives the text of the block.
+ * @return false at the end of the stream.
+ */
+bool BlockStreamReader::next(std::string& text) {
+    unsigned char header[block_header_size];
+    input_.read(reinterpret_cast<char*>(header), sizeof(header));
+    if (input_.gcount() == 0 && input_.eof()) {
+        return false;
+    }
+    if (!input_) {
+        throw ASTException("truncated compressed file");
+    }
+    const uint32_t raw_size = load_le32(header);
+    const uint32_t compressed_size = load_le32(header + 4);
+    check_block_header(raw_size, compressed_size);
+    compressed_.resize(compressed_size);
+    text.resize(raw_size);
+    if (!input_.read(compressed_.data(),
+                     static_cast<std::streamsize>(compressed_.size()))) {
+        throw ASTException("truncated compressed file");
+    }
+    decompress_block(compressed_, text.data(), text.size());
+    return true;
+}
+
+// MARK: ReverseBlockDecoder
+/**
+ * @brief Reads the block headers of a compressed file and starts decoding
+ * the last blocks.
+ * @param descriptor The open compressed file. Must stay open while the
+ * decoder exists.
+ * @param thread_count How many blocks to decode at a time. 0 means one per
+ * hardware thread.
+ */
+ReverseBlockDecoder::ReverseBlockDecoder(int descriptor,
+                                         unsigned thread_count)
+    : descriptor_(descriptor) {
+    char magic[compressed_magic.size()];
+    if (read_at(descriptor_, magic, sizeof(magic), 0) != sizeof(magic) ||
+        std::string_view(magic, sizeof(magic)) != compressed_magic) {
+        throw ASTException("not a compressed AST file");
+    }
+    struct stat status {};
+    if (fstat(descriptor_, &status) != 0) {
+        throw ASTException("error reading compressed file");
+    }
+    const auto file_size = static_cast<uint64_t>(status.st_size);
+    uint64_t offset = compressed_magic.size();
+    unsigned char header[block_header_size];
+    while (const std::size_t count =
+               read_at(descriptor_, header, sizeof(header), offset)) {
+        if (count != sizeof(header)) {
+            throw ASTException("truncated compressed file");
+        }
+        const Block block{offset + block_header_size, load_le32(header),
+                          load_le32(header + 4)};
+        check_block_header(block.raw_size, block.compressed_size);
+        if (block.compressed_size > file_size - block.offset) {
+            throw ASTException("truncated compressed file");
+        }
+        blocks_.push_back(block);
+        offset = block.offset + block.compressed_size;
+    }
+
+    if (thread_count == 0) {
+        thread_count = std::max(1U, std::thread::hardware_concurrency());
+    }
+    // Decode twice as many blocks as there are threads, so that the workers
+    // stay busy while the caller consumes a block.
+    window_ = 2 * std::size_t{thread_count};
+    next_to_start_ = blocks_.size();
+    while (next_to_start_ > 0 && in_flight_.size() < window_) {
+        start_next();
+    }
+}
+
+ReverseBlockDecoder::~ReverseBlockDecoder() {
+    // Wait for the workers, since they use the descriptor.
+    in_flight_.clear();
+}
+
+/**
+ * @brief Returns the text of the block before the previous one, starting
+ * with the last block.
+ * @param text Receives the text.
+ * @return false once every block has been returned.
+ */
+bool ReverseBlockDecoder::next(std::string& text) {
+    if (in_flight_.empty()) {
+        return false;
+    }
+    std::future<std::string> block = std::move(in_flight_.front());
+    in_flight_.pop_front();
+    if (next_to_start_ > 0) {
+        start_next();
+    }
+    text = block.get();
+    return true;
+}
+
+/**
+ * @brief Starts decoding the last block that hasn't been started yet.
+ */
+void ReverseBlockDecoder::start_next() {
+    const Block& block = blocks_[--next_to_start_];
+    in_flight_.push_back(std::async(std::launch::async,
+                                    [this, block] { return decode(block); }));
+}
+
+/**
+ * @brief Reads and decompresses one block. Safe to call from any thread.
+ */
+std::string ReverseBlockDecoder::decode(const Block& block) const {
+    std::string compressed(block.compressed_size, '\0');
+    if (read_at(descriptor_, compressed.data(), compressed.size(),
+                block.offset) != compressed.size()) {
+        throw ASTException("truncated compressed file");
+    }
+    std::string text(block.raw_size, '\0');
+    decompress_block(compressed, text.data(), text.size());
+    return text;
+}
@@ -0,0 +1,118 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <deque>
+#include <future>
+#include <istream>
+#include <ostream>
+#include <streambuf>
+#include <string>
+#include <string_view>
+#include <vector>
+
+// A small LZ77 codec for AST files, so that large preorder files take less
+// disk space and I/O. A compressed file is the magic "ASTZ1" followed by
+// blocks, each with an 8-byte header (the uncompressed size and the
+// compressed size, as little-endian uint32) and its compressed bytes. Blocks
+// are compressed independently, so they can be decoded in parallel and in
+// any order. The writer ends every block after a whitespace character, so
+// that no token is split between blocks.
+//
+// The compressed bytes are a sequence of LZ4-style commands. Each starts with
+// a byte whose high nibble is the number of literals and whose low nibble is
+// the match length minus 4, followed by the literals and a 2-byte
+// little-endian match offset. A nibble of 15 means the length continues in
+// extra bytes (after the command byte for literals, after the offset for
+// matches), which are added to it up to the first one below 255. The last
+// command has only literals.
+
+// The magic at the start of a compressed file.
+inline constexpr std::string_view compressed_magic = "ASTZ1";
+
+// How much text the writer puts into each block, if the text has whitespace
+// close enough to the limit.
+inline constexpr std::size_t default_compressed_block_size = 1 << 20;
+
+// The largest uncompressed block. The writer only goes past its block size
+// to finish a token, and refuses tokens that would need more than this.
+// Readers reject larger sizes in a header before allocating anything, so a
+// corrupt header can't make them allocate gigabytes.
+inline constexpr std::size_t max_compressed_block_size = 64 << 20;
+
+void compress_block(std::string_view input, std::string& output);
+void decompress_block(std::string_view input, char* output,
+                      std::size_t output_size);
+
+// An output stream buffer that compresses everything written through it into
+// the format above.
+class CompressingStreamBuf : public std::streambuf {
+  public:
+    explicit CompressingStreamBuf(
+        std::ostream& output,
+        std::size_t block_size = default_compressed_block_size);
+    ~CompressingStreamBuf() override;
+    CompressingStreamBuf(const CompressingStreamBuf&) = delete;
+    CompressingStreamBuf& operator=(const CompressingStreamBuf&) = delete;
+
+    void finish();
+
+  protected:
+    int_type overflow(int_type character) override;
+    std::streamsize xsputn(const char* text, std::streamsize size) override;
+
+  private:
+    void write_full_blocks();
+    void write_block(std::size_t size);
+
+    std::ostream& output_;
+    std::size_t block_size_;
+    std::string pending_;
+    std::string compressed_;
+    bool finished_ = false;
+};
+
+// Decodes the blocks of a compressed file from the last to the first. Worker
+// threads decode the blocks ahead of the caller, so that evaluation (which
+// reads preorder from the end) overlaps with decompression.
+class ReverseBlockDecoder {
+  public:
+    ReverseBlockDecoder(int descriptor, unsigned thread_count = 0);
+    ~ReverseBlockDecoder();
+    ReverseBlockDecoder(const ReverseBlockDecoder&) = delete;
+    ReverseBlockDecoder& operator=(const ReverseBlockDecoder&) = delete;
+
+    bool next(std::string& text);
+
+  private:
+    struct Block {
+        uint64_t offset; // Of the compressed bytes, in the file.
+        uint32_t raw_size;
+        uint32_t compressed_size;
+    };
+
+    std::string decode(const Block& block) const;
+    void start_next();
+
+    int descriptor_;
+    std::vector<Block> blocks_;
+    std::size_t next_to_start_; // Blocks below this haven't been started.
+    std::size_t window_;
+    std::deque<std::future<std::string>> in_flight_;
+};
+
+// Decodes the blocks of a compressed stream in order, for inputs that can't
+// seek, like pipes.
+class BlockStreamReader {
+  public:
+    explicit BlockStreamReader(std::istream& input);
+
+    bool next(std::string& text);
+
+  private:
+    std::istream& input_;
+    std::string compressed_;
+};
+
+bool is_compressed_file(const char* path);
+std::string decompress_file(std::string_view contents);
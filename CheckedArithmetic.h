@@ -0,0 +1,118 @@
+#pragma once
+#include "AST.h"
+
+#include <cstdint>
+#include <limits>
+
+/**
+ * @brief Checked arithmetic operations that report overflow or other error
+ * conditions (such as division by zero) instead of producing a result. These
+ * don't throw, so they can be used where an error must not escape, e.g. when
+ * folding constants at compile time.
+ *
+ * @param left The left operand of the operation.
+ * @param right The right operand of the operation.
+ * @param result Receives the result of the operation if it succeeds.
+ * @return nullptr on success, otherwise the error message that the throwing
+ * versions below report.
+ */
+constexpr const char* try_checked_add(int64_t left, int64_t right,
+                                      int64_t& result) noexcept {
+    return __builtin_add_overflow(left, right, &result)
+               ? "overflow in addition"
+               : nullptr;
+}
+
+constexpr const char* try_checked_sub(int64_t left, int64_t right,
+                                      int64_t& result) noexcept {
+    return __builtin_sub_overflow(left, right, &result)
+               ? "overflow in subtraction"
+               : nullptr;
+}
+
+constexpr const char* try_checked_mul(int64_t left, int64_t right,
+                                      int64_t& result) noexcept {
+    return __builtin_mul_overflow(left, right, &result)
+               ? "overflow in multiplication"
+               : nullptr;
+}
+
+constexpr const char* try_checked_div(int64_t left, int64_t right,
+                                      int64_t& result) noexcept {
+    if (right == 0) {
+        return "division by zero";
+    }
+    if (left == std::numeric_limits<int64_t>::min() && right == -1) {
+        return "overflow in division";
+    }
+    result = left / right;
+    return nullptr;
+}
+
+/**
+ * @brief Applies the operator of an operator node with try_checked_add() and
+ * friends.
+ * @param type The type of the operator node.
+ * @param left The left operand.
+ * @param right The right operand.
+ * @param result Receives the result of the operation if it succeeds.
+ * @return nullptr on success, otherwise the error message.
+ */
+constexpr const char* try_checked_operation(NodeType type, int64_t left,
+                                            int64_t right,
+                                            int64_t& result) noexcept {
+    switch (type) {
+    case NodeType::Add:
+        return try_checked_add(left, right, result);
+    case NodeType::Sub:
+        return try_checked_sub(left, right, result);
+    case NodeType::Mult:
+        return try_checked_mul(left, right, result);
+    case NodeType::Div:
+        return try_checked_div(left, right, result);
+    default:
+        return "malformed AST";
+    }
+}
+
+/**
+ * @brief Checked arithmetic operations that throw an ASTException on overflow
+ * or other error conditions (such as division by zero). Shared by every
+ * evaluator, so they all report errors the same way.
+ *
+ * @param left The left operand of the operation.
+ * @param right The right operand of the operation.
+ * @return The result of the arithmetic operation if it does not overflow or
+ * have other error conditions.
+ */
+constexpr int64_t checked_add(int64_t left, int64_t right) {
+    int64_t result = 0;
+    if (const char* error = try_checked_add(left, right, result)) {
+        throw ASTException(error);
+    }
+    return result;
+}
+
+constexpr int64_t checked_sub(int64_t left, int64_t right) {
+    int64_t result = 0;
+    if (const char* error = try_checked_sub(left, right, result)) {
+        throw ASTException(error);
+    }
+    return result;
+}
+
+constexpr int64_t checked_mul(int64_t left, int64_t right) {
+    int64_t result = 0;
+    if (const char* error = try_checked_mul(left, right, result)) {
+        throw ASTException(error);
+    }
+    return result;
+}
+
+constexpr int64_t checked_div(int64_t left, int64_t right) {
+    int64_t result = 0;
+    if (const char* error = try_checked_div(left, right, result)) {
+        throw ASTException(error);
+    }
+    return result;
+}
@@ -0,0 +1,621 @@
+#pragma once
+#include "AST.h"
+#include "CheckedArithmetic.h"
+
+#include <array>
+#include <cstddef>
+#include <cstdint>
+#include <limits>
+#include <span>
+#include <string>
+#include <string_view>
+
+// Header-only constexpr version of the tokenizer, shunting-yard builder and
+// checked evaluator, for formulas that are known at compile time. It accepts
+// exactly the same language as AST and reports the same error messages, and
+// evaluation gives the same results and errors as AST::evaluate.
+//
+// Everything works on fixed-capacity arrays, so it can run inside a constant
+// expression:
+//
+//     constexpr auto price = constexpr_ast::compile<"(base + 2 * 3) * qty">();
+//     price.evaluate({{"base", 4}, {"qty", 2}}); // 20, "2 * 3" is folded.
+//     static_assert(constexpr_ast::compile_value<"7 * 6">() == 42);
+//
+// An invalid formula passed to compile() is a compile error.
+namespace constexpr_ast {
+
+// A node of a compiled expression. Operator nodes have no payload.
+struct FlatNode {
+    NodeType type;
+    int64_t value; // The literal, or the slot of the variable.
+};
+
+// A compiled expression: the nodes in postorder, right operand first (the
+// same layout as FlatTree, following the evaluation order defined in AST.h),
+// with every subtree that only involves literals folded into one literal.
+// Subtrees whose evaluation fails are left unfolded, so evaluating reports
+// the same error as AST::evaluate.
+//
+// Variables are numbered by slot in the order they first appear in the text.
+// Their names point into the parsed text.
+template <std::size_t Capacity> struct Expression {
+    std::array<FlatNode, Capacity> nodes{};
+    std::size_t node_count = 0;
+    std::array<std::string_view, Capacity> slot_names{};
+    std::size_t slot_count = 0;
+
+    /**
+     * @brief Returns whether the expression was folded into a single value.
+     */
+    constexpr bool is_constant() const {
+        return node_count == 1 && nodes[0].type == NodeType::Number;
+    }
+
+    /**
+     * @brief Returns the slot of the variable with the given name.
+     * @param name The name of the variable.
+     * @return The slot.
+     */
+    constexpr std::size_t slot(std::string_view name) const {
+        for (std::size_t slot = 0; slot < slot_count; ++slot) {
+            if (slot_names[slot] == name) {
+                return slot;
+            }
+        }
+        throw ASTException("unknown variable");
+    }
+
+    /**
+     * @brief Evaluates an expression without variables.
+     * @return The result of evaluating the expression.
+     */
+    constexpr int64_t evaluate() const { return run(nullptr, nullptr); }
+
+    /**
+     * @brief Evaluates the expression with the values of its variables given
+     * by slot.
+     * @param slot_values The value of each slot.
+     * @return The result of evaluating the expression.
+     */
+    constexpr int64_t evaluate(std::span<const int64_t> slot_values) const {
+        if (slot_values.size() != slot_count) {
+            throw ASTException("wrong number of slot values");
+        }
+        return run(slot_values.data(), nullptr);
+    }
+
+    /**
+     * @brief Evaluates the expression, substituting the bound values for
+     * variables. Like AST::evaluate, a missing variable is only reported when
+     * evaluation reaches it.
+     * @param bindings The values to substitute for variables.
+     * @return The result of evaluating the expression.
+     */
+    int64_t evaluate(const VariableBindings& bindings) const {
+        std::array<int64_t, Capacity> slot_values{};
+        std::array<bool, Capacity> bound{};
+        for (std::size_t slot = 0; slot < slot_count; ++slot) {
+            if (const auto variable_it =
+                    bindings.find(std::string(slot_names[slot]));
+                variable_it != bindings.end()) {
+                slot_values[slot] = variable_it->second;
+                bound[slot] = true;
+            }
+        }
+        return run(slot_values.data(), bound.data());
+    }
+
+  private:
+    /**
+     * @brief Evaluates the nodes in order with a stack of values. The left
+     * operand of an operator is on top of the stack, the right one below it.
+     * @param slot_values The value of each slot, or nullptr if there are no
+     * bindings at all.
+     * @param bound Whether each slot has a value, or nullptr if they all do.
+     * @return The result of evaluating the expression.
+     */
+    constexpr int64_t run(const int64_t* slot_values, const bool* bound) const {
+        std::array<int64_t, Capacity> values{};
+        std::size_t top = 0;
+        for (std::size_t index = 0; index < node_count; ++index) {
+            const FlatNode& node = nodes[index];
+            if (node.type == NodeType::Number) {
+                values[top++] = node.value;
+            } else if (node.type == NodeType::Variable) {
+                const auto slot = static_cast<std::size_t>(node.value);
+                if (slot_values == nullptr) {
+                    throw ASTException(
+                        "cannot evaluate variable without bindings");
+                }
+                if (bound != nullptr && !bound[slot]) {
+                    throw ASTException("missing variable value: " +
+                                       std::string(slot_names[slot]));
+                }
+                values[top++] = slot_values[slot];
+            } else {
+                --top;
+                int64_t result = 0;
+                if (const char* error = try_checked_operation(
+                        node.type, values[top], values[top - 1], result)) {
+                    throw ASTException(error);
+                }
+                values[top - 1] = result;
+            }
+        }
+        return values[0];
+    }
+};
+
+// The result of parse(): the expression, or the error message if the text
+// isn't a valid expression.
+template <std::size_t Capacity> struct ParseResult {
+    Expression<Capacity> expression;
+    const char* error = nullptr;
+};
+
+namespace detail {
+
+// The character classes of the "C" locale, as used by the AST lexer.
+constexpr bool is_space(char character) {
+    return character == ' ' || character == '\t' || character == '\n' ||
+           character == '\v' || character == '\f' || character == '\r';
+}
+
+constexpr bool is_digit(char character) {
+    return character >= '0' && character <= '9';
+}
+
+constexpr bool is_lower(char character) {
+    return character >= 'a' && character <= 'z';
+}
+
+constexpr bool is_arithmetic_operator(TokenType type) {
+    return type == TokenType::Plus || type == TokenType::Minus ||
+           type == TokenType::Mult || type == TokenType::Div;
+}
+
+constexpr int get_precedence(TokenType type) {
+    return type == TokenType::Mult || type == TokenType::Div ? 2 : 1;
+}
+
+constexpr NodeType token_type_to_node_type(TokenType type) {
+    switch (type) {
+    case TokenType::Plus:
+        return NodeType::Add;
+    case TokenType::Minus:
+        return NodeType::Sub;
+    case TokenType::Mult:
+        return NodeType::Mult;
+    default:
+        return NodeType::Div;
+    }
+}
+
+// A token. Variables carry their slot instead of their name.
+struct LexToken {
+    TokenType type;
+    int64_t value;
+};
+
+template <std::size_t Capacity> struct Tokens {
+    std::array<LexToken, Capacity> tokens{};
+    std::size_t count = 0;
+};
+
+// A node of the tree built by the shunting-yard pass, with its children
+// given by index.
+struct TreeNode {
+    NodeType type;
+    int64_t value;
+    std::size_t left;
+    std::size_t right;
+};
+
+template <std::size_t Capacity> struct Tree {
+    std::array<TreeNode, Capacity> nodes{};
+    std::size_t count = 0;
+    std::size_t root = 0;
+};
+
+/**
+ * @brief Parses the digits at the given index, like std::from_chars does in
+ * the AST lexer.
+ * @param text The text being tokenized.
+ * @param index The index of the first digit. Advanced past the digits.
+ * @param limit The largest magnitude allowed.
+ * @param magnitude Receives the parsed magnitude.
+ * @return nullptr on success, otherwise the error message.
+ */
+constexpr const char* parse_magnitude(std::string_view text,
+                                      std::size_t& index, uint64_t limit,
+                                      uint64_t& magnitude) {
+    magnitude = 0;
+    bool is_overflow = false;
+    while (index < text.size() && is_digit(text[index])) {
+        const auto digit = static_cast<uint64_t>(text[index] - '0');
+        if (magnitude > (limit - digit) / 10) {
+            is_overflow = true;
+        } else {
+            magnitude = magnitude * 10 + digit;
+        }
+        ++index;
+    }
+    return is_overflow ? "integer literal overflow" : nullptr;
+}
+
+/**
+ * @brief Tokenizes the text like AST::tokenize. Variables are given slots in
+ * the order they first appear.
+ * @param text The text to tokenize.
+ * @param tokens Receives the tokens, ending with an End token.
+ * @param expression Receives the names of the slots.
+ * @return nullptr on success, otherwise the error message.
+ */
+template <std::size_t Capacity>
+constexpr const char* tokenize(std::string_view text, Tokens<Capacity>& tokens,
+                               Expression<Capacity>& expression) {
+    constexpr uint64_t max_positive_magnitude =
+        std::numeric_limits<int64_t>::max();
+    constexpr uint64_t max_negative_magnitude = max_positive_magnitude + 1;
+
+    bool is_awaiting_operand = true;
+    bool saw_non_whitespace = false;
+    std::size_t i = 0;
+    while (true) {
+        while (i < text.size() && is_space(text[i])) {
+            ++i;
+        }
+        if (i >= text.size()) {
+            break;
+        }
+        // Each step emits at most two tokens, and the End token follows.
+        if (tokens.count + 3 > Capacity) {
+            return "expression too large for its capacity";
+        }
+        saw_non_whitespace = true;
+        const char character = text[i];
+
+        // Unary minus: a negative literal, or -1 * (...).
+        if (character == '-' && is_awaiting_operand) {
+            std::size_t lookahead = i + 1;
+            while (lookahead < text.size() && is_space(text[lookahead])) {
+                ++lookahead;
+            }
+            if (lookahead >= text.size()) {
+                return "missing operand after unary minus";
+            }
+            if (is_digit(text[lookahead])) {
+                i = lookahead;
+                uint64_t magnitude = 0;
+                if (const char* error = parse_magnitude(
+                        text, i, max_negative_magnitude, magnitude)) {
+                    return error;
+                }
+                const int64_t value =
+                    magnitude == max_negative_magnitude
+                        ? std::numeric_limits<int64_t>::min()
+                        : -static_cast<int64_t>(magnitude);
+                tokens.tokens[tokens.count++] = {TokenType::Number, value};
+                is_awaiting_operand = false;
+                continue;
+            }
+            if (!is_lower(text[lookahead]) && text[lookahead] != '(' &&
+                text[lookahead] != '-') {
+                return "missing operand after unary minus";
+            }
+            tokens.tokens[tokens.count++] = {TokenType::Number, -1};
+            tokens.tokens[tokens.count++] = {TokenType::Mult, 0};
+            ++i;
+            continue;
+        }
+
+        if (is_awaiting_operand) {
+            if (is_digit(character)) {
+                uint64_t magnitude = 0;
+                if (const char* error = parse_magnitude(
+                        text, i, max_positive_magnitude, magnitude)) {
+                    return error;
+                }
+                tokens.tokens[tokens.count++] = {
+                    TokenType::Number, static_cast<int64_t>(magnitude)};
+                is_awaiting_operand = false;
+                continue;
+            }
+            if (is_lower(character)) {
+                const std::size_t start = i;
+                while (i < text.size() && is_lower(text[i])) {
+                    ++i;
+                }
+                const std::string_view name = text.substr(start, i - start);
+                std::size_t slot = 0;
+                while (slot < expression.slot_count &&
+                       expression.slot_names[slot] != name) {
+                    ++slot;
+                }
+                if (slot == expression.slot_count) {
+                    expression.slot_names[expression.slot_count++] = name;
+                }
+                tokens.tokens[tokens.count++] = {TokenType::Variable,
+                                                 static_cast<int64_t>(slot)};
+                is_awaiting_operand = false;
+                continue;
+            }
+            if (character == '(') {
+                tokens.tokens[tokens.count++] = {TokenType::LParen, 0};
+                ++i;
+                continue;
+            }
+            if (character == ')') {
+                return "missing operand before ')'";
+            }
+            if (character == '+' || character == '*' || character == '/') {
+                return "missing operand";
+            }
+            return "invalid character in expression";
+        }
+
+        TokenType type = TokenType::End;
+        if (character == '+') {
+            type = TokenType::Plus;
+        } else if (character == '-') {
+            type = TokenType::Minus;
+        } else if (character == '*') {
+            type = TokenType::Mult;
+        } else if (character == '/') {
+            type = TokenType::Div;
+        } else if (character == ')') {
+            type = TokenType::RParen;
+        } else if (is_digit(character) || is_lower(character) ||
+                   character == '(') {
+            return "missing operator between operands";
+        } else {
+            return "invalid character in expression";
+        }
+        tokens.tokens[tokens.count++] = {type, 0};
+        is_awaiting_operand = type != TokenType::RParen;
+        ++i;
+    }
+
+    if (!saw_non_whitespace) {
+        return "empty expression";
+    }
+    if (is_awaiting_operand) {
+        return "expression ends with operator";
+    }
+    tokens.tokens[tokens.count++] = {TokenType::End, 0};
+    return nullptr;
+}
+
+/**
+ * @brief Builds a tree from the tokens with the same shunting-yard algorithm
+ * as AST::add_tokens_to_tree.
+ * @param tokens The tokens, ending with an End token.
+ * @param tree Receives the tree.
+ * @return nullptr on success, otherwise the error message.
+ */
+template <std::size_t Capacity>
+constexpr const char* build_tree(const Tokens<Capacity>& tokens,
+                                 Tree<Capacity>& tree) {
+    std::array<std::size_t, Capacity> value_stack{};
+    std::size_t value_count = 0;
+    std::array<TokenType, Capacity> operator_stack{};
+    std::size_t operator_count = 0;
+
+    auto apply_top_operator = [&]() -> const char* {
+        if (operator_count == 0) {
+            return "missing operator";
+        }
+        if (value_count < 2) {
+            return "missing operand";
+        }
+        const TokenType current_operator = operator_stack[--operator_count];
+        const std::size_t right = value_stack[--value_count];
+        const std::size_t left = value_stack[--value_count];
+        tree.nodes[tree.count] = {token_type_to_node_type(current_operator), 0,
+                                  left, right};
+        value_stack[value_count++] = tree.count++;
+        return nullptr;
+    };
+
+    for (std::size_t index = 0; index < tokens.count; ++index) {
+        const LexToken& token = tokens.tokens[index];
+        if (token.type == TokenType::End) {
+            break;
+        }
+        if (token.type == TokenType::Number ||
+            token.type == TokenType::Variable) {
+            const NodeType type = token.type == TokenType::Number
+                                      ? NodeType::Number
+                                      : NodeType::Variable;
+            tree.nodes[tree.count] = {type, token.value, 0, 0};
+            value_stack[value_count++] = tree.count++;
+        } else if (token.type == TokenType::LParen) {
+            operator_stack[operator_count++] = token.type;
+        } else if (token.type == TokenType::RParen) {
+            while (operator_count > 0 &&
+                   operator_stack[operator_count - 1] != TokenType::LParen) {
+                if (const char* error = apply_top_operator()) {
+                    return error;
+                }
+            }
+            if (operator_count == 0) {
+                return "mismatched ')'";
+            }
+            --operator_count;
+            if (value_count == 0) {
+                return "missing operand";
+            }
+        } else if (is_arithmetic_operator(token.type)) {
+            while (operator_count > 0 &&
+                   operator_stack[operator_count - 1] != TokenType::LParen &&
+                   get_precedence(operator_stack[operator_count - 1]) >=
+                       get_precedence(token.type)) {
+                if (const char* error = apply_top_operator()) {
+                    return error;
+                }
+            }
+            operator_stack[operator_count++] = token.type;
+        } else {
+            return "unexpected token";
+        }
+    }
+
+    while (operator_count > 0) {
+        if (operator_stack[operator_count - 1] == TokenType::LParen) {
+            return "mismatched '('";
+        }
+        if (const char* error = apply_top_operator()) {
+            return error;
+        }
+    }
+    if (value_count != 1) {
+        return "invalid expression";
+    }
+    tree.root = value_stack[0];
+    return nullptr;
+}
+
+/**
+ * @brief Writes the tree's nodes in postorder, right operand first, folding
+ * every operator whose operands are both literals (unless applying it
+ * fails).
+ * @param tree The tree to flatten.
+ * @param expression Receives the nodes.
+ */
+template <std::size_t Capacity>
+constexpr void flatten(const Tree<Capacity>& tree,
+                       Expression<Capacity>& expression) {
+    // A node on the walk, and whether its children have been emitted yet.
+    struct Visit {
+        std::size_t node;
+        bool children_done;
+    };
+    // An emitted subtree: where its nodes start, and whether it's a literal.
+    struct Operand {
+        std::size_t start;
+        bool is_constant;
+    };
+    std::array<Visit, Capacity> walk{};
+    std::size_t walk_count = 0;
+    std::array<Operand, Capacity> operands{};
+    std::size_t operand_count = 0;
+
+    walk[walk_count++] = {tree.root, false};
+    while (walk_count > 0) {
+        Visit& visit = walk[walk_count - 1];
+        const TreeNode& node = tree.nodes[visit.node];
+        if (node.type == NodeType::Number || node.type == NodeType::Variable) {
+            operands[operand_count++] = {expression.node_count,
+                                         node.type == NodeType::Number};
+            expression.nodes[expression.node_count++] = {node.type,
+                                                         node.value};
+            --walk_count;
+            continue;
+        }
+        if (!visit.children_done) {
+            visit.children_done = true;
+            walk[walk_count++] = {node.left, false};
+            walk[walk_count++] = {node.right, false};
+            continue;
+        }
+        --walk_count;
+
+        // The right operand was emitted first, so the left one is on top.
+        const Operand left = operands[--operand_count];
+        const Operand right = operands[--operand_count];
+        int64_t folded = 0;
+        if (left.is_constant && right.is_constant &&
+            try_checked_operation(node.type, expression.nodes[left.start].value,
+                                  expression.nodes[right.start].value,
+                                  folded) == nullptr) {
+            expression.nodes[right.start] = {NodeType::Number, folded};
+            expression.node_count = right.start + 1;
+            operands[operand_count++] = {right.start, true};
+        } else {
+            expression.nodes[expression.node_count++] = {node.type, 0};
+            operands[operand_count++] = {right.start, false};
+        }
+    }
+}
+
+} // namespace detail
+
+/**
+ * @brief Parses and folds an expression. Usable both at compile time and at
+ * run time.
+ * @param text The text of the expression. Variable names in the result point
+ * into it.
+ * @return The expression, or the error message that AST::parse would throw.
+ * Capacity must be at least twice the length of the text plus 2, since a
+ * unary minus can take two tokens.
+ */
+template <std::size_t Capacity>
+constexpr ParseResult<Capacity> parse(std::string_view text) {
+    ParseResult<Capacity> result;
+    detail::Tokens<Capacity> tokens;
+    result.error = detail::tokenize(text, tokens, result.expression);
+    if (result.error != nullptr) {
+        return result;
+    }
+    detail::Tree<Capacity> tree;
+    result.error = detail::build_tree(tokens, tree);
+    if (result.error != nullptr) {
+        return result;
+    }
+    detail::flatten(tree, result.expression);
+    return result;
+}
+
+// A string literal that can be passed as a template argument.
+template <std::size_t Size> struct FixedString {
+    char chars[Size]{};
+
+    consteval FixedString(const char (&text)[Size]) {
+        for (std::size_t index = 0; index < Size; ++index) {
+            chars[index] = text[index];
+        }
+    }
+
+    constexpr std::string_view view() const { return {chars, Size - 1}; }
+};
+
+/**
+ * @brief Parses and folds an expression at compile time. An invalid
+ * expression is a compile error.
+ * @return The compiled expression, with a capacity of exactly its node
+ * count. Its variable names point into the template argument, which lives
+ * for the whole program.
+ */
+template <FixedString Text> consteval auto compile() {
+    constexpr std::size_t capacity = 2 * Text.view().size() + 2;
+    constexpr ParseResult<capacity> result = parse<capacity>(Text.view());
+    if (result.error != nullptr) {
+        throw ASTException(result.error);
+    }
+    // Every slot is a variable leaf, so the slots fit in the nodes' size.
+    constexpr std::size_t size =
+        result.expression.node_count == 0 ? 1 : result.expression.node_count;
+    Expression<size> expression;
+    for (std::size_t index = 0; index < result.expression.node_count;
+         ++index) {
+        expression.nodes[index] = result.expression.nodes[index];
+    }
+    expression.node_count = result.expression.node_count;
+    for (std::size_t slot = 0; slot < result.expression.slot_count; ++slot) {
+        expression.slot_names[slot] = result.expression.slot_names[slot];
+    }
+    expression.slot_count = result.expression.slot_count;
+    return expression;
+}
+
+/**
+ * @brief Evaluates an expression without variables at compile time. An
+ * invalid expression, or one whose evaluation fails, is a compile error.
+ * @return The value of the expression.
+ */
+template <FixedString Text> consteval int64_t compile_value() {
+    return compile<Text>().evaluate();
+}
+
+} // namespace constexpr_ast
@@ -0,0 +1,181 @@
+#include "ExprBuilder.h"
+
+#include <algorithm>
+#include <cctype>
+#include <cstdint>
+#include <limits>
+#include <memory>
+#include <span>
+#include <string>
+#include <string_view>
+#include <utility>
+#include <vector>
+
+namespace ast_build {
+
+// MARK: namespace
+namespace {
+
+/**
+ * @brief Throws unless a name is one the parser would read as a variable:
+ * one or more lowercase letters.
+ * @param name The name to check.
+ */
+void check_variable_name(std::string_view name) {
+    const bool valid =
+        !name.empty() && std::ranges::all_of(name, [](char character) {
+            return std::islower(static_cast<unsigned char>(character));
+        });
+    if (!valid) {
+        throw ASTException("invalid variable name: " + std::string(name));
+    }
+}
+
+} // namespace
+
+// MARK: Expr
+/**
+ * @brief Constructs a number leaf.
+ * @param value The literal.
+ */
+Expr::Expr(int64_t value) : node_(std::make_unique<Node>(value)) {}
+
+/**
+ * @brief Wraps an already built subtree.
+ * @param node The subtree. Must not be null.
+ */
+Expr::Expr(std::unique_ptr<Node> node) : node_(std::move(node)) {
+    if (!node_) {
+        throw ASTException("malformed AST");
+    }
+}
+
+/**
+ * @brief Returns the root of the subtree built so far.
+ */
+const Node& Expr::node() const {
+    if (!node_) {
+        throw ASTException("expression was already used");
+    }
+    return *node_;
+}
+
+/**
+ * @brief Takes the built subtree out of the Expr, e.g. to pass it to
+ * AST::set_root.
+ * @return The root of the subtree.
+ */
+std::unique_ptr<Node> Expr::release() && {
+    if (!node_) {
+        throw ASTException("expression was already used");
+    }
+    return std::move(node_);
+}
+
+Expr::operator std::unique_ptr<Node>() && { return std::move(*this).release(); }
+
+// MARK: Leaves and operators
+/**
+ * @brief Builds a number leaf.
+ * @param value The literal.
+ * @return The leaf.
+ */
+Expr num(int64_t value) { return Expr(value); }
+
+/**
+ * @brief Builds a variable leaf.
+ * @param name The variable's name. Must be lowercase letters, like in text.
+ * @return The leaf.
+ */
+Expr var(std::string name) {
+    check_variable_name(name);
+    return Expr(std::make_unique<Node>(std::move(name)));
+}
+
+/**
+ * @brief Builds an operator node from two operands.
+ * @param type The operator. Must be Add, Sub, Mult or Div.
+ * @param left The left operand.
+ * @param right The right operand.
+ * @return The operator node.
+ */
+Expr binary(NodeType type, Expr left, Expr right) {
+    if (type == NodeType::Number || type == NodeType::Variable) {
+        throw ASTException("unexpected operator token");
+    }
+    return Expr(std::make_unique<Node>(type, std::move(left).release(),
+                                       std::move(right).release()));
+}
+
+Expr operator+(Expr left, Expr right) {
+    return binary(NodeType::Add, std::move(left), std::move(right));
+}
+
+Expr operator-(Expr left, Expr right) {
+    return binary(NodeType::Sub, std::move(left), std::move(right));
+}
+
+Expr operator*(Expr left, Expr right) {
+    return binary(NodeType::Mult, std::move(left), std::move(right));
+}
+
+Expr operator/(Expr left, Expr right) {
+    return binary(NodeType::Div, std::move(left), std::move(right));
+}
+
+/**
+ * @brief Negates an expression like the parser's unary minus does: a literal
+ * becomes a negative literal, anything else becomes -1 * (operand). Unlike in
+ * text, the -1 always binds to the whole operand, so -a in a / -a negates a
+ * rather than the quotient.
+ * @param operand The expression to negate.
+ * @return The negated expression.
+ */
+Expr operator-(Expr operand) {
+    const Node& node = operand.node();
+    if (node.type == NodeType::Number &&
+        node.value != std::numeric_limits<int64_t>::min()) {
+        return num(-node.value);
+    }
+    return binary(NodeType::Mult, num(-1), std::move(operand));
+}
+
+// MARK: Bulk building
+/**
+ * @brief Builds a tree from its nodes in postorder in one pass, without
+ * going through Expr for every node.
+ * @param nodes The nodes in postorder.
+ * @return The root of the tree.
+ */
+std::unique_ptr<Node> from_postorder(std::span<const PostorderNode> nodes) {
+    if (nodes.empty()) {
+        throw ASTException("empty expression");
+    }
+
+    std::vector<std::unique_ptr<Node>> value_stack;
+    value_stack.reserve(nodes.size() / 2 + 1);
+    for (const PostorderNode& node : nodes) {
+        if (node.type == NodeType::Number) {
+            value_stack.push_back(std::make_unique<Node>(node.value));
+        } else if (node.type == NodeType::Variable) {
+            check_variable_name(node.name);
+            value_stack.push_back(
+                std::make_unique<Node>(std::string(node.name)));
+        } else {
+            if (value_stack.size() < 2) {
+                throw ASTException("missing operand");
+            }
+            std::unique_ptr<Node> right = std::move(value_stack.back());
+            value_stack.pop_back();
+            std::unique_ptr<Node>& left = value_stack.back();
+            left = std::make_unique<Node>(node.type, std::move(left),
+                                          std::move(right));
+        }
+    }
+    if (value_stack.size() != 1) {
+        throw ASTException("invalid expression");
+    }
+    return std::move(value_stack.back());
+}
+
+} // namespace ast_build
@@ -0,0 +1,58 @@
+#pragma once
+#include "AST.h"
+
+#include <cstdint>
+#include <memory>
+#include <span>
+#include <string>
+#include <string_view>
+
+// API for building trees directly in memory, without writing an expression
+// out as text and parsing it back:
+//
+//     using namespace ast_build;
+//     AST ast;
+//     ast.set_root((var("price") + 2) * var("qty") - num(1));
+//
+// The trees use the same nodes as the ones AST::parse builds, so everything
+// that works on a parsed AST (evaluate, write_preorder, FlatTree, ...) works
+// on a built one.
+namespace ast_build {
+
+// An owned subtree under construction. Operators consume their operands, so
+// an Expr can be used once; build a fresh leaf to use a variable twice.
+class Expr {
+  public:
+    // Implicit, so that `var("x") * 2` works.
+    Expr(int64_t value);
+    explicit Expr(std::unique_ptr<Node> node);
+
+    const Node& node() const;
+    std::unique_ptr<Node> release() &&;
+    operator std::unique_ptr<Node>() &&;
+
+  private:
+    std::unique_ptr<Node> node_;
+};
+
+Expr num(int64_t value);
+Expr var(std::string name);
+Expr binary(NodeType type, Expr left, Expr right);
+
+Expr operator+(Expr left, Expr right);
+Expr operator-(Expr left, Expr right);
+Expr operator*(Expr left, Expr right);
+Expr operator/(Expr left, Expr right);
+Expr operator-(Expr operand);
+
+// One node of a tree given in postorder, i.e. every operator comes right
+// after its left and right operands.
+struct PostorderNode {
+    NodeType type;
+    int64_t value;         // The literal, for Number nodes.
+    std::string_view name; // The variable name, for Variable nodes.
+};
+
+std::unique_ptr<Node> from_postorder(std::span<const PostorderNode> nodes);
+
+} // namespace ast_build
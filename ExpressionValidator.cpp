@@ -0,0 +1,292 @@
+#include "ExpressionValidator.h"
+#include "AST.h"
+
+#include <algorithm>
+#include <bit>
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+#include <limits>
+#include <string_view>
+
+#if defined(__SSE2__)
+#include <emmintrin.h>
+#endif
+
+// MARK: namespace
+namespace {
+
+// The number of characters classified at a time, one per bit of a mask.
+constexpr std::size_t block_size = 64;
+
+// Where each kind of character is in a block: bit i is set if character i is
+// of that kind. Whitespace is what std::isspace says in the "C" locale, and
+// letters are what std::islower says, like in the lexer.
+struct CharacterMasks {
+    uint64_t space;
+    uint64_t digit;
+    uint64_t letter;
+};
+
+#if defined(__SSE2__)
+/**
+ * @brief Returns the mask of the bytes in [low, high], compared unsigned.
+ */
+uint64_t in_range(__m128i bytes, unsigned char low, unsigned char high) {
+    const __m128i at_least =
+        _mm_cmpeq_epi8(_mm_max_epu8(bytes, _mm_set1_epi8(low)), bytes);
+    const __m128i at_most =
+        _mm_cmpeq_epi8(_mm_min_epu8(bytes, _mm_set1_epi8(high)), bytes);
+    return static_cast<uint16_t>(
+        _mm_movemask_epi8(_mm_and_si128(at_least, at_most)));
+}
+#endif
+
+/**
+ * @brief Classifies the characters of a block.
+ * @param block The block. Must have block_size characters.
+ * @return The masks of the block.
+ */
+CharacterMasks classify(const char* block) {
+    CharacterMasks masks{0, 0, 0};
+#if defined(__SSE2__)
+    for (std::size_t offset = 0; offset < block_size; offset += 16) {
+        const __m128i bytes =
+            _mm_loadu_si128(reinterpret_cast<const __m128i*>(block + offset));
+        const uint64_t space =
+            in_range(bytes, '\t', '\r') |
+            static_cast<uint16_t>(
+                _mm_movemask_epi8(_mm_cmpeq_epi8(bytes, _mm_set1_epi8(' '))));
+        masks.space |= space << offset;
+        masks.digit |= in_range(bytes, '0', '9') << offset;
+        masks.letter |= in_range(bytes, 'a', 'z') << offset;
+    }
+#else
+    for (std::size_t index = 0; index < block_size; ++index) {
+        const auto character = static_cast<unsigned char>(block[index]);
+        const uint64_t bit = uint64_t{1} << index;
+        if (character == ' ' || (character >= '\t' && character <= '\r')) {
+            masks.space |= bit;
+        } else if (character >= '0' && character <= '9') {
+            masks.digit |= bit;
+        } else if (character >= 'a' && character <= 'z') {
+            masks.letter |= bit;
+        }
+    }
+#endif
+    return masks;
+}
+
+bool is_digit(char character) {
+    return character >= '0' && character <= '9';
+}
+
+bool is_letter(char character) {
+    return character >= 'a' && character <= 'z';
+}
+
+} // namespace
+
+// MARK: ExpressionValidator
+/**
+ * @brief Checks the next piece of the text.
+ * @param text The piece. Tokens may continue from the previous piece.
+ */
+void ExpressionValidator::feed(std::string_view text) {
+    std::size_t offset = 0;
+    for (; text.size() - offset >= block_size; offset += block_size) {
+        scan_block(text.data() + offset, block_size);
+    }
+    if (offset < text.size()) {
+        // Pad the last block with spaces, which are never part of a token.
+        char block[block_size];
+        std::memset(block, ' ', sizeof(block));
+        std::memcpy(block, text.data() + offset, text.size() - offset);
+        scan_block(block, text.size() - offset);
+    }
+}
+
+/**
+ * @brief Ends the text, and reports the errors that can only be found at the
+ * end.
+ */
+void ExpressionValidator::finish() {
+    if (run_ == Run::Digits) {
+        end_number();
+    }
+    run_ = Run::None;
+    if (after_unary_minus_) {
+        throw ASTException("missing operand after unary minus");
+    }
+    if (!saw_token_) {
+        throw ASTException("empty expression");
+    }
+    if (awaiting_operand_) {
+        throw ASTException("expression ends with operator");
+    }
+    // The tree builder runs after the lexer, so its errors come last.
+    if (unmatched_close_) {
+        throw ASTException("mismatched ')'");
+    }
+    if (paren_depth_ > 0) {
+        throw ASTException("mismatched '('");
+    }
+}
+
+/**
+ * @brief Checks one block of the text.
+ * @param block The characters. Must have block_size characters, of which
+ * those after size are spaces.
+ * @param size The number of characters of the text in the block.
+ */
+void ExpressionValidator::scan_block(const char* block, std::size_t size) {
+    const CharacterMasks masks = classify(block);
+
+    // Finish the number or variable that continues from the last block.
+    std::size_t start = 0;
+    if (run_ == Run::Digits) {
+        start = static_cast<std::size_t>(std::countr_one(masks.digit));
+        add_digits(block, std::min(start, size));
+        if (start < size) {
+            end_number();
+        }
+    } else if (run_ == Run::Letters) {
+        start = static_cast<std::size_t>(std::countr_one(masks.letter));
+        if (start < size) {
+            run_ = Run::None;
+        }
+    }
+    if (start >= size) {
+        return;
+    }
+
+    // A token starts at every character that isn't whitespace, except
+    // digits after a digit and letters after a letter.
+    uint64_t starts = ~masks.space & ~(masks.digit & (masks.digit << 1)) &
+                      ~(masks.letter & (masks.letter << 1));
+    starts &= ~uint64_t{0} << start;
+    if (size < block_size) {
+        starts &= (uint64_t{1} << size) - 1;
+    }
+
+    while (starts != 0) {
+        const auto index = static_cast<std::size_t>(std::countr_zero(starts));
+        starts &= starts - 1;
+        const char character = block[index];
+        on_token(character);
+
+        // Find the end of a number or variable. If it reaches the end of the
+        // text so far, it might continue in the next piece.
+        if (is_digit(character)) {
+            const std::size_t end = std::min(
+                index + static_cast<std::size_t>(
+                            std::countr_one(masks.digit >> index)),
+                size);
+            add_digits(block + index, end - index);
+            if (end < size) {
+                end_number();
+            } else {
+                run_ = Run::Digits;
+            }
+        } else if (is_letter(character)) {
+            const std::size_t end = index + static_cast<std::size_t>(
+                                                std::countr_one(
+                                                    masks.letter >> index));
+            run_ = end >= size ? Run::Letters : Run::None;
+        }
+    }
+}
+
+/**
+ * @brief Checks the first character of a token against the lexer's state,
+ * like lex_step() in AST.cpp.
+ * @param character The first character of the token.
+ */
+void ExpressionValidator::on_token(char character) {
+    saw_token_ = true;
+
+    if (after_unary_minus_) {
+        after_unary_minus_ = false;
+        if (is_digit(character)) {
+            // A negative number.
+            negative_ = true;
+            magnitude_ = 0;
+            magnitude_overflow_ = false;
+            awaiting_operand_ = false;
+            return;
+        }
+        // Otherwise the minus is -1 *, which needs an operand after it.
+        if (!is_letter(character) && character != '(' && character != '-') {
+            throw ASTException("missing operand after unary minus");
+        }
+    }
+
+    if (awaiting_operand_) {
+        if (character == '-') {
+            after_unary_minus_ = true;
+        } else if (is_digit(character)) {
+            negative_ = false;
+            magnitude_ = 0;
+            magnitude_overflow_ = false;
+            awaiting_operand_ = false;
+        } else if (is_letter(character)) {
+            awaiting_operand_ = false;
+        } else if (character == '(') {
+            ++paren_depth_;
+        } else if (character == ')') {
+            throw ASTException("missing operand before ')'");
+        } else if (character == '+' || character == '*' || character == '/') {
+            throw ASTException("missing operand");
+        } else {
+            throw ASTException("invalid character in expression");
+        }
+        return;
+    }
+
+    if (character == '+' || character == '-' || character == '*' ||
+        character == '/') {
+        awaiting_operand_ = true;
+    } else if (character == ')') {
+        if (paren_depth_ == 0) {
+            unmatched_close_ = true;
+        } else {
+            --paren_depth_;
+        }
+    } else if (is_digit(character) || is_letter(character) ||
+               character == '(') {
+        throw ASTException("missing operator between operands");
+    } else {
+        throw ASTException("invalid character in expression");
+    }
+}
+
+/**
+ * @brief Adds digits to the magnitude of the number being read.
+ * @param digits The digits.
+ * @param count The number of digits.
+ */
+void ExpressionValidator::add_digits(const char* digits, std::size_t count) {
+    constexpr uint64_t max_magnitude = std::numeric_limits<uint64_t>::max();
+    for (std::size_t index = 0; index < count && !magnitude_overflow_;
+         ++index) {
+        const auto digit = static_cast<uint64_t>(digits[index] - '0');
+        if (magnitude_ > (max_magnitude - digit) / 10) {
+            magnitude_overflow_ = true;
+        } else {
+            magnitude_ = magnitude_ * 10 + digit;
+        }
+    }
+}
+
+/**
+ * @brief Checks that the number just read fits in an int64_t.
+ */
+void ExpressionValidator::end_number() {
+    const uint64_t limit =
+        static_cast<uint64_t>(std::numeric_limits<int64_t>::max()) +
+        (negative_ ? 1 : 0);
+    if (magnitude_overflow_ || magnitude_ > limit) {
+        throw ASTException("integer literal overflow");
+    }
+    run_ = Run::None;
+}
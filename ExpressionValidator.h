@@ -0,0 +1,43 @@
+#pragma once
+#include <cstddef>
+#include <cstdint>
+#include <string_view>
+
+// Checks expression text for the errors that parsing it would report, with
+// the same messages and in the same order, but without making tokens or
+// nodes. Meant for rejecting bad input cheaply before parsing it.
+//
+// The text is classified 64 characters at a time (with SSE2 where available)
+// into bit masks of whitespace, digits and letters. Only the first character
+// of each token is then looked at one by one, to check that operators and
+// operands alternate and that parentheses balance; the digits of numbers are
+// only looked at to check their range.
+//
+// The text can be fed in pieces, e.g. as it's read from a file, so memory
+// doesn't grow with the input.
+class ExpressionValidator {
+  public:
+    void feed(std::string_view text);
+    void finish();
+
+  private:
+    // The kind of multi-character token that the last character fed is in.
+    enum class Run { None, Digits, Letters };
+
+    void scan_block(const char* block, std::size_t size);
+    void on_token(char character);
+    void add_digits(const char* digits, std::size_t count);
+    void end_number();
+
+    bool awaiting_operand_ = true;
+    bool after_unary_minus_ = false;
+    bool saw_token_ = false;
+    Run run_ = Run::None;
+    // The magnitude of the number being read, unless it overflowed.
+    uint64_t magnitude_ = 0;
+    bool magnitude_overflow_ = false;
+    bool negative_ = false;
+    // The number of open parentheses, and whether a ')' had none to close.
+    uint64_t paren_depth_ = 0;
+    bool unmatched_close_ = false;
+};
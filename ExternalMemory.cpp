@@ -0,0 +1,431 @@
+#include "ExternalMemory.h"
+#include "AST.h"
+
+#include <algorithm>
+#include <cctype>
+#include <charconv>
+#include <cstddef>
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <istream>
+#include <ostream>
+#include <streambuf>
+#include <string>
+#include <unistd.h>
+#include <utility>
+#include <vector>
+
+// MARK: namespace
+namespace {
+
+// The smallest buffer a reader or writer is given, however low the limit.
+constexpr std::size_t min_buffer_size = 4 << 10;
+
+/**
+ * @brief Returns the precedence of an operator token, like the in-memory
+ * builder.
+ */
+int operator_precedence(TokenType type) {
+    return (type == TokenType::Mult || type == TokenType::Div) ? 2 : 1;
+}
+
+/**
+ * @brief Returns the character that stands for an operator token.
+ */
+char operator_symbol(TokenType type) {
+    switch (type) {
+    case TokenType::Plus:
+        return '+';
+    case TokenType::Minus:
+        return '-';
+    case TokenType::Mult:
+        return '*';
+    default:
+        return '/';
+    }
+}
+
+/**
+ * @brief Writes bytes to a temporary file.
+ */
+void write_bytes(std::FILE* file, const void* source, std::size_t size) {
+    if (std::fwrite(source, 1, size, file) != size) {
+        throw ASTException("error writing temporary file");
+    }
+}
+
+/**
+ * @brief Appends a token to a token file. The records are laid out so that
+ * they can be read from the end: the type byte comes last, after the value of
+ * a number, or after the name and its length for a variable.
+ * @param file The token file.
+ * @param token The token to append. Must not be the End token.
+ */
+void write_token_record(std::FILE* file, const Token& token) {
+    if (token.type == TokenType::Number) {
+        write_bytes(file, &token.value, sizeof(token.value));
+    } else if (token.type == TokenType::Variable) {
+        const auto length = static_cast<uint32_t>(token.variable_name.size());
+        write_bytes(file, token.variable_name.data(), length);
+        write_bytes(file, &length, sizeof(length));
+    }
+    const auto type = static_cast<uint8_t>(token.type);
+    write_bytes(file, &type, sizeof(type));
+}
+
+/**
+ * @brief Reads the token before the reader's position in a token file.
+ * @param reader The reader of the token file.
+ * @param token Receives the token.
+ * @return false at the start of the file.
+ */
+bool read_token_record_backward(BackwardReader& reader, Token& token) {
+    uint8_t type = 0;
+    if (!reader.read(&type, sizeof(type))) {
+        return false;
+    }
+    token.type = static_cast<TokenType>(type);
+    bool complete = true;
+    if (token.type == TokenType::Number) {
+        complete = reader.read(&token.value, sizeof(token.value));
+    } else if (token.type == TokenType::Variable) {
+        uint32_t length = 0;
+        complete = reader.read(&length, sizeof(length));
+        token.variable_name.resize(length);
+        complete = complete && reader.read(token.variable_name.data(), length);
+    }
+    if (!complete) {
+        throw ASTException("corrupt temporary file");
+    }
+    return true;
+}
+
+/**
+ * @brief Lexes the expression into a token file, checking that its
+ * parentheses match. The errors are the ones parse() reports: lexer errors
+ * first, then the first unmatched ')', then an unmatched '('.
+ * @param expression_input The stream to read the expression from.
+ * @param token_file Receives the tokens, without the End token.
+ */
+void lex_to_file(std::istream& expression_input, std::FILE* token_file) {
+    int64_t depth = 0;
+    const char* paren_error = nullptr;
+    AST::lex_stream(expression_input, [&](const Token& token) {
+        if (token.type == TokenType::End) {
+            return;
+        }
+        if (token.type == TokenType::LParen) {
+            ++depth;
+        } else if (token.type == TokenType::RParen && --depth < 0 &&
+                   paren_error == nullptr) {
+            paren_error = "mismatched ')'";
+        }
+        write_token_record(token_file, token);
+    });
+    if (paren_error == nullptr && depth > 0) {
+        paren_error = "mismatched '('";
+    }
+    if (paren_error != nullptr) {
+        throw ASTException(paren_error);
+    }
+}
+
+/**
+ * @brief Converts the tokens to reversed preorder with a shunting-yard pass
+ * over the reversed tokens. Reading infix backward gives the mirror image of
+ * postorder, so the operands of each operator come out right one first, and
+ * operators of equal precedence must not pop each other to stay left
+ * associative.
+ * @param token_file The file written by lex_to_file().
+ * @param output_file Receives the tokens in reversed preorder.
+ * @param buffer_size The size of the read buffer.
+ * @param resident_operators How many operators to keep in memory.
+ */
+void mirror_to_reversed_preorder(std::FILE* token_file, std::FILE* output_file,
+                                 std::size_t buffer_size,
+                                 std::size_t resident_operators) {
+    BackwardReader reader(token_file, buffer_size);
+    SpillStack<TokenType> operators(resident_operators);
+    Token token{TokenType::End, 0, ""};
+    const auto emit_operator = [output_file](TokenType type) {
+        write_token_record(output_file, {type, 0, ""});
+    };
+
+    while (read_token_record_backward(reader, token)) {
+        switch (token.type) {
+        case TokenType::Number:
+        case TokenType::Variable:
+            write_token_record(output_file, token);
+            break;
+        case TokenType::RParen:
+            operators.push_back(TokenType::RParen);
+            break;
+        case TokenType::LParen:
+            while (operators.back() != TokenType::RParen) {
+                emit_operator(operators.back());
+                operators.pop_back();
+            }
+            operators.pop_back();
+            break;
+        default:
+            while (!operators.empty() &&
+                   operators.back() != TokenType::RParen &&
+                   operator_precedence(operators.back()) >
+                       operator_precedence(token.type)) {
+                emit_operator(operators.back());
+                operators.pop_back();
+            }
+            operators.push_back(token.type);
+            break;
+        }
+    }
+    while (!operators.empty()) {
+        emit_operator(operators.back());
+        operators.pop_back();
+    }
+}
+
+/**
+ * @brief Writes the tokens of a reversed preorder file, last to first, as
+ * preorder text in the format of AST::write_preorder().
+ */
+void write_preorder_text(std::FILE* reversed_file,
+                         std::ostream& preorder_output,
+                         std::size_t buffer_size) {
+    BackwardReader reader(reversed_file, buffer_size);
+    Token token{TokenType::End, 0, ""};
+    std::string text;
+    text.reserve(buffer_size + 64);
+    char number[24];
+
+    while (read_token_record_backward(reader, token)) {
+        if (token.type == TokenType::Number) {
+            const auto result =
+                std::to_chars(number, number + sizeof(number), token.value);
+            text.append(number, result.ptr);
+        } else if (token.type == TokenType::Variable) {
+            text += token.variable_name;
+        } else {
+            text += operator_symbol(token.type);
+        }
+        text += ' ';
+        if (text.size() >= buffer_size) {
+            preorder_output.write(text.data(),
+                                  static_cast<long>(text.size()));
+            text.clear();
+        }
+    }
+    preorder_output.write(text.data(), static_cast<long>(text.size()));
+    if (!preorder_output) {
+        throw ASTException("error writing preorder output");
+    }
+}
+
+} // namespace
+
+// MARK: TempFile
+TempFile::TempFile() {
+    const char* directory = std::getenv("TMPDIR");
+    std::string path = (directory != nullptr && *directory != '\0')
+                           ? directory
+                           : "/tmp";
+    path += "/ast-XXXXXX";
+    const int descriptor = mkstemp(path.data());
+    if (descriptor < 0) {
+        throw ASTException("cannot create temporary file in " +
+                           path.substr(0, path.size() - 11));
+    }
+    unlink(path.c_str());
+    file_ = fdopen(descriptor, "w+b");
+    if (file_ == nullptr) {
+        close(descriptor);
+        throw ASTException("cannot open temporary file");
+    }
+}
+
+TempFile::~TempFile() {
+    if (file_ != nullptr) {
+        std::fclose(file_);
+    }
+}
+
+TempFile::TempFile(TempFile&& other) noexcept
+    : file_(std::exchange(other.file_, nullptr)) {}
+
+TempFile& TempFile::operator=(TempFile&& other) noexcept {
+    std::swap(file_, other.file_);
+    return *this;
+}
+
+std::FILE* TempFile::get() const { return file_; }
+
+// MARK: BackwardReader
+/**
+ * @brief Constructs a reader positioned at the end of the file.
+ * @param file The file to read. Must be seekable.
+ * @param buffer_size The number of bytes to read from the file at a time.
+ */
+BackwardReader::BackwardReader(std::FILE* file, std::size_t buffer_size)
+    : file_(file), buffer_(std::max(buffer_size, min_buffer_size)) {
+    if (std::fflush(file_) != 0 || fseeko(file_, 0, SEEK_END) != 0) {
+        throw ASTException("cannot seek in input file");
+    }
+    buffer_start_ = static_cast<uint64_t>(ftello(file_));
+}
+
+/**
+ * @brief Reads the bytes that end at the current position, and moves the
+ * position back over them.
+ * @param destination Receives the bytes, in file order.
+ * @param size The number of bytes to read.
+ * @return false if there are fewer than size bytes before the position.
+ */
+bool BackwardReader::read(void* destination, std::size_t size) {
+    auto* bytes = static_cast<char*>(destination);
+    while (size > 0) {
+        if (buffered_ == 0 && !refill()) {
+            return false;
+        }
+        const std::size_t count = std::min(size, buffered_);
+        std::memcpy(bytes + size - count, buffer_.data() + buffered_ - count,
+                    count);
+        buffered_ -= count;
+        size -= count;
+    }
+    return true;
+}
+
+/**
+ * @brief Reads the character before the current position, and moves the
+ * position back over it.
+ * @return The character, or EOF at the start of the file.
+ */
+int BackwardReader::previous_char() {
+    if (buffered_ == 0 && !refill()) {
+        return EOF;
+    }
+    return static_cast<unsigned char>(buffer_[--buffered_]);
+}
+
+/**
+ * @brief Returns the file offset of the current position.
+ */
+uint64_t BackwardReader::position() const {
+    return buffer_start_ + buffered_;
+}
+
+/**
+ * @brief Reads the block of the file before the buffered part.
+ * @return false at the start of the file.
+ */
+bool BackwardReader::refill() {
+    if (buffer_start_ == 0) {
+        return false;
+    }
+    const std::size_t count = static_cast<std::size_t>(
+        std::min<uint64_t>(buffer_start_, buffer_.size()));
+    buffer_start_ -= count;
+    if (fseeko(file_, static_cast<off_t>(buffer_start_), SEEK_SET) != 0 ||
+        std::fread(buffer_.data(), 1, count, file_) != count) {
+        throw ASTException("error reading input file");
+    }
+    buffered_ = count;
+    return true;
+}
+
+// MARK: Functions
+/**
+ * @brief Reads the whitespace separated word before the reader's position.
+ * @param reader The reader to read from.
+ * @param word Receives the word.
+ * @return false if there are no more words before the position.
+ */
+bool read_word_backward(BackwardReader& reader, std::string& word) {
+    int c = reader.previous_char();
+    while (c != EOF && std::isspace(c)) {
+        c = reader.previous_char();
+    }
+    if (c == EOF) {
+        return false;
+    }
+    word.clear();
+    while (c != EOF && !std::isspace(c)) {
+        word += static_cast<char>(c);
+        c = reader.previous_char();
+    }
+    std::reverse(word.begin(), word.end());
+    return true;
+}
+
+/**
+ * @brief Copies the rest of an input that can't seek, like a pipe, to a
+ * temporary file, so that it can be read backward.
+ * @param input The input to copy.
+ * @return The temporary file.
+ */
+TempFile spool_to_temp_file(std::FILE* input) {
+    TempFile spool;
+    std::vector<char> buffer(1 << 20);
+    std::size_t count = 0;
+    while ((count = std::fread(buffer.data(), 1, buffer.size(), input)) > 0) {
+        write_bytes(spool.get(), buffer.data(), count);
+    }
+    if (std::ferror(input)) {
+        throw ASTException("error reading input file");
+    }
+    return spool;
+}
+
+/**
+ * @brief Copies the rest of a stream buffer to a temporary file, like the
+ * overload above. For inputs that were already read from through a buffer.
+ * @param input The stream buffer to copy.
+ * @return The temporary file.
+ */
+TempFile spool_to_temp_file(std::streambuf& input) {
+    TempFile spool;
+    std::vector<char> buffer(1 << 20);
+    std::streamsize count = 0;
+    while ((count = input.sgetn(buffer.data(),
+                                static_cast<std::streamsize>(
+                                    buffer.size()))) > 0) {
+        write_bytes(spool.get(), buffer.data(),
+                    static_cast<std::size_t>(count));
+    }
+    return spool;
+}
+
+/**
+ * @brief Converts an expression to preorder text without holding it in
+ * memory, for expressions larger than RAM. The expression is lexed into a
+ * temporary token file, which is read backward to build the preorder in a
+ * second temporary file, which is read backward again to write the text. The
+ * output and any error are the same as parse() followed by write_preorder().
+ * Needs free disk space of about twice the size of the tokens.
+ * @param expression_input The stream to read the expression from, until EOF.
+ * @param preorder_output The stream to write the preorder text to.
+ * @param options The memory limit.
+ */
+void build_external(std::istream& expression_input,
+                    std::ostream& preorder_output,
+                    const ExternalMemoryOptions& options) {
+    // A quarter of the memory goes to the operator stack, and an eighth to
+    // each file buffer.
+    const std::size_t buffer_size =
+        std::max(options.memory_limit / 8, min_buffer_size);
+    const std::size_t resident_operators =
+        options.memory_limit / 4 / sizeof(TokenType);
+
+    std::vector<char> write_buffer(buffer_size);
+    const TempFile tokens;
+    std::setvbuf(tokens.get(), write_buffer.data(), _IOFBF, buffer_size);
+    lex_to_file(expression_input, tokens.get());
+
+    const TempFile reversed_preorder;
+    std::setvbuf(reversed_preorder.get(), nullptr, _IOFBF, buffer_size);
+    mirror_to_reversed_preorder(tokens.get(), reversed_preorder.get(),
+                                buffer_size, resident_operators);
+    write_preorder_text(reversed_preorder.get(), preorder_output, buffer_size);
+}
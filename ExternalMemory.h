@@ -0,0 +1,153 @@
+#pragma once
+#include "AST.h"
+
+#include <algorithm>
+#include <cstddef>
+#include <cstdint>
+#include <cstdio>
+#include <iosfwd>
+#include <memory>
+#include <string>
+#include <type_traits>
+#include <vector>
+
+// Building blocks for the external-memory (out-of-core) build and eval modes,
+// which handle expressions much larger than RAM. Everything that can grow with
+// the input lives in temporary files, and only bounded buffers and the top
+// part of each stack are kept in memory.
+
+// Options for the external-memory modes.
+struct ExternalMemoryOptions {
+    // Roughly how much memory the buffers and the in-memory parts of the
+    // stacks may use. The pending text of the lexer comes on top of this;
+    // it's at most one read block unless the input has a very long stretch
+    // without operators.
+    std::size_t memory_limit = std::size_t{256} << 20;
+};
+
+// An anonymous temporary file in $TMPDIR (or /tmp). It's unlinked as soon as
+// it's created, so it disappears when closed, even after a crash.
+class TempFile {
+  public:
+    TempFile();
+    ~TempFile();
+    TempFile(TempFile&& other) noexcept;
+    TempFile& operator=(TempFile&& other) noexcept;
+    TempFile(const TempFile&) = delete;
+    TempFile& operator=(const TempFile&) = delete;
+
+    std::FILE* get() const;
+
+  private:
+    std::FILE* file_;
+};
+
+// Reads a file from its end to its start through a buffer.
+class BackwardReader {
+  public:
+    BackwardReader(std::FILE* file, std::size_t buffer_size);
+
+    bool read(void* destination, std::size_t size);
+    int previous_char();
+    uint64_t position() const;
+
+  private:
+    bool refill();
+
+    std::FILE* file_;
+    std::vector<char> buffer_;
+    uint64_t buffer_start_; // The file offset of buffer_[0].
+    std::size_t buffered_ = 0; // The number of bytes before the position.
+};
+
+bool read_word_backward(BackwardReader& reader, std::string& word);
+TempFile spool_to_temp_file(std::FILE* input);
+TempFile spool_to_temp_file(std::streambuf& input);
+
+// A stack of trivially copyable values that keeps at most resident_limit of
+// them in memory. When it's full, the bottom half is written to a temporary
+// file, and read back once the values above it are popped.
+template <typename T> class SpillStack {
+    static_assert(std::is_trivially_copyable_v<T>);
+
+  public:
+    /**
+     * @brief Constructs an empty stack.
+     * @param resident_limit The most values to keep in memory (at least 2).
+     */
+    explicit SpillStack(std::size_t resident_limit)
+        : resident_limit_(resident_limit < 2 ? 2 : resident_limit) {
+        resident_.reserve(resident_limit_);
+    }
+
+    void push_back(const T& value) {
+        if (resident_.size() == resident_limit_) {
+            spill();
+        }
+        resident_.push_back(value);
+    }
+
+    T& back() {
+        if (resident_.empty()) {
+            reload();
+        }
+        return resident_.back();
+    }
+
+    void pop_back() {
+        if (resident_.empty()) {
+            reload();
+        }
+        resident_.pop_back();
+    }
+
+    bool empty() const { return size() == 0; }
+    std::size_t size() const { return spilled_ + resident_.size(); }
+
+  private:
+    /**
+     * @brief Writes the bottom half of the values in memory to the file.
+     */
+    void spill() {
+        if (!file_) {
+            file_ = std::make_unique<TempFile>();
+        }
+        const std::size_t count = resident_.size() / 2;
+        if (fseeko(file_->get(), static_cast<off_t>(spilled_ * sizeof(T)),
+                   SEEK_SET) != 0 ||
+            std::fwrite(resident_.data(), sizeof(T), count, file_->get()) !=
+                count) {
+            throw ASTException("error writing temporary file");
+        }
+        spilled_ += count;
+        resident_.erase(resident_.begin(),
+                        resident_.begin() + static_cast<long>(count));
+    }
+
+    /**
+     * @brief Reads the top spilled values back into memory.
+     */
+    void reload() {
+        const std::size_t count = std::min(spilled_, resident_limit_ / 2);
+        if (count == 0) {
+            throw ASTException("pop from empty stack");
+        }
+        spilled_ -= count;
+        resident_.resize(count);
+        if (fseeko(file_->get(), static_cast<off_t>(spilled_ * sizeof(T)),
+                   SEEK_SET) != 0 ||
+            std::fread(resident_.data(), sizeof(T), count, file_->get()) !=
+                count) {
+            throw ASTException("error reading temporary file");
+        }
+    }
+
+    std::size_t resident_limit_;
+    std::vector<T> resident_;
+    std::size_t spilled_ = 0;
+    std::unique_ptr<TempFile> file_;
+};
+
+void build_external(std::istream& expression_input,
+                    std::ostream& preorder_output,
+                    const ExternalMemoryOptions& options);
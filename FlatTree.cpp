@@ -0,0 +1,188 @@
+#include "FlatTree.h"
+#include "CheckedArithmetic.h"
+
+#include <algorithm>
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+#include <string>
+#include <unordered_map>
+#include <utility>
+#include <vector>
+
+// MARK: namespace
+namespace {
+
+// How many nodes ahead of the scan to prefetch.
+constexpr std::size_t prefetch_distance = 16;
+
+} // namespace
+
+// MARK: FlatTree
+/**
+ * @brief Flattens the tree of an AST.
+ * @param ast The AST to flatten. It isn't referenced after construction.
+ */
+FlatTree::FlatTree(const AST& ast) : FlatTree(ast.root()) {}
+
+/**
+ * @brief Flattens the tree rooted at the given node. The tree is walked with
+ * an explicit stack, so deep trees don't overflow the call stack.
+ * @param root The root of the tree to flatten.
+ */
+FlatTree::FlatTree(const Node* root) {
+    if (root == nullptr) {
+        throw ASTException("tree is empty");
+    }
+
+    // A node on the walk, and whether its children have been emitted yet.
+    struct Visit {
+        const Node* node;
+        bool children_done;
+    };
+    // Number the variables in the order they appear in the expression, i.e.
+    // the order of the leaves from left to right.
+    std::unordered_map<std::string, int64_t> slots;
+    std::vector<const Node*> pending{root};
+    while (!pending.empty()) {
+        const Node* node = pending.back();
+        pending.pop_back();
+        if (node->type == NodeType::Variable) {
+            if (slots.try_emplace(node->variable_name,
+                                  static_cast<int64_t>(slots.size()))
+                    .second) {
+                slot_names_.push_back(node->variable_name);
+            }
+        } else if (node->type != NodeType::Number) {
+            if (!node->left || !node->right) {
+                throw ASTException("malformed AST");
+            }
+            pending.push_back(node->right.get());
+            pending.push_back(node->left.get());
+        }
+    }
+
+    std::vector<Visit> walk{{root, false}};
+    std::size_t stack_depth = 0;
+
+    while (!walk.empty()) {
+        Visit& visit = walk.back();
+        const Node* node = visit.node;
+        if (node->type == NodeType::Number) {
+            nodes_.push_back({node->type, node->value});
+        } else if (node->type == NodeType::Variable) {
+            nodes_.push_back({node->type, slots.at(node->variable_name)});
+        } else if (!visit.children_done) {
+            visit.children_done = true;
+            // Emit the right operand first (see FlatTree.h).
+            walk.push_back({node->left.get(), false});
+            walk.push_back({node->right.get(), false});
+            continue;
+        } else {
+            nodes_.push_back({node->type, 0});
+            stack_depth -= 2; // Pops both operands, pushed back below.
+        }
+        ++stack_depth;
+        max_stack_depth_ = std::max(max_stack_depth_, stack_depth);
+        walk.pop_back();
+    }
+}
+
+/**
+ * @brief Evaluates the tree, which must not contain any variables.
+ * @return The result of evaluating the tree.
+ */
+int64_t FlatTree::evaluate() const { return evaluate_slots(nullptr); }
+
+/**
+ * @brief Evaluates the tree, substituting the bound values for variables.
+ * @param bindings The values to substitute for variables.
+ * @return The result of evaluating the tree.
+ */
+int64_t FlatTree::evaluate(const VariableBindings& bindings) const {
+    // Look each variable up once. A missing one is only reported when the
+    // scan reaches it, so errors come in the same order as Node::get_value.
+    const std::size_t slot_count = slot_names_.size();
+    const auto slot_values = std::make_unique<int64_t[]>(slot_count);
+    const auto bound = std::make_unique<bool[]>(slot_count);
+    for (std::size_t slot = 0; slot < slot_count; ++slot) {
+        if (const auto variable_it = bindings.find(slot_names_[slot]);
+            variable_it != bindings.end()) {
+            slot_values[slot] = variable_it->second;
+            bound[slot] = true;
+        }
+    }
+    return evaluate_slots(slot_values.get(), bound.get());
+}
+
+/**
+ * @brief Returns the number of nodes in the tree.
+ */
+std::size_t FlatTree::size() const { return nodes_.size(); }
+
+/**
+ * @brief Returns the names of the tree's variables, indexed by slot (i.e. in
+ * the order they first appear in the expression).
+ */
+const std::vector<std::string>& FlatTree::variables() const {
+    return slot_names_;
+}
+
+/**
+ * @brief Evaluates the tree with the values of its variables given by slot,
+ * as listed by variables().
+ *
+ * The nodes are evaluated in order with a stack of values. The left operand
+ * of an operator is on top of the stack, the right one below it.
+ * @param slot_values The value of each slot, or nullptr if there are no
+ * bindings at all.
+ * @param bound Whether each slot has a value, or nullptr if they all do.
+ * @return The result of evaluating the tree.
+ */
+int64_t FlatTree::evaluate_slots(const int64_t* slot_values,
+                                 const bool* bound) const {
+    const auto values = std::make_unique<int64_t[]>(max_stack_depth_);
+    std::size_t top = 0; // The number of values on the stack.
+
+    const FlatNode* nodes = nodes_.data();
+    const std::size_t node_count = nodes_.size();
+    for (std::size_t index = 0; index < node_count; ++index) {
+        __builtin_prefetch(nodes +
+                           std::min(index + prefetch_distance, node_count - 1));
+        const FlatNode& node = nodes[index];
+        switch (node.type) {
+        case NodeType::Number:
+            values[top++] = node.value;
+            break;
+        case NodeType::Variable: {
+            const auto slot = static_cast<std::size_t>(node.value);
+            if (slot_values == nullptr) {
+                throw ASTException("cannot evaluate variable without bindings");
+            }
+            if (bound != nullptr && !bound[slot]) {
+                throw ASTException("missing variable value: " +
+                                   slot_names_[slot]);
+            }
+            values[top++] = slot_values[slot];
+            break;
+        }
+        case NodeType::Add:
+            --top;
+            values[top - 1] = checked_add(values[top], values[top - 1]);
+            break;
+        case NodeType::Sub:
+            --top;
+            values[top - 1] = checked_sub(values[top], values[top - 1]);
+            break;
+        case NodeType::Mult:
+            --top;
+            values[top - 1] = checked_mul(values[top], values[top - 1]);
+            break;
+        case NodeType::Div:
+            --top;
+            values[top - 1] = checked_div(values[top], values[top - 1]);
+            break;
+        }
+    }
+    return values[0];
+}
@@ -0,0 +1,41 @@
+#pragma once
+#include "AST.h"
+
+#include <cstddef>
+#include <cstdint>
+#include <string>
+#include <vector>
+
+// A read-only copy of a tree laid out in postorder (right operand first) in
+// one contiguous array.
+// Nodes built by the parser are scattered around the heap, so evaluating a
+// large tree is a chain of cache misses. Evaluating a FlatTree is a single
+// forward scan over 16-byte nodes instead, which the prefetcher can keep
+// ahead of. The postorder follows the evaluation order defined in AST.h, so
+// the same error is reported when several could occur.
+//
+// Variables are resolved to slots when the tree is flattened, so evaluation
+// looks each name up once instead of once per occurrence.
+class FlatTree {
+  public:
+    explicit FlatTree(const AST& ast);
+    explicit FlatTree(const Node* root);
+
+    int64_t evaluate() const;
+    int64_t evaluate(const VariableBindings& bindings) const;
+    int64_t evaluate_slots(const int64_t* slot_values,
+                           const bool* bound = nullptr) const;
+
+    std::size_t size() const;
+    const std::vector<std::string>& variables() const;
+
+  private:
+    struct FlatNode {
+        NodeType type;
+        int64_t value; // The literal, or the slot of the variable.
+    };
+
+    std::vector<FlatNode> nodes_;
+    std::vector<std::string> slot_names_;
+    std::size_t max_stack_depth_ = 0;
+};
@@ -0,0 +1,450 @@
+#include "IoEngine.h"
+#include "AST.h"
+
+#include <algorithm>
+#include <atomic>
+#include <cerrno>
+#include <cstddef>
+#include <cstdint>
+#include <exception>
+#include <fcntl.h>
+#include <linux/io_uring.h>
+#include <memory>
+#include <string>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+#include <sys/uio.h>
+#include <unistd.h>
+#include <vector>
+
+// MARK: namespace
+namespace {
+
+// io_uring allows more, but deeper queues don't help a single device.
+constexpr unsigned max_queue_depth = 4096;
+
+/**
+ * @brief The backend of last resort: runs the submitted reads one after
+ * another with pread when the engine waits for them.
+ */
+class PreadEngine final : public IoEngine {
+  public:
+    explicit PreadEngine(const IoEngineOptions& options) : IoEngine(options) {}
+
+    const char* name() const override { return "pread"; }
+
+  protected:
+    void submit(const Request& request) override {
+        pending_.push_back(request);
+    }
+
+    void wait(std::vector<Completion>& completions) override {
+        for (const Request& request : pending_) {
+            ssize_t count = 0;
+            do {
+                count = pread(request.descriptor, request.buffer, request.size,
+                              static_cast<off_t>(request.offset));
+            } while (count < 0 && errno == EINTR);
+            completions.push_back({request.tag, count < 0 ? -errno : count});
+        }
+        pending_.clear();
+    }
+
+  private:
+    std::vector<Request> pending_;
+};
+
+/**
+ * @brief The io_uring backend. Reads are queued in the submission ring and
+ * handed to the kernel in one io_uring_enter call per wait, which also waits
+ * for the first completion.
+ */
+class IoUringEngine final : public IoEngine {
+  public:
+    explicit IoUringEngine(const IoEngineOptions& options);
+    ~IoUringEngine() override;
+
+    const char* name() const override { return "io_uring"; }
+
+  protected:
+    void submit(const Request& request) override;
+    void wait(std::vector<Completion>& completions) override;
+
+  private:
+    void release();
+
+    int ring_descriptor_ = -1;
+    void* sq_ring_ = MAP_FAILED;
+    std::size_t sq_ring_size_ = 0;
+    void* cq_ring_ = MAP_FAILED;
+    std::size_t cq_ring_size_ = 0;
+    io_uring_sqe* sqes_ = nullptr;
+    std::size_t sqes_size_ = 0;
+
+    // The ring fields shared with the kernel.
+    unsigned* sq_tail_ = nullptr;
+    unsigned* sq_array_ = nullptr;
+    unsigned sq_mask_ = 0;
+    unsigned* cq_head_ = nullptr;
+    unsigned* cq_tail_ = nullptr;
+    unsigned cq_mask_ = 0;
+    io_uring_cqe* cqes_ = nullptr;
+
+    // The number of queued reads the kernel hasn't taken yet.
+    unsigned unsubmitted_ = 0;
+    // The buffer of each read in flight, by tag. The kernel reads them when
+    // the reads are submitted.
+    std::vector<iovec> iovecs_;
+};
+
+/**
+ * @brief Sets up a ring with room for the queue depth, and maps it.
+ * @param options The engine options.
+ */
+IoUringEngine::IoUringEngine(const IoEngineOptions& options)
+    : IoEngine(options), iovecs_(options_.queue_depth) {
+    io_uring_params params{};
+    ring_descriptor_ = static_cast<int>(
+        syscall(__NR_io_uring_setup, options_.queue_depth, &params));
+    if (ring_descriptor_ < 0) {
+        throw ASTException("io_uring is not available");
+    }
+
+    sq_ring_size_ = params.sq_off.array + params.sq_entries * sizeof(unsigned);
+    cq_ring_size_ =
+        params.cq_off.cqes + params.cq_entries * sizeof(io_uring_cqe);
+    const bool single_mapping = (params.features & IORING_FEAT_SINGLE_MMAP);
+    if (single_mapping) {
+        sq_ring_size_ = cq_ring_size_ = std::max(sq_ring_size_, cq_ring_size_);
+    }
+    sq_ring_ = mmap(nullptr, sq_ring_size_, PROT_READ | PROT_WRITE,
+                    MAP_SHARED | MAP_POPULATE, ring_descriptor_,
+                    IORING_OFF_SQ_RING);
+    cq_ring_ = single_mapping
+                   ? sq_ring_
+                   : mmap(nullptr, cq_ring_size_, PROT_READ | PROT_WRITE,
+                          MAP_SHARED | MAP_POPULATE, ring_descriptor_,
+                          IORING_OFF_CQ_RING);
+    sqes_size_ = params.sq_entries * sizeof(io_uring_sqe);
+    void* sqes = mmap(nullptr, sqes_size_, PROT_READ | PROT_WRITE,
+                      MAP_SHARED | MAP_POPULATE, ring_descriptor_,
+                      IORING_OFF_SQES);
+    if (sq_ring_ == MAP_FAILED || cq_ring_ == MAP_FAILED ||
+        sqes == MAP_FAILED) {
+        if (sqes != MAP_FAILED) {
+            munmap(sqes, sqes_size_);
+        }
+        release();
+        throw ASTException("io_uring is not available");
+    }
+    sqes_ = static_cast<io_uring_sqe*>(sqes);
+
+    auto* sq = static_cast<char*>(sq_ring_);
+    auto* cq = static_cast<char*>(cq_ring_);
+    sq_tail_ = reinterpret_cast<unsigned*>(sq + params.sq_off.tail);
+    sq_array_ = reinterpret_cast<unsigned*>(sq + params.sq_off.array);
+    sq_mask_ = *reinterpret_cast<unsigned*>(sq + params.sq_off.ring_mask);
+    cq_head_ = reinterpret_cast<unsigned*>(cq + params.cq_off.head);
+    cq_tail_ = reinterpret_cast<unsigned*>(cq + params.cq_off.tail);
+    cq_mask_ = *reinterpret_cast<unsigned*>(cq + params.cq_off.ring_mask);
+    cqes_ = reinterpret_cast<io_uring_cqe*>(cq + params.cq_off.cqes);
+}
+
+IoUringEngine::~IoUringEngine() {
+    if (sqes_ != nullptr) {
+        munmap(sqes_, sqes_size_);
+    }
+    release();
+}
+
+/**
+ * @brief Unmaps the rings and closes the ring descriptor.
+ */
+void IoUringEngine::release() {
+    if (cq_ring_ != MAP_FAILED && cq_ring_ != sq_ring_) {
+        munmap(cq_ring_, cq_ring_size_);
+    }
+    if (sq_ring_ != MAP_FAILED) {
+        munmap(sq_ring_, sq_ring_size_);
+    }
+    if (ring_descriptor_ >= 0) {
+        close(ring_descriptor_);
+    }
+}
+
+/**
+ * @brief Queues a read in the submission ring. The scheduler never has more
+ * reads in flight than the queue depth, so there's always room.
+ */
+void IoUringEngine::submit(const Request& request) {
+    const unsigned tail = std::atomic_ref(*sq_tail_).load(
+        std::memory_order_relaxed);
+    const unsigned index = tail & sq_mask_;
+    iovecs_[request.tag] = {request.buffer, request.size};
+
+    io_uring_sqe& sqe = sqes_[index];
+    sqe = {};
+    sqe.opcode = IORING_OP_READV;
+    sqe.fd = request.descriptor;
+    sqe.addr = reinterpret_cast<uint64_t>(&iovecs_[request.tag]);
+    sqe.len = 1;
+    sqe.off = request.offset;
+    sqe.user_data = request.tag;
+    sq_array_[index] = index;
+    // Publish the entry before the new tail.
+    std::atomic_ref(*sq_tail_).store(tail + 1, std::memory_order_release);
+    ++unsubmitted_;
+}
+
+/**
+ * @brief Submits the queued reads, waits for at least one completion, and
+ * collects every completion that is ready.
+ */
+void IoUringEngine::wait(std::vector<Completion>& completions) {
+    for (;;) {
+        const long submitted =
+            syscall(__NR_io_uring_enter, ring_descriptor_, unsubmitted_, 1,
+                    IORING_ENTER_GETEVENTS, nullptr, 0);
+        if (submitted >= 0) {
+            unsubmitted_ -= static_cast<unsigned>(submitted);
+            break;
+        }
+        if (errno != EINTR) {
+            throw ASTException("io_uring_enter failed");
+        }
+    }
+
+    unsigned head = std::atomic_ref(*cq_head_).load(std::memory_order_relaxed);
+    const unsigned tail =
+        std::atomic_ref(*cq_tail_).load(std::memory_order_acquire);
+    for (; head != tail; ++head) {
+        const io_uring_cqe& cqe = cqes_[head & cq_mask_];
+        completions.push_back({cqe.user_data, cqe.res});
+    }
+    // Hand the entries back to the kernel.
+    std::atomic_ref(*cq_head_).store(head, std::memory_order_release);
+}
+
+// The state of a file being read by read_files().
+struct FileState {
+    int descriptor = -1;
+    std::string contents;
+    std::size_t submitted = 0; // Bytes for which reads have been submitted.
+    std::size_t outstanding = 0; // Reads in flight.
+    std::exception_ptr error;
+};
+
+/**
+ * @brief Opens a file and sizes its buffer. Files that aren't regular files,
+ * like pipes, have no size, so they are read to the end right away.
+ * @param path The path of the file.
+ * @param file The file's state.
+ * @return true if the file's chunks still have to be read.
+ */
+bool start_file(const std::string& path, FileState& file) {
+    file.descriptor = open(path.c_str(), O_RDONLY | O_CLOEXEC);
+    struct stat status{};
+    if (file.descriptor < 0 || fstat(file.descriptor, &status) != 0) {
+        file.error =
+            std::make_exception_ptr(ASTException("cannot open file: " + path));
+        return false;
+    }
+    if (S_ISREG(status.st_mode)) {
+        file.contents.resize(static_cast<std::size_t>(status.st_size));
+        return !file.contents.empty();
+    }
+
+    char buffer[1 << 16];
+    for (;;) {
+        const ssize_t count = read(file.descriptor, buffer, sizeof(buffer));
+        if (count < 0 && errno == EINTR) {
+            continue;
+        }
+        if (count < 0) {
+            file.error = std::make_exception_ptr(
+                ASTException("error reading file: " + path));
+        }
+        if (count <= 0) {
+            return false;
+        }
+        file.contents.append(buffer, static_cast<std::size_t>(count));
+    }
+}
+
+} // namespace
+
+// MARK: IoEngine
+IoEngine::IoEngine(const IoEngineOptions& options) : options_(options) {
+    options_.queue_depth =
+        std::clamp(options_.queue_depth, 1U, max_queue_depth);
+    options_.chunk_size = std::max<std::size_t>(options_.chunk_size, 4096);
+}
+
+/**
+ * @brief Creates an engine with the requested backend.
+ * @param options The backend, queue depth and chunk size. With
+ * IoBackend::Auto, io_uring is used if the kernel allows it, and pread
+ * otherwise.
+ * @return The engine.
+ */
+std::unique_ptr<IoEngine> IoEngine::create(const IoEngineOptions& options) {
+    if (options.backend != IoBackend::Pread) {
+        try {
+            return std::make_unique<IoUringEngine>(options);
+        } catch (const ASTException&) {
+            if (options.backend == IoBackend::IoUring) {
+                throw;
+            }
+        }
+    }
+    return std::make_unique<PreadEngine>(options);
+}
+
+/**
+ * @brief Reads whole files. The files are opened in order, and their chunks
+ * are read with up to the queue depth of reads in flight, across files, so
+ * that many small files are read as concurrently as the chunks of one large
+ * file.
+ * @param paths The paths of the files.
+ * @param on_file Called on this thread as each file completes, in completion
+ * order, with the file's contents or the error that stopped it from being
+ * read.
+ */
+void IoEngine::read_files(const std::vector<std::string>& paths,
+                          const FileCallback& on_file) {
+    // A chunk being read, by tag.
+    struct Slot {
+        std::size_t file;
+        uint64_t offset;
+        std::size_t size;
+    };
+
+    const unsigned depth = options_.queue_depth;
+    std::vector<FileState> files(paths.size());
+    std::vector<Slot> slots(depth);
+    std::vector<uint64_t> free_tags;
+    for (unsigned tag = depth; tag > 0; --tag) {
+        free_tags.push_back(tag - 1);
+    }
+    std::vector<Completion> completions;
+
+    const auto finish = [&](std::size_t index) {
+        FileState& file = files[index];
+        if (file.descriptor >= 0) {
+            close(file.descriptor);
+        }
+        if (file.error) {
+            file.contents.clear();
+        }
+        on_file(index, std::move(file.contents), file.error);
+    };
+    const auto issue = [&](uint64_t tag, const Slot& slot) {
+        slots[tag] = slot;
+        FileState& file = files[slot.file];
+        submit({file.descriptor, file.contents.data() + slot.offset,
+                slot.size, slot.offset, tag});
+    };
+
+    std::size_t next_file = 0;
+    std::size_t current = paths.size(); // The file being submitted, if any.
+    for (;;) {
+        // Fill the queue with the chunks of the current file and the next
+        // ones.
+        while (!free_tags.empty()) {
+            if (current == paths.size()) {
+                if (next_file == paths.size()) {
+                    break;
+                }
+                current = next_file++;
+                if (!start_file(paths[current], files[current])) {
+                    finish(current);
+                    current = paths.size();
+                }
+                continue;
+            }
+            FileState& file = files[current];
+            if (file.submitted == file.contents.size()) {
+                if (file.outstanding == 0) {
+                    finish(current);
+                }
+                current = paths.size();
+                continue;
+            }
+            const std::size_t size = std::min(
+                options_.chunk_size, file.contents.size() - file.submitted);
+            const uint64_t tag = free_tags.back();
+            free_tags.pop_back();
+            ++file.outstanding;
+            issue(tag, {current, file.submitted, size});
+            file.submitted += size;
+        }
+        if (free_tags.size() == depth) {
+            break; // Nothing in flight, and nothing left to submit.
+        }
+
+        completions.clear();
+        wait(completions);
+        for (const Completion& completion : completions) {
+            const Slot slot = slots[completion.tag];
+            FileState& file = files[slot.file];
+            if (completion.result > 0 &&
+                static_cast<std::size_t>(completion.result) < slot.size) {
+                // A short read: read the rest of the chunk.
+                const auto count = static_cast<std::size_t>(completion.result);
+                issue(completion.tag,
+                      {slot.file, slot.offset + count, slot.size - count});
+                continue;
+            }
+            free_tags.push_back(completion.tag);
+            --file.outstanding;
+            // Reading nothing means the file shrank while it was read.
+            if (completion.result <= 0 && !file.error) {
+                file.error = std::make_exception_ptr(
+                    ASTException("error reading file: " + paths[slot.file]));
+            }
+            if (file.outstanding == 0 && slot.file != current) {
+                finish(slot.file);
+            }
+        }
+    }
+}
+
+/**
+ * @brief Reads one whole file, in chunks with up to the queue depth of reads
+ * in flight.
+ * @param path The path of the file.
+ * @return The file's contents.
+ */
+std::string IoEngine::read_file(const std::string& path) {
+    std::string contents;
+    std::exception_ptr error;
+    read_files({path}, [&contents, &error](std::size_t, std::string text,
+                                           std::exception_ptr read_error) {
+        contents = std::move(text);
+        error = std::move(read_error);
+    });
+    if (error) {
+        std::rethrow_exception(error);
+    }
+    return contents;
+}
+
+// MARK: Functions
+/**
+ * @brief Parses the name of an I/O backend, as given on the command line.
+ * @param name "auto", "io_uring" or "pread".
+ * @return The backend.
+ */
+IoBackend parse_io_backend(const std::string& name) {
+    if (name == "auto") {
+        return IoBackend::Auto;
+    }
+    if (name == "io_uring") {
+        return IoBackend::IoUring;
+    }
+    if (name == "pread") {
+        return IoBackend::Pread;
+    }
+    throw ASTException("unknown I/O backend: " + name);
+}
@@ -0,0 +1,68 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <exception>
+#include <functional>
+#include <memory>
+#include <string>
+#include <vector>
+
+// An I/O engine for the batch modes, which read many files, or one huge one.
+// Files are read in chunks with many reads in flight at once, so that fast
+// SSDs see a deep queue instead of one blocking read at a time. The io_uring
+// backend uses the raw system calls (no liburing); where io_uring isn't
+// available (old kernels, seccomp filters), the engine falls back to pread.
+
+enum class IoBackend { Auto, IoUring, Pread };
+
+struct IoEngineOptions {
+    IoBackend backend = IoBackend::Auto;
+    // The most reads in flight at once.
+    unsigned queue_depth = 64;
+    // Files are read in chunks of this many bytes.
+    std::size_t chunk_size = std::size_t{1} << 20;
+};
+
+class IoEngine {
+  public:
+    // Called with the index of a file in the list, its contents, and the
+    // error that stopped it from being read, if any.
+    using FileCallback = std::function<void(
+        std::size_t index, std::string contents, std::exception_ptr error)>;
+
+    static std::unique_ptr<IoEngine> create(const IoEngineOptions& options);
+    virtual ~IoEngine() = default;
+    IoEngine(const IoEngine&) = delete;
+    IoEngine& operator=(const IoEngine&) = delete;
+
+    void read_files(const std::vector<std::string>& paths,
+                    const FileCallback& on_file);
+    std::string read_file(const std::string& path);
+    virtual const char* name() const = 0;
+
+  protected:
+    // One read of a chunk.
+    struct Request {
+        int descriptor;
+        char* buffer;
+        std::size_t size;
+        uint64_t offset;
+        uint64_t tag;
+    };
+
+    // The outcome of a request: the bytes read, or a negative errno.
+    struct Completion {
+        uint64_t tag;
+        int64_t result;
+    };
+
+    explicit IoEngine(const IoEngineOptions& options);
+
+    virtual void submit(const Request& request) = 0;
+    virtual void wait(std::vector<Completion>& completions) = 0;
+
+    IoEngineOptions options_;
+};
+
+IoBackend parse_io_backend(const std::string& name);
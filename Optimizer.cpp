@@ -0,0 +1,509 @@
+#include "Optimizer.h"
+#include "CheckedArithmetic.h"
+
+#include <chrono>
+#include <cstddef>
+#include <cstdint>
+#include <iomanip>
+#include <limits>
+#include <memory>
+#include <ostream>
+#include <random>
+#include <set>
+#include <string>
+#include <string_view>
+#include <utility>
+#include <vector>
+
+// MARK: namespace
+namespace {
+
+// With fixpoint iteration, the passes are repeated at most this many times,
+// in case two passes keep undoing each other.
+constexpr unsigned max_fixpoint_rounds = 100;
+
+bool is_operator(const Node& node) {
+    return node.left && node.right;
+}
+
+bool is_number(const Node& node, int64_t value) {
+    return node.type == NodeType::Number && node.value == value;
+}
+
+/**
+ * @brief Replaces a node with one of its operands, dropping the other.
+ * @param node The node to replace.
+ * @param operand The operand to keep, node->left or node->right.
+ */
+void replace_with_operand(std::unique_ptr<Node>& node,
+                          std::unique_ptr<Node>& operand) {
+    std::unique_ptr<Node> kept = std::move(operand);
+    node = std::move(kept);
+}
+
+// Replaces operators whose operands are both numbers with their result,
+// unless applying them fails, so that the error is still reported when the
+// tree is evaluated.
+class ConstantFoldingPass final : public OptimizationPass {
+  public:
+    const char* name() const override { return "fold"; }
+    bool run(std::unique_ptr<Node>& root) override { return fold(*root); }
+
+  private:
+    static bool fold(Node& node);
+};
+
+/**
+ * @brief Folds the subtree rooted at a node, operands first.
+ * @param node The root of the subtree.
+ * @return Whether the subtree changed.
+ */
+bool ConstantFoldingPass::fold(Node& node) {
+    if (!is_operator(node)) {
+        return false;
+    }
+    const bool left_changed = fold(*node.left);
+    const bool right_changed = fold(*node.right);
+    if (node.left->type != NodeType::Number ||
+        node.right->type != NodeType::Number) {
+        return left_changed || right_changed;
+    }
+
+    int64_t result = 0;
+    if (try_checked_operation(node.type, node.left->value, node.right->value,
+                              result) != nullptr) {
+        return left_changed || right_changed;
+    }
+    node.type = NodeType::Number;
+    node.value = result;
+    node.left.reset();
+    node.right.reset();
+    return true;
+}
+
+// Removes operations that leave their other operand as it is: x + 0, 0 + x,
+// x - 0, x * 1, 1 * x and x / 1. None of them can fail, so dropping them
+// can't hide an error. (x * 0 is left alone, since x might fail.)
+class IdentityPass final : public OptimizationPass {
+  public:
+    const char* name() const override { return "identities"; }
+    bool run(std::unique_ptr<Node>& root) override {
+        return simplify(root);
+    }
+
+  private:
+    static bool simplify(std::unique_ptr<Node>& node);
+};
+
+/**
+ * @brief Simplifies the subtree rooted at a node, operands first.
+ * @param node The root of the subtree. Replaced if it's an identity.
+ * @return Whether the subtree changed.
+ */
+bool IdentityPass::simplify(std::unique_ptr<Node>& node) {
+    if (!is_operator(*node)) {
+        return false;
+    }
+    const bool left_changed = simplify(node->left);
+    const bool right_changed = simplify(node->right);
+
+    const bool additive =
+        node->type == NodeType::Add || node->type == NodeType::Sub;
+    const int64_t identity = additive ? 0 : 1;
+    if (is_number(*node->right, identity)) {
+        replace_with_operand(node, node->left);
+        return true;
+    }
+    // Only + and * are commutative.
+    if ((node->type == NodeType::Add || node->type == NodeType::Mult) &&
+        is_number(*node->left, identity)) {
+        replace_with_operand(node, node->right);
+        return true;
+    }
+    return left_changed || right_changed;
+}
+
+// Combines the constants of a chain like (x + 1) + 2 into x + 3. That's only
+// done where it can't change whether the chain overflows: if both constants
+// move the value the same way (the same sign for + and -, at least 1 for *
+// and /), every step of the chain lies between x and the result, so the
+// chain overflows exactly when the combined operation does. (x / 2) / 3
+// is x / 6, since division truncates.
+class ReassociationPass final : public OptimizationPass {
+  public:
+    const char* name() const override { return "reassociate"; }
+    bool run(std::unique_ptr<Node>& root) override {
+        return reassociate(root);
+    }
+
+  private:
+    static bool reassociate(std::unique_ptr<Node>& node);
+    static bool combine(NodeType type, int64_t inner, int64_t outer,
+                        int64_t& combined);
+};
+
+/**
+ * @brief Combines the constant chains in the subtree rooted at a node,
+ * operands first.
+ * @param node The root of the subtree. Replaced if it ends a chain.
+ * @return Whether the subtree changed.
+ */
+bool ReassociationPass::reassociate(std::unique_ptr<Node>& node) {
+    if (!is_operator(*node)) {
+        return false;
+    }
+    const bool left_changed = reassociate(node->left);
+    const bool right_changed = reassociate(node->right);
+
+    // Look for (x op inner) op outer.
+    Node& left = *node->left;
+    if (left.type != node->type || !is_operator(left) ||
+        left.right->type != NodeType::Number ||
+        node->right->type != NodeType::Number) {
+        return left_changed || right_changed;
+    }
+    int64_t combined = 0;
+    if (!combine(node->type, left.right->value, node->right->value,
+                 combined)) {
+        return left_changed || right_changed;
+    }
+    left.right->value = combined;
+    replace_with_operand(node, node->left);
+    return true;
+}
+
+/**
+ * @brief Combines the constants of (x op inner) op outer.
+ * @param type The operator.
+ * @param inner The constant applied first.
+ * @param outer The constant applied second.
+ * @param combined Receives the constant of x op combined.
+ * @return Whether the chain can be combined without changing its errors.
+ */
+bool ReassociationPass::combine(NodeType type, int64_t inner, int64_t outer,
+                                int64_t& combined) {
+    switch (type) {
+    case NodeType::Add:
+    case NodeType::Sub:
+        // (x - a) - b is x - (a + b).
+        return (inner < 0) == (outer < 0) &&
+               try_checked_add(inner, outer, combined) == nullptr;
+    case NodeType::Mult:
+    case NodeType::Div:
+        // (x / a) / b is x / (a * b).
+        return inner >= 1 && outer >= 1 &&
+               try_checked_mul(inner, outer, combined) == nullptr;
+    default:
+        return false;
+    }
+}
+
+/**
+ * @brief Evaluates a tree like Node::get_value(), in the order described in
+ * AST.h, but reporting an error instead of throwing it.
+ * @param node The root of the tree.
+ * @param bindings The values of the variables.
+ * @param value Receives the value of the tree.
+ * @param error Receives the error, if evaluating fails.
+ * @return Whether evaluating succeeded.
+ */
+bool evaluate_reporting_error(const Node& node,
+                              const VariableBindings& bindings, int64_t& value,
+                              std::string& error) {
+    if (node.type == NodeType::Number) {
+        value = node.value;
+        return true;
+    }
+    if (node.type == NodeType::Variable) {
+        const auto variable_it = bindings.find(node.variable_name);
+        if (variable_it == bindings.end()) {
+            error = "missing variable value: " + node.variable_name;
+            return false;
+        }
+        value = variable_it->second;
+        return true;
+    }
+
+    // Right operand first.
+    int64_t left = 0;
+    int64_t right = 0;
+    const bool ok =
+        evaluate_reporting_error(*node.right, bindings, right, error) &&
+        evaluate_reporting_error(*node.left, bindings, left, error);
+    if (!ok) {
+        return false;
+    }
+    if (const char* message =
+            try_checked_operation(node.type, left, right, value)) {
+        error = message;
+        return false;
+    }
+    return true;
+}
+
+/**
+ * @brief Describes the outcome of evaluating a tree, for error messages.
+ */
+std::string describe_outcome(bool ok, int64_t value, const std::string& error) {
+    return ok ? std::to_string(value) : "error \"" + error + "\"";
+}
+
+/**
+ * @brief Collects the names of the variables in a tree.
+ * @param node The root of the tree.
+ * @param names Receives the names.
+ */
+void collect_variable_names(const Node& node, std::set<std::string>& names) {
+    if (node.type == NodeType::Variable) {
+        names.insert(node.variable_name);
+    }
+    if (is_operator(node)) {
+        collect_variable_names(*node.left, names);
+        collect_variable_names(*node.right, names);
+    }
+}
+
+} // namespace
+
+// MARK: Passes
+/**
+ * @brief Creates a pass by name.
+ * @param name One of pass_names().
+ * @return The pass.
+ */
+std::unique_ptr<OptimizationPass> create_pass(std::string_view name) {
+    if (name == "fold") {
+        return std::make_unique<ConstantFoldingPass>();
+    }
+    if (name == "identities") {
+        return std::make_unique<IdentityPass>();
+    }
+    if (name == "reassociate") {
+        return std::make_unique<ReassociationPass>();
+    }
+    throw ASTException("unknown optimization pass: " + std::string(name));
+}
+
+/**
+ * @brief Returns the names of the passes that create_pass() knows.
+ */
+std::vector<std::string_view> pass_names() {
+    return {"fold", "identities", "reassociate"};
+}
+
+// MARK: PassManager
+/**
+ * @brief Creates a pass manager with the passes of an optimization level:
+ * - 0: No passes.
+ * - 1: fold.
+ * - 2: fold and identities, repeated to a fixpoint.
+ * - 3: fold, identities and reassociate, repeated to a fixpoint.
+ * @param level The level, from 0 to 3.
+ * @return The pass manager.
+ */
+PassManager PassManager::for_level(unsigned level) {
+    if (level > 3) {
+        throw ASTException("bad optimization level: " +
+                           std::to_string(level));
+    }
+    // Each level adds the next pass.
+    PassManager manager;
+    const std::vector<std::string_view> names = pass_names();
+    for (std::size_t index = 0; index < level; ++index) {
+        manager.add_pass(create_pass(names[index]));
+    }
+    manager.set_fixpoint(level >= 2);
+    return manager;
+}
+
+/**
+ * @brief Adds a pass to the end of the list.
+ * @param pass The pass.
+ */
+void PassManager::add_pass(std::unique_ptr<OptimizationPass> pass) {
+    statistics_.push_back({pass->name(), 0, 0, {}, 0});
+    passes_.push_back(std::move(pass));
+}
+
+/**
+ * @brief Sets whether run() repeats the passes until none of them changes
+ * the tree, rather than running each of them once.
+ * @param fixpoint Whether to repeat the passes.
+ */
+void PassManager::set_fixpoint(bool fixpoint) {
+    fixpoint_ = fixpoint;
+}
+
+/**
+ * @brief Makes run() check that the optimized tree evaluates exactly like the
+ * original (see verify_optimization()).
+ * @param trials The number of random bindings to check, or 0 not to check.
+ */
+void PassManager::set_verify_trials(unsigned trials) {
+    verify_trials_ = trials;
+}
+
+/**
+ * @brief Runs the passes on a tree, timing each of them and counting the
+ * nodes it adds or removes.
+ * @param root The root of the tree, replaced by the optimized tree.
+ */
+void PassManager::run(std::unique_ptr<Node>& root) {
+    if (!root) {
+        throw ASTException("tree is empty");
+    }
+    std::unique_ptr<Node> original;
+    if (verify_trials_ > 0) {
+        original = copy_tree(*root);
+    }
+
+    nodes_before_ = count_nodes(*root);
+    std::size_t node_count = nodes_before_;
+    rounds_ = 0;
+    bool changed = true;
+    while (changed && (rounds_ == 0 || fixpoint_) &&
+           rounds_ < max_fixpoint_rounds) {
+        changed = false;
+        ++rounds_;
+        for (std::size_t index = 0; index < passes_.size(); ++index) {
+            PassStatistics& statistics = statistics_[index];
+            const auto start = std::chrono::steady_clock::now();
+            const bool pass_changed = passes_[index]->run(root);
+            statistics.time += std::chrono::steady_clock::now() - start;
+            ++statistics.runs;
+            if (pass_changed) {
+                const std::size_t new_count = count_nodes(*root);
+                statistics.node_delta += static_cast<int64_t>(new_count) -
+                                         static_cast<int64_t>(node_count);
+                node_count = new_count;
+                ++statistics.changed_runs;
+                changed = true;
+            }
+        }
+    }
+    nodes_after_ = node_count;
+
+    if (original) {
+        verify_optimization(*original, *root, verify_trials_);
+    }
+}
+
+// Getter for statistics_, which add up over all runs.
+const std::vector<PassStatistics>& PassManager::statistics() const {
+    return statistics_;
+}
+
+/**
+ * @brief Writes a table of the statistics of each pass, and a summary of the
+ * last run.
+ * @param output_stream The stream to write to.
+ */
+void PassManager::write_statistics(std::ostream& output_stream) const {
+    output_stream << std::left << std::setw(14) << "pass" << std::right
+                  << std::setw(6) << "runs" << std::setw(9) << "changed"
+                  << std::setw(12) << "time (ms)" << std::setw(12) << "nodes"
+                  << '\n';
+    for (const PassStatistics& statistics : statistics_) {
+        const double milliseconds =
+            std::chrono::duration<double, std::milli>(statistics.time)
+                .count();
+        output_stream << std::left << std::setw(14) << statistics.name
+                      << std::right << std::setw(6) << statistics.runs
+                      << std::setw(9) << statistics.changed_runs
+                      << std::setw(12) << std::fixed << std::setprecision(3)
+                      << milliseconds << std::setw(12) << std::showpos
+                      << statistics.node_delta << std::noshowpos << '\n';
+    }
+    output_stream << "total: " << rounds_
+                  << (rounds_ == 1 ? " round, " : " rounds, ") << nodes_before_
+                  << " -> " << nodes_after_ << " nodes\n";
+}
+
+// MARK: Functions
+/**
+ * @brief Counts the nodes of a tree.
+ * @param root The root of the tree.
+ * @return The number of nodes.
+ */
+std::size_t count_nodes(const Node& root) {
+    if (!is_operator(root)) {
+        return 1;
+    }
+    return 1 + count_nodes(*root.left) + count_nodes(*root.right);
+}
+
+/**
+ * @brief Makes a copy of a tree.
+ * @param root The root of the tree.
+ * @return The root of the copy.
+ */
+std::unique_ptr<Node> copy_tree(const Node& root) {
+    if (root.type == NodeType::Number) {
+        return std::make_unique<Node>(root.value);
+    }
+    if (root.type == NodeType::Variable) {
+        return std::make_unique<Node>(root.variable_name);
+    }
+    return std::make_unique<Node>(root.type, copy_tree(*root.left),
+                                  copy_tree(*root.right));
+}
+
+/**
+ * @brief Checks that an optimized tree evaluates exactly like the original,
+ * to the same value or the same error, with random bindings of the original's
+ * variables. The values are drawn from small numbers, the extremes of
+ * int64_t and random 64-bit numbers, so overflow is tried too, and now and
+ * then a variable is left unbound.
+ * @param original The tree before optimizing.
+ * @param optimized The tree after optimizing.
+ * @param trials The number of random bindings to check.
+ */
+void verify_optimization(const Node& original, const Node& optimized,
+                         unsigned trials) {
+    std::set<std::string> names;
+    collect_variable_names(original, names);
+
+    // A fixed seed, so that a failure can be reproduced.
+    std::mt19937_64 random(0x5eed);
+    VariableBindings bindings;
+    for (unsigned trial = 0; trial < trials; ++trial) {
+        bindings.clear();
+        for (const std::string& name : names) {
+            switch (random() % 8) {
+            case 0:
+                continue; // Unbound.
+            case 1:
+                bindings[name] = std::numeric_limits<int64_t>::min();
+                break;
+            case 2:
+                bindings[name] = std::numeric_limits<int64_t>::max();
+                break;
+            case 3:
+            case 4:
+                bindings[name] = static_cast<int64_t>(random());
+                break;
+            default:
+                bindings[name] = static_cast<int64_t>(random() % 7) - 3;
+                break;
+            }
+        }
+
+        int64_t expected = 0;
+        int64_t actual = 0;
+        std::string expected_error;
+        std::string actual_error;
+        const bool expected_ok = evaluate_reporting_error(
+            original, bindings, expected, expected_error);
+        const bool actual_ok =
+            evaluate_reporting_error(optimized, bindings, actual, actual_error);
+        if (expected_ok != actual_ok ||
+            (expected_ok ? expected != actual
+                         : expected_error != actual_error)) {
+            throw ASTException(
+                "optimized tree evaluates to " +
+                describe_outcome(actual_ok, actual, actual_error) +
+                " instead of " +
+                describe_outcome(expected_ok, expected, expected_error));
+        }
+    }
+}
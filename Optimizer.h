@@ -0,0 +1,77 @@
+#pragma once
+#include "AST.h"
+
+#include <chrono>
+#include <cstddef>
+#include <cstdint>
+#include <iosfwd>
+#include <memory>
+#include <string>
+#include <string_view>
+#include <vector>
+
+// The optimizer that runs between parsing a tree and writing it out. A
+// PassManager runs a list of passes, each a tree-to-tree transform, and can
+// repeat the list until none of them changes the tree any more:
+//
+//     PassManager manager = PassManager::for_level(2);
+//     std::unique_ptr<Node> root = ast.release_root();
+//     manager.run(root);
+//     ast.set_root(std::move(root));
+//
+// Every pass keeps the value of the tree and its errors exactly as they
+// were, for any bindings, with operands evaluated in the order every
+// evaluator follows (see AST.h). So a subtree is only rewritten if that
+// can't hide, move or add an error.
+
+// A tree-to-tree transform.
+class OptimizationPass {
+  public:
+    virtual ~OptimizationPass() = default;
+
+    virtual const char* name() const = 0;
+    // Rewrites the tree in place. Returns whether anything changed.
+    virtual bool run(std::unique_ptr<Node>& root) = 0;
+};
+
+std::unique_ptr<OptimizationPass> create_pass(std::string_view name);
+std::vector<std::string_view> pass_names();
+
+// What the pass manager measured for one pass, over all of its runs.
+struct PassStatistics {
+    std::string name;
+    unsigned runs = 0;
+    unsigned changed_runs = 0; // The runs that changed the tree.
+    std::chrono::nanoseconds time{0};
+    int64_t node_delta = 0; // Negative if nodes were removed.
+};
+
+class PassManager {
+  public:
+    static PassManager for_level(unsigned level);
+
+    void add_pass(std::unique_ptr<OptimizationPass> pass);
+    void set_fixpoint(bool fixpoint);
+    void set_verify_trials(unsigned trials);
+    void run(std::unique_ptr<Node>& root);
+
+    const std::vector<PassStatistics>& statistics() const;
+    void write_statistics(std::ostream& output_stream) const;
+
+  private:
+    std::vector<std::unique_ptr<OptimizationPass>> passes_;
+    std::vector<PassStatistics> statistics_;
+    // Whether to repeat the passes until none of them changes the tree.
+    bool fixpoint_ = false;
+    // The random bindings to check the optimized tree on, if any.
+    unsigned verify_trials_ = 0;
+    // Of the last run.
+    unsigned rounds_ = 0;
+    std::size_t nodes_before_ = 0;
+    std::size_t nodes_after_ = 0;
+};
+
+std::size_t count_nodes(const Node& root);
+std::unique_ptr<Node> copy_tree(const Node& root);
+void verify_optimization(const Node& original, const Node& optimized,
+                         unsigned trials);
@@ -0,0 +1,208 @@
+#include "ResultCache.h"
+
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+#include <mutex>
+#include <utility>
+#include <vector>
+
+// MARK: namespace
+namespace {
+
+/**
+ * @brief Recursively copies the subtree rooted at the given node.
+ * @param node The root of the subtree to copy.
+ * @return The copy.
+ */
+std::unique_ptr<Node> copy_tree(const Node& node) {
+    if (node.type == NodeType::Number) {
+        return std::make_unique<Node>(node.value);
+    }
+    if (node.type == NodeType::Variable) {
+        return std::make_unique<Node>(node.variable_name);
+    }
+    if (!node.left || !node.right) {
+        throw ASTException("malformed AST");
+    }
+    return std::make_unique<Node>(node.type, copy_tree(*node.left),
+                                  copy_tree(*node.right));
+}
+
+/**
+ * @brief Recursively checks whether two subtrees have the same structure,
+ * leaves included.
+ * @return true if the subtrees are the same.
+ */
+bool same_tree(const Node& first, const Node& second) {
+    if (first.type != second.type) {
+        return false;
+    }
+    if (first.type == NodeType::Number) {
+        return first.value == second.value;
+    }
+    if (first.type == NodeType::Variable) {
+        return first.variable_name == second.variable_name;
+    }
+    return same_tree(*first.left, *second.left) &&
+           same_tree(*first.right, *second.right);
+}
+
+} // namespace
+
+// MARK: ResultCache
+/**
+ * @brief Constructs an empty cache that holds at most the given number of
+ * results.
+ * @param capacity The maximum number of results to keep. A capacity of 0
+ * disables caching.
+ */
+ResultCache::ResultCache(std::size_t capacity) : capacity_(capacity) {}
+
+/**
+ * @brief Compares two cache keys. Keys of the same prepared formula share
+ * their tree, so only keys of different formulas compare trees node by node.
+ * @param other The key to compare with.
+ * @return true if the keys have the same tree and the same values.
+ */
+bool ResultCache::Key::operator==(const Key& other) const {
+    return tree_hash == other.tree_hash && values == other.values &&
+           (tree == other.tree || same_tree(*tree, *other.tree));
+}
+
+/**
+ * @brief Hashes a cache key by combining the tree hash with every bound value.
+ * @param key The key to hash.
+ * @return The hash of the key.
+ */
+std::size_t ResultCache::KeyHash::operator()(const Key& key) const {
+    uint64_t hash = key.tree_hash;
+    for (const int64_t value : key.values) {
+        hash ^= static_cast<uint64_t>(value) + 0x9e3779b97f4a7c15ULL +
+                (hash << 6) + (hash >> 2);
+    }
+    return static_cast<std::size_t>(hash);
+}
+
+/**
+ * @brief Prepares a formula for cached evaluation by copying its tree,
+ * computing its structural hash and collecting the variables it references.
+ * @param ast The AST to prepare. It isn't referenced after this returns.
+ * @return The prepared formula.
+ */
+CachedFormula ResultCache::prepare(const AST& ast) const {
+    if (ast.root() == nullptr) {
+        throw ASTException("tree is empty");
+    }
+    return {copy_tree(*ast.root()), ast.structural_hash(), ast.variables()};
+}
+
+/**
+ * @brief Evaluates a prepared formula, returning the cached result if the
+ * same tree (from this formula or any other) was already evaluated with the
+ * same values for its variables.
+ *
+ * Only successful evaluations are cached. If evaluation throws (e.g. on
+ * overflow or a missing variable), the exception is passed on to the caller
+ * and nothing is stored.
+ * @param formula The prepared formula to evaluate.
+ * @param bindings The values to substitute for variables. Bindings for
+ * variables that the tree doesn't reference don't affect the cache key.
+ * @return The result of evaluating the formula.
+ */
+int64_t ResultCache::evaluate(const CachedFormula& formula,
+                              const VariableBindings& bindings) {
+    // Build the key from only the values of the variables the tree uses.
+    Key key{formula.tree_hash, formula.tree, {}};
+    key.values.reserve(formula.variables.size());
+    for (const std::string& name : formula.variables) {
+        const auto variable_it = bindings.find(name);
+        if (variable_it == bindings.end()) {
+            // Let the evaluator report the missing variable.
+            misses_.fetch_add(1, std::memory_order_relaxed);
+            return formula.tree->get_value(bindings);
+        }
+        key.values.push_back(variable_it->second);
+    }
+
+    {
+        const std::lock_guard<std::mutex> lock(mutex_);
+        if (const auto index_it = index_.find(key); index_it != index_.end()) {
+            // Move the entry to the front, since it was just used.
+            entries_.splice(entries_.begin(), entries_, index_it->second);
+            hits_.fetch_add(1, std::memory_order_relaxed);
+            return index_it->second->result;
+        }
+    }
+    misses_.fetch_add(1, std::memory_order_relaxed);
+
+    // Evaluate without holding the lock so other threads aren't blocked.
+    const int64_t result = formula.tree->get_value(bindings);
+
+    const std::lock_guard<std::mutex> lock(mutex_);
+    if (capacity_ == 0 || index_.contains(key)) {
+        // Either caching is disabled, or another thread got here first.
+        return result;
+    }
+    entries_.push_front({key, result});
+    index_.emplace(std::move(key), entries_.begin());
+    evict_to_capacity();
+    return result;
+}
+
+/**
+ * @brief Convenience overload that prepares the AST and evaluates it. Prefer
+ * prepare() + evaluate() when the same AST is evaluated many times, since
+ * preparing copies the whole tree.
+ * @param ast The AST to evaluate.
+ * @param bindings The values to substitute for variables.
+ * @return The result of evaluating the AST.
+ */
+int64_t ResultCache::evaluate(const AST& ast,
+                              const VariableBindings& bindings) {
+    return evaluate(prepare(ast), bindings);
+}
+
+/**
+ * @brief Changes the maximum number of results to keep, evicting the least
+ * recently used results if the cache is now over capacity.
+ * @param capacity The new capacity.
+ */
+void ResultCache::set_capacity(std::size_t capacity) {
+    const std::lock_guard<std::mutex> lock(mutex_);
+    capacity_ = capacity;
+    evict_to_capacity();
+}
+
+/**
+ * @brief Removes all cached results. The hit/miss counters are kept.
+ */
+void ResultCache::clear() {
+    const std::lock_guard<std::mutex> lock(mutex_);
+    entries_.clear();
+    index_.clear();
+}
+
+/**
+ * @brief Returns a snapshot of the cache's counters.
+ * @return The current hit, miss and eviction counts, and the cache's size.
+ */
+ResultCacheStats ResultCache::stats() const {
+    const std::lock_guard<std::mutex> lock(mutex_);
+    return {hits_.load(std::memory_order_relaxed),
+            misses_.load(std::memory_order_relaxed),
+            evictions_.load(std::memory_order_relaxed), entries_.size(),
+            capacity_};
+}
+
+/**
+ * @brief Drops least recently used entries until the cache fits its capacity.
+ * The caller must hold mutex_.
+ */
+void ResultCache::evict_to_capacity() {
+    while (entries_.size() > capacity_) {
+        index_.erase(entries_.back().key);
+        entries_.pop_back();
+        evictions_.fetch_add(1, std::memory_order_relaxed);
+    }
+}
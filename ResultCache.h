@@ -0,0 +1,81 @@
+#pragma once
+#include "AST.h"
+
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <list>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+// A formula that has been prepared for cached evaluation. Holds a copy of
+// the tree, its structural hash and the variables it references, so they're
+// only computed once per formula instead of once per evaluation. The copy is
+// what gets evaluated, so changing the AST afterwards doesn't affect it.
+struct CachedFormula {
+    std::shared_ptr<const Node> tree;
+    uint64_t tree_hash;
+    std::vector<std::string> variables;
+};
+
+// Counters describing how well the cache is doing.
+struct ResultCacheStats {
+    uint64_t hits;
+    uint64_t misses;
+    uint64_t evictions;
+    std::size_t size;
+    std::size_t capacity;
+};
+
+// In-process LRU cache of evaluation results, keyed by the tree's structure
+// plus the values bound to the variables that the tree references. Formulas
+// prepared from different ASTs share results when their trees are the same.
+// Safe to use from several threads at once.
+class ResultCache {
+  public:
+    explicit ResultCache(std::size_t capacity = 4096);
+
+    CachedFormula prepare(const AST& ast) const;
+    int64_t evaluate(const CachedFormula& formula,
+                     const VariableBindings& bindings);
+    int64_t evaluate(const AST& ast, const VariableBindings& bindings);
+
+    void set_capacity(std::size_t capacity);
+    void clear();
+    ResultCacheStats stats() const;
+
+  private:
+    // The hash only picks the bucket: keys are equal only if their trees
+    // are, so trees whose hashes collide never share a result.
+    struct Key {
+        uint64_t tree_hash;
+        std::shared_ptr<const Node> tree;
+        std::vector<int64_t> values;
+
+        bool operator==(const Key& other) const;
+    };
+
+    struct KeyHash {
+        std::size_t operator()(const Key& key) const;
+    };
+
+    struct Entry {
+        Key key;
+        int64_t result;
+    };
+
+    void evict_to_capacity();
+
+    mutable std::mutex mutex_;
+    std::size_t capacity_;
+    // Most recently used entries are at the front.
+    std::list<Entry> entries_;
+    std::unordered_map<Key, std::list<Entry>::iterator, KeyHash> index_;
+
+    std::atomic<uint64_t> hits_{0};
+    std::atomic<uint64_t> misses_{0};
+    std::atomic<uint64_t> evictions_{0};
+};
@@ -0,0 +1,234 @@
+#include "ResumableEvaluation.h"
+#include "CheckedArithmetic.h"
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <exception>
+#include <optional>
+#include <vector>
+
+// MARK: namespace
+namespace {
+
+// The clock, the cancellation token and the deadline are only checked every
+// this many steps, which keeps their cost out of the walk. A step takes a
+// few nanoseconds, so a slice overruns its time budget by microseconds at
+// most.
+constexpr uint64_t check_interval = 256;
+
+} // namespace
+
+// MARK: CancellationToken
+void CancellationToken::cancel() {
+    cancelled_.store(true, std::memory_order_relaxed);
+}
+
+bool CancellationToken::cancelled() const {
+    return cancelled_.load(std::memory_order_relaxed);
+}
+
+// MARK: ResumableEvaluation
+/**
+ * @brief Prepares to evaluate the tree of an AST under its limits.
+ * @param ast The AST. Its tree must outlive the evaluation.
+ * @param bindings The values to substitute for variables. Must outlive the
+ * evaluation.
+ */
+ResumableEvaluation::ResumableEvaluation(const AST& ast,
+                                         const VariableBindings& bindings)
+    : ResumableEvaluation(ast.root(), bindings,
+                          ast.limits().max_eval_operations) {}
+
+/**
+ * @brief Prepares to evaluate a tree. Nothing is evaluated until run().
+ * @param root The root of the tree. The tree must outlive the evaluation.
+ * @param bindings The values to substitute for variables. Must outlive the
+ * evaluation.
+ * @param max_eval_operations The most operators that evaluating the tree
+ * may apply, or 0 for no limit (see ASTLimits).
+ */
+ResumableEvaluation::ResumableEvaluation(const Node* root,
+                                         const VariableBindings& bindings,
+                                         uint64_t max_eval_operations)
+    : bindings_(bindings), max_eval_operations_(max_eval_operations),
+      counting_(max_eval_operations != 0) {
+    if (root == nullptr) {
+        throw ASTException("tree is empty");
+    }
+    if (counting_) {
+        pending_.push_back(root);
+    }
+    frames_.push_back({root, false});
+}
+
+// Makes run() stop with Cancelled once the token is set.
+void ResumableEvaluation::set_cancellation_token(
+    const CancellationToken* token) {
+    cancellation_token_ = token;
+}
+
+// Makes run() stop with DeadlineExceeded once the deadline has passed.
+void ResumableEvaluation::set_deadline(
+    std::chrono::steady_clock::time_point deadline) {
+    deadline_ = deadline;
+}
+
+/**
+ * @brief Continues the evaluation until it finishes or the budget of this
+ * call runs out. Once the evaluation has stopped for good, every further
+ * call returns the same status (or throws the same error).
+ * @param budget The most work to do in this call.
+ * @return Whether the evaluation finished, stopped, or can be resumed.
+ */
+EvaluationStatus ResumableEvaluation::run(const EvaluationBudget& budget) {
+    if (error_) {
+        std::rethrow_exception(error_);
+    }
+    if (status_ != EvaluationStatus::Suspended) {
+        return status_;
+    }
+
+    using Clock = std::chrono::steady_clock;
+    const bool timed = budget.max_time.count() > 0 || deadline_;
+    const Clock::time_point start = timed ? Clock::now() : Clock::time_point();
+    uint64_t slice_operations = 0;
+    for (;;) {
+        if (cancellation_token_ != nullptr &&
+            cancellation_token_->cancelled()) {
+            status_ = EvaluationStatus::Cancelled;
+            return status_;
+        }
+        if (timed) {
+            const Clock::time_point now =
+                slice_operations == 0 ? start : Clock::now();
+            if (deadline_ && now >= *deadline_) {
+                status_ = EvaluationStatus::DeadlineExceeded;
+                return status_;
+            }
+            if (budget.max_time.count() > 0 && slice_operations > 0 &&
+                now - start >= budget.max_time) {
+                return status_;
+            }
+        }
+        if (budget.max_operations != 0 &&
+            slice_operations >= budget.max_operations) {
+            return status_;
+        }
+
+        uint64_t burst = check_interval;
+        if (budget.max_operations != 0) {
+            burst = std::min(burst, budget.max_operations - slice_operations);
+        }
+        try {
+            for (uint64_t index = 0; index < burst; ++index) {
+                if (!step()) {
+                    status_ = EvaluationStatus::Done;
+                    return status_;
+                }
+            }
+        } catch (...) {
+            error_ = std::current_exception();
+            status_ = EvaluationStatus::Done;
+            throw;
+        }
+        slice_operations += burst;
+    }
+}
+
+EvaluationStatus ResumableEvaluation::status() const { return status_; }
+
+/**
+ * @brief Returns the value of the tree. Throws if the evaluation failed or
+ * hasn't finished.
+ */
+int64_t ResumableEvaluation::result() const {
+    if (error_) {
+        std::rethrow_exception(error_);
+    }
+    if (status_ != EvaluationStatus::Done) {
+        throw ASTException("evaluation has not finished");
+    }
+    return values_.back();
+}
+
+/**
+ * @brief Returns the number of steps of the walk so far, over all calls to
+ * run(): one per leaf and two per operator, plus one per node for counting
+ * the operators if there's an operation limit.
+ */
+uint64_t ResumableEvaluation::operations() const { return operations_; }
+
+/**
+ * @brief Does one step of the walk.
+ * @return false if the evaluation is done, true otherwise.
+ */
+bool ResumableEvaluation::step() {
+    ++operations_;
+    return counting_ ? count_step() : evaluate_step();
+}
+
+/**
+ * @brief Counts the operators of one node, like check_eval_operations() in
+ * AST.cpp, and throws once there are more than the limit.
+ * @return false if the evaluation is done, true otherwise.
+ */
+bool ResumableEvaluation::count_step() {
+    const Node* node = pending_.back();
+    pending_.pop_back();
+    if (node->left && node->right) {
+        if (++operator_count_ > max_eval_operations_) {
+            throw ASTException("evaluation exceeds the operation limit");
+        }
+        pending_.push_back(node->left.get());
+        pending_.push_back(node->right.get());
+    }
+    if (pending_.empty()) {
+        counting_ = false;
+        pending_.shrink_to_fit();
+    }
+    return true;
+}
+
+/**
+ * @brief Evaluates a leaf, descends into the operands of an operator, or
+ * applies an operator to its evaluated operands, like
+ * Node::get_value(bindings).
+ * @return false if the evaluation is done, true otherwise.
+ */
+bool ResumableEvaluation::evaluate_step() {
+    Frame& frame = frames_.back();
+    const Node* node = frame.node;
+    if (node->type == NodeType::Number) {
+        values_.push_back(node->value);
+    } else if (node->type == NodeType::Variable) {
+        const auto variable_it = bindings_.find(node->variable_name);
+        if (variable_it == bindings_.end()) {
+            throw ASTException("missing variable value: " +
+                               node->variable_name);
+        }
+        values_.push_back(variable_it->second);
+    } else if (!node->left || !node->right) {
+        throw ASTException("malformed AST");
+    } else if (!frame.operands_done) {
+        // The right operand goes on top, so it's evaluated first.
+        frame.operands_done = true;
+        frames_.push_back({node->left.get(), false});
+        frames_.push_back({node->right.get(), false});
+        return true;
+    } else {
+        // The left operand was evaluated last, so its value is on top.
+        const int64_t left = values_.back();
+        values_.pop_back();
+        int64_t& right = values_.back();
+        int64_t result = 0;
+        if (const char* error =
+                try_checked_operation(node->type, left, right, result)) {
+            throw ASTException(error);
+        }
+        right = result;
+    }
+    frames_.pop_back();
+    return !frames_.empty();
+}
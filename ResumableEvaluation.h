@@ -0,0 +1,95 @@
+#pragma once
+#include "AST.h"
+
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <exception>
+#include <optional>
+#include <vector>
+
+// An evaluation of a tree that runs in slices, for threads that can't block
+// on one large tree, like an event loop. Each call to run() does a bounded
+// amount of work and returns; the next call picks up where it stopped. The
+// walk keeps its state on an explicit stack rather than the call stack, so
+// it can stop after any node:
+//
+//     ResumableEvaluation evaluation(ast, bindings);
+//     evaluation.set_deadline(std::chrono::steady_clock::now() + 50ms);
+//     while (evaluation.run({.max_time = 200us}) ==
+//            EvaluationStatus::Suspended) {
+//         serve_other_requests();
+//     }
+//
+// The value and error are the same as AST::evaluate(): operands are
+// evaluated in the order defined in AST.h, and the first error found is
+// thrown. The tree and
+// the bindings must not change or go away while the evaluation is used.
+
+// Where an evaluation stands after a call to run().
+enum class EvaluationStatus {
+    Suspended,        // The slice's budget ran out; call run() again.
+    Done,             // result() gives the value, or throws the error.
+    Cancelled,        // The cancellation token was set.
+    DeadlineExceeded, // The deadline passed before the evaluation finished.
+};
+
+// How much work one call to run() may do. A limit of 0 means no limit.
+struct EvaluationBudget {
+    uint64_t max_operations = 0; // Steps of the walk (see operations()).
+    std::chrono::nanoseconds max_time{0};
+};
+
+// Asks evaluations to stop, e.g. from another thread when the request they
+// serve goes away.
+class CancellationToken {
+  public:
+    void cancel();
+    bool cancelled() const;
+
+  private:
+    std::atomic<bool> cancelled_{false};
+};
+
+class ResumableEvaluation {
+  public:
+    ResumableEvaluation(const AST& ast, const VariableBindings& bindings);
+    ResumableEvaluation(const Node* root, const VariableBindings& bindings,
+                        uint64_t max_eval_operations = 0);
+
+    void set_cancellation_token(const CancellationToken* token);
+    void set_deadline(std::chrono::steady_clock::time_point deadline);
+
+    EvaluationStatus run(const EvaluationBudget& budget = {});
+    EvaluationStatus status() const;
+    int64_t result() const;
+    uint64_t operations() const;
+
+  private:
+    // A node on the walk, and whether its operands have been evaluated.
+    struct Frame {
+        const Node* node;
+        bool operands_done;
+    };
+
+    bool step();
+    bool count_step();
+    bool evaluate_step();
+
+    const VariableBindings& bindings_;
+    uint64_t max_eval_operations_;
+    const CancellationToken* cancellation_token_ = nullptr;
+    std::optional<std::chrono::steady_clock::time_point> deadline_;
+
+    // With an operation limit, the operators are counted first, like
+    // AST::evaluate() does, before anything is evaluated.
+    bool counting_;
+    std::vector<const Node*> pending_;
+    uint64_t operator_count_ = 0;
+
+    std::vector<Frame> frames_;
+    std::vector<int64_t> values_;
+    uint64_t operations_ = 0;
+    EvaluationStatus status_ = EvaluationStatus::Suspended;
+    std::exception_ptr error_;
+};
@@ -0,0 +1,363 @@
+#include "ShapedFormula.h"
+
+#include <algorithm>
+#include <bit>
+#include <cstddef>
+#include <cstdint>
+#include <limits>
+#include <memory>
+#include <string>
+#include <unordered_map>
+#include <utility>
+#include <vector>
+
+// MARK: namespace
+namespace {
+
+constexpr uint64_t max_int64 =
+    static_cast<uint64_t>(std::numeric_limits<int64_t>::max());
+
+// The magnitude of a value, which for INT64_MIN doesn't fit in an int64_t.
+uint64_t magnitude(int64_t value) {
+    return value < 0 ? 0 - static_cast<uint64_t>(value)
+                     : static_cast<uint64_t>(value);
+}
+
+// Negates a value with wrapping, like the kernel's arithmetic.
+int64_t wrapping_negate(int64_t value) {
+    return static_cast<int64_t>(0 - static_cast<uint64_t>(value));
+}
+
+/**
+ * @brief Returns the most significant bits that the values of a linear form
+ * may have for its kernel's result to be exact.
+ *
+ * A value with w significant bits (counting the bits of |v| - 1 for a
+ * negative v, see linear_kernel()) has a magnitude of at most 2^w. If that
+ * holds for all values, every product and every partial sum that evaluating
+ * the tree computes is at most
+ *     term_count * max_coefficient * 2^w + constant_magnitude,
+ * in any order and with any signs. If that fits in an int64_t, nothing the
+ * tree computes overflows, and the wrapped sum is the exact result.
+ * @param term_count The number of terms with a variable.
+ * @param max_coefficient The largest magnitude of their coefficients.
+ * @param constant_magnitude The sum of the magnitudes of the numbers.
+ * @return The most bits, or -1 if the result can never be shown exact.
+ */
+int bound_value_bits(std::size_t term_count, uint64_t max_coefficient,
+                     uint64_t constant_magnitude) {
+    if (constant_magnitude > max_int64) {
+        return -1;
+    }
+    uint64_t scale = 0;
+    if (__builtin_mul_overflow(static_cast<uint64_t>(term_count),
+                               max_coefficient, &scale)) {
+        return -1;
+    }
+    if (scale == 0) {
+        return std::numeric_limits<uint64_t>::digits;
+    }
+    const uint64_t limit = (max_int64 - constant_magnitude) / scale;
+    return static_cast<int>(std::bit_width(limit)) - 1;
+}
+
+/**
+ * @brief The kernel of a linear form: constant + the dot product of the
+ * coefficients with the values, in wrapping arithmetic.
+ * @tparam Contiguous Whether the values are consecutive, so they're read
+ * directly instead of through the slots.
+ * @param coefficients The coefficients.
+ * @param slots The slot of each coefficient's variable, if not Contiguous.
+ * @param count The number of coefficients.
+ * @param values The values of the slots, or of the terms if Contiguous.
+ * @param constant The constant.
+ * @param max_value_bits See bound_value_bits().
+ * @param result Receives the wrapped result.
+ * @return Whether the result is exact.
+ */
+template <bool Contiguous>
+bool linear_kernel(const int64_t* coefficients, const uint32_t* slots,
+                   std::size_t count, const int64_t* values, int64_t constant,
+                   int max_value_bits, int64_t& result) {
+    auto sum = static_cast<uint64_t>(constant);
+    uint64_t magnitudes = 0;
+    for (std::size_t index = 0; index < count; ++index) {
+        const int64_t value = Contiguous ? values[index] : values[slots[index]];
+        sum += static_cast<uint64_t>(coefficients[index]) *
+               static_cast<uint64_t>(value);
+        // |value| for positive values, |value| - 1 for negative ones.
+        magnitudes |= static_cast<uint64_t>(value ^ (value >> 63));
+    }
+    result = static_cast<int64_t>(sum);
+    return static_cast<int>(std::bit_width(magnitudes)) <= max_value_bits;
+}
+
+} // namespace
+
+/**
+ * @brief Returns the name of a shape, for reports.
+ */
+const char* shape_name(FormulaShape shape) {
+    switch (shape) {
+    case FormulaShape::General:
+        return "general";
+    case FormulaShape::Linear:
+        return "linear";
+    case FormulaShape::Ratio:
+        return "ratio";
+    }
+    return "unknown";
+}
+
+// MARK: ShapedFormula
+/**
+ * @brief Recognizes the shape of the tree of an AST.
+ * @param ast The AST. It isn't referenced after construction.
+ */
+ShapedFormula::ShapedFormula(const AST& ast) : ShapedFormula(ast.root()) {}
+
+/**
+ * @brief Recognizes the shape of a tree, and prepares its kernel.
+ * @param root The root of the tree. It isn't referenced after construction.
+ */
+ShapedFormula::ShapedFormula(const Node* root) : flat_(root) {
+    SlotMap slots;
+    for (const std::string& name : flat_.variables()) {
+        slots.try_emplace(name, static_cast<uint32_t>(slots.size()));
+    }
+
+    if (recognize_linear(root, slots, numerator_)) {
+        shape_ = FormulaShape::Linear;
+        return;
+    }
+    numerator_ = {};
+    if (root->type == NodeType::Div && root->left && root->right &&
+        recognize_linear(root->left.get(), slots, numerator_) &&
+        recognize_linear(root->right.get(), slots, denominator_)) {
+        shape_ = FormulaShape::Ratio;
+        return;
+    }
+    numerator_ = {};
+    denominator_ = {};
+}
+
+FormulaShape ShapedFormula::shape() const { return shape_; }
+
+// The names of the variables, indexed by slot.
+const std::vector<std::string>& ShapedFormula::variables() const {
+    return flat_.variables();
+}
+
+/**
+ * @brief Evaluates the formula, substituting the bound values for
+ * variables.
+ * @param bindings The values to substitute for variables.
+ * @return The result of evaluating the formula.
+ */
+int64_t ShapedFormula::evaluate(const VariableBindings& bindings) const {
+    const std::vector<std::string>& names = flat_.variables();
+    const auto slot_values = std::make_unique<int64_t[]>(names.size());
+    const auto bound = std::make_unique<bool[]>(names.size());
+    for (std::size_t slot = 0; slot < names.size(); ++slot) {
+        if (const auto variable_it = bindings.find(names[slot]);
+            variable_it != bindings.end()) {
+            slot_values[slot] = variable_it->second;
+            bound[slot] = true;
+        }
+    }
+    return evaluate_slots(slot_values.get(), bound.get());
+}
+
+/**
+ * @brief Evaluates the formula with the values of its variables given by
+ * slot, like FlatTree::evaluate_slots().
+ * @param slot_values The value of each slot, or nullptr if there are no
+ * bindings at all.
+ * @param bound Whether each slot has a value, or nullptr if they all do.
+ * @return The result of evaluating the formula.
+ */
+int64_t ShapedFormula::evaluate_slots(const int64_t* slot_values,
+                                      const bool* bound) const {
+    int64_t result = 0;
+    if ((slot_values != nullptr || flat_.variables().empty()) &&
+        !has_unbound_slot(bound) && evaluate_kernel(slot_values, result)) {
+        return result;
+    }
+    return flat_.evaluate_slots(slot_values, bound);
+}
+
+/**
+ * @brief Evaluates the formula once per row with its kernel, leaving the
+ * rows that the kernel can't evaluate exactly to the caller, which must
+ * evaluate them with evaluate_slots() to get their value or error. For a
+ * General formula, that's every row.
+ * @param slot_values row_count rows of one value per slot, row after row.
+ * May be nullptr if there are no slots.
+ * @param row_count The number of rows.
+ * @param results Receives the result of each row that the kernel
+ * evaluated, and 0 for the others.
+ * @param unresolved Receives whether each row is left to the caller.
+ * @return The number of rows left to the caller.
+ */
+std::size_t ShapedFormula::evaluate_rows(const int64_t* slot_values,
+                                         std::size_t row_count,
+                                         int64_t* results,
+                                         bool* unresolved) const {
+    const std::size_t slot_count = flat_.variables().size();
+    std::size_t unresolved_count = 0;
+    for (std::size_t row = 0; row < row_count; ++row) {
+        const int64_t* row_values =
+            slot_count == 0 ? nullptr : slot_values + row * slot_count;
+        const bool exact = evaluate_kernel(row_values, results[row]);
+        if (!exact) {
+            results[row] = 0;
+            ++unresolved_count;
+        }
+        unresolved[row] = !exact;
+    }
+    return unresolved_count;
+}
+
+/**
+ * @brief Recognizes a linear form: a tree of + and - over numbers,
+ * variables and products of a number and a variable. The tree is walked
+ * with an explicit stack, so long sums don't overflow the call stack.
+ * @param root The root of the tree.
+ * @param slots The slot of each variable.
+ * @param form Receives the form, if the tree is one.
+ * @return Whether the tree is a linear form.
+ */
+bool ShapedFormula::recognize_linear(const Node* root, const SlotMap& slots,
+                                     LinearForm& form) {
+    // A subtree, and whether it's subtracted rather than added.
+    std::vector<std::pair<const Node*, bool>> pending{{root, false}};
+    uint64_t constant_magnitude = 0;
+    uint64_t max_coefficient = 0;
+    while (!pending.empty()) {
+        const auto [node, negated] = pending.back();
+        pending.pop_back();
+        if (node->type == NodeType::Add || node->type == NodeType::Sub) {
+            if (!node->left || !node->right) {
+                return false;
+            }
+            // The left operand's terms come first, in the order of the
+            // slots.
+            pending.emplace_back(node->right.get(),
+                                 negated != (node->type == NodeType::Sub));
+            pending.emplace_back(node->left.get(), negated);
+            continue;
+        }
+        if (node->type == NodeType::Number) {
+            form.constant = static_cast<int64_t>(
+                static_cast<uint64_t>(form.constant) +
+                static_cast<uint64_t>(negated ? wrapping_negate(node->value)
+                                              : node->value));
+            if (__builtin_add_overflow(constant_magnitude,
+                                       magnitude(node->value),
+                                       &constant_magnitude)) {
+                constant_magnitude = std::numeric_limits<uint64_t>::max();
+            }
+            continue;
+        }
+
+        const Node* variable = nullptr;
+        int64_t coefficient = 1;
+        if (node->type == NodeType::Variable) {
+            variable = node;
+        } else if (node->type == NodeType::Mult && node->left &&
+                   node->right) {
+            const Node* left = node->left.get();
+            const Node* right = node->right.get();
+            if (left->type == NodeType::Number &&
+                right->type == NodeType::Variable) {
+                coefficient = left->value;
+                variable = right;
+            } else if (left->type == NodeType::Variable &&
+                       right->type == NodeType::Number) {
+                coefficient = right->value;
+                variable = left;
+            }
+        }
+        if (variable == nullptr) {
+            return false;
+        }
+        if (negated) {
+            coefficient = wrapping_negate(coefficient);
+        }
+        form.coefficients.push_back(coefficient);
+        form.slots.push_back(slots.at(variable->variable_name));
+        max_coefficient = std::max(max_coefficient, magnitude(coefficient));
+    }
+
+    for (std::size_t index = 1; index < form.slots.size(); ++index) {
+        if (form.slots[index] != form.slots[0] + index) {
+            form.contiguous = false;
+        }
+    }
+    form.max_value_bits = bound_value_bits(
+        form.coefficients.size(), max_coefficient, constant_magnitude);
+    return true;
+}
+
+/**
+ * @brief Evaluates a linear form with its kernel.
+ * @param form The form.
+ * @param slot_values The value of each slot.
+ * @param result Receives the result.
+ * @return Whether the result is exact.
+ */
+bool ShapedFormula::evaluate_form(const LinearForm& form,
+                                  const int64_t* slot_values,
+                                  int64_t& result) {
+    const std::size_t count = form.coefficients.size();
+    if (count == 0) {
+        result = form.constant;
+        return form.max_value_bits >= 0;
+    }
+    if (form.contiguous) {
+        return linear_kernel<true>(form.coefficients.data(), nullptr, count,
+                                   slot_values + form.slots[0],
+                                   form.constant, form.max_value_bits,
+                                   result);
+    }
+    return linear_kernel<false>(form.coefficients.data(), form.slots.data(),
+                                count, slot_values, form.constant,
+                                form.max_value_bits, result);
+}
+
+/**
+ * @brief Evaluates the formula with the kernel of its shape.
+ * @param slot_values The value of each slot. All must be bound.
+ * @param result Receives the result, if it's exact.
+ * @return Whether the result is exact. If not, the FlatTree must evaluate
+ * the formula, to get its value or error.
+ */
+bool ShapedFormula::evaluate_kernel(const int64_t* slot_values,
+                                    int64_t& result) const {
+    if (shape_ == FormulaShape::Linear) {
+        return evaluate_form(numerator_, slot_values, result);
+    }
+    if (shape_ == FormulaShape::Ratio) {
+        int64_t numerator = 0;
+        int64_t denominator = 0;
+        // An exact numerator is less than 2^63 in magnitude, so dividing
+        // can't overflow; only dividing by zero is left to the FlatTree.
+        if (!evaluate_form(denominator_, slot_values, denominator) ||
+            !evaluate_form(numerator_, slot_values, numerator) ||
+            denominator == 0) {
+            return false;
+        }
+        result = numerator / denominator;
+        return true;
+    }
+    return false;
+}
+
+// Whether any slot is unbound, where nullptr means all are bound.
+bool ShapedFormula::has_unbound_slot(const bool* bound) const {
+    if (bound == nullptr) {
+        return false;
+    }
+    const std::size_t slot_count = flat_.variables().size();
+    return std::find(bound, bound + slot_count, false) != bound + slot_count;
+}
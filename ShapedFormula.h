@@ -0,0 +1,75 @@
+#pragma once
+#include "AST.h"
+#include "FlatTree.h"
+
+#include <cstddef>
+#include <cstdint>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+// A formula evaluated by a specialized kernel when its tree has one of the
+// common shapes, and by a FlatTree otherwise:
+//
+// - Linear: sums and differences of numbers, variables and number *
+//   variable products, e.g. 3*x - 2*y + z + 7. Evaluated as a constant plus
+//   a dot product of a coefficient array with the variables' values.
+// - Ratio: one linear form divided by another.
+//
+// A kernel computes in wrapping arithmetic, and bounds the magnitude of the
+// values with bit masks alongside. Only when the bound proves that no step
+// of the tree's own evaluation could overflow is the kernel's result used;
+// otherwise (and for unbound variables or division by zero) the FlatTree
+// evaluates the formula, so values and errors are always exactly those of
+// AST::evaluate(). The loops over the terms are plain integer arithmetic
+// over arrays, which the compiler can vectorize.
+//
+// Variable slots are those of the FlatTree (see FlatTree::variables()).
+
+enum class FormulaShape { General, Linear, Ratio };
+
+const char* shape_name(FormulaShape shape);
+
+class ShapedFormula {
+  public:
+    explicit ShapedFormula(const AST& ast);
+    explicit ShapedFormula(const Node* root);
+
+    FormulaShape shape() const;
+    const std::vector<std::string>& variables() const;
+
+    int64_t evaluate(const VariableBindings& bindings) const;
+    int64_t evaluate_slots(const int64_t* slot_values,
+                           const bool* bound = nullptr) const;
+    std::size_t evaluate_rows(const int64_t* slot_values,
+                              std::size_t row_count, int64_t* results,
+                              bool* unresolved) const;
+
+  private:
+    // constant + sum of coefficients[i] * (value of slots[i]).
+    struct LinearForm {
+        int64_t constant = 0; // Wrapped, like the kernel's sum.
+        std::vector<int64_t> coefficients;
+        std::vector<uint32_t> slots;
+        // Whether the slots are consecutive, so the values can be read
+        // without a gather.
+        bool contiguous = true;
+        // The kernel's result is exact if all values have at most this many
+        // significant bits (see bound_value_bits()), or -1 if never.
+        int max_value_bits = -1;
+    };
+
+    using SlotMap = std::unordered_map<std::string, uint32_t>;
+
+    static bool recognize_linear(const Node* root, const SlotMap& slots,
+                                 LinearForm& form);
+    static bool evaluate_form(const LinearForm& form,
+                              const int64_t* slot_values, int64_t& result);
+    bool evaluate_kernel(const int64_t* slot_values, int64_t& result) const;
+    bool has_unbound_slot(const bool* bound) const;
+
+    FlatTree flat_;
+    FormulaShape shape_ = FormulaShape::General;
+    LinearForm numerator_; // The linear form, for Linear.
+    LinearForm denominator_;
+};
@@ -0,0 +1,249 @@
+#include "SharedForest.h"
+#include "CheckedArithmetic.h"
+
+#include <cstddef>
+#include <cstdint>
+#include <functional>
+#include <iomanip>
+#include <limits>
+#include <memory>
+#include <ostream>
+#include <string>
+#include <vector>
+
+// MARK: namespace
+namespace {
+
+// The error source of a node that evaluated without errors.
+constexpr uint32_t no_error = std::numeric_limits<uint32_t>::max();
+
+/**
+ * @brief Returns the number of operators in a tree of the given size. Every
+ * operator has two operands, so a tree of n operators has 2n + 1 nodes.
+ */
+uint64_t operators_in_tree(uint64_t tree_size) {
+    return (tree_size - 1) / 2;
+}
+
+} // namespace
+
+// MARK: SharedForest
+std::size_t SharedForest::ForestNodeHash::operator()(
+    const ForestNode& node) const {
+    std::size_t hash = std::hash<int64_t>{}(node.value);
+    hash = hash * 31 + static_cast<std::size_t>(node.type);
+    hash = hash * 1000003 + node.left;
+    hash = hash * 1000003 + node.right;
+    return hash;
+}
+
+/**
+ * @brief Adds the tree of an AST as a formula.
+ * @param ast The AST. It isn't referenced after the call.
+ * @return The index of the formula.
+ */
+std::size_t SharedForest::add(const AST& ast) {
+    if (ast.root() == nullptr) {
+        throw ASTException("tree is empty");
+    }
+    return add(*ast.root());
+}
+
+/**
+ * @brief Adds a tree as a formula, reusing the nodes of every subtree that
+ * is already in the forest. The tree is walked with an explicit stack, so
+ * deep trees don't overflow the call stack.
+ * @param root The root of the tree. It isn't referenced after the call.
+ * @return The index of the formula.
+ */
+std::size_t SharedForest::add(const Node& root) {
+    // A node on the walk, and whether its operands have been added yet.
+    struct Visit {
+        const Node* node;
+        bool operands_done;
+    };
+    std::vector<Visit> walk{{&root, false}};
+    // The forest ids of the subtrees added so far whose parent isn't yet.
+    std::vector<uint32_t> ids;
+
+    while (!walk.empty()) {
+        Visit& visit = walk.back();
+        const Node* node = visit.node;
+        if (node->type == NodeType::Number) {
+            ids.push_back(intern({node->type, 0, 0, node->value}, 1));
+        } else if (node->type == NodeType::Variable) {
+            const uint32_t symbol = variables_.intern(node->variable_name);
+            ids.push_back(intern({node->type, 0, 0, symbol}, 1));
+        } else if (!node->left || !node->right) {
+            throw ASTException("malformed AST");
+        } else if (!visit.operands_done) {
+            visit.operands_done = true;
+            walk.push_back({node->right.get(), false});
+            walk.push_back({node->left.get(), false});
+            continue;
+        } else {
+            const uint32_t right = ids.back();
+            ids.pop_back();
+            const uint32_t left = ids.back();
+            ids.pop_back();
+            ids.push_back(intern({node->type, left, right, 0},
+                                 1 + tree_sizes_[left] + tree_sizes_[right]));
+        }
+        walk.pop_back();
+    }
+
+    roots_.push_back(ids.back());
+    return roots_.size() - 1;
+}
+
+/**
+ * @brief Returns the id of a node, adding it if the forest doesn't have it.
+ * @param node The node. Its operands must already be in the forest.
+ * @param tree_size The size of the node's subtree, counted as a tree.
+ * @return The id of the node.
+ */
+uint32_t SharedForest::intern(const ForestNode& node, uint64_t tree_size) {
+    const auto [node_it, inserted] =
+        index_.try_emplace(node, static_cast<uint32_t>(nodes_.size()));
+    if (inserted) {
+        if (nodes_.size() == no_error) {
+            index_.erase(node_it);
+            throw ASTException("forest exceeds the node limit");
+        }
+        nodes_.push_back(node);
+        tree_sizes_.push_back(tree_size);
+        if (node.type != NodeType::Number &&
+            node.type != NodeType::Variable) {
+            ++operator_count_;
+        }
+    }
+    return node_it->second;
+}
+
+std::size_t SharedForest::formula_count() const { return roots_.size(); }
+
+// The number of distinct nodes.
+std::size_t SharedForest::node_count() const { return nodes_.size(); }
+
+/**
+ * @brief Evaluates every formula, evaluating each distinct subtree once.
+ *
+ * Each node records either its value or the node its error comes from. An
+ * operator takes the error of its right operand first, then of its left
+ * one, then its own, following the evaluation order defined in AST.h.
+ * @param bindings The values to substitute for variables.
+ * @return The result of each formula, in the order they were added.
+ */
+std::vector<FormulaResult>
+SharedForest::evaluate(const VariableBindings& bindings) const {
+    // Look each variable up once.
+    const std::size_t symbol_count = variables_.size();
+    const auto symbol_values = std::make_unique<int64_t[]>(symbol_count);
+    const auto bound = std::make_unique<bool[]>(symbol_count);
+    for (uint32_t symbol = 0; symbol < symbol_count; ++symbol) {
+        if (const auto variable_it =
+                bindings.find(std::string(variables_.name(symbol)));
+            variable_it != bindings.end()) {
+            symbol_values[symbol] = variable_it->second;
+            bound[symbol] = true;
+        }
+    }
+
+    const std::size_t node_count = nodes_.size();
+    const auto values = std::make_unique<int64_t[]>(node_count);
+    const auto error_sources = std::make_unique<uint32_t[]>(node_count);
+    for (std::size_t index = 0; index < node_count; ++index) {
+        const ForestNode& node = nodes_[index];
+        values[index] = 0;
+        error_sources[index] = no_error;
+        if (node.type == NodeType::Number) {
+            values[index] = node.value;
+        } else if (node.type == NodeType::Variable) {
+            const auto symbol = static_cast<std::size_t>(node.value);
+            if (bound[symbol]) {
+                values[index] = symbol_values[symbol];
+            } else {
+                error_sources[index] = static_cast<uint32_t>(index);
+            }
+        } else if (error_sources[node.right] != no_error) {
+            error_sources[index] = error_sources[node.right];
+        } else if (error_sources[node.left] != no_error) {
+            error_sources[index] = error_sources[node.left];
+        } else if (try_checked_operation(node.type, values[node.left],
+                                         values[node.right],
+                                         values[index]) != nullptr) {
+            error_sources[index] = static_cast<uint32_t>(index);
+        }
+    }
+
+    // Only the source of an error is recorded, so its message is made again
+    // for the formulas that report it.
+    std::vector<FormulaResult> results;
+    results.reserve(roots_.size());
+    for (const uint32_t root : roots_) {
+        const uint32_t source = error_sources[root];
+        if (source == no_error) {
+            results.push_back({values[root], {}});
+            continue;
+        }
+        const ForestNode& node = nodes_[source];
+        if (node.type == NodeType::Variable) {
+            results.push_back(
+                {0, "missing variable value: " +
+                        std::string(variables_.name(
+                            static_cast<uint32_t>(node.value)))});
+        } else {
+            int64_t result = 0;
+            results.push_back(
+                {0, try_checked_operation(node.type, values[node.left],
+                                          values[node.right], result)});
+        }
+    }
+    return results;
+}
+
+/**
+ * @brief Returns how much the forest saves over separate trees.
+ */
+ForestStatistics SharedForest::statistics() const {
+    ForestStatistics statistics;
+    statistics.formulas = roots_.size();
+    statistics.shared_nodes = nodes_.size();
+    statistics.shared_operations = operator_count_;
+    for (const uint32_t root : roots_) {
+        statistics.tree_nodes += tree_sizes_[root];
+        statistics.tree_operations += operators_in_tree(tree_sizes_[root]);
+    }
+    return statistics;
+}
+
+/**
+ * @brief Writes the statistics() in a human-readable form: the node counts
+ * with the sharing ratio (tree nodes per distinct node), and the operators
+ * that evaluate() applies with the share of them that sharing saves.
+ * @param output_stream The stream to write to.
+ */
+void SharedForest::write_statistics(std::ostream& output_stream) const {
+    const ForestStatistics statistics = this->statistics();
+    const double sharing_ratio =
+        statistics.shared_nodes == 0
+            ? 1.0
+            : static_cast<double>(statistics.tree_nodes) /
+                  static_cast<double>(statistics.shared_nodes);
+    const double saved_percent =
+        statistics.tree_operations == 0
+            ? 0.0
+            : 100.0 *
+                  static_cast<double>(statistics.tree_operations -
+                                      statistics.shared_operations) /
+                  static_cast<double>(statistics.tree_operations);
+    output_stream << "formulas: " << statistics.formulas << '\n'
+                  << "nodes: " << statistics.tree_nodes << " in trees, "
+                  << statistics.shared_nodes << " shared (sharing ratio "
+                  << std::fixed << std::setprecision(2) << sharing_ratio
+                  << ")\n"
+                  << "operations per evaluation: "
+                  << statistics.tree_operations << " in trees, "
+                  << statistics.shared_operations << " shared ("
+                  << std::setprecision(1) << saved_percent << "% saved)\n";
+}
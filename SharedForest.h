@@ -0,0 +1,81 @@
+#pragma once
+#include "AST.h"
+#include "SymbolInterner.h"
+
+#include <cstddef>
+#include <cstdint>
+#include <iosfwd>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+// The trees of many formulas, stored as one forest in which every distinct
+// subtree is a single node (hash-consing). Formulas that share a
+// subexpression, like a common normalization term, point to the same node,
+// so it's stored once and evaluated once per set of bindings:
+//
+//     SharedForest forest;
+//     for (const std::string& formula : formulas) {
+//         ast.parse(formula);
+//         forest.add(ast);
+//     }
+//     std::vector<FormulaResult> results = forest.evaluate(bindings);
+//
+// Nodes are numbered in the order they're added, children before parents,
+// so evaluate() is a single forward scan over the distinct nodes.
+// Evaluating a formula gives the same value or error as AST::evaluate() on
+// its own tree.
+
+// The outcome of evaluating one formula of a forest.
+struct FormulaResult {
+    int64_t value;
+    std::string error; // Empty if evaluating succeeded.
+};
+
+// How much the forest saves over keeping each formula's tree on its own.
+struct ForestStatistics {
+    std::size_t formulas = 0;
+    uint64_t tree_nodes = 0; // In the formulas' trees, counted separately.
+    std::size_t shared_nodes = 0; // Distinct nodes in the forest.
+    uint64_t tree_operations = 0; // Operators applied per separate tree.
+    std::size_t shared_operations = 0; // Operators applied by evaluate().
+};
+
+class SharedForest {
+  public:
+    std::size_t add(const AST& ast);
+    std::size_t add(const Node& root);
+
+    std::size_t formula_count() const;
+    std::size_t node_count() const;
+    std::vector<FormulaResult> evaluate(const VariableBindings& bindings) const;
+
+    ForestStatistics statistics() const;
+    void write_statistics(std::ostream& output_stream) const;
+
+  private:
+    // A distinct subtree. Its operands are nodes added before it.
+    struct ForestNode {
+        NodeType type;
+        uint32_t left;  // Of an operator.
+        uint32_t right; // Of an operator.
+        int64_t value;  // The literal, or the symbol id of the variable.
+
+        bool operator==(const ForestNode& other) const = default;
+    };
+
+    struct ForestNodeHash {
+        std::size_t operator()(const ForestNode& node) const;
+    };
+
+    uint32_t intern(const ForestNode& node, uint64_t tree_size);
+
+    std::vector<ForestNode> nodes_;
+    // The size of each node's subtree as a tree, i.e. with shared subtrees
+    // counted every time they occur.
+    std::vector<uint64_t> tree_sizes_;
+    std::unordered_map<ForestNode, uint32_t, ForestNodeHash> index_;
+    std::vector<uint32_t> roots_; // Of the formulas, in the order added.
+    std::size_t operator_count_ = 0;
+    SymbolInterner variables_;
+};
@@ -0,0 +1,133 @@
+#pragma once
+#include <atomic>
+#include <cstddef>
+#include <optional>
+#include <thread>
+#include <utility>
+#include <vector>
+
+// Lock-free ring buffer for passing values from exactly one producer thread
+// to exactly one consumer thread. The producer calls push() and close(), the
+// consumer calls pop(). A side that has to wait spins briefly, then sleeps
+// on an atomic wait until the other side makes progress.
+template <typename T> class SpscRing {
+  public:
+    /**
+     * @brief Constructs an empty ring.
+     * @param capacity The number of slots. Rounded up to a power of two so
+     * that indices can be wrapped with a mask.
+     */
+    explicit SpscRing(std::size_t capacity) {
+        std::size_t size = 2;
+        while (size < capacity) {
+            size *= 2;
+        }
+        slots_.resize(size);
+        mask_ = size - 1;
+    }
+
+    /**
+     * @brief Pushes a value, waiting for a free slot if the ring is full.
+     * @param value The value to push.
+     */
+    void push(T value) {
+        const std::size_t tail = tail_.load(std::memory_order_relaxed);
+        for (unsigned attempt = 0; tail - cached_head_ > mask_; ++attempt) {
+            cached_head_ = head_.load(std::memory_order_acquire);
+            if (tail - cached_head_ > mask_) {
+                pause(producer_waiting_, attempt,
+                      [&] { return tail - head_.load() > mask_; });
+            }
+        }
+        slots_[tail & mask_] = std::move(value);
+        tail_.store(tail + 1);
+        wake(consumer_waiting_);
+    }
+
+    /**
+     * @brief Marks the end of the stream. pop() returns nothing once the
+     * values pushed before this call are consumed.
+     */
+    void close() {
+        closed_.store(true);
+        wake(consumer_waiting_);
+    }
+
+    /**
+     * @brief Pops the oldest value, waiting for one if the ring is empty.
+     * @return The value, or nothing if the ring is empty and closed.
+     */
+    std::optional<T> pop() {
+        const std::size_t head = head_.load(std::memory_order_relaxed);
+        for (unsigned attempt = 0; head == cached_tail_; ++attempt) {
+            cached_tail_ = tail_.load(std::memory_order_acquire);
+            if (head != cached_tail_) {
+                break;
+            }
+            if (closed_.load(std::memory_order_acquire)) {
+                // Check again, since values may have been pushed right
+                // before the ring was closed.
+                cached_tail_ = tail_.load(std::memory_order_acquire);
+                if (head == cached_tail_) {
+                    return std::nullopt;
+                }
+                break;
+            }
+            pause(consumer_waiting_, attempt,
+                  [&] { return head == tail_.load() && !closed_.load(); });
+        }
+        std::optional<T> value(std::move(slots_[head & mask_]));
+        head_.store(head + 1);
+        wake(producer_waiting_);
+        return value;
+    }
+
+  private:
+    // A side that finds the ring full (or empty) yields this many times
+    // before it goes to sleep.
+    static constexpr unsigned spin_attempts = 16;
+
+    // Waits for the other side. After spin_attempts attempts, announces the
+    // sleep in waiting and sleeps until the other side calls wake(). blocked
+    // is checked after the announcement, so a wake-up can't be missed: the
+    // positions, closed_ and the flags are all accessed sequentially
+    // consistently, so either blocked sees the other side's update or the
+    // other side sees the announcement.
+    template <typename Blocked>
+    static void pause(std::atomic<bool>& waiting, unsigned attempt,
+                      Blocked blocked) {
+        if (attempt < spin_attempts) {
+            std::this_thread::yield();
+            return;
+        }
+        waiting.store(true);
+        if (blocked()) {
+            waiting.wait(true);
+        }
+        waiting.store(false);
+    }
+
+    // Wakes the other side if it sleeps in pause().
+    static void wake(std::atomic<bool>& waiting) {
+        if (waiting.load()) {
+            waiting.store(false);
+            waiting.notify_one();
+        }
+    }
+
+    std::vector<T> slots_;
+    std::size_t mask_;
+
+    // The consumer's position, and its cached copy of the producer's
+    // position. Kept on separate cache lines from the producer's side to
+    // avoid false sharing.
+    alignas(64) std::atomic<std::size_t> head_{0};
+    std::size_t cached_tail_ = 0;
+    // The producer's position, and its cached copy of the consumer's.
+    alignas(64) std::atomic<std::size_t> tail_{0};
+    std::size_t cached_head_ = 0;
+    // Mostly read; written only on close() and around sleeps.
+    alignas(64) std::atomic<bool> closed_{false};
+    std::atomic<bool> consumer_waiting_{false};
+    std::atomic<bool> producer_waiting_{false};
+};
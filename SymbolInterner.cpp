@@ -0,0 +1,262 @@
+#include "SymbolInterner.h"
+#include "AST.h"
+
+#include <algorithm>
+#include <bit>
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+#include <functional>
+#include <limits>
+#include <memory>
+#include <mutex>
+#include <string_view>
+#include <utility>
+
+// MARK: namespace
+namespace {
+
+// Returned by find() when the name isn't in the table.
+constexpr uint32_t not_found = std::numeric_limits<uint32_t>::max();
+
+// Names are copied into arena blocks of at least this many bytes.
+constexpr std::size_t arena_block_size = 64 << 10;
+
+/**
+ * @brief Packs a hash tag and an id into a table slot. The id is stored plus
+ * one, so that an empty slot is 0.
+ */
+uint64_t make_slot(uint32_t tag, uint32_t id) {
+    return (static_cast<uint64_t>(tag) << 32) |
+           (static_cast<uint64_t>(id) + 1);
+}
+
+} // namespace
+
+// MARK: SymbolInterner
+SymbolInterner::SymbolInterner() = default;
+
+SymbolInterner::~SymbolInterner() {
+    for (std::atomic<NameEntry*>& segment : segments_) {
+        delete[] segment.load(std::memory_order_relaxed);
+    }
+}
+
+/**
+ * @brief Returns the id of the given name, assigning the next free id if the
+ * name hasn't been seen before. Ids are dense, starting from 0, and never
+ * change once assigned.
+ * @param name The name to intern.
+ * @return The name's id.
+ */
+uint32_t SymbolInterner::intern(std::string_view name) {
+    const uint64_t hash = std::hash<std::string_view>{}(name);
+    Shard& shard = shards_[hash >> 58]; // The top 6 bits pick the shard.
+
+    // Fast path: the name is usually already there, so look without locking.
+    if (const Table* table = shard.table.load(std::memory_order_acquire)) {
+        if (const uint32_t id = find(*table, hash, name); id != not_found) {
+            return id;
+        }
+    }
+
+    const std::lock_guard<std::mutex> lock(shard.mutex);
+    // Look again, since another thread may have added it in the meantime.
+    const Table* table = shard.table.load(std::memory_order_relaxed);
+    if (table != nullptr) {
+        if (const uint32_t id = find(*table, hash, name); id != not_found) {
+            return id;
+        }
+    }
+    // Keep the table at most half full.
+    if (table == nullptr || (shard.used + 1) * 2 > table->mask + 1) {
+        grow(shard);
+        table = shard.table.load(std::memory_order_relaxed);
+    }
+
+    // The segments have no room for ids past id_limit. Unlike fetch_add,
+    // the compare-exchange leaves next_id_ alone once the ids run out, so
+    // it never wraps around or counts ids that were never assigned.
+    uint32_t id = next_id_.load(std::memory_order_relaxed);
+    do {
+        if (id >= id_limit) {
+            throw ASTException("too many distinct variable names");
+        }
+    } while (!next_id_.compare_exchange_weak(id, id + 1,
+                                             std::memory_order_relaxed));
+    publish_name(id, store_name(shard, name));
+
+    // Publish the slot last, so lock-free readers that find it also see the
+    // name.
+    const auto tag = static_cast<uint32_t>(hash);
+    std::size_t index = tag & table->mask;
+    while (table->slots[index].load(std::memory_order_relaxed) != 0) {
+        index = (index + 1) & table->mask;
+    }
+    table->slots[index].store(make_slot(tag, id), std::memory_order_release);
+    ++shard.used;
+    return id;
+}
+
+/**
+ * @brief Returns the name that was assigned the given id. An id that
+ * another thread is still assigning counts as unknown until intern()
+ * has stored its name.
+ * @param id An id returned by intern().
+ * @return The name. Stays valid for the lifetime of the interner.
+ */
+std::string_view SymbolInterner::name(uint32_t id) const {
+    if (id >= next_id_.load(std::memory_order_acquire)) {
+        throw ASTException("unknown symbol id");
+    }
+    const auto [segment, offset] = locate(id);
+    const NameEntry* entries =
+        segments_[segment].load(std::memory_order_acquire);
+    if (entries == nullptr ||
+        !entries[offset].published.load(std::memory_order_acquire)) {
+        throw ASTException("unknown symbol id");
+    }
+    return entries[offset].name;
+}
+
+/**
+ * @brief Returns the number of ids handed out so far.
+ */
+std::size_t SymbolInterner::size() const {
+    return next_id_.load(std::memory_order_acquire);
+}
+
+/**
+ * @brief Finds where the name of an id is stored.
+ * @param id The id to locate.
+ * @return The index of the segment, and the index within the segment.
+ */
+std::pair<std::size_t, std::size_t> SymbolInterner::locate(uint32_t id) {
+    // Segment s holds the ids whose position (id + first segment size) has
+    // its highest bit at s + first_segment_bits.
+    const uint64_t position =
+        static_cast<uint64_t>(id) + (uint64_t{1} << first_segment_bits);
+    const auto segment = static_cast<std::size_t>(std::bit_width(position)) -
+                         1 - first_segment_bits;
+    const auto offset = static_cast<std::size_t>(
+        position - (uint64_t{1} << (segment + first_segment_bits)));
+    return {segment, offset};
+}
+
+/**
+ * @brief Allocates an empty table with the given number of slots.
+ * @param capacity The number of slots. Must be a power of two.
+ * @return The new table.
+ */
+std::unique_ptr<SymbolInterner::Table>
+SymbolInterner::make_table(std::size_t capacity) {
+    auto table = std::make_unique<Table>();
+    table->mask = capacity - 1;
+    table->slots = std::make_unique<std::atomic<uint64_t>[]>(capacity);
+    return table;
+}
+
+/**
+ * @brief Looks a name up in a table without locking.
+ * @param table The table to probe.
+ * @param hash The name's hash.
+ * @param name The name to look up.
+ * @return The name's id, or not_found.
+ */
+uint32_t SymbolInterner::find(const Table& table, uint64_t hash,
+                              std::string_view name) const {
+    const auto tag = static_cast<uint32_t>(hash);
+    for (std::size_t index = tag & table.mask;;
+         index = (index + 1) & table.mask) {
+        const uint64_t slot =
+            table.slots[index].load(std::memory_order_acquire);
+        if (slot == 0) {
+            return not_found;
+        }
+        if (static_cast<uint32_t>(slot >> 32) == tag) {
+            const auto id = static_cast<uint32_t>(slot) - 1;
+            if (this->name(id) == name) {
+                return id;
+            }
+        }
+    }
+}
+
+/**
+ * @brief Replaces a shard's table with one twice the size. The old table is
+ * kept alive, since lock-free readers might still be probing it. The caller
+ * must hold the shard's mutex.
+ * @param shard The shard to grow.
+ */
+void SymbolInterner::grow(Shard& shard) {
+    const Table* old_table = shard.table.load(std::memory_order_relaxed);
+    const std::size_t capacity =
+        old_table == nullptr ? 16 : 2 * (old_table->mask + 1);
+    std::unique_ptr<Table> new_table = make_table(capacity);
+
+    if (old_table != nullptr) {
+        for (std::size_t old_index = 0; old_index <= old_table->mask;
+             ++old_index) {
+            const uint64_t slot =
+                old_table->slots[old_index].load(std::memory_order_relaxed);
+            if (slot == 0) {
+                continue;
+            }
+            std::size_t index = (slot >> 32) & new_table->mask;
+            while (new_table->slots[index].load(std::memory_order_relaxed) !=
+                   0) {
+                index = (index + 1) & new_table->mask;
+            }
+            new_table->slots[index].store(slot, std::memory_order_relaxed);
+        }
+    }
+
+    shard.table.store(new_table.get(), std::memory_order_release);
+    shard.tables.push_back(std::move(new_table));
+}
+
+/**
+ * @brief Copies a name into the shard's arena. The caller must hold the
+ * shard's mutex.
+ * @param shard The shard whose arena to use.
+ * @param name The name to copy.
+ * @return A view of the copy, which is never moved or freed.
+ */
+std::string_view SymbolInterner::store_name(Shard& shard,
+                                            std::string_view name) {
+    if (name.size() > shard.arena_left) {
+        const std::size_t block_size = std::max(arena_block_size, name.size());
+        shard.arena.push_back(std::make_unique<char[]>(block_size));
+        shard.arena_next = shard.arena.back().get();
+        shard.arena_left = block_size;
+    }
+    char* destination = shard.arena_next;
+    std::memcpy(destination, name.data(), name.size());
+    shard.arena_next += name.size();
+    shard.arena_left -= name.size();
+    return {destination, name.size()};
+}
+
+/**
+ * @brief Records the name for an id so that name() can find it. The name is
+ * marked published last, with release ordering, so that a reader that sees
+ * the mark also sees the name.
+ * @param id The newly assigned id.
+ * @param name The interned copy of the name.
+ */
+void SymbolInterner::publish_name(uint32_t id, std::string_view name) {
+    const auto [segment, offset] = locate(id);
+
+    NameEntry* entries = segments_[segment].load(std::memory_order_acquire);
+    if (entries == nullptr) {
+        const std::lock_guard<std::mutex> lock(segment_mutex_);
+        entries = segments_[segment].load(std::memory_order_relaxed);
+        if (entries == nullptr) {
+            entries = new NameEntry[std::size_t{1}
+                                    << (segment + first_segment_bits)];
+            segments_[segment].store(entries, std::memory_order_release);
+        }
+    }
+    entries[offset].name = name;
+    entries[offset].published.store(true, std::memory_order_release);
+}
@@ -0,0 +1,81 @@
+#pragma once
+#include <array>
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+#include <mutex>
+#include <string_view>
+#include <utility>
+#include <vector>
+
+// Maps variable names to dense, stable integer ids, and back. Safe to call
+// from many threads at once (e.g. from several tokenizers parsing into one
+// shared forest).
+//
+// Names are hashed into one of shard_count shards. Each shard is an
+// open-addressing table that is read without locks; only inserting a new name
+// takes the shard's mutex. The names themselves are copied into an
+// append-only arena, so the string_views handed out stay valid for the
+// lifetime of the interner.
+class SymbolInterner {
+  public:
+    SymbolInterner();
+    ~SymbolInterner();
+    SymbolInterner(const SymbolInterner&) = delete;
+    SymbolInterner& operator=(const SymbolInterner&) = delete;
+
+    uint32_t intern(std::string_view name);
+    std::string_view name(uint32_t id) const;
+    std::size_t size() const;
+
+  private:
+    static constexpr std::size_t shard_count = 64;
+    // Ids are stored in segments of doubling size, so growing never moves the
+    // existing entries. Segment s holds 2^(s + first_segment_bits) ids.
+    static constexpr std::size_t first_segment_bits = 10;
+    static constexpr std::size_t segment_count = 22;
+    // The number of ids the segments can hold, 2^32 - 2^first_segment_bits.
+    static constexpr uint32_t id_limit = static_cast<uint32_t>(
+        (uint64_t{1} << (first_segment_bits + segment_count)) -
+        (uint64_t{1} << first_segment_bits));
+
+    // An open-addressing table. Each slot holds the low 32 bits of the name's
+    // hash in its high half and the id + 1 in its low half, or 0 if empty.
+    struct Table {
+        std::size_t mask;
+        std::unique_ptr<std::atomic<uint64_t>[]> slots;
+    };
+
+    // The name of an id. published is set once name is stored, since an id
+    // is handed out (next_id_) before its name is.
+    struct NameEntry {
+        std::string_view name;
+        std::atomic<bool> published{false};
+    };
+
+    struct alignas(64) Shard {
+        std::atomic<Table*> table{nullptr};
+        std::size_t used = 0;
+        std::mutex mutex;
+        // Tables replaced by a bigger one. Kept alive until the interner is
+        // destroyed, since lock-free readers might still be probing them.
+        std::vector<std::unique_ptr<Table>> tables;
+        std::vector<std::unique_ptr<char[]>> arena;
+        char* arena_next = nullptr;
+        std::size_t arena_left = 0;
+    };
+
+    static std::pair<std::size_t, std::size_t> locate(uint32_t id);
+    static std::unique_ptr<Table> make_table(std::size_t capacity);
+    uint32_t find(const Table& table, uint64_t hash,
+                  std::string_view name) const;
+    void grow(Shard& shard);
+    std::string_view store_name(Shard& shard, std::string_view name);
+    void publish_name(uint32_t id, std::string_view name);
+
+    std::array<Shard, shard_count> shards_;
+    std::atomic<uint32_t> next_id_{0};
+    std::array<std::atomic<NameEntry*>, segment_count> segments_{};
+    std::mutex segment_mutex_;
+};
@@ -0,0 +1,325 @@
+#include "TaggedTree.h"
+#include "CheckedArithmetic.h"
+
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+#include <string>
+#include <unordered_map>
+#include <utility>
+#include <vector>
+
+// MARK: namespace
+namespace {
+
+static_assert(sizeof(uintptr_t) == sizeof(int64_t),
+              "immediate leaves need 64-bit words");
+
+// The low bits of a word that tell what it holds (see TaggedTree.h).
+constexpr unsigned tag_bits = 2;
+constexpr uintptr_t tag_mask = (uintptr_t{1} << tag_bits) - 1;
+constexpr uintptr_t operator_tag = 0;
+constexpr uintptr_t small_number_tag = 1;
+constexpr uintptr_t variable_tag = 2;
+constexpr uintptr_t large_number_tag = 3;
+
+// The range of the numbers that fit in a word beside the tag.
+constexpr int64_t min_small_number = INT64_MIN >> tag_bits;
+constexpr int64_t max_small_number = INT64_MAX >> tag_bits;
+
+uintptr_t make_word(uint64_t payload, uintptr_t tag) {
+    return static_cast<uintptr_t>(payload << tag_bits) | tag;
+}
+
+uint64_t word_payload(uintptr_t word) { return word >> tag_bits; }
+
+/**
+ * @brief Returns the number held by a small number word, sign extended.
+ */
+int64_t small_number(uintptr_t word) {
+    return static_cast<int64_t>(word) >> tag_bits;
+}
+
+} // namespace
+
+// MARK: TaggedTree::NodeRef
+TaggedTree::NodeRef::NodeRef(const TaggedTree* tree, uintptr_t word)
+    : tree_(tree), word_(word) {}
+
+/**
+ * @brief Returns the node's type. Immediate leaves are Number or Variable.
+ */
+NodeType TaggedTree::NodeRef::type() const {
+    switch (word_ & tag_mask) {
+    case small_number_tag:
+    case large_number_tag:
+        return NodeType::Number;
+    case variable_tag:
+        return NodeType::Variable;
+    default:
+        return reinterpret_cast<const OperatorNode*>(word_)->type;
+    }
+}
+
+/**
+ * @brief Returns the value of a Number node.
+ */
+int64_t TaggedTree::NodeRef::value() const {
+    switch (word_ & tag_mask) {
+    case small_number_tag:
+        return small_number(word_);
+    case large_number_tag:
+        return tree_->large_numbers_[word_payload(word_)];
+    default:
+        throw ASTException("node is not a number");
+    }
+}
+
+/**
+ * @brief Returns the name of a Variable node.
+ */
+const std::string& TaggedTree::NodeRef::variable_name() const {
+    if ((word_ & tag_mask) != variable_tag) {
+        throw ASTException("node is not a variable");
+    }
+    return tree_->slot_names_[word_payload(word_)];
+}
+
+/**
+ * @brief Returns the left operand of an operator node.
+ */
+TaggedTree::NodeRef TaggedTree::NodeRef::left() const {
+    if ((word_ & tag_mask) != operator_tag) {
+        throw ASTException("node is not an operator");
+    }
+    return {tree_, reinterpret_cast<const OperatorNode*>(word_)->left};
+}
+
+/**
+ * @brief Returns the right operand of an operator node.
+ */
+TaggedTree::NodeRef TaggedTree::NodeRef::right() const {
+    if ((word_ & tag_mask) != operator_tag) {
+        throw ASTException("node is not an operator");
+    }
+    return {tree_, reinterpret_cast<const OperatorNode*>(word_)->right};
+}
+
+/**
+ * @brief Returns whether the node is a leaf stored in its parent's word
+ * rather than a node of its own. Every leaf is.
+ */
+bool TaggedTree::NodeRef::immediate() const {
+    return (word_ & tag_mask) != operator_tag;
+}
+
+// MARK: TaggedTree
+/**
+ * @brief Copies the tree of an AST.
+ * @param ast The AST to copy. It isn't referenced after construction.
+ */
+TaggedTree::TaggedTree(const AST& ast) : TaggedTree(ast.root()) {}
+
+/**
+ * @brief Copies the tree rooted at the given node. The tree is walked with
+ * an explicit stack, so deep trees don't overflow the call stack.
+ * @param root The root of the tree to copy.
+ */
+TaggedTree::TaggedTree(const Node* root) {
+    if (root == nullptr) {
+        throw ASTException("tree is empty");
+    }
+
+    // A node on the walk, and whether its operands have been copied yet.
+    struct Visit {
+        const Node* node;
+        bool operands_done;
+    };
+    // Number the variables in the order they appear in the expression. The
+    // walk reaches the leaves from left to right.
+    std::unordered_map<std::string, uint64_t> slots;
+    std::vector<Visit> walk{{root, false}};
+    // The words of the copied subtrees whose parent isn't copied yet.
+    std::vector<uintptr_t> words;
+
+    while (!walk.empty()) {
+        Visit& visit = walk.back();
+        const Node* node = visit.node;
+        if (node->type == NodeType::Number) {
+            if (node->value >= min_small_number &&
+                node->value <= max_small_number) {
+                words.push_back(make_word(static_cast<uint64_t>(node->value),
+                                          small_number_tag));
+            } else {
+                words.push_back(
+                    make_word(large_numbers_.size(), large_number_tag));
+                large_numbers_.push_back(node->value);
+            }
+        } else if (node->type == NodeType::Variable) {
+            const auto [slot_it, inserted] =
+                slots.try_emplace(node->variable_name, slot_names_.size());
+            if (inserted) {
+                slot_names_.push_back(node->variable_name);
+            }
+            words.push_back(make_word(slot_it->second, variable_tag));
+        } else if (!visit.operands_done) {
+            if (!node->left || !node->right) {
+                throw ASTException("malformed AST");
+            }
+            visit.operands_done = true;
+            walk.push_back({node->right.get(), false});
+            walk.push_back({node->left.get(), false});
+            continue;
+        } else {
+            const uintptr_t right = words.back();
+            words.pop_back();
+            const OperatorNode& copy =
+                operators_.emplace_back(node->type, words.back(), right);
+            words.back() = reinterpret_cast<uintptr_t>(&copy);
+            walk.pop_back();
+            continue;
+        }
+        walk.pop_back();
+    }
+    root_ = words.back();
+}
+
+/**
+ * @brief Evaluates the tree, which must not contain any variables.
+ * @return The result of evaluating the tree.
+ */
+int64_t TaggedTree::evaluate() const { return evaluate_slots(nullptr); }
+
+/**
+ * @brief Evaluates the tree, substituting the bound values for variables.
+ * @param bindings The values to substitute for variables.
+ * @return The result of evaluating the tree.
+ */
+int64_t TaggedTree::evaluate(const VariableBindings& bindings) const {
+    // Look each variable up once. A missing one is only reported when the
+    // walk reaches it, so errors come in the same order as Node::get_value.
+    const std::size_t slot_count = slot_names_.size();
+    const auto slot_values = std::make_unique<int64_t[]>(slot_count);
+    const auto bound = std::make_unique<bool[]>(slot_count);
+    for (std::size_t slot = 0; slot < slot_count; ++slot) {
+        if (const auto variable_it = bindings.find(slot_names_[slot]);
+            variable_it != bindings.end()) {
+            slot_values[slot] = variable_it->second;
+            bound[slot] = true;
+        }
+    }
+    return evaluate_slots(slot_values.get(), bound.get());
+}
+
+/**
+ * @brief Evaluates the tree with the values of its variables given by slot,
+ * as listed by variables().
+ * @param slot_values The value of each slot, or nullptr if there are no
+ * bindings at all.
+ * @param bound Whether each slot has a value, or nullptr if they all do.
+ * @return The result of evaluating the tree.
+ */
+int64_t TaggedTree::evaluate_slots(const int64_t* slot_values,
+                                   const bool* bound) const {
+    return evaluate_word(root_, slot_values, bound);
+}
+
+/**
+ * @brief Returns the root of the tree.
+ */
+TaggedTree::NodeRef TaggedTree::root() const { return {this, root_}; }
+
+/**
+ * @brief Copies the tree back into Nodes, one per node including the
+ * immediate leaves. The tree is walked with an explicit stack.
+ * @return The root of the copy.
+ */
+std::unique_ptr<Node> TaggedTree::to_node() const {
+    std::vector<std::pair<NodeRef, bool>> walk{{root(), false}};
+    std::vector<std::unique_ptr<Node>> nodes;
+    while (!walk.empty()) {
+        auto& [node, operands_done] = walk.back();
+        if (node.type() == NodeType::Number) {
+            nodes.push_back(std::make_unique<Node>(node.value()));
+        } else if (node.type() == NodeType::Variable) {
+            nodes.push_back(std::make_unique<Node>(node.variable_name()));
+        } else if (!operands_done) {
+            operands_done = true;
+            const NodeRef left = node.left();
+            walk.emplace_back(node.right(), false);
+            walk.emplace_back(left, false);
+            continue;
+        } else {
+            std::unique_ptr<Node> right = std::move(nodes.back());
+            nodes.pop_back();
+            nodes.back() = std::make_unique<Node>(
+                node.type(), std::move(nodes.back()), std::move(right));
+        }
+        walk.pop_back();
+    }
+    return std::move(nodes.back());
+}
+
+/**
+ * @brief Returns the number of nodes in the tree, leaves included.
+ */
+std::size_t TaggedTree::size() const { return 2 * operators_.size() + 1; }
+
+/**
+ * @brief Returns the number of operator nodes, the only nodes allocated.
+ */
+std::size_t TaggedTree::operator_count() const { return operators_.size(); }
+
+/**
+ * @brief Returns the names of the tree's variables, indexed by slot (i.e. in
+ * the order they first appear in the expression).
+ */
+const std::vector<std::string>& TaggedTree::variables() const {
+    return slot_names_;
+}
+
+/**
+ * @brief Recursively evaluates the subtree held by a word. The right
+ * operand is evaluated first (see AST.h).
+ * @param word The word of the subtree's root.
+ * @param slot_values The value of each slot, or nullptr.
+ * @param bound Whether each slot has a value, or nullptr if they all do.
+ * @return The result of evaluating the subtree.
+ */
+int64_t TaggedTree::evaluate_word(uintptr_t word, const int64_t* slot_values,
+                                  const bool* bound) const {
+    switch (word & tag_mask) {
+    case small_number_tag:
+        return small_number(word);
+    case large_number_tag:
+        return large_numbers_[word_payload(word)];
+    case variable_tag: {
+        const uint64_t slot = word_payload(word);
+        if (slot_values == nullptr) {
+            throw ASTException("cannot evaluate variable without bindings");
+        }
+        if (bound != nullptr && !bound[slot]) {
+            throw ASTException("missing variable value: " + slot_names_[slot]);
+        }
+        return slot_values[slot];
+    }
+    default:
+        break;
+    }
+
+    const auto* node = reinterpret_cast<const OperatorNode*>(word);
+    const int64_t right = evaluate_word(node->right, slot_values, bound);
+    const int64_t left = evaluate_word(node->left, slot_values, bound);
+    switch (node->type) {
+    case NodeType::Add:
+        return checked_add(left, right);
+    case NodeType::Sub:
+        return checked_sub(left, right);
+    case NodeType::Mult:
+        return checked_mul(left, right);
+    case NodeType::Div:
+        return checked_div(left, right);
+    default:
+        throw ASTException("malformed AST");
+    }
+}
@@ -0,0 +1,82 @@
+#pragma once
+#include "AST.h"
+
+#include <cstddef>
+#include <cstdint>
+#include <deque>
+#include <memory>
+#include <string>
+#include <vector>
+
+// A read-only copy of a tree in which the leaves take no memory of their
+// own. An operator node holds each operand in a tagged word, which either
+// points to another operator node or is the leaf itself:
+//
+//     pointer          an operator node (aligned, so it ends in 00)
+//     value << 2 | 01  a number in [-2^61, 2^61)
+//     slot << 2 | 10   a variable, by slot (see variables())
+//     index << 2 | 11  any other number, kept in a side table
+//
+// Half of a binary tree's nodes are leaves, and none of them is allocated:
+// the operator nodes are 24 bytes, against 64 for every Node, and
+// evaluating an operator reads its leaf operands from its own node instead
+// of following a pointer to each. Operands are evaluated in the order
+// defined in AST.h, so the same error is reported when several could occur.
+//
+// The encoding stays internal: NodeRef presents the immediate leaves as
+// Number and Variable nodes, and to_node() copies the tree back into Nodes.
+class TaggedTree {
+  public:
+    // A node of the tree, which may be an immediate leaf. Valid as long as
+    // the tree is.
+    class NodeRef {
+      public:
+        NodeType type() const;
+        int64_t value() const; // Of a Number.
+        const std::string& variable_name() const; // Of a Variable.
+        NodeRef left() const;  // Of an operator.
+        NodeRef right() const; // Of an operator.
+        bool immediate() const;
+
+      private:
+        friend class TaggedTree;
+        NodeRef(const TaggedTree* tree, uintptr_t word);
+
+        const TaggedTree* tree_;
+        uintptr_t word_;
+    };
+
+    explicit TaggedTree(const AST& ast);
+    explicit TaggedTree(const Node* root);
+    TaggedTree(const TaggedTree&) = delete;
+    TaggedTree& operator=(const TaggedTree&) = delete;
+    TaggedTree(TaggedTree&&) = default;
+    TaggedTree& operator=(TaggedTree&&) = default;
+
+    int64_t evaluate() const;
+    int64_t evaluate(const VariableBindings& bindings) const;
+    int64_t evaluate_slots(const int64_t* slot_values,
+                           const bool* bound = nullptr) const;
+
+    NodeRef root() const;
+    std::unique_ptr<Node> to_node() const;
+    std::size_t size() const;
+    std::size_t operator_count() const;
+    const std::vector<std::string>& variables() const;
+
+  private:
+    struct OperatorNode {
+        NodeType type;
+        uintptr_t left;
+        uintptr_t right;
+    };
+
+    int64_t evaluate_word(uintptr_t word, const int64_t* slot_values,
+                          const bool* bound) const;
+
+    // A deque, so the nodes never move and the words can point to them.
+    std::deque<OperatorNode> operators_;
+    std::vector<int64_t> large_numbers_;
+    std::vector<std::string> slot_names_;
+    uintptr_t root_ = 0;
+};
@@ -0,0 +1,570 @@
+#include "TokenStream.h"
+#include "AST.h"
+#include "BlockCodec.h"
+
+#include <algorithm>
+#include <cctype>
+#include <cerrno>
+#include <charconv>
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+#include <ios>
+#include <istream>
+#include <memory>
+#include <ostream>
+#include <string>
+#include <string_view>
+#include <system_error>
+#include <unistd.h>
+#include <vector>
+
+// MARK: namespace
+namespace {
+
+// Marks a byte of a binary token's payload.
+constexpr unsigned char payload_bit = 0x80;
+
+bool is_space(char character) {
+    return std::isspace(static_cast<unsigned char>(character)) != 0;
+}
+
+bool is_operator_symbol(char character) {
+    return character == '+' || character == '-' || character == '*' ||
+           character == '/';
+}
+
+/**
+ * @brief Turns a binary token back into text.
+ * @param kind The byte that ends the token.
+ * @param payload The bytes before it, in file order, without payload_bit.
+ * @param token Receives the text of the token.
+ */
+void decode_binary_token(char kind, std::string_view payload,
+                         std::string& token) {
+    if (is_operator_symbol(kind) && payload.empty()) {
+        token.assign(1, kind);
+    } else if (kind == 'v' && !payload.empty()) {
+        token.assign(payload);
+    } else if (kind == 'i' && payload.size() <= 10) {
+        uint64_t zigzag = 0;
+        for (std::size_t index = payload.size(); index-- > 0;) {
+            zigzag = (zigzag << 7) | static_cast<unsigned char>(payload[index]);
+        }
+        const auto value = static_cast<int64_t>(zigzag >> 1) ^
+                           -static_cast<int64_t>(zigzag & 1);
+        token = std::to_string(value);
+    } else {
+        throw ASTException("bad binary AST token");
+    }
+}
+
+// Reads the tokens of a compressed file in order, a block at a time. Blocks
+// end at whitespace, so no token spans two of them.
+class CompressedSource final : public TokenSource {
+  public:
+    explicit CompressedSource(std::istream& input) : reader_(input) {}
+
+    bool next(std::string& token) override {
+        for (;;) {
+            while (offset_ < text_.size() && is_space(text_[offset_])) {
+                ++offset_;
+            }
+            if (offset_ < text_.size()) {
+                break;
+            }
+            if (!reader_.next(text_)) {
+                return false;
+            }
+            offset_ = 0;
+        }
+        const std::size_t start = offset_;
+        while (offset_ < text_.size() && !is_space(text_[offset_])) {
+            ++offset_;
+        }
+        token.assign(text_, start, offset_ - start);
+        return true;
+    }
+
+  private:
+    BlockStreamReader reader_;
+    std::string text_;
+    std::size_t offset_ = 0;
+};
+
+// Reads the tokens of a binary file in order.
+class BinarySource final : public TokenSource {
+  public:
+    explicit BinarySource(std::streambuf& input) : input_(input) {
+        char magic[binary_magic.size()];
+        if (input_.sgetn(magic, sizeof(magic)) != sizeof(magic) ||
+            std::string_view(magic, sizeof(magic)) != binary_magic) {
+            throw ASTException("not a binary AST file");
+        }
+    }
+
+    bool next(std::string& token) override {
+        constexpr auto eof = std::streambuf::traits_type::eof();
+        payload_.clear();
+        for (;;) {
+            const auto character = input_.sbumpc();
+            if (character == eof) {
+                if (!payload_.empty()) {
+                    throw ASTException("truncated binary AST file");
+                }
+                return false;
+            }
+            if ((character & payload_bit) == 0) {
+                decode_binary_token(static_cast<char>(character), payload_,
+                                    token);
+                return true;
+            }
+            payload_ += static_cast<char>(character & ~payload_bit);
+        }
+    }
+
+  private:
+    std::streambuf& input_;
+    std::string payload_;
+};
+
+// Reads a postorder text file and gives its tokens in preorder. Preorder
+// starts with the root, which postorder stores last, so the whole file is
+// read up front, compactly: the text of the tokens in one string, and for
+// each operator where its left operand's root is.
+class PostorderSource final : public TokenSource {
+  public:
+    explicit PostorderSource(std::streambuf& input) {
+        TokenReader reader(input);
+        // The roots of the complete subtrees read so far.
+        std::vector<uint64_t> roots;
+        for (std::string token; reader.next(token);) {
+            const uint64_t index = starts_.size();
+            starts_.push_back(text_.size());
+            text_ += token;
+            left_roots_.push_back(0);
+            if (token.size() == 1 && is_operator_symbol(token[0])) {
+                if (roots.size() < 2) {
+                    throw ASTException("bad postorder");
+                }
+                // The right operand's root is the token before this one.
+                roots.pop_back();
+                left_roots_.back() = roots.back();
+                roots.back() = index;
+            } else {
+                roots.push_back(index);
+            }
+        }
+        if (roots.size() != 1) {
+            throw ASTException("bad postorder");
+        }
+        starts_.push_back(text_.size());
+        pending_.push_back(roots.back());
+    }
+
+    bool next(std::string& token) override {
+        if (pending_.empty()) {
+            return false;
+        }
+        const uint64_t index = pending_.back();
+        pending_.pop_back();
+        token.assign(text_, starts_[index],
+                     starts_[index + 1] - starts_[index]);
+        if (token.size() == 1 && is_operator_symbol(token[0])) {
+            pending_.push_back(index - 1);
+            pending_.push_back(left_roots_[index]);
+        }
+        return true;
+    }
+
+  private:
+    std::string text_;
+    // Where each token starts in text_, then the end of text_.
+    std::vector<uint64_t> starts_;
+    // For each operator, the index of its left operand's root.
+    std::vector<uint64_t> left_roots_;
+    // The roots of the subtrees still to give, the next one last. Holds at
+    // most one right operand per level of the tree.
+    std::vector<uint64_t> pending_;
+};
+
+// Writes tokens as text, each followed by a space, like
+// AST::write_preorder(), and a newline at the end, like build.
+class TextSink final : public TokenSink {
+  public:
+    explicit TextSink(std::ostream& output) : output_(output) {}
+
+    void write_operator(char symbol) override {
+        const char text[] = {symbol, ' '};
+        output_.write(text, sizeof(text));
+    }
+
+    void write_integer(int64_t value) override {
+        char text[24];
+        char* end = std::to_chars(text, text + sizeof(text), value).ptr;
+        *end++ = ' ';
+        output_.write(text, end - text);
+    }
+
+    void write_variable(std::string_view name) override {
+        output_.write(name.data(), static_cast<std::streamsize>(name.size()));
+        output_.put(' ');
+    }
+
+    void finish() override { output_.put('\n'); }
+
+  private:
+    std::ostream& output_;
+};
+
+// Writes tokens given in preorder as postorder text, left operand first.
+// Each operator waits on a stack until both of its operands are written, so
+// only the pending operators on the path to the current token are kept.
+class PostorderSink final : public TokenSink {
+  public:
+    explicit PostorderSink(std::ostream& output) : text_(output) {}
+
+    void write_operator(char symbol) override {
+        pending_.push_back({symbol, false});
+    }
+
+    void write_integer(int64_t value) override {
+        text_.write_integer(value);
+        finish_operand();
+    }
+
+    void write_variable(std::string_view name) override {
+        text_.write_variable(name);
+        finish_operand();
+    }
+
+    void finish() override { text_.finish(); }
+
+  private:
+    struct PendingOperator {
+        char symbol;
+        bool has_left; // Whether its left operand has been written.
+    };
+
+    // Called once an operand is written in full. Writes every operator that
+    // it completes, which in turn is a complete operand of the next one.
+    void finish_operand() {
+        while (!pending_.empty()) {
+            if (!pending_.back().has_left) {
+                pending_.back().has_left = true;
+                return;
+            }
+            text_.write_operator(pending_.back().symbol);
+            pending_.pop_back();
+        }
+    }
+
+    TextSink text_;
+    std::vector<PendingOperator> pending_;
+};
+
+// Writes tokens in the binary encoding (see binary_magic).
+class BinarySink final : public TokenSink {
+  public:
+    explicit BinarySink(std::ostream& output) : output_(output) {
+        output_.write(binary_magic.data(), binary_magic.size());
+    }
+
+    void write_operator(char symbol) override { output_.put(symbol); }
+
+    void write_integer(int64_t value) override {
+        uint64_t zigzag = (static_cast<uint64_t>(value) << 1) ^
+                          static_cast<uint64_t>(value >> 63);
+        char bytes[11];
+        std::size_t size = 0;
+        for (; zigzag != 0; zigzag >>= 7) {
+            bytes[size++] = static_cast<char>(payload_bit | (zigzag & 0x7f));
+        }
+        bytes[size++] = 'i';
+        output_.write(bytes, static_cast<std::streamsize>(size));
+    }
+
+    void write_variable(std::string_view name) override {
+        for (const char character : name) {
+            output_.put(static_cast<char>(payload_bit | character));
+        }
+        output_.put('v');
+    }
+
+    void finish() override {}
+
+  private:
+    std::ostream& output_;
+};
+
+// Writes tokens as compressed text.
+class CompressedSink final : public TokenSink {
+  public:
+    explicit CompressedSink(std::ostream& output)
+        : compressor_(output), stream_(&compressor_), text_(stream_) {}
+
+    void write_operator(char symbol) override {
+        text_.write_operator(symbol);
+    }
+
+    void write_integer(int64_t value) override { text_.write_integer(value); }
+
+    void write_variable(std::string_view name) override {
+        text_.write_variable(name);
+    }
+
+    void finish() override {
+        text_.finish();
+        compressor_.finish();
+    }
+
+  private:
+    CompressingStreamBuf compressor_;
+    std::ostream stream_;
+    TextSink text_;
+};
+
+} // namespace
+
+// MARK: FdStreamBuf
+/**
+ * @brief Constructs a stream buffer that reads from or writes to a file
+ * descriptor. The descriptor isn't closed.
+ * @param descriptor The file descriptor, like STDIN_FILENO or STDOUT_FILENO.
+ * @param mode std::ios::in to read, or std::ios::out to write.
+ * @param buffer_size The size of the buffer.
+ */
+FdStreamBuf::FdStreamBuf(int descriptor, std::ios::openmode mode,
+                         std::size_t buffer_size)
+    : descriptor_(descriptor), buffer_(std::max<std::size_t>(buffer_size, 64)) {
+    char* begin = buffer_.data();
+    if (mode & std::ios::out) {
+        setp(begin, begin + buffer_.size());
+    } else {
+        setg(begin, begin, begin);
+    }
+}
+
+FdStreamBuf::~FdStreamBuf() { flush_buffer(); }
+
+/**
+ * @brief Returns the next bytes of the input without consuming them, reading
+ * until there are enough of them or the input ends.
+ * @param count The number of bytes to look at. At most the buffer size.
+ * @return The bytes; fewer than count only at the end of the input.
+ */
+std::string_view FdStreamBuf::peek(std::size_t count) {
+    count = std::min(count, buffer_.size());
+    std::size_t available = static_cast<std::size_t>(egptr() - gptr());
+    if (available < count) {
+        // Move the unread bytes to the front to make room.
+        std::memmove(buffer_.data(), gptr(), available);
+        while (available < count) {
+            const ssize_t size =
+                read(descriptor_, buffer_.data() + available,
+                     buffer_.size() - available);
+            if (size < 0 && errno == EINTR) {
+                continue;
+            }
+            if (size <= 0) {
+                break;
+            }
+            available += static_cast<std::size_t>(size);
+        }
+        setg(buffer_.data(), buffer_.data(), buffer_.data() + available);
+    }
+    return {gptr(), std::min(count, available)};
+}
+
+FdStreamBuf::int_type FdStreamBuf::underflow() {
+    if (gptr() < egptr()) {
+        return traits_type::to_int_type(*gptr());
+    }
+    ssize_t size = 0;
+    do {
+        size = read(descriptor_, buffer_.data(), buffer_.size());
+    } while (size < 0 && errno == EINTR);
+    if (size <= 0) {
+        return traits_type::eof();
+    }
+    setg(buffer_.data(), buffer_.data(), buffer_.data() + size);
+    return traits_type::to_int_type(*gptr());
+}
+
+FdStreamBuf::int_type FdStreamBuf::overflow(int_type character) {
+    if (pbase() == nullptr || !flush_buffer()) {
+        return traits_type::eof();
+    }
+    if (!traits_type::eq_int_type(character, traits_type::eof())) {
+        *pptr() = traits_type::to_char_type(character);
+        pbump(1);
+    }
+    return traits_type::not_eof(character);
+}
+
+int FdStreamBuf::sync() { return flush_buffer() ? 0 : -1; }
+
+/**
+ * @brief Writes out the buffered output, if any.
+ * @return false if the write failed.
+ */
+bool FdStreamBuf::flush_buffer() {
+    const char* next = pbase();
+    while (next < pptr()) {
+        const ssize_t size =
+            write(descriptor_, next, static_cast<std::size_t>(pptr() - next));
+        if (size < 0 && errno == EINTR) {
+            continue;
+        }
+        if (size < 0) {
+            return false;
+        }
+        next += size;
+    }
+    if (pbase() != nullptr) {
+        setp(pbase(), epptr());
+    }
+    return true;
+}
+
+// MARK: LimitedStreamBuf
+/**
+ * @brief Constructs a stream buffer that reads at most limit bytes from
+ * another one.
+ * @param input The stream buffer to read from.
+ * @param limit The most bytes the input may have.
+ */
+LimitedStreamBuf::LimitedStreamBuf(std::streambuf& input, uint64_t limit)
+    : input_(input), remaining_(limit), buffer_(std::size_t{1} << 16) {
+    setg(buffer_.data(), buffer_.data(), buffer_.data());
+}
+
+LimitedStreamBuf::int_type LimitedStreamBuf::underflow() {
+    if (gptr() < egptr()) {
+        return traits_type::to_int_type(*gptr());
+    }
+    if (remaining_ == 0) {
+        if (traits_type::eq_int_type(input_.sgetc(), traits_type::eof())) {
+            return traits_type::eof();
+        }
+        throw ASTException("input exceeds the byte limit");
+    }
+    const std::streamsize size = input_.sgetn(
+        buffer_.data(), static_cast<std::streamsize>(std::min<uint64_t>(
+                            buffer_.size(), remaining_)));
+    if (size <= 0) {
+        return traits_type::eof();
+    }
+    remaining_ -= static_cast<uint64_t>(size);
+    setg(buffer_.data(), buffer_.data(), buffer_.data() + size);
+    return traits_type::to_int_type(*gptr());
+}
+
+// MARK: TokenReader
+TokenReader::TokenReader(std::streambuf& input) : input_(input) {}
+
+/**
+ * @brief Reads the next token, skipping the whitespace before it. Whitespace
+ * is what std::isspace says, like for operator>>.
+ * @param token Receives the token.
+ * @return false at the end of the input.
+ */
+bool TokenReader::next(std::string& token) {
+    constexpr auto eof = std::streambuf::traits_type::eof();
+    auto character = input_.sgetc();
+    while (character != eof && std::isspace(character)) {
+        character = input_.snextc();
+    }
+    if (character == eof) {
+        return false;
+    }
+    token.clear();
+    while (character != eof && !std::isspace(character)) {
+        token += static_cast<char>(character);
+        character = input_.snextc();
+    }
+    return true;
+}
+
+// MARK: Functions
+/**
+ * @brief Parses the name of an AST format: "preorder", "postorder", "binary"
+ * or "compressed".
+ * @param name The name.
+ * @return The format.
+ */
+AstFormat parse_ast_format(std::string_view name) {
+    if (name == "preorder") {
+        return AstFormat::Preorder;
+    }
+    if (name == "postorder") {
+        return AstFormat::Postorder;
+    }
+    if (name == "binary") {
+        return AstFormat::Binary;
+    }
+    if (name == "compressed") {
+        return AstFormat::Compressed;
+    }
+    throw ASTException("unknown AST format: " + std::string(name));
+}
+
+/**
+ * @brief Tells the format of an AST file from its magic. Text files have
+ * none, and are taken to be preorder.
+ * @param start The first bytes of the file.
+ * @return The format.
+ */
+AstFormat detect_ast_format(std::string_view start) {
+    if (start.starts_with(compressed_magic)) {
+        return AstFormat::Compressed;
+    }
+    if (start.starts_with(binary_magic)) {
+        return AstFormat::Binary;
+    }
+    return AstFormat::Preorder;
+}
+
+/**
+ * @brief Opens a reader for the tokens of an AST file, in preorder. A
+ * postorder file is read whole when the reader is opened; the other formats
+ * are read as the tokens are.
+ * @param input The stream to read, at the start of the file. Read until its
+ * end.
+ * @param format The format of the file.
+ * @return The reader. input must outlive it.
+ */
+std::unique_ptr<TokenSource> open_token_source(std::istream& input,
+                                               AstFormat format) {
+    if (format == AstFormat::Postorder) {
+        return std::make_unique<PostorderSource>(*input.rdbuf());
+    }
+    if (format == AstFormat::Compressed) {
+        return std::make_unique<CompressedSource>(input);
+    }
+    if (format == AstFormat::Binary) {
+        return std::make_unique<BinarySource>(*input.rdbuf());
+    }
+    return std::make_unique<TokenReader>(*input.rdbuf());
+}
+
+/**
+ * @brief Opens a writer for the tokens of an AST file. The tokens are given
+ * in preorder, whatever the format.
+ * @param output The stream to write to.
+ * @param format The format to write.
+ * @return The writer. output must outlive it.
+ */
+std::unique_ptr<TokenSink> open_token_sink(std::ostream& output,
+                                           AstFormat format) {
+    if (format == AstFormat::Postorder) {
+        return std::make_unique<PostorderSink>(output);
+    }
+    if (format == AstFormat::Compressed) {
+        return std::make_unique<CompressedSink>(output);
+    }
+    if (format == AstFormat::Binary) {
+        return std::make_unique<BinarySink>(output);
+    }
+    return std::make_unique<TextSink>(output);
+}
@@ -0,0 +1,118 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <ios>
+#include <iosfwd>
+#include <memory>
+#include <streambuf>
+#include <string>
+#include <string_view>
+#include <vector>
+
+// Reading and writing the tokens of AST files, in each of their encodings.
+
+// The encodings of an AST file.
+enum class AstFormat {
+    // Text, tokens separated by whitespace, operators before their operands.
+    // What build writes.
+    Preorder,
+    // Text, operators after their operands, left operand first (what
+    // ast_build::from_postorder takes).
+    Postorder,
+    // The preorder tokens in binary (see binary_magic).
+    Binary,
+    // The preorder text, compressed (see BlockCodec.h).
+    Compressed,
+};
+
+// The magic at the start of a binary AST file. Each token is one ASCII byte
+// that says what it is, preceded by its payload in bytes that have the high
+// bit set, so the tokens can be read in either direction:
+// - An operator is just its symbol.
+// - An integer is its zigzag encoding in base 128, least significant digit
+//   first, then 'i'.
+// - A variable is its name, then 'v'.
+inline constexpr std::string_view binary_magic = "ASTB1";
+
+AstFormat parse_ast_format(std::string_view name);
+AstFormat detect_ast_format(std::string_view start);
+
+// A stream buffer over a file descriptor with a large buffer, for stdin and
+// stdout. A read returns as soon as any bytes arrive, so a reader of a pipe
+// starts working before the writer is done.
+class FdStreamBuf : public std::streambuf {
+  public:
+    FdStreamBuf(int descriptor, std::ios::openmode mode,
+                std::size_t buffer_size = std::size_t{1} << 20);
+    ~FdStreamBuf() override;
+    FdStreamBuf(const FdStreamBuf&) = delete;
+    FdStreamBuf& operator=(const FdStreamBuf&) = delete;
+
+    std::string_view peek(std::size_t count);
+
+  protected:
+    int_type underflow() override;
+    int_type overflow(int_type character) override;
+    int sync() override;
+
+  private:
+    bool flush_buffer();
+
+    int descriptor_;
+    std::vector<char> buffer_;
+};
+
+// A stream buffer that reads through another one, and throws an
+// ASTException once the input turns out to be longer than a limit. For input
+// that can't be trusted to be of a reasonable size.
+class LimitedStreamBuf : public std::streambuf {
+  public:
+    LimitedStreamBuf(std::streambuf& input, uint64_t limit);
+
+  protected:
+    int_type underflow() override;
+
+  private:
+    std::streambuf& input_;
+    uint64_t remaining_; // The bytes that may still be read.
+    std::vector<char> buffer_;
+};
+
+// Reads the tokens of an AST file one at a time, as text: operators as their
+// symbol, integers in decimal, variables by name.
+class TokenSource {
+  public:
+    virtual ~TokenSource() = default;
+
+    virtual bool next(std::string& token) = 0;
+};
+
+// Reads whitespace separated tokens straight from a stream buffer, without
+// the formatting machinery of operator>>.
+class TokenReader final : public TokenSource {
+  public:
+    explicit TokenReader(std::streambuf& input);
+
+    bool next(std::string& token) override;
+
+  private:
+    std::streambuf& input_;
+};
+
+// Writes the tokens of an AST file, given in preorder. The caller has
+// already told the kinds of token apart.
+class TokenSink {
+  public:
+    virtual ~TokenSink() = default;
+
+    virtual void write_operator(char symbol) = 0;
+    virtual void write_integer(int64_t value) = 0;
+    virtual void write_variable(std::string_view name) = 0;
+    virtual void finish() = 0;
+};
+
+std::unique_ptr<TokenSource> open_token_source(std::istream& input,
+                                               AstFormat format);
+std::unique_ptr<TokenSink> open_token_sink(std::ostream& output,
+                                           AstFormat format);
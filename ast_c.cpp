@@ -0,0 +1,264 @@
+#include "ast_c.h"
+#include "AST.h"
+#include "ShapedFormula.h"
+
+#include <algorithm>
+#include <cstdint>
+#include <cstdlib>
+#include <cstring>
+#include <exception>
+#include <memory>
+#include <new>
+#include <optional>
+#include <sstream>
+#include <string>
+#include <string_view>
+#include <vector>
+
+struct ast_formula {
+    AST ast; // Kept for serializing.
+    std::optional<ShapedFormula> shaped;
+    std::vector<int64_t> slot_values;
+    std::unique_ptr<bool[]> bound;
+};
+
+// MARK: namespace
+namespace {
+
+// The message of the last failure on each thread. A fixed buffer, so that
+// recording an error can't fail.
+thread_local char last_error[256] = "";
+
+/**
+ * @brief Records an error message for ast_last_error().
+ * @param status The status to return.
+ * @param message The message to record. Truncated if it's too long.
+ * @return status, so callers can return the result directly.
+ */
+ast_status fail(ast_status status, const char* message) noexcept {
+    const std::size_t length =
+        std::min(std::strlen(message), sizeof(last_error) - 1);
+    std::memcpy(last_error, message, length);
+    last_error[length] = '\0';
+    return status;
+}
+
+/**
+ * @brief Maps an evaluation error to a status code.
+ * @param error The error thrown by the evaluator.
+ * @return The matching status code.
+ */
+ast_status evaluation_status(const ASTException& error) {
+    const std::string_view message = error.what();
+    if (message.starts_with("overflow")) {
+        return AST_ERROR_OVERFLOW;
+    }
+    if (message == "division by zero") {
+        return AST_ERROR_DIVISION_BY_ZERO;
+    }
+    if (message.starts_with("missing variable value") ||
+        message.starts_with("cannot evaluate variable")) {
+        return AST_ERROR_UNBOUND_VARIABLE;
+    }
+    return AST_ERROR_INTERNAL;
+}
+
+/**
+ * @brief Runs a function, turning any exception it throws into a status code
+ * so that no exception crosses the C boundary.
+ * @param is_parsing Whether an ASTException means a syntax error (when
+ * parsing) or an evaluation error.
+ * @param function The function to run.
+ * @return AST_OK, or the status matching the exception.
+ */
+template <typename Function>
+ast_status guarded(bool is_parsing, Function&& function) noexcept {
+    try {
+        function();
+        return AST_OK;
+    } catch (const ASTException& error) {
+        return fail(is_parsing ? AST_ERROR_SYNTAX : evaluation_status(error),
+                    error.what());
+    } catch (const std::bad_alloc&) {
+        return fail(AST_ERROR_OUT_OF_MEMORY, "out of memory");
+    } catch (const std::exception& error) {
+        return fail(AST_ERROR_INTERNAL, error.what());
+    } catch (...) {
+        return fail(AST_ERROR_INTERNAL, "unknown error");
+    }
+}
+
+} // namespace
+
+// MARK: C API
+ast_status ast_parse(const char* text, size_t length, ast_formula** formula) {
+    if ((text == nullptr && length != 0) || formula == nullptr) {
+        return fail(AST_ERROR_INVALID_ARGUMENT, "null argument");
+    }
+    *formula = nullptr;
+
+    std::unique_ptr<ast_formula> parsed;
+    ast_status status = guarded(false, [&] {
+        parsed = std::make_unique<ast_formula>();
+    });
+    if (status != AST_OK) {
+        return status;
+    }
+    status = guarded(true, [&] {
+        parsed->ast.parse(std::string(text == nullptr ? "" : text, length));
+    });
+    if (status != AST_OK) {
+        return status;
+    }
+    status = guarded(false, [&] {
+        parsed->shaped.emplace(parsed->ast);
+        const std::size_t slot_count = parsed->shaped->variables().size();
+        parsed->slot_values.resize(slot_count);
+        parsed->bound = std::make_unique<bool[]>(slot_count);
+    });
+    if (status == AST_OK) {
+        *formula = parsed.release();
+    }
+    return status;
+}
+
+void ast_free(ast_formula* formula) { delete formula; }
+
+size_t ast_slot_count(const ast_formula* formula) {
+    return formula == nullptr ? 0 : formula->slot_values.size();
+}
+
+const char* ast_slot_name(const ast_formula* formula, size_t slot) {
+    if (formula == nullptr || slot >= formula->slot_values.size()) {
+        return nullptr;
+    }
+    return formula->shaped->variables()[slot].c_str();
+}
+
+ast_status ast_find_slot(const ast_formula* formula, const char* name,
+                         size_t* slot) {
+    if (formula == nullptr || name == nullptr || slot == nullptr) {
+        return fail(AST_ERROR_INVALID_ARGUMENT, "null argument");
+    }
+    const std::vector<std::string>& names = formula->shaped->variables();
+    const auto name_it = std::find(names.begin(), names.end(), name);
+    if (name_it == names.end()) {
+        return fail(AST_ERROR_INVALID_ARGUMENT, "no such variable");
+    }
+    *slot = static_cast<size_t>(name_it - names.begin());
+    return AST_OK;
+}
+
+ast_status ast_bind(ast_formula* formula, size_t slot, int64_t value) {
+    if (formula == nullptr) {
+        return fail(AST_ERROR_INVALID_ARGUMENT, "null argument");
+    }
+    if (slot >= formula->slot_values.size()) {
+        return fail(AST_ERROR_INVALID_ARGUMENT, "no such slot");
+    }
+    formula->slot_values[slot] = value;
+    formula->bound[slot] = true;
+    return AST_OK;
+}
+
+ast_status ast_evaluate(const ast_formula* formula, int64_t* result) {
+    if (formula == nullptr || result == nullptr) {
+        return fail(AST_ERROR_INVALID_ARGUMENT, "null argument");
+    }
+    return guarded(false, [&] {
+        *result = formula->shaped->evaluate_slots(formula->slot_values.data(),
+                                                  formula->bound.get());
+    });
+}
+
+ast_status ast_evaluate_batch(const ast_formula* formula,
+                              const int64_t* slot_values, size_t row_count,
+                              int64_t* results, ast_status* statuses) {
+    if (formula == nullptr || results == nullptr ||
+        (slot_values == nullptr && row_count != 0 &&
+         !formula->slot_values.empty())) {
+        return fail(AST_ERROR_INVALID_ARGUMENT, "null argument");
+    }
+    const std::size_t slot_count = formula->slot_values.size();
+    // The formula's kernel takes the rows it can evaluate exactly, and the
+    // general evaluator the rest (see ShapedFormula).
+    std::unique_ptr<bool[]> unresolved;
+    const ast_status kernel_status = guarded(false, [&] {
+        unresolved = std::make_unique<bool[]>(row_count);
+        formula->shaped->evaluate_rows(slot_values, row_count, results,
+                                       unresolved.get());
+    });
+    if (kernel_status != AST_OK) {
+        return kernel_status;
+    }
+    ast_status first_failure = AST_OK;
+    for (std::size_t row = 0; row < row_count; ++row) {
+        const int64_t* row_values =
+            slot_count == 0 ? nullptr : slot_values + row * slot_count;
+        const ast_status status = guarded(false, [&] {
+            if (unresolved[row]) {
+                results[row] = formula->shaped->evaluate_slots(row_values);
+            }
+        });
+        if (status != AST_OK) {
+            results[row] = 0;
+            if (first_failure == AST_OK) {
+                first_failure = status;
+            }
+        }
+        if (statuses != nullptr) {
+            statuses[row] = status;
+        }
+    }
+    return first_failure;
+}
+
+ast_status ast_serialize(const ast_formula* formula, char** text,
+                         size_t* length) {
+    if (formula == nullptr || text == nullptr) {
+        return fail(AST_ERROR_INVALID_ARGUMENT, "null argument");
+    }
+    *text = nullptr;
+    return guarded(false, [&] {
+        std::ostringstream output;
+        formula->ast.write_preorder(output);
+        const std::string serialized = output.str();
+
+        // Allocated with malloc so that C callers could free it themselves.
+        auto* copy = static_cast<char*>(std::malloc(serialized.size() + 1));
+        if (copy == nullptr) {
+            throw std::bad_alloc();
+        }
+        std::memcpy(copy, serialized.c_str(), serialized.size() + 1);
+        *text = copy;
+        if (length != nullptr) {
+            *length = serialized.size();
+        }
+    });
+}
+
+void ast_free_string(char* text) { std::free(text); }
+
+const char* ast_last_error(void) { return last_error; }
+
+const char* ast_status_name(ast_status status) {
+    switch (status) {
+    case AST_OK:
+        return "ok";
+    case AST_ERROR_INVALID_ARGUMENT:
+        return "invalid argument";
+    case AST_ERROR_SYNTAX:
+        return "syntax error";
+    case AST_ERROR_UNBOUND_VARIABLE:
+        return "unbound variable";
+    case AST_ERROR_OVERFLOW:
+        return "overflow";
+    case AST_ERROR_DIVISION_BY_ZERO:
+        return "division by zero";
+    case AST_ERROR_OUT_OF_MEMORY:
+        return "out of memory";
+    case AST_ERROR_INTERNAL:
+        return "internal error";
+    }
+    return "unknown status";
+}
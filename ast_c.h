@@ -0,0 +1,93 @@
+#pragma once
+/*
+ * C API for embedding the expression engine (libast.a / libast.so).
+ *
+ * No C++ exception crosses this boundary: every function that can fail
+ * returns an ast_status, and ast_last_error() gives a message describing the
+ * most recent failure on the calling thread.
+ *
+ * A formula may be evaluated from several threads at once, as long as no
+ * thread binds values to it at the same time.
+ */
+
+#include <stddef.h>
+#include <stdint.h>
+
+#if defined(__GNUC__)
+#define AST_API __attribute__((visibility("default")))
+#else
+#define AST_API
+#endif
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+typedef enum ast_status {
+    AST_OK = 0,
+    /* A null pointer, or a slot that the formula doesn't have. */
+    AST_ERROR_INVALID_ARGUMENT = 1,
+    /* The expression text is not a valid expression. */
+    AST_ERROR_SYNTAX = 2,
+    /* A variable has no value bound to it. */
+    AST_ERROR_UNBOUND_VARIABLE = 3,
+    AST_ERROR_OVERFLOW = 4,
+    AST_ERROR_DIVISION_BY_ZERO = 5,
+    AST_ERROR_OUT_OF_MEMORY = 6,
+    AST_ERROR_INTERNAL = 7
+} ast_status;
+
+/* A parsed expression, ready to be evaluated. */
+typedef struct ast_formula ast_formula;
+
+/*
+ * Parses length bytes of expression text. On success *formula receives a new
+ * formula, which must be released with ast_free().
+ */
+AST_API ast_status ast_parse(const char* text, size_t length,
+                             ast_formula** formula);
+AST_API void ast_free(ast_formula* formula);
+
+/*
+ * Variables are addressed by slot, numbered from 0 in the order the
+ * variables first appear in the expression.
+ */
+AST_API size_t ast_slot_count(const ast_formula* formula);
+/* Returns the variable name of a slot, or NULL if there's no such slot. The
+ * name stays valid until the formula is freed. */
+AST_API const char* ast_slot_name(const ast_formula* formula, size_t slot);
+AST_API ast_status ast_find_slot(const ast_formula* formula, const char* name,
+                                 size_t* slot);
+/* Binds a value to a slot for later ast_evaluate() calls. */
+AST_API ast_status ast_bind(ast_formula* formula, size_t slot, int64_t value);
+
+/* Evaluates the formula with the values bound by ast_bind(). */
+AST_API ast_status ast_evaluate(const ast_formula* formula, int64_t* result);
+/*
+ * Evaluates the formula once per row. slot_values holds row_count rows of
+ * ast_slot_count() values each, row after row. results receives one value
+ * per row. If statuses is not NULL, it receives the status of each row.
+ * Returns AST_OK if every row succeeded, otherwise the status of the first
+ * row that failed (the remaining rows are still evaluated).
+ */
+AST_API ast_status ast_evaluate_batch(const ast_formula* formula,
+                                      const int64_t* slot_values,
+                                      size_t row_count, int64_t* results,
+                                      ast_status* statuses);
+
+/*
+ * Writes the formula in the preorder format that `ast_program eval` reads.
+ * On success *text receives a NUL-terminated string that must be released
+ * with ast_free_string(), and *length (if not NULL) its length.
+ */
+AST_API ast_status ast_serialize(const ast_formula* formula, char** text,
+                                 size_t* length);
+AST_API void ast_free_string(char* text);
+
+/* The message of the last failure on this thread, or "" if none. */
+AST_API const char* ast_last_error(void);
+AST_API const char* ast_status_name(ast_status status);
+
+#ifdef __cplusplus
+}
+#endif
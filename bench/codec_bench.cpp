@@ -0,0 +1,115 @@
+// Measures the block codec of compressed AST files on preorder text:
+// compression ratio, and single-thread compression and decompression speed.
+//
+// Usage: codec_bench [file] [rounds]
+// Without a file, the preorder of a generated expression of about 64 MiB is
+// used: random sums and products of numbers and a few variable names.
+
+#include "BlockCodec.h"
+
+#include <chrono>
+#include <cstddef>
+#include <cstdint>
+#include <cstdlib>
+#include <fstream>
+#include <iomanip>
+#include <iostream>
+#include <iterator>
+#include <random>
+#include <string>
+#include <vector>
+
+// MARK: namespace
+namespace {
+
+/**
+ * @brief Generates preorder text like build writes: operators first, then
+ * their operands, separated by spaces.
+ */
+std::string generate_preorder(std::size_t target_size) {
+    static const char* const names[] = {"price", "qty", "rate", "total", "x"};
+    std::mt19937_64 random(42);
+    std::string text;
+    text.reserve(target_size + 64);
+    while (text.size() < target_size) {
+        text += "+*-"[random() % 3];
+        text += ' ';
+        if (random() % 2 == 0) {
+            text += names[random() % 5];
+        } else {
+            text += std::to_string(random() % 100000);
+        }
+        text += ' ';
+    }
+    text += "1\n";
+    return text;
+}
+
+double seconds_since(std::chrono::steady_clock::time_point start) {
+    return std::chrono::duration<double>(std::chrono::steady_clock::now() -
+                                         start)
+        .count();
+}
+
+} // namespace
+
+// MARK: main()
+int main(int argc, char* argv[]) {
+    std::string text;
+    if (argc > 1) {
+        std::ifstream input(argv[1], std::ios::binary);
+        if (!input) {
+            std::cerr << "cannot open " << argv[1] << '\n';
+            return 1;
+        }
+        text.assign(std::istreambuf_iterator<char>(input), {});
+    } else {
+        text = generate_preorder(std::size_t{64} << 20);
+    }
+    const int rounds = argc > 2 ? std::atoi(argv[2]) : 5;
+
+    // Split into blocks of the default size, like the writer (which also
+    // cuts at whitespace, which doesn't matter for speed).
+    std::vector<std::string_view> blocks;
+    for (std::size_t offset = 0; offset < text.size();
+         offset += default_compressed_block_size) {
+        blocks.push_back(std::string_view(text).substr(
+            offset, default_compressed_block_size));
+    }
+
+    std::vector<std::string> compressed(blocks.size());
+    auto start = std::chrono::steady_clock::now();
+    for (std::size_t i = 0; i < blocks.size(); ++i) {
+        compress_block(blocks[i], compressed[i]);
+    }
+    const double compress_seconds = seconds_since(start);
+    std::size_t compressed_size = 0;
+    for (const std::string& block : compressed) {
+        compressed_size += block.size();
+    }
+
+    std::string decoded(default_compressed_block_size, '\0');
+    start = std::chrono::steady_clock::now();
+    for (int round = 0; round < rounds; ++round) {
+        for (std::size_t i = 0; i < blocks.size(); ++i) {
+            decompress_block(compressed[i], decoded.data(), blocks[i].size());
+            if (round == 0 &&
+                std::string_view(decoded.data(), blocks[i].size()) !=
+                    blocks[i]) {
+                std::cerr << "block " << i << " differs after a round trip\n";
+                return 1;
+            }
+        }
+    }
+    const double decompress_seconds = seconds_since(start) / rounds;
+
+    const double megabytes = static_cast<double>(text.size()) / (1 << 20);
+    std::cout << std::fixed << std::setprecision(2) << "input " << megabytes
+              << " MiB in " << blocks.size() << " blocks, ratio "
+              << static_cast<double>(text.size()) /
+                     static_cast<double>(compressed_size)
+              << "\ncompress   " << megabytes / compress_seconds
+              << " MiB/s\ndecompress " << megabytes / decompress_seconds
+              << " MiB/s\n";
+    return 0;
+}
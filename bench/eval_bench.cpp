@@ -0,0 +1,169 @@
+// Compares evaluating a large parsed tree through its scattered Node objects
+// with evaluating its FlatTree copy and its TaggedTree copy. Reports ns/node
+// and, where the kernel allows perf events, last-level cache misses per node.
+//
+// Usage: eval_bench [depth] [rounds]
+// The tree is a complete binary tree of the given depth (2^(depth+1) - 1
+// nodes). The default of 23 gives a Node tree of about 1 GiB.
+
+#include "AST.h"
+#include "FlatTree.h"
+#include "TaggedTree.h"
+
+#include <linux/perf_event.h>
+#include <sys/ioctl.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+#include <chrono>
+#include <cstddef>
+#include <cstdint>
+#include <cstdlib>
+#include <iomanip>
+#include <iostream>
+#include <string>
+
+// MARK: namespace
+namespace {
+
+// Counts last-level cache misses of this thread, if perf events are
+// available (they usually aren't in containers).
+class LlcMissCounter {
+  public:
+    LlcMissCounter() {
+        perf_event_attr attributes{};
+        attributes.type = PERF_TYPE_HARDWARE;
+        attributes.size = sizeof(attributes);
+        attributes.config = PERF_COUNT_HW_CACHE_MISSES;
+        attributes.disabled = 1;
+        attributes.exclude_kernel = 1;
+        fd_ = static_cast<int>(
+            syscall(SYS_perf_event_open, &attributes, 0, -1, -1, 0));
+    }
+    ~LlcMissCounter() {
+        if (fd_ >= 0) {
+            close(fd_);
+        }
+    }
+    LlcMissCounter(const LlcMissCounter&) = delete;
+    LlcMissCounter& operator=(const LlcMissCounter&) = delete;
+
+    bool available() const { return fd_ >= 0; }
+
+    void start() {
+        if (fd_ >= 0) {
+            ioctl(fd_, PERF_EVENT_IOC_RESET, 0);
+            ioctl(fd_, PERF_EVENT_IOC_ENABLE, 0);
+        }
+    }
+
+    uint64_t stop() {
+        uint64_t count = 0;
+        if (fd_ >= 0) {
+            ioctl(fd_, PERF_EVENT_IOC_DISABLE, 0);
+            if (read(fd_, &count, sizeof(count)) != sizeof(count)) {
+                count = 0;
+            }
+        }
+        return count;
+    }
+
+  private:
+    int fd_;
+};
+
+/**
+ * @brief Appends a complete binary expression tree of the given depth, with
+ * single-digit numbers and the variables x, y and z at the leaves.
+ */
+void append_expression(std::string& text, int depth, uint64_t& leaf) {
+    if (depth == 0) {
+        const uint64_t kind = leaf++ % 4;
+        text += kind == 3 ? static_cast<char>('x' + leaf % 3)
+                          : static_cast<char>('1' + leaf % 9);
+        return;
+    }
+    text += '(';
+    append_expression(text, depth - 1, leaf);
+    text += depth % 2 == 0 ? " + " : " - ";
+    append_expression(text, depth - 1, leaf);
+    text += ')';
+}
+
+// The result of timing one evaluator.
+struct Measurement {
+    double ns_per_node;
+    double misses_per_node;
+    int64_t result;
+};
+
+template <typename Evaluate>
+Measurement measure(Evaluate evaluate, std::size_t node_count, int rounds,
+                    LlcMissCounter& counter) {
+    evaluate(); // Warm up.
+    int64_t result = 0;
+    counter.start();
+    const auto start = std::chrono::steady_clock::now();
+    for (int round = 0; round < rounds; ++round) {
+        result = evaluate();
+    }
+    const std::chrono::duration<double, std::nano> elapsed =
+        std::chrono::steady_clock::now() - start;
+    const uint64_t misses = counter.stop();
+    const double visited = static_cast<double>(node_count) * rounds;
+    return {elapsed.count() / visited, static_cast<double>(misses) / visited,
+            result};
+}
+
+} // namespace
+
+// MARK: main()
+int main(int argc, char* argv[]) {
+    const int depth = argc > 1 ? std::atoi(argv[1]) : 23;
+    const int rounds = argc > 2 ? std::atoi(argv[2]) : 5;
+
+    std::string text;
+    uint64_t leaf = 0;
+    append_expression(text, depth, leaf);
+    AST ast;
+    ast.parse(text);
+    text.clear();
+    text.shrink_to_fit();
+    const FlatTree flat(ast);
+    const TaggedTree tagged(ast);
+    const std::size_t node_count = flat.size();
+    const VariableBindings bindings{{"x", 3}, {"y", -2}, {"z", 7}};
+
+    LlcMissCounter counter;
+    const Measurement tree = measure(
+        [&] { return ast.evaluate(bindings); }, node_count, rounds, counter);
+    const Measurement flattened = measure(
+        [&] { return flat.evaluate(bindings); }, node_count, rounds, counter);
+    const Measurement immediate = measure(
+        [&] { return tagged.evaluate(bindings); }, node_count, rounds,
+        counter);
+    if (tree.result != flattened.result || tree.result != immediate.result) {
+        std::cerr << "results differ\n";
+        return 1;
+    }
+
+    std::cout << "nodes=" << node_count << " rounds=" << rounds
+              << " Node tree ~" << (node_count * sizeof(Node)) / (1 << 20)
+              << " MiB, FlatTree ~" << (node_count * 16) / (1 << 20)
+              << " MiB, TaggedTree ~"
+              << (tagged.operator_count() * 24) / (1 << 20) << " MiB\n"
+              << "evaluator    ns/node  LLC misses/node\n";
+    for (const auto& [name, measurement] :
+         {std::pair{"Node tree ", tree}, std::pair{"FlatTree  ", flattened},
+          std::pair{"TaggedTree", immediate}}) {
+        std::cout << name << std::setw(10) << std::fixed
+                  << std::setprecision(2) << measurement.ns_per_node;
+        if (counter.available()) {
+            std::cout << std::setw(17) << std::setprecision(3)
+                      << measurement.misses_per_node << '\n';
+        } else {
+            std::cout << "              n/a\n";
+        }
+    }
+    return 0;
+}
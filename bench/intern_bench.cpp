@@ -0,0 +1,115 @@
+// Contention benchmark for SymbolInterner: several threads intern the same
+// pool of names at once, compared against a mutex-guarded unordered_map.
+//
+// Usage: intern_bench [names] [operations_per_thread]
+
+#include "SymbolInterner.h"
+
+#include <atomic>
+#include <chrono>
+#include <cstddef>
+#include <cstdint>
+#include <cstdlib>
+#include <iomanip>
+#include <iostream>
+#include <mutex>
+#include <string>
+#include <string_view>
+#include <thread>
+#include <unordered_map>
+#include <vector>
+
+// MARK: namespace
+namespace {
+
+std::atomic<uint64_t> sink{0};
+
+// The baseline: one map behind one mutex.
+class MutexInterner {
+  public:
+    uint32_t intern(std::string_view name) {
+        const std::lock_guard<std::mutex> lock(mutex_);
+        const auto [it, inserted] = ids_.try_emplace(
+            std::string(name), static_cast<uint32_t>(ids_.size()));
+        return it->second;
+    }
+
+  private:
+    std::mutex mutex_;
+    std::unordered_map<std::string, uint32_t> ids_;
+};
+
+/**
+ * @brief Makes a pool of distinct lower-case names, like variable names.
+ * @param count The number of names to make.
+ * @return The names.
+ */
+std::vector<std::string> make_names(std::size_t count) {
+    std::vector<std::string> names;
+    names.reserve(count);
+    for (std::size_t index = 0; index < count; ++index) {
+        std::string name = "var";
+        for (std::size_t rest = index; rest > 0 || name.size() == 3;
+             rest /= 26) {
+            name += static_cast<char>('a' + rest % 26);
+        }
+        names.push_back(std::move(name));
+    }
+    return names;
+}
+
+/**
+ * @brief Runs operations_per_thread interns on each of thread_count threads,
+ * each thread walking the name pool with its own stride.
+ * @return The average wall-clock nanoseconds per intern call.
+ */
+template <typename Interner>
+double run(Interner& interner, const std::vector<std::string>& names,
+           std::size_t thread_count, std::size_t operations_per_thread) {
+    const auto start = std::chrono::steady_clock::now();
+    {
+        std::vector<std::jthread> workers;
+        for (std::size_t thread = 0; thread < thread_count; ++thread) {
+            workers.emplace_back([&, thread] {
+                std::size_t index = thread;
+                const std::size_t stride = 2 * thread + 1;
+                uint64_t checksum = 0;
+                for (std::size_t op = 0; op < operations_per_thread; ++op) {
+                    checksum += interner.intern(names[index]);
+                    index = (index + stride) % names.size();
+                }
+                sink += checksum; // Keep the loop from being optimized out.
+            });
+        }
+    }
+    const std::chrono::duration<double, std::nano> elapsed =
+        std::chrono::steady_clock::now() - start;
+    return elapsed.count() /
+           static_cast<double>(thread_count * operations_per_thread);
+}
+
+} // namespace
+
+// MARK: main()
+int main(int argc, char* argv[]) {
+    const std::size_t name_count =
+        argc > 1 ? std::strtoull(argv[1], nullptr, 10) : 100000;
+    const std::size_t operations =
+        argc > 2 ? std::strtoull(argv[2], nullptr, 10) : 1000000;
+    const std::vector<std::string> names = make_names(name_count);
+
+    std::cout << "names=" << name_count << " ops/thread=" << operations
+              << " hardware threads=" << std::thread::hardware_concurrency()
+              << "\n"
+              << "threads  sharded ns/op  mutex map ns/op\n";
+    for (std::size_t threads = 1; threads <= 64; threads *= 2) {
+        SymbolInterner sharded;
+        MutexInterner mutex_map;
+        const double sharded_ns = run(sharded, names, threads, operations);
+        const double mutex_ns = run(mutex_map, names, threads, operations);
+        std::cout << std::setw(7) << threads << std::setw(15) << std::fixed
+                  << std::setprecision(1) << sharded_ns << std::setw(17)
+                  << mutex_ns << '\n';
+    }
+    return 0;
+}
@@ -0,0 +1,77 @@
+// Compares the I/O engine backends reading a set of files whole, at several
+// queue depths. Reports MiB/s. Files that are in the page cache are read at
+// memory speed whatever the backend; to measure the device, drop the caches
+// before each run (echo 3 > /proc/sys/vm/drop_caches) or use files larger
+// than RAM.
+//
+// Usage: io_bench <file>...
+
+#include "IoEngine.h"
+
+#include <chrono>
+#include <cstddef>
+#include <cstdint>
+#include <exception>
+#include <iomanip>
+#include <iostream>
+#include <string>
+#include <vector>
+
+// MARK: main()
+int main(int argc, char* argv[]) {
+    if (argc < 2) {
+        std::cerr << "Usage: " << argv[0] << " <file>...\n";
+        return 1;
+    }
+    const std::vector<std::string> paths(argv + 1, argv + argc);
+
+    uint64_t expected_checksum = 0;
+    bool first = true;
+    for (const IoBackend backend : {IoBackend::Pread, IoBackend::IoUring}) {
+        for (const unsigned depth : {1U, 4U, 16U, 64U}) {
+            IoEngineOptions options;
+            options.backend = backend;
+            options.queue_depth = depth;
+            std::unique_ptr<IoEngine> engine;
+            try {
+                engine = IoEngine::create(options);
+            } catch (const std::exception& e) {
+                std::cout << "io_uring: " << e.what() << '\n';
+                break;
+            }
+
+            std::size_t bytes = 0;
+            uint64_t checksum = 0;
+            const auto start = std::chrono::steady_clock::now();
+            engine->read_files(paths, [&](std::size_t index,
+                                          std::string contents,
+                                          std::exception_ptr error) {
+                if (error) {
+                    std::cerr << "cannot read " << paths[index] << '\n';
+                    return;
+                }
+                bytes += contents.size();
+                for (std::size_t i = 0; i < contents.size(); i += 4096) {
+                    checksum += static_cast<unsigned char>(contents[i]) * i;
+                }
+            });
+            const std::chrono::duration<double> elapsed =
+                std::chrono::steady_clock::now() - start;
+
+            if (first) {
+                expected_checksum = checksum;
+                first = false;
+            } else if (checksum != expected_checksum) {
+                std::cerr << "backends read different contents\n";
+                return 1;
+            }
+            std::cout << std::setw(9) << engine->name() << " depth "
+                      << std::setw(2) << depth << std::fixed
+                      << std::setprecision(1) << std::setw(10)
+                      << static_cast<double>(bytes) / (1 << 20) /
+                             elapsed.count()
+                      << " MiB/s\n";
+        }
+    }
+    return 0;
+}
@@ -0,0 +1,190 @@
+// Compares evaluating formulas through their shape's kernel (see
+// ShapedFormula) with evaluating them with a FlatTree, on a mix of linear
+// forms, ratios of linear forms and general formulas. Reports the fraction
+// of formulas recognized, and ns/row for each shape, one row at a time and
+// in batches.
+//
+// Usage: shape_bench [formulas] [rows]
+
+#include "AST.h"
+#include "FlatTree.h"
+#include "ShapedFormula.h"
+
+#include <chrono>
+#include <cstddef>
+#include <cstdint>
+#include <cstdlib>
+#include <iomanip>
+#include <iostream>
+#include <memory>
+#include <random>
+#include <string>
+#include <vector>
+
+// MARK: namespace
+namespace {
+
+using Clock = std::chrono::steady_clock;
+
+/**
+ * @brief Returns the name of the given variable: a, b, ..., z, aa, ab, ...
+ */
+std::string variable_name(std::size_t index) {
+    std::string name(1, static_cast<char>('a' + index % 26));
+    for (index /= 26; index != 0; index /= 26) {
+        name.insert(name.begin(), static_cast<char>('a' + (index - 1) % 26));
+    }
+    return name;
+}
+
+/**
+ * @brief Appends a linear form over the given number of variables from the
+ * first one on, with random coefficients and a constant.
+ */
+void append_linear(std::string& text, std::size_t first, std::size_t terms,
+                   std::mt19937_64& random) {
+    for (std::size_t term = 0; term < terms; ++term) {
+        if (term != 0) {
+            text += random() % 2 == 0 ? " + " : " - ";
+        }
+        text += std::to_string(random() % 100 + 1) + " * " +
+                variable_name(first + term);
+    }
+    text += " + " + std::to_string(random() % 1000);
+}
+
+/**
+ * @brief Makes a random formula: a linear form, a ratio of two, or a
+ * general formula (products of variables, which no kernel handles).
+ */
+std::string make_formula(std::mt19937_64& random) {
+    std::string text;
+    const std::size_t terms = random() % 15 + 2;
+    switch (random() % 10) {
+    case 0:
+    case 1:
+    case 2:
+    case 3:
+        append_linear(text, 0, terms, random);
+        break;
+    case 4:
+    case 5:
+    case 6:
+        text += '(';
+        append_linear(text, 0, terms, random);
+        text += ") / (";
+        append_linear(text, terms, random() % 4 + 1, random);
+        text += " + 500000)";
+        break;
+    default:
+        for (std::size_t term = 0; term < terms; ++term) {
+            text += term == 0 ? "" : " + ";
+            text += variable_name(term) + " * " + variable_name(term + 1);
+        }
+        break;
+    }
+    return text;
+}
+
+// The time per row of each evaluator, summed over the formulas of a shape.
+struct ShapeTimes {
+    std::size_t formulas = 0;
+    double flat = 0;
+    double kernel = 0;
+    double batch = 0;
+};
+
+double nanoseconds(Clock::duration duration) {
+    return std::chrono::duration<double, std::nano>(duration).count();
+}
+
+} // namespace
+
+// MARK: main()
+int main(int argc, char* argv[]) {
+    const std::size_t formula_count =
+        argc > 1 ? std::strtoull(argv[1], nullptr, 10) : 1000;
+    const std::size_t row_count =
+        argc > 2 ? std::strtoull(argv[2], nullptr, 10) : 2000;
+
+    std::mt19937_64 random(42);
+    ShapeTimes times[3];
+    int64_t checksum = 0;
+    for (std::size_t formula = 0; formula < formula_count; ++formula) {
+        AST ast;
+        ast.parse(make_formula(random));
+        const FlatTree flat(ast);
+        const ShapedFormula shaped(ast);
+        const std::size_t slot_count = shaped.variables().size();
+        std::vector<int64_t> rows(row_count * slot_count);
+        for (int64_t& value : rows) {
+            value = static_cast<int64_t>(random() % 2001) - 1000;
+        }
+        std::vector<int64_t> flat_results(row_count);
+        std::vector<int64_t> kernel_results(row_count);
+        std::vector<int64_t> batch_results(row_count);
+        const auto unresolved = std::make_unique<bool[]>(row_count);
+
+        Clock::time_point start = Clock::now();
+        for (std::size_t row = 0; row < row_count; ++row) {
+            flat_results[row] =
+                flat.evaluate_slots(rows.data() + row * slot_count);
+        }
+        const Clock::duration flat_time = Clock::now() - start;
+
+        start = Clock::now();
+        for (std::size_t row = 0; row < row_count; ++row) {
+            kernel_results[row] =
+                shaped.evaluate_slots(rows.data() + row * slot_count);
+        }
+        const Clock::duration kernel_time = Clock::now() - start;
+
+        start = Clock::now();
+        shaped.evaluate_rows(rows.data(), row_count, batch_results.data(),
+                             unresolved.get());
+        for (std::size_t row = 0; row < row_count; ++row) {
+            if (unresolved[row]) {
+                batch_results[row] =
+                    shaped.evaluate_slots(rows.data() + row * slot_count);
+            }
+        }
+        const Clock::duration batch_time = Clock::now() - start;
+
+        if (kernel_results != flat_results || batch_results != flat_results) {
+            std::cerr << "results differ\n";
+            return 1;
+        }
+        checksum += flat_results.back();
+
+        ShapeTimes& shape_times = times[static_cast<int>(shaped.shape())];
+        ++shape_times.formulas;
+        shape_times.flat += nanoseconds(flat_time);
+        shape_times.kernel += nanoseconds(kernel_time);
+        shape_times.batch += nanoseconds(batch_time);
+    }
+
+    std::cout << "formulas=" << formula_count << " rows=" << row_count
+              << " checksum=" << checksum << '\n'
+              << "shape     share  FlatTree ns/row  kernel ns/row  "
+                 "batch ns/row  speedup\n";
+    for (const FormulaShape shape :
+         {FormulaShape::Linear, FormulaShape::Ratio, FormulaShape::General}) {
+        const ShapeTimes& shape_times = times[static_cast<int>(shape)];
+        if (shape_times.formulas == 0) {
+            continue;
+        }
+        const auto rows = static_cast<double>(shape_times.formulas *
+                                              row_count);
+        std::cout << std::left << std::setw(8) << shape_name(shape)
+                  << std::right << std::fixed << std::setprecision(1)
+                  << std::setw(6)
+                  << 100.0 * static_cast<double>(shape_times.formulas) /
+                         static_cast<double>(formula_count)
+                  << '%' << std::setprecision(2) << std::setw(17)
+                  << shape_times.flat / rows << std::setw(15)
+                  << shape_times.kernel / rows << std::setw(14)
+                  << shape_times.batch / rows << std::setw(8)
+                  << shape_times.flat / shape_times.batch << "x\n";
+    }
+    return 0;
+}
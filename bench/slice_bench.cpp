@@ -0,0 +1,144 @@
+// Measures what evaluating a large tree in slices (see ResumableEvaluation)
+// costs and what it buys an event loop: the overhead over AST::evaluate(),
+// how long the thread is blocked per slice (median, 99th percentile and
+// longest; the longest includes being preempted), and how soon a deadline
+// and a cancellation stop the walk.
+//
+// Usage: slice_bench [depth] [slice_us]
+// The tree is a complete binary tree of the given depth (2^(depth+1) - 1
+// nodes), evaluated in slices of slice_us microseconds (default 200).
+
+#include "AST.h"
+#include "ResumableEvaluation.h"
+
+#include <algorithm>
+#include <chrono>
+#include <cstddef>
+#include <cstdint>
+#include <cstdlib>
+#include <iomanip>
+#include <iostream>
+#include <string>
+#include <thread>
+#include <vector>
+
+// MARK: namespace
+namespace {
+
+using Clock = std::chrono::steady_clock;
+
+/**
+ * @brief Appends a complete binary expression tree of the given depth, with
+ * single-digit numbers and the variables x, y and z at the leaves.
+ */
+void append_expression(std::string& text, int depth, uint64_t& leaf) {
+    if (depth == 0) {
+        const uint64_t kind = leaf++ % 4;
+        text += kind == 3 ? static_cast<char>('x' + leaf % 3)
+                          : static_cast<char>('1' + leaf % 9);
+        return;
+    }
+    text += '(';
+    append_expression(text, depth - 1, leaf);
+    text += depth % 2 == 0 ? " + " : " - ";
+    append_expression(text, depth - 1, leaf);
+    text += ')';
+}
+
+double milliseconds(Clock::duration duration) {
+    return std::chrono::duration<double, std::milli>(duration).count();
+}
+
+} // namespace
+
+// MARK: main()
+int main(int argc, char* argv[]) {
+    const int depth = argc > 1 ? std::atoi(argv[1]) : 22;
+    const std::chrono::microseconds slice_time(argc > 2 ? std::atoi(argv[2])
+                                                        : 200);
+
+    std::string text;
+    uint64_t leaf = 0;
+    append_expression(text, depth, leaf);
+    AST ast;
+    ast.parse(text);
+    text.clear();
+    text.shrink_to_fit();
+    const VariableBindings bindings{{"x", 3}, {"y", -2}, {"z", 7}};
+
+    // One blocking call.
+    Clock::time_point start = Clock::now();
+    const int64_t expected = ast.evaluate(bindings);
+    const Clock::duration blocking = Clock::now() - start;
+
+    // One unbounded run() of the explicit-stack walk.
+    ResumableEvaluation whole(ast, bindings);
+    start = Clock::now();
+    whole.run();
+    const Clock::duration unbounded = Clock::now() - start;
+
+    // Time slices, as an event loop would run them between other requests.
+    ResumableEvaluation sliced(ast, bindings);
+    std::vector<Clock::duration> slices;
+    start = Clock::now();
+    EvaluationStatus status = EvaluationStatus::Suspended;
+    while (status == EvaluationStatus::Suspended) {
+        const Clock::time_point slice_start = Clock::now();
+        status = sliced.run({.max_time = slice_time});
+        slices.push_back(Clock::now() - slice_start);
+    }
+    const Clock::duration total_sliced = Clock::now() - start;
+    std::ranges::sort(slices);
+    if (whole.result() != expected || sliced.result() != expected) {
+        std::cerr << "results differ\n";
+        return 1;
+    }
+
+    // A deadline of a tenth of the blocking time.
+    ResumableEvaluation bounded(ast, bindings);
+    start = Clock::now();
+    bounded.set_deadline(start + blocking / 10);
+    const EvaluationStatus deadline_status = bounded.run();
+    const Clock::duration deadline_stop = Clock::now() - start;
+
+    // A cancellation from another thread after a tenth of the blocking time.
+    CancellationToken token;
+    ResumableEvaluation cancelled(ast, bindings);
+    cancelled.set_cancellation_token(&token);
+    start = Clock::now();
+    std::jthread canceller([&token, &blocking] {
+        std::this_thread::sleep_for(blocking / 10);
+        token.cancel();
+    });
+    const EvaluationStatus cancel_status = cancelled.run();
+    const Clock::duration cancel_stop = Clock::now() - start;
+
+    std::cout << std::fixed << std::setprecision(3)
+              << "nodes=" << (uint64_t{2} << depth) - 1 << '\n'
+              << "AST::evaluate:        " << milliseconds(blocking)
+              << " ms blocking\n"
+              << "run(), no budget:     " << milliseconds(unbounded)
+              << " ms\n"
+              << "run(), " << slice_time.count() << " us slices: "
+              << milliseconds(total_sliced) << " ms in " << slices.size()
+              << " slices\n"
+              << "  per slice: median "
+              << milliseconds(slices[slices.size() / 2]) << " ms, p99 "
+              << milliseconds(slices[slices.size() * 99 / 100])
+              << " ms, longest " << milliseconds(slices.back()) << " ms\n"
+              << "deadline at "
+              << milliseconds(blocking / 10) << " ms: stopped after "
+              << milliseconds(deadline_stop) << " ms ("
+              << (deadline_status == EvaluationStatus::DeadlineExceeded
+                      ? "deadline exceeded"
+                      : "not stopped")
+              << ")\n"
+              << "cancel at " << milliseconds(blocking / 10)
+              << " ms: stopped after " << milliseconds(cancel_stop)
+              << " ms ("
+              << (cancel_status == EvaluationStatus::Cancelled
+                      ? "cancelled"
+                      : "not stopped")
+              << ")\n";
+    return 0;
+}
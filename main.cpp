@@ -1,13 +1,39 @@
 #include "AST.h"
+#include "BlockCodec.h"
+#include "CheckedArithmetic.h"
+#include "ExpressionValidator.h"
+#include "ExternalMemory.h"
+#include "IoEngine.h"
+#include "Optimizer.h"
+#include "SharedForest.h"
+#include "TokenStream.h"
 
 #include <algorithm>
 #include <cctype>
+#include <charconv>
+#include <chrono>
+#include <condition_variable>
+#include <cstdio>
+#include <deque>
+#include <exception>
+#include <fcntl.h>
+#include <filesystem>
 #include <fstream>
+#include <functional>
+#include <initializer_list>
+#include <iomanip>
 #include <iostream>
 #include <iterator>
 #include <limits>
+#include <memory>
+#include <mutex>
+#include <optional>
+#include <sstream>
 #include <stdexcept>
 #include <string>
+#include <string_view>
+#include <thread>
+#include <unistd.h>
 #include <unordered_map>
 #include <vector>
 
@@ -16,66 +42,141 @@
 // MARK: namespace
 namespace {
 
+// The "--name" and "--name=value" arguments of the command line, by name.
+using CommandLineOptions = std::unordered_map<std::string, std::string>;
+
+// Closes a file owned by a std::unique_ptr.
+struct FileCloser {
+    void operator()(std::FILE* file) const { std::fclose(file); }
+};
+
+// A variable values file is parsed on several threads only if each gets at
+// least this many bytes.
+constexpr std::size_t min_values_chunk_size = std::size_t{1} << 20;
+
+// An assignment in a chunk of a variable values file.
+struct ValuesEntry {
+    std::string_view name;
+    int64_t value;
+    std::size_t line; // Counting from 1 at the start of the chunk.
+};
+
+// What's wrong with the first bad line of a chunk of a variable values file.
+// Duplicates are only found when the chunks are merged.
+enum class ValuesError { None, Assignment, Name, Value };
+
+// A chunk of a variable values file, parsed up to its first bad line.
+struct ValuesChunk {
+    std::vector<ValuesEntry> entries;
+    std::size_t line_count = 0;
+    ValuesError error = ValuesError::None;
+    std::size_t error_line = 0;
+    std::string_view error_name; // For Value.
+    std::string error_message;   // For Value.
+};
+
 // Usage of these functions will be defined by build/eval modes.
-void write_pre(const Node* current_node, std::ostream& output_stream);
 int64_t
 eval_pre(std::istream& input_stream,
-         const std::unordered_map<std::string, int64_t>& variable_values);
+         const std::unordered_map<std::string, int64_t>& variable_values,
+         const ASTLimits& limits);
+int64_t eval_pre_external(
+    std::FILE* input,
+    const std::unordered_map<std::string, int64_t>& variable_values,
+    const ExternalMemoryOptions& options);
+template <typename Values>
+int64_t eval_pre_compressed(
+    const char* path,
+    const std::unordered_map<std::string, int64_t>& variable_values,
+    Values& values);
+int64_t eval_pre_compressed_stream(
+    std::istream& input_stream,
+    const std::unordered_map<std::string, int64_t>& variable_values,
+    const ASTLimits& limits);
+void convert_tokens(TokenSource& source, TokenSink& sink);
+template <typename Values>
+void apply_preorder_token(
+    const std::string& tok, Values& values,
+    const std::unordered_map<std::string, int64_t>& variable_values);
+template <typename Values>
+bool apply_preorder_text(
+    std::string_view text, Values& values,
+    const std::unordered_map<std::string, int64_t>& variable_values);
+int64_t eval_preorder_contents(
+    std::string_view contents,
+    const std::unordered_map<std::string, int64_t>& variable_values);
+IoEngineOptions io_engine_options(const CommandLineOptions& options);
+void check_options(const CommandLineOptions& options,
+                   std::initializer_list<std::string_view> known);
+ExternalMemoryOptions
+external_memory_options(const CommandLineOptions& options);
+ASTLimits resource_limits(const CommandLineOptions& options);
+unsigned thread_count_option(const CommandLineOptions& options);
+PassManager pass_manager(const CommandLineOptions& options);
+bool has_limits(const ASTLimits& limits);
+std::unordered_map<std::string, int64_t>
+parse_variable_values_file(std::istream& input_stream,
+                           unsigned thread_count = 0);
 std::unordered_map<std::string, int64_t>
-parse_variable_values_file(std::istream& input_stream);
+parse_variable_values(std::string_view contents, unsigned thread_count = 0);
 bool is_variable_token(const std::string& token);
 int64_t parse_int64_token(const std::string& token);
 
-/**
- * @brief Checked arithmetic operations that throw an ASTException on overflow
- * or other error conditions (such as division by zero).
- *
- * @param left The left operand of the operation.
- * @param right The right operand of the operation.
- * @return The result of the arithmetic operation if it does not overflow or
- * have other error conditions.
- */
-int64_t checked_add(int64_t left, int64_t right) {
-    int64_t result = 0;
-    if (__builtin_add_overflow(left, right, &result)) {
-        throw ASTException("overflow in addition");
-    }
-    return result;
-}
+// Evaluates preorder tokens in the order they are read. Only the operators
+// whose operands are still being read are kept, so memory is bounded by the
+// depth of the tree rather than by its size, and evaluation starts with the
+// first token.
+//
+// The errors are the same as evaluating from the last token to the first,
+// like eval_pre_external() does: of the errors in the stream, the one
+// furthest into it wins. An arithmetic error counts at the position of its
+// operator, and only if both operands were evaluated without errors. Going
+// over one of the limits is the exception: it's thrown right away, so a
+// stream that's too large is never read to its end.
+class PreorderEvaluator {
+  public:
+    PreorderEvaluator(
+        const std::unordered_map<std::string, int64_t>& variable_values,
+        const ASTLimits& limits);
 
-int64_t checked_sub(int64_t left, int64_t right) {
-    int64_t result = 0;
-    if (__builtin_sub_overflow(left, right, &result)) {
-        throw ASTException("overflow in subtraction");
-    }
-    return result;
-}
+    void add(const std::string& tok);
+    int64_t finish();
 
-int64_t checked_mul(int64_t left, int64_t right) {
-    int64_t result = 0;
-    if (__builtin_mul_overflow(left, right, &result)) {
-        throw ASTException("overflow in multiplication");
-    }
-    return result;
-}
+  private:
+    // The value of a subtree, unless evaluating it failed.
+    struct Operand {
+        int64_t value;
+        bool valid;
+    };
 
-int64_t checked_div(int64_t left, int64_t right) {
-    if (right == 0) {
-        throw ASTException("division by zero");
-    }
-    if (left == std::numeric_limits<int64_t>::min() && right == -1) {
-        throw ASTException("overflow in division");
-    }
-    return left / right;
-}
+    // An operator that is still waiting for an operand. Kept to 24 bytes,
+    // since a left-deep tree has one per token.
+    struct Frame {
+        uint64_t position;
+        int64_t left_value;
+        char symbol;
+        bool has_left;
+        bool left_valid;
+    };
+
+    void complete(Operand operand);
+    void fail(std::string message, uint64_t position);
+    void check_limits(bool is_operator);
+
+    const std::unordered_map<std::string, int64_t>& variable_values_;
+    const ASTLimits& limits_;
+    uint64_t operator_count_ = 0;
+    std::vector<Frame> frames_;
+    uint64_t position_ = 0; // Of the last token, counting from 1.
+    uint64_t tree_count_ = 0; // The complete trees so far.
+    int64_t result_ = 0;
+    std::optional<std::string> error_;
+    uint64_t error_position_ = 0;
+};
 
 /**
  * @brief Read an entire input stream into a std::string.
  *
- * This is used for expression input file reading input_stream build mode. The
- * iterators consume the entire stream until EOF and construct a single string
- * with the content.
- *
  * @param input_stream Input stream currently positioned at the first character
  * to read. Consumes the entire stream content and leaves the stream positioned
  * at EOF.
@@ -89,64 +190,158 @@ std::string read_all(std::istream& input_stream) {
 /**
  * @brief Build mode:
  *   1. Read an expression from the input file.
- *   2. Parse the expression into an in-memory AST using the AST class.
+ *   2. Parse the expression into an in-memory AST using the AST class. A
+ *      regular file is read whole and parsed with AST::parse; otherwise the
+ *      reading, lexing and tree building run concurrently (see
+ *      AST::parse_stream).
  *   3. Write the AST in a compact preorder format to the output file.
  *
  * CLI contract:
- *     <program> build <ast_output_file> <expression_input_file>
+ *     <program> build [options] <ast_output_file> <expression_input_file>
+ *
+ * Either file can be "-", meaning stdout or stdin. Both go through a large
+ * buffer (see FdStreamBuf), so a pipe is written in big chunks.
+ *
+ * Options:
+ * - --external: Build out of core (see build_external), for expressions
+ *   larger than memory.
+ * - --memory-limit=<MiB>: The memory budget of --external.
+ * - --compress: Write the AST file compressed (see BlockCodec.h). Eval
+ *   detects compressed files by themselves.
+ * - --max-bytes=<n>, --max-tokens=<n>, --max-nodes=<n>, --max-depth=<n>:
+ *   Reject an expression that goes over the limit (see ASTLimits), before
+ *   the memory for it is allocated. Not with --external.
+ * - -O<level> (0 to 3), or --passes=<pass,...> and --fixpoint: Optimize the
+ *   tree before writing it (see PassManager). --opt-stats writes the time
+ *   and node count change of each pass to stderr, and --verify-opt[=<n>]
+ *   checks that the optimized tree evaluates like the original with n
+ *   random bindings (default 100). Not with --external.
  *
  * @param argc Argument count from main context. Expected value:
  * - 4 => argv = [program, "build", ast_output_file, expression_input_file]
- * @param argv Argument vector from main context.
+ * @param argv Argument vector from main context, without the options.
  * - argv[0]: The executable name.
  * - argv[1]: The mode string (in this case: "build").
  * - argv[2]: The AST output file path
  * - argv[3]: The expression input file path containing the infix expression to
  *   parse.
+ * @param options The options from the command line.
  * @return Exit code (0 on success, non-zero on error).
  */
-int run_build_mode(int argc, char* argv[]) {
+int run_build_mode(int argc, char* argv[], const CommandLineOptions& options) {
     // Support:
     //   <program> build <ast_output_file> <expression_input_file>
     //   <program> build <ast_output_file>   (read expression from stdin)
     if (argc != 3 && argc != 4) {
         std::cerr << "Usage: " << argv[0]
-                  << " build <ast_output_file> [expression_input_file]\n";
+                  << " build [--external] [--memory-limit=<MiB>] [--compress] "
+                     "[--max-<resource>=<n>] [-O<level>] "
+                     "<ast_output_file> [expression_input_file]\n";
         return 1;
     }
+    check_options(options,
+                  {"external", "memory-limit", "compress", "max-bytes",
+                   "max-tokens", "max-nodes", "max-depth", "O", "passes",
+                   "fixpoint", "opt-stats", "verify-opt"});
+    const ASTLimits limits = resource_limits(options);
+    if (has_limits(limits) && options.contains("external")) {
+        throw ASTException("resource limits don't apply to --external");
+    }
+    const bool optimizing =
+        std::ranges::any_of(std::initializer_list<const char*>{
+                                "O", "passes", "fixpoint", "opt-stats",
+                                "verify-opt"},
+                            [&options](const char* name) {
+                                return options.contains(name);
+                            });
+    if (optimizing && options.contains("external")) {
+        throw ASTException("optimization doesn't apply to --external");
+    }
+    PassManager optimizer = pass_manager(options);
 
-    // The expression string to hold the full content of the input file.
-    std::string expression;
+    // The stream to read the expression from. No expression file provided
+    // means reading from stdin by contract.
+    FdStreamBuf stdin_buffer(STDIN_FILENO, std::ios::in);
+    std::istream stdin_input(&stdin_buffer);
+    std::istream* expression_input = &stdin_input;
+    std::ifstream expression_file;
 
-    if (argc == 4) {
+    if (argc == 4 && std::string_view(argv[3]) != "-") {
         // Read the expression text from the input file.
-        std::ifstream expression_file(argv[3]);
+        expression_file.open(argv[3]);
         if (!expression_file) {
             std::cerr << "Error: expression input file does not exist or "
                          "cannot be opened: "
                       << argv[3] << '\n';
             return 1;
         }
-        expression = read_all(expression_file);
-    } else {
-        // No expression file provided: read from stdin by contract.
-        expression = read_all(std::cin);
+        expression_input = &expression_file;
     }
 
     // Open the target file that will hold the preorder AST.
-    std::ofstream ast_output(argv[2]);
-    if (!ast_output) {
-        std::cerr << "Error: could not open AST output file: " << argv[2]
-                  << '\n';
-        return 1;
+    std::unique_ptr<FdStreamBuf> stdout_buffer;
+    std::ofstream ast_file;
+    std::ostream ast_output(nullptr);
+    if (std::string_view(argv[2]) == "-") {
+        stdout_buffer =
+            std::make_unique<FdStreamBuf>(STDOUT_FILENO, std::ios::out);
+        ast_output.rdbuf(stdout_buffer.get());
+    } else {
+        ast_file.open(argv[2]);
+        if (!ast_file) {
+            std::cerr << "Error: could not open AST output file: " << argv[2]
+                      << '\n';
+            return 1;
+        }
+        ast_output.rdbuf(ast_file.rdbuf());
     }
 
-    // Parse expression into the in-memory AST, then serialize it in preorder.
-    AST ast;
-    ast.parse(expression);
-    write_pre(ast.root(), ast_output);
+    // With --compress, the preorder goes through a compressor on its way to
+    // the file.
+    std::unique_ptr<CompressingStreamBuf> compressor;
+    std::ostream compressed_output(nullptr);
+    std::ostream* preorder_output = &ast_output;
+    if (options.contains("compress")) {
+        compressor = std::make_unique<CompressingStreamBuf>(ast_output);
+        compressed_output.rdbuf(compressor.get());
+        preorder_output = &compressed_output;
+    }
+
+    if (options.contains("external")) {
+        build_external(*expression_input, *preorder_output,
+                       external_memory_options(options));
+    } else {
+        // Parse expression into the in-memory AST, then serialize it in
+        // preorder.
+        AST ast;
+        ast.set_limits(limits);
+        if (expression_file.is_open() &&
+            std::filesystem::is_regular_file(argv[3])) {
+            // A regular file is read whole, so that parse() can lex and
+            // build it on several threads, which beats the single
+            // pipeline of parse_stream() on large inputs.
+            ast.parse(read_all(expression_file));
+        } else {
+            ast.parse_stream(*expression_input);
+        }
+        if (optimizing) {
+            std::unique_ptr<Node> root = ast.release_root();
+            optimizer.run(root);
+            ast.set_root(std::move(root));
+            if (options.contains("opt-stats")) {
+                optimizer.write_statistics(std::cerr);
+            }
+        }
+        ast.write_preorder(*preorder_output);
+    }
     // Trailing newline for cleaner output files, for terminals.
-    ast_output << '\n';
+    *preorder_output << '\n';
+    if (compressor) {
+        compressor->finish();
+    }
+    if (!ast_output.flush()) {
+        throw ASTException("error writing AST output");
+    }
     return 0;
 }
 
@@ -157,35 +352,82 @@ int run_build_mode(int argc, char* argv[]) {
  *   3. Print the final numeric result to stdout.
  *
  * CLI contract:
- *     <program> eval <ast_input_file> [variable_values_file]
+ *     <program> eval [options] <ast_input_file> [variable_values_file]
+ *
+ * An AST input file of "-" means stdin. Plain and compressed preorder are
+ * both evaluated as they arrive, so eval can run at the end of a pipe from
+ * build without waiting for it to finish.
+ *
+ * Options:
+ * - --external: Evaluate out of core (see eval_pre_external), for trees
+ *   larger than memory.
+ * - --memory-limit=<MiB>: The memory budget of --external.
+ * - --io=<auto|io_uring|pread>, --queue-depth=<n>: Read the AST file into
+ *   memory with an IoEngine, many chunks at a time, before evaluating it.
+ * - --max-bytes=<n>, --max-tokens=<n>, --max-nodes=<n>, --max-depth=<n>,
+ *   --max-eval-ops=<n>: Stop as soon as the AST file goes over the limit
+ *   (see ASTLimits). The file is then always evaluated as it's read, so
+ *   these can't be combined with --external or --io.
+ * - --threads=<n>: The threads that parse a large variable values file. By
+ *   default one per core.
  *
  * @param argc Argument count from main context. Must be 3 or 4.
- * @param argv Argument vector from main context.
+ * @param argv Argument vector from main context, without the options.
  * - argv[0]: The executable name.
  * - argv[1]: The mode string (in this case: "eval").
  * - argv[2]: The AST input file path containing the preorder token stream to
  *   evaluate.
  * - argv[3]: Optional variable values file path. One assignment per line in
  *   the format "x=7".
+ * @param options The options from the command line.
  * @return Exit code (0 on success, non-zero on error).
  */
-int run_eval_mode(int argc, char* argv[]) {
+int run_eval_mode(int argc, char* argv[], const CommandLineOptions& options) {
     // Support:
     //   <program> eval <ast_input_file>
     //   <program> eval <ast_input_file> <variable_values_file>
     if (argc != 3 && argc != 4) {
         std::cerr << "Usage: " << argv[0]
-                  << " eval <ast_input_file> [variable_values_file]\n";
+                  << " eval [--external] [--memory-limit=<MiB>] "
+                     "[--io=<backend>] [--queue-depth=<n>] "
+                     "[--max-<resource>=<n>] [--threads=<n>] "
+                     "<ast_input_file> [variable_values_file]\n";
         return 1;
     }
+    check_options(options, {"external", "memory-limit", "io", "queue-depth",
+                            "max-bytes", "max-tokens", "max-nodes",
+                            "max-depth", "max-eval-ops", "threads"});
+    const ASTLimits limits = resource_limits(options);
+    const bool limited = has_limits(limits);
+    if (limited && (options.contains("external") || options.contains("io") ||
+                    options.contains("queue-depth"))) {
+        throw ASTException(
+            "resource limits don't apply to --external or --io");
+    }
 
-    // Open the input file containing the preorder AST token stream.
-    std::ifstream ast_input(argv[2]);
-    if (!ast_input) {
-        std::cerr << "Error: AST input file does not exist or cannot be "
-                     "opened: "
-                  << argv[2] << '\n';
-        return 1;
+    // Open the input file containing the preorder AST token stream. The
+    // paths below that open the file by name get stdin as /dev/stdin.
+    const bool from_stdin = std::string_view(argv[2]) == "-";
+    const char* ast_path = from_stdin ? "/dev/stdin" : argv[2];
+    FdStreamBuf stdin_buffer(STDIN_FILENO, std::ios::in);
+    std::ifstream ast_file;
+    std::istream ast_input(&stdin_buffer);
+    if (!from_stdin) {
+        ast_file.open(argv[2]);
+        if (!ast_file) {
+            std::cerr << "Error: AST input file does not exist or cannot be "
+                         "opened: "
+                      << argv[2] << '\n';
+            return 1;
+        }
+        ast_input.rdbuf(ast_file.rdbuf());
+    }
+    std::optional<LimitedStreamBuf> limited_buffer;
+    if (limits.max_input_bytes != 0) {
+        limited_buffer.emplace(*ast_input.rdbuf(), limits.max_input_bytes);
+        ast_input.rdbuf(&*limited_buffer);
+        // Let the limit's exception through, rather than just failing reads.
+        ast_input.exceptions(std::ios::badbit);
     }
 
     // The map of variable names to their integer values, if provided.
@@ -200,12 +442,71 @@ int run_eval_mode(int argc, char* argv[]) {
                       << argv[3] << '\n';
             return 1;
         }
-        variable_values = parse_variable_values_file(variable_values_input);
+        variable_values = parse_variable_values_file(
+            variable_values_input, thread_count_option(options));
     }
 
     // Evaluate the preorder stream directly and print the final result.
     try {
-        const int64_t result = eval_pre(ast_input, variable_values);
+        if (options.contains("io") || options.contains("queue-depth")) {
+            ast_file.close();
+            const std::unique_ptr<IoEngine> engine =
+                IoEngine::create(io_engine_options(options));
+            std::cout << eval_preorder_contents(engine->read_file(ast_path),
+                                                variable_values)
+                      << '\n';
+            return 0;
+        }
+        if (from_stdin ? stdin_buffer.peek(compressed_magic.size()) ==
+                             compressed_magic
+                       : limited && is_compressed_file(ast_path)) {
+            // A pipe can't be decoded from the end like a file, so decode
+            // the blocks as they arrive. Limits are checked in the order the
+            // tokens are read, so a file is decoded that way too.
+            std::cout << eval_pre_compressed_stream(ast_input,
+                                                    variable_values, limits)
+                      << '\n';
+            return 0;
+        }
+        if (is_compressed_file(ast_path)) {
+            ast_file.close();
+            int64_t result = 0;
+            if (options.contains("external")) {
+                SpillStack<int64_t> values(
+                    external_memory_options(options).memory_limit /
+                    sizeof(int64_t));
+                result = eval_pre_compressed(ast_path, variable_values, values);
+            } else {
+                std::vector<int64_t> values;
+                result = eval_pre_compressed(ast_path, variable_values, values);
+            }
+            std::cout << result << '\n';
+            return 0;
+        }
+        if (options.contains("external")) {
+            ast_file.close();
+            // Looking for compressed_magic read from stdin, so a pipe is
+            // copied from its buffer, which still holds those bytes.
+            std::optional<TempFile> spool;
+            std::unique_ptr<std::FILE, FileCloser> input;
+            if (from_stdin && lseek(STDIN_FILENO, 0, SEEK_CUR) < 0) {
+                spool = spool_to_temp_file(stdin_buffer);
+            } else {
+                input.reset(std::fopen(ast_path, "rb"));
+                if (!input) {
+                    throw ASTException(
+                        std::string("cannot open AST input file: ") +
+                        ast_path);
+                }
+            }
+            std::cout << eval_pre_external(spool ? spool->get() : input.get(),
+                                           variable_values,
+                                           external_memory_options(options))
+                      << '\n';
+            return 0;
+        }
+
+        const int64_t result = eval_pre(ast_input, variable_values, limits);
 
         // Check for trailing garbage tokens after the full tree is read.
         if (std::string trailing; ast_input >> trailing) {
@@ -221,142 +522,861 @@ int run_eval_mode(int argc, char* argv[]) {
 }
 
 /**
- * @brief Serialize an AST to a stream in preorder format.
+ * @brief Batch mode: evaluate many AST files.
+ *   1. Read the job list: one job per line, an AST file and optionally a
+ *      variable values file, separated by whitespace.
+ *   2. Read every file named in the list with an IoEngine, which keeps many
+ *      reads in flight.
+ *   3. As soon as both files of a job are in, evaluate the job on one of the
+ *      worker threads.
+ *   4. Print one line per job, in the order of the list: the result, or
+ *      "Error: <message>".
  *
- * Format (space-separated tokens):
- * - Number node  -> <integer>
- * - Operator node-> <operator_symbol> <left-subtree> <right-subtree>
- *   where <operator_symbol> is one of +, -, *, /
+ * CLI contract:
+ *     <program> batch [options] <job_list_file>
  *
- * Example for 1 + 1:
- *   + 1 1
+ * Options:
+ * - --io=<auto|io_uring|pread>: The I/O backend. auto uses io_uring if the
+ *   kernel allows it.
+ * - --queue-depth=<n>: The most reads in flight (default 64).
  *
- * @param current_node Current AST node pointer in recursive context.
- * - Number node => writes the integer token's value.
- * - Operator node => writes the operator token and recurses into left/right
- * @param output_stream Output stream receiving the preorder token stream.
- */
-void write_pre(const Node* current_node, std::ostream& output_stream) {
-    // Leaf case: output the integer value.
-    if (current_node->type == NodeType::Number) {
-        output_stream << current_node->value << ' ';
-        return;
+ * @param argc Argument count from main context. Must be 3.
+ * @param argv Argument vector from main context, without the options.
+ * - argv[2]: The job list file path.
+ * @param options The options from the command line.
+ * @return Exit code (0 if every job succeeded, non-zero otherwise).
+ */
+int run_batch_mode(int argc, char* argv[], const CommandLineOptions& options) {
+    if (argc != 3) {
+        std::cerr << "Usage: " << argv[0]
+                  << " batch [--io=<backend>] [--queue-depth=<n>] "
+                     "<job_list_file>\n";
+        return 1;
     }
-    if (current_node->type == NodeType::Variable) {
-        output_stream << current_node->variable_name << ' ';
-        return;
+    check_options(options, {"io", "queue-depth"});
+
+    std::ifstream job_list(argv[2]);
+    if (!job_list) {
+        std::cerr << "Error: job list file does not exist or cannot be "
+                     "opened: "
+                  << argv[2] << '\n';
+        return 1;
+    }
+
+    // The files of a job, as indices into paths.
+    struct Job {
+        std::size_t ast_file;
+        std::optional<std::size_t> values_file;
+        std::size_t files_missing;
+    };
+    std::vector<Job> jobs;
+    // Every file is read once, however many jobs name it.
+    std::vector<std::string> paths;
+    std::unordered_map<std::string, std::size_t> path_indices;
+    std::vector<std::vector<std::size_t>> jobs_of_file;
+    const auto file_index = [&](const std::string& path) {
+        const auto [path_it, inserted] =
+            path_indices.try_emplace(path, paths.size());
+        if (inserted) {
+            paths.push_back(path);
+            jobs_of_file.emplace_back();
+        }
+        return path_it->second;
+    };
+
+    std::string line;
+    for (std::size_t line_number = 1; std::getline(job_list, line);
+         ++line_number) {
+        std::istringstream fields(line);
+        std::string ast_path;
+        std::string values_path;
+        if (!(fields >> ast_path)) {
+            continue; // Blank line.
+        }
+        fields >> values_path;
+        if (std::string extra; fields >> extra) {
+            throw ASTException("too many files on job list line " +
+                               std::to_string(line_number));
+        }
+        Job job{file_index(ast_path), std::nullopt, 1};
+        jobs_of_file[job.ast_file].push_back(jobs.size());
+        if (!values_path.empty()) {
+            job.values_file = file_index(values_path);
+            if (*job.values_file != job.ast_file) {
+                ++job.files_missing;
+                jobs_of_file[*job.values_file].push_back(jobs.size());
+            }
+        }
+        jobs.push_back(job);
+    }
+
+    std::vector<std::string> contents(paths.size());
+    std::vector<std::exception_ptr> read_errors(paths.size());
+    std::vector<std::string> outputs(jobs.size());
+    std::vector<char> failed(jobs.size(), 0);
+
+    const auto run_job = [&](std::size_t job_index) {
+        const Job& job = jobs[job_index];
+        try {
+            if (read_errors[job.ast_file]) {
+                std::rethrow_exception(read_errors[job.ast_file]);
+            }
+            std::unordered_map<std::string, int64_t> variable_values;
+            if (job.values_file) {
+                if (read_errors[*job.values_file]) {
+                    std::rethrow_exception(read_errors[*job.values_file]);
+                }
+                // The jobs already run in parallel.
+                variable_values =
+                    parse_variable_values(contents[*job.values_file], 1);
+            }
+            outputs[job_index] = std::to_string(
+                eval_preorder_contents(contents[job.ast_file],
+                                       variable_values));
+        } catch (const std::exception& e) {
+            outputs[job_index] = std::string("Error: ") + e.what();
+            failed[job_index] = 1;
+        }
+    };
+
+    // The jobs whose files are all in, for the workers to take.
+    std::mutex ready_mutex;
+    std::condition_variable ready_changed;
+    std::deque<std::size_t> ready_jobs;
+    bool reading_done = false;
+
+    std::vector<std::thread> workers(
+        std::max(1U, std::thread::hardware_concurrency()));
+    for (std::thread& worker : workers) {
+        worker = std::thread([&] {
+            for (;;) {
+                std::unique_lock<std::mutex> lock(ready_mutex);
+                ready_changed.wait(lock, [&] {
+                    return !ready_jobs.empty() || reading_done;
+                });
+                if (ready_jobs.empty()) {
+                    return;
+                }
+                const std::size_t job_index = ready_jobs.front();
+                ready_jobs.pop_front();
+                lock.unlock();
+                run_job(job_index);
+            }
+        });
     }
 
-    // Internal node: emit the operator token first (preorder), then recurse
-    // into its child nodes.
-    char operator_symbol;
-    if (current_node->type == NodeType::Add) {
-        operator_symbol = '+';
-    } else if (current_node->type == NodeType::Sub) {
-        operator_symbol = '-';
-    } else if (current_node->type == NodeType::Mult) {
-        operator_symbol = '*';
-    } else if (current_node->type == NodeType::Div) {
-        operator_symbol = '/';
+    try {
+        const std::unique_ptr<IoEngine> engine =
+            IoEngine::create(io_engine_options(options));
+        engine->read_files(paths, [&](std::size_t index, std::string text,
+                                      std::exception_ptr error) {
+            contents[index] = std::move(text);
+            read_errors[index] = std::move(error);
+            const std::lock_guard<std::mutex> lock(ready_mutex);
+            for (const std::size_t job_index : jobs_of_file[index]) {
+                if (--jobs[job_index].files_missing == 0) {
+                    ready_jobs.push_back(job_index);
+                    ready_changed.notify_one();
+                }
+            }
+        });
+    } catch (...) {
+        {
+            const std::lock_guard<std::mutex> lock(ready_mutex);
+            ready_jobs.clear();
+            reading_done = true;
+        }
+        ready_changed.notify_all();
+        for (std::thread& worker : workers) {
+            worker.join();
+        }
+        throw;
+    }
+    {
+        const std::lock_guard<std::mutex> lock(ready_mutex);
+        reading_done = true;
+    }
+    ready_changed.notify_all();
+    for (std::thread& worker : workers) {
+        worker.join();
+    }
+
+    for (const std::string& output : outputs) {
+        std::cout << output << '\n';
+    }
+    return std::ranges::find(failed, 1) == failed.end() ? 0 : 1;
+}
+
+/**
+ * @brief Convert mode: translate an AST file to another format (see
+ * AstFormat) in one pass, for migrating files of any size.
+ *   1. Read the tokens of the input file in preorder.
+ *   2. Check each token, and that the tokens form exactly one tree.
+ *   3. Write each token to the output file as it is read. Postorder output
+ *      holds back each operator until its operands are written.
+ *
+ * Only a buffer's worth of each file, plus the pending operators along one
+ * path of the tree, is in memory at a time, and pipes are read as they
+ * come. The exception is postorder input: preorder starts with the root,
+ * which postorder stores last, so its tokens are read into memory first.
+ *
+ * CLI contract:
+ *     <program> convert --to=<format> [--from=<format>] <input> <output>
+ *
+ * Options:
+ * - --to=<preorder|postorder|binary|compressed>: The output format.
+ * - --from=<format>: The input format. By default, binary and compressed
+ *   files are told apart by their magic, and text is taken as preorder.
+ *
+ * @param argc Argument count from main context. Must be 4.
+ * @param argv Argument vector from main context, without the options.
+ * - argv[2]: The input file path, or "-" for stdin.
+ * - argv[3]: The output file path, or "-" for stdout.
+ * @param options The options from the command line.
+ * @return Exit code (0 on success, non-zero on error).
+ */
+int run_convert_mode(int argc, char* argv[],
+                     const CommandLineOptions& options) {
+    if (argc != 4 || !options.contains("to")) {
+        std::cerr << "Usage: " << argv[0]
+                  << " convert --to=<format> [--from=<format>] "
+                     "<input_file> <output_file>\n"
+                  << "Formats: preorder, postorder, binary, compressed\n";
+        return 1;
+    }
+    check_options(options, {"from", "to"});
+    const AstFormat to = parse_ast_format(options.at("to"));
+
+    const std::string_view input_path = argv[2];
+    const std::unique_ptr<std::FILE, FileCloser> input(std::fopen(
+        input_path == "-" ? "/dev/stdin" : input_path.data(), "rb"));
+    if (!input) {
+        std::cerr << "Error: input file does not exist or cannot be opened: "
+                  << input_path << '\n';
+        return 1;
+    }
+    FdStreamBuf input_buffer(fileno(input.get()), std::ios::in);
+    const AstFormat from =
+        options.contains("from")
+            ? parse_ast_format(options.at("from"))
+            : detect_ast_format(input_buffer.peek(compressed_magic.size()));
+
+    std::unique_ptr<FdStreamBuf> stdout_buffer;
+    std::ofstream output_file;
+    std::ostream output(nullptr);
+    if (std::string_view(argv[3]) == "-") {
+        stdout_buffer =
+            std::make_unique<FdStreamBuf>(STDOUT_FILENO, std::ios::out);
+        output.rdbuf(stdout_buffer.get());
     } else {
-        // IF it's not one of these, then we have a malformed AST.
-        throw ASTException("malformed AST");
+        output_file.open(argv[3], std::ios::binary);
+        if (!output_file) {
+            std::cerr << "Error: could not open output file: " << argv[3]
+                      << '\n';
+            return 1;
+        }
+        output.rdbuf(output_file.rdbuf());
+    }
+
+    // The tokens go from the source to the sink in preorder, whatever the
+    // formats.
+    std::istream input_stream(&input_buffer);
+    try {
+        const std::unique_ptr<TokenSource> source =
+            open_token_source(input_stream, from);
+        const std::unique_ptr<TokenSink> sink = open_token_sink(output, to);
+        convert_tokens(*source, *sink);
+    } catch (const std::exception& e) {
+        std::cerr << "Error: " << e.what() << '\n';
+        return 1;
+    }
+    if (!output.flush()) {
+        throw ASTException("error writing AST output");
+    }
+    return 0;
+}
+
+/**
+ * @brief Check mode: report whether an expression would parse, without
+ * parsing it (see ExpressionValidator). The expression is read a block at a
+ * time, so memory doesn't grow with it.
+ *   1. Read the expression from the input file.
+ *   2. Print "ok" if build would accept it. Otherwise print the error that
+ *      build would report, and fail.
+ *
+ * CLI contract:
+ *     <program> check [options] [expression_input_file]
+ *
+ * Options:
+ * - --max-bytes=<n>: Reject an expression longer than this, like build
+ *   with the same option.
+ *
+ * @param argc Argument count from main context. Must be 2 or 3.
+ * @param argv Argument vector from main context, without the options.
+ * - argv[2]: Optional expression input file path. Without it, or with "-",
+ *   the expression is read from stdin.
+ * @param options The options from the command line.
+ * @return Exit code (0 if the expression is valid, non-zero otherwise).
+ */
+int run_check_mode(int argc, char* argv[], const CommandLineOptions& options) {
+    if (argc != 2 && argc != 3) {
+        std::cerr << "Usage: " << argv[0]
+                  << " check [--max-bytes=<n>] [expression_input_file]\n";
+        return 1;
+    }
+    check_options(options, {"max-bytes"});
+    const ASTLimits limits = resource_limits(options);
+
+    FdStreamBuf stdin_buffer(STDIN_FILENO, std::ios::in);
+    std::ifstream expression_file;
+    std::streambuf* input = &stdin_buffer;
+    if (argc == 3 && std::string_view(argv[2]) != "-") {
+        expression_file.open(argv[2], std::ios::binary);
+        if (!expression_file) {
+            std::cerr << "Error: expression input file does not exist or "
+                         "cannot be opened: "
+                      << argv[2] << '\n';
+            return 1;
+        }
+        input = expression_file.rdbuf();
+    }
+
+    try {
+        ExpressionValidator validator;
+        std::vector<char> buffer(std::size_t{1} << 20);
+        std::streamsize size = 0;
+        uint64_t input_size = 0;
+        while ((size = input->sgetn(buffer.data(),
+                                    static_cast<std::streamsize>(
+                                        buffer.size()))) > 0) {
+            input_size += static_cast<uint64_t>(size);
+            if (limits.max_input_bytes != 0 &&
+                input_size > limits.max_input_bytes) {
+                throw ASTException("input exceeds the byte limit");
+            }
+            validator.feed({buffer.data(), static_cast<std::size_t>(size)});
+        }
+        validator.finish();
+    } catch (const std::exception& e) {
+        std::cerr << "Error: " << e.what() << '\n';
+        return 1;
     }
-    output_stream << operator_symbol << ' ';
-    write_pre(current_node->left.get(), output_stream);
-    write_pre(current_node->right.get(), output_stream);
+    std::cout << "ok\n";
+    return 0;
+}
+
+/**
+ * @brief Forest mode: evaluate many formulas that share subexpressions.
+ *   1. Read the formulas, one expression per line, and parse each of them.
+ *   2. Add their trees to a SharedForest, which stores every distinct
+ *      subtree once.
+ *   3. Evaluate all formulas with the variable values, evaluating every
+ *      distinct subtree once.
+ *   4. Print one line per formula, in order: the result, or
+ *      "Error: <message>". Then write the forest's statistics (the sharing
+ *      ratio and the operations saved) and the evaluation time to stderr.
+ *
+ * CLI contract:
+ *     <program> forest <formula_file> [variable_values_file]
+ *
+ * Blank lines of the formula file are skipped.
+ *
+ * @param argc Argument count from main context. Must be 3 or 4.
+ * @param argv Argument vector from main context, without the options.
+ * - argv[2]: The formula file path, or "-" for stdin.
+ * - argv[3]: Optional variable values file path.
+ * @param options The options from the command line.
+ * @return Exit code (0 if every formula succeeded, non-zero otherwise).
+ */
+int run_forest_mode(int argc, char* argv[], const CommandLineOptions& options) {
+    if (argc != 3 && argc != 4) {
+        std::cerr << "Usage: " << argv[0]
+                  << " forest <formula_file> [variable_values_file]\n";
+        return 1;
+    }
+    check_options(options, {});
+
+    FdStreamBuf stdin_buffer(STDIN_FILENO, std::ios::in);
+    std::ifstream formula_file;
+    std::istream formula_input(&stdin_buffer);
+    if (std::string_view(argv[2]) != "-") {
+        formula_file.open(argv[2]);
+        if (!formula_file) {
+            std::cerr << "Error: formula file does not exist or cannot be "
+                         "opened: "
+                      << argv[2] << '\n';
+            return 1;
+        }
+        formula_input.rdbuf(formula_file.rdbuf());
+    }
+
+    std::unordered_map<std::string, int64_t> variable_values;
+    if (argc == 4) {
+        std::ifstream variable_values_input(argv[3]);
+        if (!variable_values_input) {
+            std::cerr << "Error: variable values file does not exist or cannot "
+                         "be opened: "
+                      << argv[3] << '\n';
+            return 1;
+        }
+        variable_values = parse_variable_values_file(variable_values_input);
+    }
+
+    // The formula of each line, or the error that parsing it failed with.
+    std::vector<std::optional<std::size_t>> formulas;
+    std::vector<std::string> parse_errors;
+    SharedForest forest;
+    AST ast;
+    for (std::string line; std::getline(formula_input, line);) {
+        if (std::ranges::all_of(line, [](unsigned char character) {
+                return std::isspace(character) != 0;
+            })) {
+            continue;
+        }
+        try {
+            ast.parse(line);
+            formulas.emplace_back(forest.add(ast));
+            parse_errors.emplace_back();
+        } catch (const ASTException& e) {
+            formulas.emplace_back();
+            parse_errors.emplace_back(e.what());
+        }
+    }
+    if (formula_input.bad()) {
+        throw ASTException("error reading formula input");
+    }
+
+    const auto start = std::chrono::steady_clock::now();
+    const std::vector<FormulaResult> results =
+        forest.evaluate(variable_values);
+    const std::chrono::duration<double, std::milli> evaluation_time =
+        std::chrono::steady_clock::now() - start;
+
+    bool failed = false;
+    for (std::size_t index = 0; index < formulas.size(); ++index) {
+        const std::string& error = formulas[index]
+                                       ? results[*formulas[index]].error
+                                       : parse_errors[index];
+        if (error.empty()) {
+            std::cout << results[*formulas[index]].value << '\n';
+        } else {
+            std::cout << "Error: " << error << '\n';
+            failed = true;
+        }
+    }
+    forest.write_statistics(std::cerr);
+    std::cerr << "evaluation: " << std::fixed << std::setprecision(3)
+              << evaluation_time.count() << " ms\n";
+    return failed ? 1 : 0;
 }
 
 /**
- * @brief Evaluate a preorder token stream recursively.
+ * @brief Evaluate a preorder token stream as it is read (see
+ * PreorderEvaluator).
  *
  * Reading rules:
- * - If the token is an operator (+, -, *, /), recursively read/evaluate two
+ * - If the token is an operator (+, -, *, /), the next two subtrees are its
  *   operands.
+ * - If the token is a variable name, its value comes from variable_values.
  * - Otherwise the token is parsed as a signed integer literal.
  *
  * @param input_stream The input stream containing preorder tokens. The
- * function consumes exactly the tokens for one subtree and leaves the stream
- * positioned immediately after that subtree.
- * @return Computed 64-bit integer value of the parsed subtree.
+ * function reads until EOF, and the stream must hold exactly one tree.
+ * @param variable_values The values of the variables.
+ * @param limits The limits on the tree and its evaluation.
+ * @return Computed 64-bit integer value of the tree.
  */
 int64_t
 eval_pre(std::istream& input_stream,
-         const std::unordered_map<std::string, int64_t>& variable_values) {
-    // The current token we're processing in the stream.
-    std::vector<std::string> tokens;
-    // Tokenize the input stream by reading space-separated tokens until EOF.
-    // The tokens vector will hold all the tokens in the input stream, which we
-    // will process in reverse order to evaluate the preorder expression.
-    for (std::string token; input_stream >> token;) {
-        tokens.push_back(token);
+         const std::unordered_map<std::string, int64_t>& variable_values,
+         const ASTLimits& limits) {
+    PreorderEvaluator evaluator(variable_values, limits);
+    TokenReader reader(*input_stream.rdbuf());
+    for (std::string tok; reader.next(tok);) {
+        evaluator.add(tok);
     }
+    return evaluator.finish();
+}
+
+/**
+ * @brief Evaluate a compressed preorder stream that can't seek, like a pipe,
+ * decompressing its blocks in order as they arrive.
+ * @param input_stream The compressed stream, at its magic.
+ * @param variable_values The values of the variables.
+ * @param limits The limits on the tree and its evaluation.
+ * @return The value of the expression.
+ */
+int64_t eval_pre_compressed_stream(
+    std::istream& input_stream,
+    const std::unordered_map<std::string, int64_t>& variable_values,
+    const ASTLimits& limits) {
+    PreorderEvaluator evaluator(variable_values, limits);
+    const std::unique_ptr<TokenSource> source =
+        open_token_source(input_stream, AstFormat::Compressed);
+    for (std::string tok; source->next(tok);) {
+        evaluator.add(tok);
+    }
+    return evaluator.finish();
+}
+
+/**
+ * @brief Checks the tokens of an AST and copies them to a writer, in the
+ * order they are read.
+ * @param source The tokens, in preorder.
+ * @param sink The writer.
+ */
+void convert_tokens(TokenSource& source, TokenSink& sink) {
+    // The number of operands still to come.
+    uint64_t count = 1;
+    for (std::string tok; source.next(tok);) {
+        const bool is_operator =
+            tok == "+" || tok == "-" || tok == "*" || tok == "/";
+        if (count == 0) {
+            throw ASTException("bad preorder");
+        }
+        count = is_operator ? count + 1 : count - 1;
 
-    if (tokens.empty()) {
+        if (is_operator) {
+            sink.write_operator(tok[0]);
+        } else if (is_variable_token(tok)) {
+            sink.write_variable(tok);
+        } else {
+            sink.write_integer(parse_int64_token(tok));
+        }
+    }
+    if (count != 0) {
         throw ASTException("bad preorder");
     }
+    sink.finish();
+}
 
-    // The stack of values for evaluating the expression.
-    std::vector<int64_t> values;
-    // Reserve space in the values vector to avoid repeated reallocations as we
-    // push values onto it. The maximum number of values we would need is equal
-    // to the number of tokens.
-    values.reserve(tokens.size());
-
-    // Process the tokens in reverse order, since it's a preorder stream and we
-    // want to evaluate the operators after their operands.
-    for (auto it = tokens.rbegin(); it != tokens.rend(); ++it) {
-        const std::string& tok = *it;
-
-        // If the token is an operator.
-        if (tok == "+" || tok == "-" || tok == "*" || tok == "/") {
-            // If we have fewer than 2 values on the stack, then we have a bad
-            // preorder error, since operators must have 2 operands.
-            if (values.size() < 2) {
-                throw ASTException("bad preorder");
-            }
+// MARK: PreorderEvaluator
+PreorderEvaluator::PreorderEvaluator(
+    const std::unordered_map<std::string, int64_t>& variable_values,
+    const ASTLimits& limits)
+    : variable_values_(variable_values), limits_(limits) {}
+
+/**
+ * @brief Adds the next token of the stream. Errors are recorded rather than
+ * thrown, since a later token's error takes precedence.
+ * @param tok The token.
+ */
+void PreorderEvaluator::add(const std::string& tok) {
+    ++position_;
+    const bool is_operator =
+        tok == "+" || tok == "-" || tok == "*" || tok == "/";
+    check_limits(is_operator);
+    if (is_operator) {
+        frames_.push_back({position_, 0, tok[0], false, false});
+        return;
+    }
+
+    Operand operand{0, true};
+    if (is_variable_token(tok)) {
+        const auto variable_it = variable_values_.find(tok);
+        if (variable_it == variable_values_.end()) {
+            fail("missing variable value: " + tok, position_);
+            operand.valid = false;
+        } else {
+            operand.value = variable_it->second;
+        }
+    } else {
+        try {
+            operand.value = parse_int64_token(tok);
+        } catch (const ASTException& e) {
+            fail(e.what(), position_);
+            operand.valid = false;
+        }
+    }
+    complete(operand);
+}
 
-            // Pop the top 2 values from the stack.
-            int64_t left = values.back();
-            values.pop_back();
-            int64_t right = values.back();
-            values.pop_back();
-
-            // Apply the operator to the left and right values and push the
-            // result back onto the stack.
-            if (tok == "+") {
-                values.push_back(checked_add(left, right));
-            } else if (tok == "-") {
-                values.push_back(checked_sub(left, right));
-            } else if (tok == "*") {
-                values.push_back(checked_mul(left, right));
+/**
+ * @brief Hands a finished subtree to the operator waiting for it, applying
+ * every operator that it completes.
+ * @param operand The value of the subtree.
+ */
+void PreorderEvaluator::complete(Operand operand) {
+    while (!frames_.empty()) {
+        Frame& frame = frames_.back();
+        if (!frame.has_left) {
+            frame.has_left = true;
+            frame.left_value = operand.value;
+            frame.left_valid = operand.valid;
+            return;
+        }
+
+        Operand result{0, frame.left_valid && operand.valid};
+        if (result.valid) {
+            const int64_t left = frame.left_value;
+            const int64_t right = operand.value;
+            const char* error = nullptr;
+            if (frame.symbol == '+') {
+                error = try_checked_add(left, right, result.value);
+            } else if (frame.symbol == '-') {
+                error = try_checked_sub(left, right, result.value);
+            } else if (frame.symbol == '*') {
+                error = try_checked_mul(left, right, result.value);
             } else {
-                values.push_back(checked_div(left, right));
+                error = try_checked_div(left, right, result.value);
             }
-        } else if (is_variable_token(tok)) {
-            // Get the value of the variable in the variable_values map. If
-            // it's not found, throw an error.
-            const auto variable_it = variable_values.find(tok);
-            if (variable_it == variable_values.end()) {
-                throw ASTException("missing variable value: " + tok);
+            if (error != nullptr) {
+                // Every token after the operator is in its operands, which
+                // had no errors, so this is the furthest error so far.
+                fail(error, frame.position);
+                result.valid = false;
             }
-            values.push_back(variable_it->second);
-        } else {
-            values.push_back(parse_int64_token(tok));
         }
+        frames_.pop_back();
+        operand = result;
+    }
+    ++tree_count_;
+    result_ = operand.value;
+}
+
+/**
+ * @brief Throws if the token just added goes over one of the limits. In
+ * preorder every token is a node, and the operators still waiting for
+ * operands are exactly the token's ancestors.
+ * @param is_operator Whether the token is an operator.
+ */
+void PreorderEvaluator::check_limits(bool is_operator) {
+    const auto exceeds = [](uint64_t count, uint64_t limit) {
+        return limit != 0 && count > limit;
+    };
+    if (exceeds(position_, limits_.max_tokens)) {
+        throw ASTException("expression exceeds the token limit");
+    }
+    if (exceeds(position_, limits_.max_nodes)) {
+        throw ASTException("expression exceeds the node limit");
+    }
+    if (exceeds(frames_.size() + 1, limits_.max_depth)) {
+        throw ASTException("expression exceeds the depth limit");
+    }
+    if (is_operator &&
+        exceeds(++operator_count_, limits_.max_eval_operations)) {
+        throw ASTException("evaluation exceeds the operation limit");
+    }
+}
+
+/**
+ * @brief Records an error, unless an error further into the stream has been
+ * recorded.
+ */
+void PreorderEvaluator::fail(std::string message, uint64_t position) {
+    if (!error_ || position > error_position_) {
+        error_ = std::move(message);
+        error_position_ = position;
+    }
+}
+
+/**
+ * @brief Ends the stream.
+ * @return The value of the tree.
+ */
+int64_t PreorderEvaluator::finish() {
+    // An operator still missing an operand is an error at its position.
+    // Evaluating from the end would have reached it after the tokens of its
+    // left operand, which are the only tokens after it.
+    if (!frames_.empty()) {
+        fail("bad preorder", frames_.back().position);
+    }
+    if (error_) {
+        throw ASTException(*error_);
+    }
+    if (tree_count_ != 1) {
+        throw ASTException("bad preorder");
+    }
+    return result_;
+}
+
+/**
+ * @brief Evaluate a preorder file that may be larger than memory. The file is
+ * read backward in blocks, and the values are kept in a stack that spills to
+ * a temporary file, so the result and any error are the same as eval_pre()
+ * without reading the whole file into memory.
+ * @param input The preorder file, read from its start. Inputs that can't
+ * seek, like pipes, are first copied to a temporary file.
+ * @param variable_values The values of the variables.
+ * @param options The memory limit.
+ * @return The value of the expression.
+ */
+int64_t eval_pre_external(
+    std::FILE* input,
+    const std::unordered_map<std::string, int64_t>& variable_values,
+    const ExternalMemoryOptions& options) {
+    std::optional<TempFile> spool;
+    std::FILE* seekable_input = input;
+    if (fseeko(input, 0, SEEK_END) != 0) {
+        spool = spool_to_temp_file(input);
+        seekable_input = spool->get();
+    }
+
+    // Half of the memory goes to the read buffer, and half to the values.
+    BackwardReader reader(seekable_input, options.memory_limit / 2);
+    SpillStack<int64_t> values(options.memory_limit / 2 / sizeof(int64_t));
+    bool saw_token = false;
+    for (std::string tok; read_word_backward(reader, tok);) {
+        saw_token = true;
+        apply_preorder_token(tok, values, variable_values);
+    }
+
+    if (!saw_token || values.size() != 1) {
+        throw ASTException("bad preorder");
+    }
+    return values.back();
+}
+
+/**
+ * @brief Evaluate a compressed preorder file (see BlockCodec.h). The blocks
+ * are decompressed from the last to the first on worker threads while the
+ * tokens of the blocks already decompressed are evaluated, so the result and
+ * any error are the same as eval_pre() on the uncompressed file.
+ * @param path The path of the compressed file.
+ * @param variable_values The values of the variables.
+ * @param values The stack of values to use, like std::vector<int64_t>, or a
+ * SpillStack for trees larger than memory.
+ * @return The value of the expression.
+ */
+template <typename Values>
+int64_t eval_pre_compressed(
+    const char* path,
+    const std::unordered_map<std::string, int64_t>& variable_values,
+    Values& values) {
+    const int descriptor = open(path, O_RDONLY | O_CLOEXEC);
+    if (descriptor < 0) {
+        throw ASTException(std::string("cannot open AST input file: ") + path);
+    }
+    bool saw_token = false;
+    try {
+        ReverseBlockDecoder decoder(descriptor);
+        std::string text;
+        // No token spans two blocks, so each block is walked back on its own.
+        while (decoder.next(text)) {
+            saw_token |= apply_preorder_text(text, values, variable_values);
+        }
+    } catch (...) {
+        close(descriptor);
+        throw;
     }
+    close(descriptor);
 
-    // After processing all the tokens, there should be exactly 1 value left on
-    // the stack, which is the final result of evaluating the preorder
-    // expression.
-    if (values.size() != 1) {
+    if (!saw_token || values.size() != 1) {
         throw ASTException("bad preorder");
     }
+    return values.back();
+}
+
+/**
+ * @brief Applies the tokens of a piece of preorder text, from the last to the
+ * first, with apply_preorder_token().
+ * @param text Whole tokens separated by whitespace.
+ * @param values The stack of values.
+ * @param variable_values The values of the variables.
+ * @return true if the text had any tokens.
+ */
+template <typename Values>
+bool apply_preorder_text(
+    std::string_view text, Values& values,
+    const std::unordered_map<std::string, int64_t>& variable_values) {
+    const auto is_space = [](char character) {
+        return std::isspace(static_cast<unsigned char>(character)) != 0;
+    };
+    bool saw_token = false;
+    std::string tok;
+    std::size_t end = text.size();
+    for (;;) {
+        while (end > 0 && is_space(text[end - 1])) {
+            --end;
+        }
+        if (end == 0) {
+            return saw_token;
+        }
+        std::size_t start = end;
+        while (start > 0 && !is_space(text[start - 1])) {
+            --start;
+        }
+        tok.assign(text, start, end - start);
+        saw_token = true;
+        apply_preorder_token(tok, values, variable_values);
+        end = start;
+    }
+}
 
-    // Return the final result.
+/**
+ * @brief Evaluate the contents of an AST file that has been read into
+ * memory, compressed or not. The result and any error are the same as
+ * eval_pre() on the file.
+ * @param contents The contents of the file.
+ * @param variable_values The values of the variables.
+ * @return The value of the expression.
+ */
+int64_t eval_preorder_contents(
+    std::string_view contents,
+    const std::unordered_map<std::string, int64_t>& variable_values) {
+    std::string decompressed;
+    if (contents.starts_with(compressed_magic)) {
+        decompressed = decompress_file(contents);
+        contents = decompressed;
+    }
+    std::vector<int64_t> values;
+    if (!apply_preorder_text(contents, values, variable_values) ||
+        values.size() != 1) {
+        throw ASTException("bad preorder");
+    }
     return values.back();
 }
 
+/**
+ * @brief Applies one token of a preorder stream that is being read from the
+ * end: an operator pops its two operands and pushes the result, and any other
+ * token pushes its value.
+ * @param tok The token.
+ * @param values The stack of values, like std::vector<int64_t>.
+ * @param variable_values The values of the variables.
+ */
+template <typename Values>
+void apply_preorder_token(
+    const std::string& tok, Values& values,
+    const std::unordered_map<std::string, int64_t>& variable_values) {
+    // If the token is an operator.
+    if (tok == "+" || tok == "-" || tok == "*" || tok == "/") {
+        // If we have fewer than 2 values on the stack, then we have a bad
+        // preorder error, since operators must have 2 operands.
+        if (values.size() < 2) {
+            throw ASTException("bad preorder");
+        }
+
+        // Pop the top 2 values from the stack.
+        int64_t left = values.back();
+        values.pop_back();
+        int64_t right = values.back();
+        values.pop_back();
+
+        // Apply the operator to the left and right values and push the
+        // result back onto the stack.
+        if (tok == "+") {
+            values.push_back(checked_add(left, right));
+        } else if (tok == "-") {
+            values.push_back(checked_sub(left, right));
+        } else if (tok == "*") {
+            values.push_back(checked_mul(left, right));
+        } else {
+            values.push_back(checked_div(left, right));
+        }
+    } else if (is_variable_token(tok)) {
+        // Get the value of the variable in the variable_values map. If
+        // it's not found, throw an error.
+        const auto variable_it = variable_values.find(tok);
+        if (variable_it == variable_values.end()) {
+            throw ASTException("missing variable value: " + tok);
+        }
+        values.push_back(variable_it->second);
+    } else {
+        values.push_back(parse_int64_token(tok));
+    }
+}
+
 /**
  * @brief Check if a token is a valid variable token, which consists of one or
  * more lower-case letters.
@@ -400,92 +1420,403 @@ int64_t parse_int64_token(const std::string& token) {
     }
 }
 
+/**
+ * @brief Parses the lines of a chunk of a variable values file, like
+ * parse_variable_values() does for a whole file, stopping at the first bad
+ * line. Duplicate names are left to the merge, which sees every chunk.
+ * @param text The chunk, made of whole lines.
+ * @param chunk Receives the assignments and the error.
+ */
+void parse_values_chunk(std::string_view text, ValuesChunk& chunk) {
+    const auto trim = [](std::string_view field) {
+        const auto is_space = [](char character) {
+            return std::isspace(static_cast<unsigned char>(character)) != 0;
+        };
+        while (!field.empty() && is_space(field.front())) {
+            field.remove_prefix(1);
+        }
+        while (!field.empty() && is_space(field.back())) {
+            field.remove_suffix(1);
+        }
+        return field;
+    };
+    const auto fail = [&chunk](ValuesError error, std::size_t line_number,
+                               std::string_view name = {}) {
+        chunk.error = error;
+        chunk.error_line = line_number;
+        chunk.error_name = name;
+    };
+
+    std::size_t line_number = 0;
+    for (std::size_t start = 0; start < text.size();) {
+        std::size_t end = text.find('\n', start);
+        if (end == std::string_view::npos) {
+            end = text.size();
+        }
+        ++line_number;
+        const std::string_view line = trim(text.substr(start, end - start));
+        start = end + 1;
+        if (line.empty()) {
+            continue;
+        }
+
+        const std::size_t equal_sign = line.find('=');
+        if (equal_sign == std::string_view::npos ||
+            line.find('=', equal_sign + 1) != std::string_view::npos) {
+            fail(ValuesError::Assignment, line_number);
+            return;
+        }
+        const std::string_view variable_name =
+            trim(line.substr(0, equal_sign));
+        const std::string_view variable_value_text =
+            trim(line.substr(equal_sign + 1));
+
+        if (variable_name.empty() ||
+            !std::ranges::all_of(variable_name, [](char character) {
+                return std::islower(static_cast<unsigned char>(character));
+            })) {
+            fail(ValuesError::Name, line_number);
+            return;
+        }
+
+        // Plain decimal numbers take the fast path. Anything else goes
+        // through parse_int64_token(), which decides what's accepted.
+        int64_t value = 0;
+        const char* value_end =
+            variable_value_text.data() + variable_value_text.size();
+        if (const auto [parsed_end, error] = std::from_chars(
+                variable_value_text.data(), value_end, value);
+            error != std::errc{} || parsed_end != value_end) {
+            try {
+                value = parse_int64_token(std::string(variable_value_text));
+            } catch (const ASTException& e) {
+                fail(ValuesError::Value, line_number, variable_name);
+                chunk.error_message = e.what();
+                return;
+            }
+        }
+        chunk.entries.push_back({variable_name, value, line_number});
+    }
+    chunk.line_count = line_number;
+}
+
 /**
  * @brief Parse a variable values file into a map of variable names to their
- * integer values.
+ * integer values (see parse_variable_values).
+ * @param input_stream The input stream to read the variable assignments from.
+ * Should be positioned at the beginning of the first line of the file. The
+ * function reads until EOF.
+ * @param thread_count The number of threads to use, or 0 for one per core.
+ * @return An unordered_map mapping variable names to their integer values as
+ * parsed from the file.
+ */
+std::unordered_map<std::string, int64_t>
+parse_variable_values_file(std::istream& input_stream, unsigned thread_count) {
+    std::string contents;
+    std::streamsize size = 0;
+    do {
+        const std::size_t old_size = contents.size();
+        contents.resize(old_size + (std::size_t{1} << 20));
+        size = input_stream.rdbuf()->sgetn(
+            contents.data() + old_size,
+            static_cast<std::streamsize>(contents.size() - old_size));
+        contents.resize(old_size + static_cast<std::size_t>(size));
+    } while (size > 0);
+    return parse_variable_values(contents, thread_count);
+}
+
+/**
+ * @brief Parse the contents of a variable values file into a map of variable
+ * names to their integer values.
  *
  * The variable values file should have one assignment per line in the format
  * "x=7", where the left-hand side is a variable name (lower-case letters only)
  * and the right-hand side is an integer value.
- * @param input_stream The input stream to read the variable assignments from.
- * Should be positioned at the beginning of the first line of the file. The
- * function reads until EOF.
+ *
+ * Large files are cut into chunks at line breaks, which are parsed on
+ * separate threads into tables of their own, and then merged in order. The
+ * error is the same as reading the file line by line: that of the first bad
+ * line, where a name that was assigned on an earlier line is bad.
+ * @param contents The contents of the file.
+ * @param thread_count The number of threads to use, or 0 for one per core.
  * @return An unordered_map mapping variable names to their integer values as
  * parsed from the file.
  */
 std::unordered_map<std::string, int64_t>
-parse_variable_values_file(std::istream& input_stream) {
-    // Helper lambda to trim leading/trailing whitespace from a string.
-    auto trim = [](const std::string& text) {
-        std::size_t start = 0;
-        while (start < text.size()) {
-            if (const auto curr_char = static_cast<unsigned char>(text[start]);
-                !std::isspace(curr_char)) {
-                break;
-            }
-            ++start;
+parse_variable_values(std::string_view contents, unsigned thread_count) {
+    if (thread_count == 0) {
+        thread_count = std::max(1U, std::thread::hardware_concurrency());
+    }
+    // Cut the contents into chunks of whole lines, at least
+    // min_values_chunk_size bytes each.
+    const std::size_t chunk_count = std::clamp<std::size_t>(
+        contents.size() / min_values_chunk_size, 1, thread_count);
+    std::vector<std::string_view> chunk_texts;
+    std::size_t chunk_start = 0;
+    for (std::size_t chunk = 1; chunk <= chunk_count; ++chunk) {
+        std::size_t chunk_end = contents.size();
+        if (chunk < chunk_count) {
+            chunk_end = contents.find(
+                '\n', std::max(chunk_start,
+                               contents.size() * chunk / chunk_count));
+            chunk_end = chunk_end == std::string_view::npos ? contents.size()
+                                                            : chunk_end + 1;
         }
+        chunk_texts.push_back(
+            contents.substr(chunk_start, chunk_end - chunk_start));
+        chunk_start = chunk_end;
+    }
 
-        std::size_t end = text.size();
-        while (end > start) {
-            if (const auto curr_char =
-                    static_cast<unsigned char>(text[end - 1]);
-                !std::isspace(curr_char)) {
-                break;
-            }
-            --end;
+    std::vector<ValuesChunk> chunks(chunk_texts.size());
+    if (chunks.size() == 1) {
+        parse_values_chunk(chunk_texts[0], chunks[0]);
+    } else {
+        std::vector<std::thread> threads;
+        for (std::size_t chunk = 0; chunk < chunks.size(); ++chunk) {
+            threads.emplace_back(parse_values_chunk, chunk_texts[chunk],
+                                 std::ref(chunks[chunk]));
         }
-        return text.substr(start, end - start);
-    };
+        for (std::thread& thread : threads) {
+            thread.join();
+        }
+    }
 
-    // The map to hold the parsed variable names and their corresponding
-    // integer values.
+    // Merge the chunks in order. The assignments come in line order, and
+    // all of a chunk's come before its bad line, so the first name that's
+    // already in the map is the first duplicate.
+    std::size_t total_entries = 0;
+    for (const ValuesChunk& chunk : chunks) {
+        total_entries += chunk.entries.size();
+    }
     std::unordered_map<std::string, int64_t> variable_values;
-    std::size_t line_number = 0; // The current line number, for error handling.
-    std::string line; // The current line being read from the input stream.
+    variable_values.reserve(total_entries);
+    const auto duplicate_error = [](std::string_view name,
+                                    std::size_t line_number) {
+        return ASTException("duplicate variable assignment for '" +
+                            std::string(name) + "' on line " +
+                            std::to_string(line_number));
+    };
+    std::size_t lines_before = 0;
+    for (ValuesChunk& chunk : chunks) {
+        for (const ValuesEntry& entry : chunk.entries) {
+            if (!variable_values.try_emplace(std::string(entry.name),
+                                             entry.value)
+                     .second) {
+                throw duplicate_error(entry.name, lines_before + entry.line);
+            }
+        }
+        const std::string line_text =
+            std::to_string(lines_before + chunk.error_line);
+        switch (chunk.error) {
+        case ValuesError::None:
+            break;
+        case ValuesError::Assignment:
+            throw ASTException("invalid variable assignment on line " +
+                               line_text);
+        case ValuesError::Name:
+            throw ASTException("invalid variable name on line " + line_text);
+        case ValuesError::Value:
+            // The bad line's name is checked for duplicates before its value.
+            if (variable_values.contains(std::string(chunk.error_name))) {
+                throw duplicate_error(chunk.error_name,
+                                      lines_before + chunk.error_line);
+            }
+            throw ASTException(chunk.error_message);
+        }
+        lines_before += chunk.line_count;
+    }
+    return variable_values;
+}
 
-    // Read the lines in the input stream.
-    while (std::getline(input_stream, line)) {
-        ++line_number;
-        const std::string trimmed_line = trim(line);
-        // If the line is empty or consists of only whitespace, skip it.
-        if (trimmed_line.empty()) {
+/**
+ * @brief Removes the options ("--name", "--name=value", or "-O<level>"
+ * which is read as "O") from the command line, leaving the other arguments in
+ * order.
+ * @param argc The argument count, updated to the remaining arguments.
+ * @param argv The argument vector, compacted in place.
+ * @return The options, by name. A flag without a value maps to "".
+ */
+CommandLineOptions strip_options(int& argc, char* argv[]) {
+    CommandLineOptions options;
+    int kept = 0;
+    for (int i = 0; i < argc; ++i) {
+        const std::string_view argument = argv[i];
+        if (argument.size() == 3 && argument.starts_with("-O")) {
+            // -O<level>, like a compiler's.
+            options["O"] = std::string(argument.substr(2));
             continue;
         }
+        if (i == 0 || !argument.starts_with("--")) {
+            argv[kept++] = argv[i];
+            continue;
+        }
+        const std::size_t equal_sign = argument.find('=');
+        const std::string_view name = argument.substr(2, equal_sign - 2);
+        options[std::string(name)] =
+            equal_sign == std::string_view::npos
+                ? ""
+                : std::string(argument.substr(equal_sign + 1));
+    }
+    argc = kept;
+    return options;
+}
+
+/**
+ * @brief Throws if an option isn't one the mode understands.
+ * @param options The options from the command line.
+ * @param known The names of the options the mode understands.
+ */
+void check_options(const CommandLineOptions& options,
+                   std::initializer_list<std::string_view> known) {
+    for (const auto& [name, value] : options) {
+        if (std::ranges::find(known, name) == known.end()) {
+            throw ASTException("unknown option: --" + name);
+        }
+    }
+}
 
-        const std::size_t equal_sign = trimmed_line.find('=');
-        // If there's no '=' character, or if there's more than one '=', then
-        // we have an invalid variable assignment error.
-        if ((equal_sign == std::string::npos) ||
-            (trimmed_line.find('=', equal_sign + 1) != std::string::npos)) {
-            throw ASTException("invalid variable assignment on line " +
-                               std::to_string(line_number));
+/**
+ * @brief Reads the options of the I/O engine.
+ * @param options The options from the command line.
+ * @return The options for IoEngine::create().
+ */
+IoEngineOptions io_engine_options(const CommandLineOptions& options) {
+    IoEngineOptions engine;
+    if (const auto io_it = options.find("io"); io_it != options.end()) {
+        engine.backend = parse_io_backend(io_it->second);
+    }
+    if (const auto depth_it = options.find("queue-depth");
+        depth_it != options.end()) {
+        const int64_t depth = parse_int64_token(depth_it->second);
+        if (depth < 1 || depth > 4096) {
+            throw ASTException("bad queue depth: " + depth_it->second);
         }
+        engine.queue_depth = static_cast<unsigned>(depth);
+    }
+    return engine;
+}
 
-        // Split the line into variable name and variable value parts, trimming
-        // whitespace from both parts.
-        const std::string variable_name =
-            trim(trimmed_line.substr(0, equal_sign));
-        const std::string variable_value_text =
-            trim(trimmed_line.substr(equal_sign + 1));
+/**
+ * @brief Reads --threads, the number of threads for the work that can be
+ * spread over several.
+ * @param options The options from the command line.
+ * @return The number of threads, or 0 (one per core) if not given.
+ */
+unsigned thread_count_option(const CommandLineOptions& options) {
+    const auto threads_it = options.find("threads");
+    if (threads_it == options.end()) {
+        return 0;
+    }
+    const int64_t threads = parse_int64_token(threads_it->second);
+    if (threads < 1 || threads > 1024) {
+        throw ASTException("bad thread count: " + threads_it->second);
+    }
+    return static_cast<unsigned>(threads);
+}
 
-        // Check that the variable name is valid (lower-case letters only).
-        if (!is_variable_token(variable_name)) {
-            throw ASTException("invalid variable name on line " +
-                               std::to_string(line_number));
+/**
+ * @brief Reads the options of the external-memory modes.
+ * @param options The options from the command line.
+ * @return The options for build_external() and eval_pre_external().
+ */
+ExternalMemoryOptions
+external_memory_options(const CommandLineOptions& options) {
+    ExternalMemoryOptions external;
+    if (const auto limit_it = options.find("memory-limit");
+        limit_it != options.end()) {
+        const int64_t mebibytes = parse_int64_token(limit_it->second);
+        if (mebibytes <= 0 || mebibytes > (int64_t{1} << 30)) {
+            throw ASTException("bad memory limit: " + limit_it->second);
         }
+        external.memory_limit = static_cast<std::size_t>(mebibytes) << 20;
+    }
+    return external;
+}
 
-        if (variable_values.contains(variable_name)) {
-            throw ASTException("duplicate variable assignment for '" +
-                               variable_name + "' on line " +
-                               std::to_string(line_number));
+/**
+ * @brief Reads the resource limits (see ASTLimits): --max-bytes,
+ * --max-tokens, --max-nodes, --max-depth and --max-eval-ops.
+ * @param options The options from the command line.
+ * @return The limits. Those not given are 0, meaning no limit.
+ */
+ASTLimits resource_limits(const CommandLineOptions& options) {
+    const auto read_limit = [&options](const std::string& name) -> uint64_t {
+        const auto limit_it = options.find(name);
+        if (limit_it == options.end()) {
+            return 0;
+        }
+        const int64_t limit = parse_int64_token(limit_it->second);
+        if (limit <= 0) {
+            throw ASTException("bad limit: --" + name + "=" +
+                               limit_it->second);
         }
+        return static_cast<uint64_t>(limit);
+    };
+    ASTLimits limits;
+    limits.max_input_bytes = read_limit("max-bytes");
+    limits.max_tokens = read_limit("max-tokens");
+    limits.max_nodes = read_limit("max-nodes");
+    limits.max_depth = read_limit("max-depth");
+    limits.max_eval_operations = read_limit("max-eval-ops");
+    return limits;
+}
 
-        // Parse the variable value as an integer and store it in the map.
-        variable_values[variable_name] = parse_int64_token(variable_value_text);
+/**
+ * @brief Reads the optimizer options: -O<level>, or --passes=<pass,...> with
+ * the passes in the order to run them, --fixpoint and --verify-opt[=<n>].
+ * @param options The options from the command line.
+ * @return The pass manager. Without options, it has no passes (-O0).
+ */
+PassManager pass_manager(const CommandLineOptions& options) {
+    const auto level_it = options.find("O");
+    const auto passes_it = options.find("passes");
+    if (level_it != options.end() && passes_it != options.end()) {
+        throw ASTException("-O and --passes can't be combined");
     }
 
-    return variable_values;
+    PassManager manager;
+    if (level_it != options.end()) {
+        const int64_t level = parse_int64_token(level_it->second);
+        if (level < 0 || level > 3) {
+            throw ASTException("bad optimization level: -O" +
+                               level_it->second);
+        }
+        manager = PassManager::for_level(static_cast<unsigned>(level));
+    } else if (passes_it != options.end()) {
+        std::string_view names = passes_it->second;
+        while (!names.empty()) {
+            const std::size_t comma = names.find(',');
+            manager.add_pass(create_pass(names.substr(0, comma)));
+            names = comma == std::string_view::npos
+                        ? std::string_view()
+                        : names.substr(comma + 1);
+        }
+    }
+    if (options.contains("fixpoint")) {
+        manager.set_fixpoint(true);
+    }
+    if (const auto verify_it = options.find("verify-opt");
+        verify_it != options.end()) {
+        int64_t trials = 100;
+        if (!verify_it->second.empty()) {
+            trials = parse_int64_token(verify_it->second);
+        }
+        if (trials <= 0 || trials > std::numeric_limits<int>::max()) {
+            throw ASTException("bad verification trial count: " +
+                               verify_it->second);
+        }
+        manager.set_verify_trials(static_cast<unsigned>(trials));
+    }
+    return manager;
+}
+
+/**
+ * @brief Returns whether any resource limit is set.
+ */
+bool has_limits(const ASTLimits& limits) {
+    return limits.max_input_bytes != 0 || limits.max_tokens != 0 ||
+           limits.max_nodes != 0 || limits.max_depth != 0 ||
+           limits.max_eval_operations != 0;
 }
 
 } // namespace
@@ -507,25 +1838,58 @@ parse_variable_values_file(std::istream& input_stream) {
  */
 int main(int argc, char* argv[]) {
     try {
+        const CommandLineOptions options = strip_options(argc, argv);
+
         // Require at least 2 arguments (program name + mode).
         if (argc < 2) {
             // Error indicating the correct usage of the program for both
             // modes.
             std::cerr << "Usage:\n"
                       << "  " << argv[0]
-                      << " build <ast_output_file> [expression_input_file]\n"
+                      << " build [options] <ast_output_file> "
+                         "[expression_input_file]\n"
+                      << "  " << argv[0]
+                      << " eval [options] <ast_input_file> "
+                         "[variable_values_file]\n"
+                      << "  " << argv[0] << " batch [options] <job_list_file>\n"
                       << "  " << argv[0]
-                      << " eval <ast_input_file> [variable_values_file]\n";
+                      << " convert --to=<format> [--from=<format>] "
+                         "<input_file> <output_file>\n"
+                      << "  " << argv[0]
+                      << " check [options] [expression_input_file]\n"
+                      << "  " << argv[0]
+                      << " forest <formula_file> [variable_values_file]\n"
+                      << "Options: --external, --memory-limit=<MiB>, "
+                         "--compress (build), --io=<backend>, "
+                         "--queue-depth=<n> (eval, batch), "
+                         "--max-bytes=<n> (build, eval, check), "
+                         "--max-tokens=<n>, --max-nodes=<n>, "
+                         "--max-depth=<n> (build, eval), "
+                         "--max-eval-ops=<n> (eval), -O<level>, "
+                         "--passes=<pass,...>, --fixpoint, --opt-stats, "
+                         "--verify-opt[=<n>] (build)\n";
             return 1;
         }
 
         // Dispatch to the appropriate mode handler based on the mode argument.
         const std::string mode = argv[1];
         if (mode == "build") {
-            return run_build_mode(argc, argv);
+            return run_build_mode(argc, argv, options);
         }
         if (mode == "eval") {
-            return run_eval_mode(argc, argv);
+            return run_eval_mode(argc, argv, options);
+        }
+        if (mode == "batch") {
+            return run_batch_mode(argc, argv, options);
+        }
+        if (mode == "convert") {
+            return run_convert_mode(argc, argv, options);
+        }
+        if (mode == "check") {
+            return run_check_mode(argc, argv, options);
+        }
+        if (mode == "forest") {
+            return run_forest_mode(argc, argv, options);
         }
 
         // Unknown mode.
@@ -0,0 +1,88 @@
+// Checks that parsing and evaluating expressions of similar size on one AST
+// performs no heap allocations once the AST and this thread's node free list
+// are warmed up. Every allocation goes through the counting operator new
+// below.
+//
+// Usage: alloc_test (exits with 0 on success)
+
+#include "AST.h"
+
+#include <cstddef>
+#include <cstdint>
+#include <cstdlib>
+#include <iostream>
+#include <new>
+#include <string>
+#include <vector>
+
+// MARK: namespace
+namespace {
+
+// Counted only while counting is set, so the test's own setup doesn't count.
+bool counting = false;
+std::size_t allocation_count = 0;
+
+} // namespace
+
+// Not inlined, so GCC doesn't pair the malloc() in one with the operator
+// new of the other (-Wmismatched-new-delete).
+[[gnu::noinline]] void* operator new(std::size_t size) {
+    if (counting) {
+        ++allocation_count;
+    }
+    if (void* pointer = std::malloc(size == 0 ? 1 : size)) {
+        return pointer;
+    }
+    throw std::bad_alloc();
+}
+
+[[gnu::noinline]] void operator delete(void* pointer) noexcept {
+    std::free(pointer);
+}
+
+[[gnu::noinline]] void operator delete(void* pointer, std::size_t) noexcept {
+    std::free(pointer);
+}
+
+// MARK: main()
+int main() {
+    // Formulas of similar size with different numbers, variables and
+    // nesting, built before counting starts.
+    std::vector<std::string> formulas;
+    for (int index = 0; index < 64; ++index) {
+        const std::string number = std::to_string(index * 37 + 1);
+        formulas.push_back("(price * " + number + " - discount) / (qty + " +
+                           number + ") + tax * (" + number + " - rate)");
+        formulas.push_back("-(qty - " + number + ") * (price + rate * " +
+                           number + ") - tax / (discount + 1)");
+    }
+    const VariableBindings bindings{{"price", 1200}, {"discount", 35},
+                                    {"qty", 4},      {"tax", 8},
+                                    {"rate", 3}};
+
+    AST ast;
+    int64_t checksum = 0;
+    // Warm up: grow the AST's buffers and fill the node free list.
+    for (const std::string& formula : formulas) {
+        ast.parse(formula);
+        checksum += ast.evaluate(bindings);
+    }
+
+    counting = true;
+    for (int round = 0; round < 100; ++round) {
+        for (const std::string& formula : formulas) {
+            ast.parse(formula);
+            checksum += ast.evaluate(bindings);
+        }
+    }
+    counting = false;
+
+    if (allocation_count != 0) {
+        std::cerr << "alloc_test: " << allocation_count
+                  << " heap allocations after warm-up (checksum " << checksum
+                  << ")\n";
+        return 1;
+    }
+    std::cout << "alloc_test: no heap allocations after warm-up\n";
+    return 0;
+}
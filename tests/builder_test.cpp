@@ -0,0 +1,84 @@
+// Checks that trees built with ExprBuilder.h match the parser's, and that
+// the builders reject variable names the parser wouldn't accept.
+//
+// Usage: builder_test (exits with 0 on success)
+
+#include "AST.h"
+#include "ExprBuilder.h"
+
+#include <initializer_list>
+#include <iostream>
+#include <memory>
+#include <sstream>
+#include <string>
+#include <vector>
+
+// MARK: namespace
+namespace {
+
+int failures = 0;
+
+void check(bool condition, const std::string& what) {
+    if (!condition) {
+        std::cerr << "builder_test: " << what << '\n';
+        ++failures;
+    }
+}
+
+std::string preorder(const AST& ast) {
+    std::ostringstream output;
+    ast.write_preorder(output);
+    return output.str();
+}
+
+std::string parsed_preorder(const std::string& expression) {
+    AST ast;
+    ast.parse(expression);
+    return preorder(ast);
+}
+
+// Whether building a tree throws an ASTException.
+template <typename Build> bool throws(Build build) {
+    try {
+        build();
+    } catch (const ASTException&) {
+        return true;
+    }
+    return false;
+}
+
+} // namespace
+
+// MARK: main()
+int main() {
+    using namespace ast_build;
+
+    AST built;
+    built.set_root((var("price") + 2) * var("qty") - num(1));
+    check(preorder(built) == parsed_preorder("(price + 2) * qty - 1"),
+          "operators don't build the parsed tree");
+
+    // (price - 3) / qty in postorder.
+    const std::vector<PostorderNode> nodes{{NodeType::Variable, 0, "price"},
+                                           {NodeType::Number, 3, ""},
+                                           {NodeType::Sub, 0, ""},
+                                           {NodeType::Variable, 0, "qty"},
+                                           {NodeType::Div, 0, ""}};
+    built.set_root(from_postorder(nodes));
+    check(preorder(built) == parsed_preorder("(price - 3) / qty"),
+          "from_postorder doesn't build the parsed tree");
+
+    for (const std::string name : {"", "Price", "x1", "a b", "-", "\xe9"}) {
+        check(throws([&name] { var(name); }),
+              "var() accepted '" + name + "'");
+        const std::vector<PostorderNode> leaf{{NodeType::Variable, 0, name}};
+        check(throws([&leaf] { from_postorder(leaf); }),
+              "from_postorder() accepted '" + name + "'");
+    }
+
+    if (failures != 0) {
+        return 1;
+    }
+    std::cout << "builder_test: built trees match parsed ones\n";
+    return 0;
+}
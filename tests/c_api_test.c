@@ -0,0 +1,124 @@
+/*
+ * Checks the status codes of the C API (ast_c.h), from C, linked against
+ * libast.a: every failure that the header documents, and a few successes.
+ *
+ * Usage: c_api_test (exits with 0 on success)
+ */
+
+#include "ast_c.h"
+
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+
+static int failures = 0;
+
+static void check_status(ast_status actual, ast_status expected,
+                         const char* what) {
+    if (actual != expected) {
+        fprintf(stderr, "c_api_test: %s gave %s, not %s (%s)\n", what,
+                ast_status_name(actual), ast_status_name(expected),
+                ast_last_error());
+        ++failures;
+    }
+}
+
+static void check(int condition, const char* what) {
+    if (!condition) {
+        fprintf(stderr, "c_api_test: %s\n", what);
+        ++failures;
+    }
+}
+
+/* Parses text, which must be valid. */
+static ast_formula* parse(const char* text) {
+    ast_formula* formula = NULL;
+    check_status(ast_parse(text, strlen(text), &formula), AST_OK, text);
+    return formula;
+}
+
+/* Evaluates a formula without variables and checks the status. */
+static void check_constant(const char* text, ast_status expected) {
+    ast_formula* formula = parse(text);
+    int64_t result = 0;
+    if (formula != NULL) {
+        check_status(ast_evaluate(formula, &result), expected, text);
+    }
+    ast_free(formula);
+}
+
+int main(void) {
+    ast_formula* formula = NULL;
+    int64_t result = 0;
+    size_t slot = 0;
+
+    /* Arguments and syntax. */
+    check_status(ast_parse(NULL, 1, &formula), AST_ERROR_INVALID_ARGUMENT,
+                 "parsing NULL");
+    check_status(ast_parse(NULL, 0, &formula), AST_ERROR_SYNTAX,
+                 "parsing no text");
+    check_status(ast_parse("1", 1, NULL), AST_ERROR_INVALID_ARGUMENT,
+                 "parsing into NULL");
+    check_status(ast_parse("1 +", 3, &formula), AST_ERROR_SYNTAX,
+                 "parsing '1 +'");
+    check(strcmp(ast_last_error(), "expression ends with operator") == 0,
+          "the syntax error has the parser's message");
+    check_status(ast_evaluate(NULL, &result), AST_ERROR_INVALID_ARGUMENT,
+                 "evaluating NULL");
+
+    /* Evaluation errors. */
+    check_constant("7 * 6", AST_OK);
+    check_constant("9223372036854775807 + 1", AST_ERROR_OVERFLOW);
+    check_constant("1 / (2 - 2)", AST_ERROR_DIVISION_BY_ZERO);
+
+    /* Slots and bindings. */
+    formula = parse("price * qty - price");
+    if (formula != NULL) {
+        check(ast_slot_count(formula) == 2, "two slots");
+        check(ast_slot_name(formula, 2) == NULL, "no name for slot 2");
+        check_status(ast_find_slot(formula, "tax", &slot),
+                     AST_ERROR_INVALID_ARGUMENT, "finding an unknown name");
+        check_status(ast_bind(formula, 2, 1), AST_ERROR_INVALID_ARGUMENT,
+                     "binding slot 2");
+        check_status(ast_evaluate(formula, &result),
+                     AST_ERROR_UNBOUND_VARIABLE, "evaluating unbound");
+        check_status(ast_find_slot(formula, "qty", &slot), AST_OK,
+                     "finding qty");
+        check(slot == 1, "qty is slot 1");
+        check_status(ast_bind(formula, 0, 10), AST_OK, "binding price");
+        check_status(ast_bind(formula, 1, 3), AST_OK, "binding qty");
+        check_status(ast_evaluate(formula, &result), AST_OK, "evaluating");
+        check(result == 20, "10 * 3 - 10 is 20");
+
+        /* A batch reports the first failing row and each row's status. */
+        const int64_t rows[] = {2, 5, INT64_MAX, 2, 4, 0};
+        int64_t results[3];
+        ast_status statuses[3];
+        check_status(ast_evaluate_batch(formula, rows, 3, results, statuses),
+                     AST_ERROR_OVERFLOW, "evaluating a batch");
+        check_status(statuses[0], AST_OK, "batch row 0");
+        check_status(statuses[1], AST_ERROR_OVERFLOW, "batch row 1");
+        check_status(statuses[2], AST_OK, "batch row 2");
+        check(results[0] == 8 && results[2] == -4, "batch results");
+        check_status(ast_evaluate_batch(formula, NULL, 1, results, NULL),
+                     AST_ERROR_INVALID_ARGUMENT, "a batch without values");
+
+        char* text = NULL;
+        size_t length = 0;
+        check_status(ast_serialize(formula, &text, &length), AST_OK,
+                     "serializing");
+        check(text != NULL && strcmp(text, "- * price qty price ") == 0 &&
+                  length == strlen(text),
+              "the serialized preorder");
+        ast_free_string(text);
+        check_status(ast_serialize(formula, NULL, NULL),
+                     AST_ERROR_INVALID_ARGUMENT, "serializing into NULL");
+    }
+    ast_free(formula);
+
+    if (failures != 0) {
+        return 1;
+    }
+    printf("c_api_test: status codes match ast_c.h\n");
+    return 0;
+}
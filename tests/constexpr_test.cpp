@@ -0,0 +1,98 @@
+// Checks that ConstexprAST.h parses and evaluates formulas like AST does,
+// at compile time (the static_asserts) and at run time.
+//
+// Usage: constexpr_test (exits with 0 on success)
+
+#include "AST.h"
+#include "ConstexprAST.h"
+
+#include <cstddef>
+#include <cstdint>
+#include <initializer_list>
+#include <iostream>
+#include <string>
+#include <string_view>
+
+// MARK: namespace
+namespace {
+
+using constexpr_ast::compile;
+using constexpr_ast::compile_value;
+using constexpr_ast::FixedString;
+
+// Chains of unary minus take two tokens per character.
+static_assert(compile_value<"---5">() == -5);
+static_assert(compile_value<"-(-(-(-(7))))">() == 7);
+static_assert(compile_value<"- - -(2 - 9)">() == 7);
+static_assert(constexpr_ast::parse<10>("---x").error == nullptr);
+static_assert(constexpr_ast::parse<28>("-(-(-(-(x))))").error == nullptr);
+
+// Literal-only subtrees are folded, and the result is sized to its nodes.
+static_assert(compile<"(1 + 2) * x">().nodes.size() == 3);
+static_assert(compile<"6 / 3 - 4 * 5">().is_constant());
+static_assert(compile_value<"10 - 3 - 2">() == 5);
+static_assert(compile_value<"2 * (3 + 4) / 7">() == 2);
+
+int failures = 0;
+
+/**
+ * @brief Checks that a formula compiled at compile time evaluates to what
+ * AST::evaluate gives for the same text and bindings.
+ */
+template <FixedString Text> void check_same(const VariableBindings& bindings) {
+    const std::string text(Text.view());
+    AST ast;
+    ast.parse(text);
+    const int64_t expected = ast.evaluate(bindings);
+    const int64_t actual = compile<Text>().evaluate(bindings);
+    if (actual != expected) {
+        std::cerr << "constexpr_test: " << text << " gave " << actual
+                  << ", AST gave " << expected << '\n';
+        ++failures;
+    }
+}
+
+/**
+ * @brief Checks that parsing a formula at run time fails with the message
+ * AST::parse throws.
+ */
+void check_same_error(std::string_view text) {
+    std::string expected;
+    try {
+        AST ast;
+        ast.parse(std::string(text));
+    } catch (const ASTException& error) {
+        expected = error.what();
+    }
+    const auto result = constexpr_ast::parse<64>(text);
+    const std::string actual = result.error == nullptr ? "" : result.error;
+    if (actual != expected) {
+        std::cerr << "constexpr_test: " << text << " failed with '" << actual
+                  << "', AST with '" << expected << "'\n";
+        ++failures;
+    }
+}
+
+} // namespace
+
+// MARK: main()
+int main() {
+    const VariableBindings bindings{{"x", 7}, {"y", -3}, {"rate", 4}};
+    check_same<"---x">(bindings);
+    check_same<"-(-(-(-(x))))">(bindings);
+    check_same<"- -x * -y">(bindings);
+    check_same<"(x + 2 * 3) * rate - y / 2">(bindings);
+    check_same<"x - y - rate">(bindings);
+    check_same<"-(x - 10) / -(y)">(bindings);
+
+    for (const std::string_view text : {"", "x +", "(x", "x)", "2 x", "- ",
+                                        "x # 2", "99999999999999999999"}) {
+        check_same_error(text);
+    }
+
+    if (failures != 0) {
+        return 1;
+    }
+    std::cout << "constexpr_test: compiled formulas match AST\n";
+    return 0;
+}
@@ -0,0 +1,47 @@
+#!/bin/sh
+# Checks that convert writes postorder with the left operand first, and that
+# converting through every format, from files and from pipes, gives back the
+# preorder that build wrote.
+#
+# Usage: convert_test.sh <ast_program>
+
+program=$1
+work=$(mktemp -d) || exit 1
+trap 'rm -rf "$work"' EXIT
+
+status=0
+fail() {
+    echo "convert_test: $*"
+    status=1
+}
+
+echo '10 - 3' >"$work/small.txt"
+"$program" build "$work/small.pre" "$work/small.txt" || exit 1
+postorder=$("$program" convert --to=postorder "$work/small.pre" -)
+[ "$postorder" = '10 3 - ' ] ||
+    fail "postorder of 10 - 3 is '$postorder', not '10 3 - '"
+
+echo '(a - 2) * (b / (c + 3)) - -(7 * d) + e' >"$work/expression.txt"
+"$program" build "$work/tree.pre" "$work/expression.txt" || exit 1
+for format in postorder binary compressed; do
+    "$program" convert --to=$format "$work/tree.pre" "$work/tree.$format" ||
+        fail "converting to $format failed"
+    # Read back once from the file and once from a pipe.
+    from_file=$("$program" convert --from=$format --to=preorder \
+        "$work/tree.$format" -)
+    piped=$(cat "$work/tree.$format" |
+        "$program" convert --from=$format --to=preorder - -)
+    expected=$(cat "$work/tree.pre")
+    if [ "$from_file" != "$expected" ] || [ "$piped" != "$expected" ]; then
+        fail "$format gave '$from_file' and '$piped', not '$expected'"
+    fi
+done
+
+for bad in '1 +' '1 2' '+'; do
+    if echo "$bad" | "$program" convert --from=postorder --to=preorder - - \
+        >/dev/null 2>&1; then
+        fail "postorder '$bad' was accepted"
+    fi
+done
+[ $status -eq 0 ] && echo "convert_test: conversions round-trip"
+exit $status
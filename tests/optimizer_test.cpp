@@ -0,0 +1,131 @@
+// Checks that the optimizer keeps the value and the error of random trees
+// for any bindings: each pass on its own, and every optimization level.
+//
+// Usage: optimizer_test (exits with 0 on success)
+
+#include "AST.h"
+#include "Optimizer.h"
+
+#include <cstddef>
+#include <cstdint>
+#include <iostream>
+#include <limits>
+#include <memory>
+#include <random>
+#include <string>
+#include <string_view>
+#include <vector>
+
+// MARK: namespace
+namespace {
+
+int failures = 0;
+
+// Generates random expressions, with the values that make evaluating fail
+// (zero divisors, overflowing literals) and names that may be unbound.
+class ExpressionGenerator {
+  public:
+    explicit ExpressionGenerator(uint32_t seed) : random_(seed) {}
+
+    std::string expression(int depth) {
+        std::string text;
+        append_operand(text, depth);
+        for (std::size_t count = pick(3); count > 0; --count) {
+            static constexpr std::string_view operators[] = {" + ", " - ",
+                                                             " * ", " / "};
+            text += operators[pick(3)];
+            append_operand(text, depth);
+        }
+        return text;
+    }
+
+    // A random number in [0, max].
+    std::size_t pick(std::size_t max) {
+        return std::uniform_int_distribution<std::size_t>(0, max)(random_);
+    }
+
+  private:
+    void append_operand(std::string& text, int depth) {
+        static constexpr std::string_view literals[] = {
+            "0", "1", "2", "3", "7", "-1", "9223372036854775807"};
+        switch (depth > 0 ? pick(4) : pick(1)) {
+        case 0:
+            text += literals[pick(6)];
+            break;
+        case 1:
+            text += static_cast<char>('a' + pick(2));
+            break;
+        case 2:
+            text += "-";
+            append_operand(text, depth - 1);
+            break;
+        default:
+            text += "(" + expression(depth - 1) + ")";
+            break;
+        }
+    }
+
+    std::mt19937 random_;
+};
+
+// The value of a tree for some bindings, or its error.
+std::string outcome(const Node& root, const VariableBindings& bindings) {
+    try {
+        return std::to_string(root.get_value(bindings));
+    } catch (const ASTException& error) {
+        return std::string("error: ") + error.what();
+    }
+}
+
+void check_manager(const std::string& text, const std::string& what,
+                   PassManager manager,
+                   const std::vector<VariableBindings>& all_bindings) {
+    AST ast;
+    ast.parse(text);
+    std::unique_ptr<Node> optimized = copy_tree(*ast.root());
+    manager.run(optimized);
+    for (const VariableBindings& bindings : all_bindings) {
+        const std::string expected = outcome(*ast.root(), bindings);
+        const std::string actual = outcome(*optimized, bindings);
+        if (actual != expected) {
+            std::cerr << "optimizer_test: " << what << " changed '" << text
+                      << "' from '" << expected << "' to '" << actual
+                      << "'\n";
+            ++failures;
+            return;
+        }
+    }
+}
+
+} // namespace
+
+// MARK: main()
+int main() {
+    constexpr int64_t max = std::numeric_limits<int64_t>::max();
+    constexpr int64_t min = std::numeric_limits<int64_t>::min();
+    const std::vector<VariableBindings> all_bindings{
+        {{"a", 5}, {"b", -3}, {"c", 2}}, {{"a", 0}, {"b", 0}, {"c", 0}},
+        {{"a", max}, {"b", min}, {"c", -1}}, {{"a", 1}, {"b", 2}}, {}};
+
+    ExpressionGenerator generator(20261018);
+    for (int round = 0; round < 2000; ++round) {
+        const std::string text = generator.expression(round % 5);
+        for (const std::string_view name : pass_names()) {
+            PassManager manager;
+            manager.add_pass(create_pass(name));
+            check_manager(text, std::string(name), std::move(manager),
+                          all_bindings);
+        }
+        for (unsigned level = 1; level <= 3; ++level) {
+            check_manager(text, "-O" + std::to_string(level),
+                          PassManager::for_level(level), all_bindings);
+        }
+    }
+
+    if (failures != 0) {
+        return 1;
+    }
+    std::cout << "optimizer_test: optimized trees keep their values and "
+                 "errors\n";
+    return 0;
+}
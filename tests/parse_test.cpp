@@ -0,0 +1,257 @@
+// Checks that every way of parsing an expression gives the same tokens, tree
+// and error as the sequential parser: the parallel lexer and builder, the
+// streaming parser, AST::validate, and AST::reparse after a series of edits.
+// The parallel paths are tuned down so that they run on short, random
+// expressions.
+//
+// Usage: parse_test (exits with 0 on success)
+
+#include "AST.h"
+
+#include <algorithm>
+#include <cstddef>
+#include <cstdint>
+#include <initializer_list>
+#include <iostream>
+#include <random>
+#include <sstream>
+#include <string>
+#include <string_view>
+
+// MARK: namespace
+namespace {
+
+int failures = 0;
+
+// Tuning that sends every input down the parallel paths, in small pieces.
+ParseTuning small_tuning() {
+    ParseTuning tuning;
+    tuning.parallel_parse_threshold = 0;
+    tuning.thread_count = 4;
+    tuning.min_parallel_chunk_size = 1;
+    tuning.min_parallel_group_tokens = 2;
+    tuning.stream_block_size = 7;
+    return tuning;
+}
+
+// Generates random expressions, valid and not, of the kinds of text the
+// lexer and builder handle differently.
+class ExpressionGenerator {
+  public:
+    explicit ExpressionGenerator(uint32_t seed) : random_(seed) {}
+
+    std::string valid(int depth) {
+        std::string text;
+        append_expression(text, depth);
+        return text;
+    }
+
+    // A valid expression with one character inserted, removed or replaced.
+    std::string mutated(int depth) {
+        std::string text = valid(depth);
+        static constexpr std::string_view alphabet = "()+-*/ 09az#";
+        const std::size_t index = pick(text.size());
+        const char character = alphabet[pick(alphabet.size() - 1)];
+        switch (pick(2)) {
+        case 0:
+            text.insert(index, 1, character);
+            break;
+        case 1:
+            text.erase(index, 1);
+            break;
+        default:
+            text[index] = character;
+            break;
+        }
+        return text;
+    }
+
+    // A random edit of a text, of the size a user would make.
+    TextEdit edit(const std::string& text) {
+        static constexpr std::string_view insertions[] = {
+            "", "(", ")", " + 1", "x", "-", " * (a + b)", "7", "()"};
+        const std::size_t offset = pick(text.size());
+        const std::size_t removed_length =
+            std::min(pick(3), text.size() - offset);
+        return {offset, removed_length, std::string(insertions[pick(8)])};
+    }
+
+  private:
+    // A random number in [0, max].
+    std::size_t pick(std::size_t max) {
+        return std::uniform_int_distribution<std::size_t>(0, max)(random_);
+    }
+
+    void append_operand(std::string& text, int depth) {
+        switch (depth > 0 ? pick(5) : pick(2)) {
+        case 0:
+            text += std::to_string(pick(1000));
+            break;
+        case 1:
+            text += std::string(1 + pick(2), static_cast<char>('a' + pick(3)));
+            break;
+        case 2:
+            text += "-";
+            append_operand(text, depth - 1);
+            break;
+        default:
+            text += "(";
+            append_expression(text, depth - 1);
+            text += ")";
+            break;
+        }
+    }
+
+    void append_expression(std::string& text, int depth) {
+        append_operand(text, depth);
+        for (std::size_t count = pick(4); count > 0; --count) {
+            static constexpr std::string_view operators[] = {" + ", "-", " * ",
+                                                             "/", "  -  "};
+            text += operators[pick(4)];
+            append_operand(text, depth);
+        }
+    }
+
+    std::mt19937 random_;
+};
+
+// The outcome of parsing: the preorder of the tree, or the error.
+std::string outcome(const AST& ast) {
+    std::ostringstream output;
+    ast.write_preorder(output);
+    return output.str();
+}
+
+template <typename Parse> std::string outcome_of(Parse parse) {
+    try {
+        return parse();
+    } catch (const ASTException& error) {
+        return std::string("error: ") + error.what();
+    }
+}
+
+// The tokens of a TokenList, as text, for comparing.
+std::string describe(const TokenList& tokens) {
+    std::string text;
+    for (std::size_t index = 0; index < tokens.size(); ++index) {
+        const TokenView token = tokens[index];
+        text += std::to_string(static_cast<int>(token.type)) + ':' +
+                std::to_string(token.value) + ':' +
+                std::string(token.variable_name) + ' ';
+    }
+    return text;
+}
+
+void check_same(const std::string& text, const std::string& what,
+                const std::string& expected, const std::string& actual) {
+    if (actual != expected) {
+        std::cerr << "parse_test: " << what << " of '" << text << "' gave '"
+                  << actual << "', not '" << expected << "'\n";
+        ++failures;
+    }
+}
+
+std::string parsed_outcome(const std::string& text) {
+    return outcome_of([&text] {
+        AST ast;
+        ast.parse(text);
+        return outcome(ast);
+    });
+}
+
+void check_expression(const std::string& text) {
+    const std::string expected = parsed_outcome(text);
+
+    check_same(text, "parallel parse", expected, outcome_of([&text] {
+                   AST ast;
+                   ast.set_tuning(small_tuning());
+                   ast.parse(text);
+                   return outcome(ast);
+               }));
+    check_same(text, "parse_stream", expected, outcome_of([&text] {
+                   AST ast;
+                   ast.set_tuning(small_tuning());
+                   std::istringstream input(text);
+                   ast.parse_stream(input);
+                   return outcome(ast);
+               }));
+    check_same(text, "tokenize_parallel",
+               outcome_of([&text] {
+                   AST ast;
+                   ast.tokenize(text);
+                   return describe(ast.tokens());
+               }),
+               outcome_of([&text] {
+                   AST ast;
+                   ast.set_tuning(small_tuning());
+                   ast.tokenize_parallel(text);
+                   return describe(ast.tokens());
+               }));
+
+    // validate() only reports errors, so compare it with parse()'s error.
+    const std::string validated = outcome_of([&text] {
+        AST::validate(text);
+        return std::string();
+    });
+    if (expected.starts_with("error: ") ? validated != expected
+                                        : !validated.empty()) {
+        check_same(text, "validate", expected, validated);
+    }
+}
+
+/**
+ * @brief Applies a series of random edits with AST::reparse, and checks
+ * each result against parse() of the edited text.
+ */
+void check_reparse(ExpressionGenerator& generator, std::string text) {
+    AST ast;
+    outcome_of([&] {
+        ast.parse(text);
+        return std::string();
+    });
+    for (int step = 0; step < 6; ++step) {
+        const TextEdit edit = generator.edit(text);
+        std::string edited = text;
+        edited.replace(edit.offset, edit.removed_length, edit.inserted_text);
+        const std::string expected = parsed_outcome(edited);
+        const std::string actual = outcome_of([&] {
+            if (ast.reparse(text, edit) != edited) {
+                return std::string("wrong edited text");
+            }
+            return outcome(ast);
+        });
+        check_same(edited, "reparse", expected, actual);
+        text = edited;
+    }
+}
+
+} // namespace
+
+// MARK: main()
+int main() {
+    ExpressionGenerator generator(20261018);
+    for (int round = 0; round < 1500; ++round) {
+        const int depth = round % 6;
+        check_expression(generator.valid(depth));
+        check_expression(generator.mutated(depth));
+        check_reparse(generator, generator.valid(depth));
+    }
+    // An old text other than the last one parsed is parsed from scratch.
+    AST stale;
+    stale.parse("(a + b) * 2");
+    stale.reparse("(a + c) * 2", {0, 0, "1 - "});
+    check_same("1 - (a + c) * 2", "reparse of another text",
+               parsed_outcome("1 - (a + c) * 2"), outcome(stale));
+    for (const std::string text :
+         {"", "   ", "(", ")", "-", "--5", "1 +", "99999999999999999999",
+          "-9223372036854775808", "((((a))))", "a b", "(a +) * 2"}) {
+        check_expression(text);
+    }
+
+    if (failures != 0) {
+        return 1;
+    }
+    std::cout << "parse_test: parallel, streaming, checking and incremental "
+                 "parsers match parse()\n";
+    return 0;
+}
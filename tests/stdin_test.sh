@@ -0,0 +1,31 @@
+#!/bin/sh
+# Checks that eval reads an AST from a pipe the same way as from a file,
+# with and without --external, for preorder and compressed files.
+#
+# Usage: stdin_test.sh <ast_program>
+
+program=$1
+work=$(mktemp -d) || exit 1
+trap 'rm -rf "$work"' EXIT
+
+echo '(4 - 1) * 3 + 2 * (7 - 5) / 2' >"$work/expression.txt"
+"$program" build "$work/tree.pre" "$work/expression.txt" || exit 1
+"$program" build --compress "$work/tree.z" "$work/expression.txt" || exit 1
+
+status=0
+for tree in tree.pre tree.z; do
+    for option in '' --external; do
+        # $option is left unquoted so that an empty one is no argument.
+        expected=$("$program" eval $option "$work/$tree")
+        piped=$(cat "$work/$tree" | "$program" eval $option -)
+        redirected=$("$program" eval $option - <"$work/$tree")
+        if [ "$expected" != 11 ] || [ "$piped" != "$expected" ] ||
+            [ "$redirected" != "$expected" ]; then
+            echo "stdin_test: eval ${option:+$option }of $tree from" \
+                "stdin gave '$piped' and '$redirected', not '$expected'"
+            status=1
+        fi
+    done
+done
+[ $status -eq 0 ] && echo "stdin_test: eval from stdin matches eval from a file"
+exit $status
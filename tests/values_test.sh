@@ -0,0 +1,55 @@
+#!/bin/sh
+# Checks that eval parses a large variable values file on several threads
+# with the same result, and the same error for a bad file, as on one thread.
+#
+# Usage: values_test.sh <ast_program>
+
+program=$1
+work=$(mktemp -d) || exit 1
+trap 'rm -rf "$work"' EXIT
+
+# About 3 MiB of assignments, so the file is cut into several chunks. Line n
+# assigns n to the name that spells n in base 26 with the letters a to z.
+awk 'BEGIN {
+    for (n = 0; n < 300000; n++) {
+        name = ""
+        for (v = n; ; v = int(v / 26)) {
+            name = sprintf("%c", 97 + v % 26) name
+            if (v < 26) break
+        }
+        print name "=" n
+    }
+}' >"$work/values.txt"
+echo 'b - ba * c + (pjba - qqqq) / bb' >"$work/expression.txt"
+"$program" build "$work/tree.pre" "$work/expression.txt" || exit 1
+
+status=0
+# Runs eval on one thread and on four, and compares the output, the error
+# and the exit status.
+compare() {
+    one=$("$program" eval --threads=1 "$work/tree.pre" "$1" 2>&1)
+    one_status=$?
+    four=$("$program" eval --threads=4 "$work/tree.pre" "$1" 2>&1)
+    four_status=$?
+    if [ "$one" != "$four" ] || [ $one_status -ne $four_status ]; then
+        echo "values_test: $2: one thread gave '$one' ($one_status)," \
+            "four gave '$four' ($four_status)"
+        status=1
+    fi
+}
+
+compare "$work/values.txt" "valid file"
+# Errors near the end, so they are in a later chunk than the first.
+{ cat "$work/values.txt"; echo 'b=1'; } >"$work/duplicate.txt"
+compare "$work/duplicate.txt" "duplicate across chunks"
+sed '250000s/=.*/=x/' "$work/values.txt" >"$work/bad_value.txt"
+compare "$work/bad_value.txt" "bad value"
+sed '200000s/^/A/' "$work/values.txt" >"$work/bad_name.txt"
+compare "$work/bad_name.txt" "bad name"
+sed -e '100000s/=.*/=x/' -e '280000s/^/A/' "$work/values.txt" \
+    >"$work/two_errors.txt"
+compare "$work/two_errors.txt" "two bad lines"
+
+[ $status -eq 0 ] &&
+    echo "values_test: values files parse the same on one thread and four"
+exit $status